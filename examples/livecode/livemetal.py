@@ -30,6 +30,10 @@ class MetalViewHTTPServer:
         self.ui_running = False
         self.last_modified = None
         self.count = 0
+        self.shader_kernel = None
+        self.compiling = None
+        self.update_shader()
+        self.compiling.wait()
         self.update_shader()
 
     def parseargs(self):
@@ -43,14 +47,18 @@ class MetalViewHTTPServer:
             self.shader = self.shader_file.read_text()
             self.last_modified = last_modified
 
+            # Compile in the background, rendering with the last kernel meanwhile
             sys.stderr.write(f"Compiling[{self.count}]:\n")
+            self.compiling = self.dev.kernel_async(self.shader)
+        if self.compiling is not None and self.compiling.done():
             try:
-                self.shader_kernel = self.dev.kernel(self.shader).function("render")
+                self.shader_kernel = self.compiling.result().function("render")
             except:
                 exc = traceback.format_exc()
                 exc = exc.replace("program_source","shader.metal")
                 sys.stderr.write(exc)
             sys.stderr.write(f"Complete[{self.count}].\n")
+            self.compiling = None
             self.count += 1
 
     async def page(self, request):
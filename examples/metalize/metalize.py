@@ -103,14 +103,16 @@ kernel void {fn.__name__}(
                     count = call_arg.size
                 if call_arg.shape != shape:
                     raise Exception(f"Expected all args to have shape {shape}")
-                as_float = call_arg.astype('f')
+                if not call_arg.flags.c_contiguous:
+                    call_arg = call_arg.copy()
+                # Converted to float as it is copied in, e.g. from float64
+                as_buf = mcdev.buffer(call_arg, format='f')
             else:
                 if count is None:
                     count = len(call_arg)
                 if len(call_arg) != count:
                     raise Exception(f"Expected all args to have {count} items")
-                as_float = array('f',call_arg)
-            as_buf = mcdev.buffer(as_float)
+                as_buf = mcdev.buffer(array('f',call_arg))
             converted.append(as_buf)
         # Allocate return buffers
         for retarg in ret:
@@ -1,7 +1,11 @@
 import os
+import platform
 
 os.environ['MACOSX_DEPLOYMENT_TARGET'] = '14.0'
 
+# Backend which runs the kernels: "metal" (Swift/Metal, macOS only) or "cpu" (worker threads on the host)
+backend = os.environ.get("METALCOMPUTE_BACKEND", "metal" if platform.system() == "Darwin" else "cpu")
+
 try:
     from setuptools import setup, Extension
     from setuptools.command import build_ext as build_module
@@ -23,9 +27,29 @@ def build_swift():
 
 class build(build_module.build_ext):
     def run(self):
-        build_swift()
+        if backend == "metal":
+            build_swift()
         build_module.build_ext.run(self)
 
+if backend == "metal":
+    extension = Extension(
+        'metalcompute', 
+        ['src/metalcompute.c', 'src/mc_cache.c', 'src/mc_notify.c', 'src/mc_tune.c', 'src/mc_compile.c', 'src/mc_convert.c', 'src/mc_copy.c'], 
+        extra_compile_args=["-mmacosx-version-min=14.0","-arch","arm64","-arch","x86_64","-Wno-unused-command-line-argument"],
+        extra_link_args=["-mmacosx-version-min=14.0","-arch","arm64","-arch","x86_64","-Wno-unused-command-line-argument"],
+        library_dirs=[".","/usr/lib","/usr/lib/swift"],
+        libraries=["swiftFoundation","swiftMetal"],
+        extra_objects=["build/swift/metalcomputeswift.a"])
+elif backend == "cpu":
+    extension = Extension(
+        'metalcompute',
+        ['src/metalcompute.c', 'src/mc_cache.c', 'src/mc_notify.c', 'src/mc_tune.c', 'src/mc_compile.c', 'src/mc_convert.c', 'src/mc_copy.c', 'src/metalcompute_cpu.c', 'src/mc_cpu/mc_msl.c'],
+        extra_compile_args=["-O3","-pthread"],
+        extra_link_args=["-pthread"],
+        libraries=["m"])
+else:
+    raise ValueError(f"Unknown METALCOMPUTE_BACKEND '{backend}' (expected 'metal' or 'cpu')")
+
 setup(name="metalcompute",
     version="0.2.9",
     author="Andrew Baldwin",
@@ -46,14 +70,7 @@ setup(name="metalcompute",
     ],
     python_requires=">=3.9",
     cmdclass = {'build_ext': build,},
-    ext_modules=[Extension(
-        'metalcompute', 
-        ['src/metalcompute.c'], 
-        extra_compile_args=["-mmacosx-version-min=14.0","-arch","arm64","-arch","x86_64","-Wno-unused-command-line-argument"],
-        extra_link_args=["-mmacosx-version-min=14.0","-arch","arm64","-arch","x86_64","-Wno-unused-command-line-argument"],
-        library_dirs=[".","/usr/lib","/usr/lib/swift"],
-        libraries=["swiftFoundation","swiftMetal"],
-        extra_objects=["build/swift/metalcomputeswift.a"])],
+    ext_modules=[extension],
     scripts=["examples/metalcompute-mandelbrot", 
              "examples/metalcompute-measure",
              "examples/metalcompute-raymarch",
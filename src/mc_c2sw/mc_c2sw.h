@@ -1,2 +1,6 @@
 // Bridging header between C & Swift
-#include "../metalcompute.h"
\ No newline at end of file
+#include "../metalcompute.h"
+#include "../mc_cache.h"
+#include "../mc_convert.h"
+#include "../mc_copy.h"
+#include "../mc_notify.h"
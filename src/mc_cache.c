@@ -0,0 +1,421 @@
+/*
+mc_cache.c
+
+Content addressed cache of compiled kernels, shared by the backends
+
+(c) Andrew Baldwin 2021
+*/
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "mc_cache.h"
+
+// -------------------------------------------------
+// SHA-256
+
+typedef struct {
+    uint32_t h[8];
+    uint8_t block[64];
+    size_t used;
+    uint64_t length;
+} mc_sha256;
+
+static const uint32_t sha_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha_init(mc_sha256* s) {
+    static const uint32_t h0[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(s->h, h0, sizeof(h0));
+    s->used = 0;
+    s->length = 0;
+}
+
+static void sha_block(mc_sha256* s, const uint8_t* p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t)p[4*i] << 24 | (uint32_t)p[4*i+1] << 16 | (uint32_t)p[4*i+2] << 8 | p[4*i+3];
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROR(w[i-15], 7) ^ ROR(w[i-15], 18) ^ (w[i-15] >> 3);
+        uint32_t s1 = ROR(w[i-2], 17) ^ ROR(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+    uint32_t a = s->h[0], b = s->h[1], c = s->h[2], d = s->h[3];
+    uint32_t e = s->h[4], f = s->h[5], g = s->h[6], h = s->h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + sha_k[i] + w[i];
+        uint32_t t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d;
+    s->h[4] += e; s->h[5] += f; s->h[6] += g; s->h[7] += h;
+}
+
+static void sha_update(mc_sha256* s, const void* data, size_t n) {
+    const uint8_t* p = data;
+    s->length += n;
+    while (n > 0) {
+        size_t take = 64 - s->used < n ? 64 - s->used : n;
+        memcpy(s->block + s->used, p, take);
+        s->used += take;
+        p += take;
+        n -= take;
+        if (s->used == 64) {
+            sha_block(s, s->block);
+            s->used = 0;
+        }
+    }
+}
+
+static void sha_final(mc_sha256* s, uint8_t digest[32]) {
+    uint64_t bits = s->length * 8;
+    uint8_t pad = 0x80;
+    sha_update(s, &pad, 1);
+    pad = 0;
+    while (s->used != 56) sha_update(s, &pad, 1);
+    uint8_t len[8];
+    for (int i = 0; i < 8; i++) len[i] = (uint8_t)(bits >> (56 - 8 * i));
+    sha_update(s, len, 8);
+    for (int i = 0; i < 8; i++) {
+        digest[4*i] = (uint8_t)(s->h[i] >> 24);
+        digest[4*i+1] = (uint8_t)(s->h[i] >> 16);
+        digest[4*i+2] = (uint8_t)(s->h[i] >> 8);
+        digest[4*i+3] = (uint8_t)s->h[i];
+    }
+}
+
+// Parts are length prefixed so that no two different inputs hash the same bytes
+static void sha_part(mc_sha256* s, const char* part) {
+    uint64_t n = part ? strlen(part) : 0;
+    sha_update(s, &n, sizeof(n));
+    sha_update(s, part, n);
+}
+
+void mc_cache_key(const char* backend, const char* device, const char* options,
+                  const char* program, char* key) {
+    static const char hex[] = "0123456789abcdef";
+    mc_sha256 s;
+    uint8_t digest[32];
+    sha_init(&s);
+    sha_part(&s, backend);
+    sha_part(&s, device);
+    sha_part(&s, options);
+    sha_part(&s, program);
+    sha_final(&s, digest);
+    for (int i = 0; i < 32; i++) {
+        key[2*i] = hex[digest[i] >> 4];
+        key[2*i+1] = hex[digest[i] & 15];
+    }
+    key[64] = 0;
+}
+
+// -------------------------------------------------
+// Settings and counters
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static char* cache_dir = NULL;
+static int64_t memory_limit = 64 << 20;
+static int64_t disk_limit = 256 << 20;
+static mc_cache_stats stats;
+
+static void cache_init(void) {
+    char path[4096];
+    const char* env = getenv("METALCOMPUTE_CACHE_DIR");
+    const char* xdg = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    if (env != NULL) {
+        snprintf(path, sizeof(path), "%s", env);
+    } else if (xdg != NULL && xdg[0] == '/') {
+        snprintf(path, sizeof(path), "%s/metalcompute", xdg);
+    } else if (home != NULL && home[0] != 0) {
+        snprintf(path, sizeof(path), "%s/.cache/metalcompute", home);
+    } else {
+        path[0] = 0;
+    }
+    cache_dir = path[0] ? strdup(path) : NULL;
+}
+
+void mc_cache_set_dir(const char* dir) {
+    pthread_once(&cache_once, cache_init);
+    pthread_mutex_lock(&cache_lock);
+    free(cache_dir);
+    cache_dir = (dir && dir[0]) ? strdup(dir) : NULL;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+char* mc_cache_get_dir(void) {
+    pthread_once(&cache_once, cache_init);
+    pthread_mutex_lock(&cache_lock);
+    char* dir = cache_dir ? strdup(cache_dir) : NULL;
+    pthread_mutex_unlock(&cache_lock);
+    return dir;
+}
+
+void mc_cache_set_limits(int64_t memory_bytes, int64_t disk_bytes) {
+    pthread_mutex_lock(&cache_lock);
+    if (memory_bytes >= 0) memory_limit = memory_bytes;
+    if (disk_bytes >= 0) disk_limit = disk_bytes;
+    pthread_mutex_unlock(&cache_lock);
+    if (disk_bytes >= 0) mc_cache_trim_disk();
+}
+
+int64_t mc_cache_memory_limit(void) {
+    pthread_mutex_lock(&cache_lock);
+    int64_t limit = memory_limit;
+    pthread_mutex_unlock(&cache_lock);
+    return limit;
+}
+
+int64_t mc_cache_disk_limit(void) {
+    pthread_mutex_lock(&cache_lock);
+    int64_t limit = disk_limit;
+    pthread_mutex_unlock(&cache_lock);
+    return limit;
+}
+
+void mc_cache_count(int event) {
+    pthread_mutex_lock(&cache_lock);
+    switch (event) {
+        case MC_CACHE_MEMORY_HIT: stats.memory_hits++; break;
+        case MC_CACHE_DISK_HIT: stats.disk_hits++; break;
+        case MC_CACHE_MISS: stats.misses++; break;
+        case MC_CACHE_EVICTION: stats.evictions++; break;
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void mc_cache_set_memory_usage(int64_t entries, int64_t bytes) {
+    pthread_mutex_lock(&cache_lock);
+    stats.memory_entries = entries;
+    stats.memory_bytes = bytes;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void mc_cache_get_stats(mc_cache_stats* out) {
+    pthread_mutex_lock(&cache_lock);
+    *out = stats;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// -------------------------------------------------
+// On-disk tier
+
+static int make_dirs(const char* dir) {
+    char path[4096];
+    if (snprintf(path, sizeof(path), "%s", dir) >= (int)sizeof(path)) return 0;
+    for (char* p = path + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = 0;
+        if (mkdir(path, 0755) != 0 && errno != EEXIST) return 0;
+        *p = '/';
+    }
+    return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+int mc_cache_path(const char* key, const char* ext, char* path, size_t size) {
+    char* dir = mc_cache_get_dir();
+    if (dir == NULL) return 0;
+    int n = snprintf(path, size, "%s/%s.%s", dir, key, ext);
+    int ok = n > 0 && (size_t)n < size && make_dirs(dir);
+    free(dir);
+    return ok;
+}
+
+void mc_cache_tmp_path(const char* path, char* tmp_path, size_t size) {
+    // The pid alone is shared by the threads compiling at once
+    static atomic_long tmp_count = 0;
+    snprintf(tmp_path, size, "%s.tmp%ld.%ld", path, (long)getpid(), atomic_fetch_add(&tmp_count, 1));
+}
+
+int mc_cache_commit(const char* tmp_path, const char* path) {
+    if (rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return 0;
+    }
+    mc_cache_trim_disk();
+    return 1;
+}
+
+// Blob entries: header then payload
+typedef struct {
+    char magic[8];
+    uint64_t length;
+    uint8_t digest[32]; // SHA-256 of the payload
+} mc_cache_header;
+
+static const char blob_magic[8] = "MCCACHE1";
+
+int mc_cache_read(const char* key, const char* ext, void** data, size_t* length) {
+    char path[4096];
+    if (!mc_cache_path(key, ext, path, sizeof(path))) return 0;
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) return 0;
+    mc_cache_header header;
+    char* payload = NULL;
+    int ok = fread(&header, sizeof(header), 1, f) == 1
+        && memcmp(header.magic, blob_magic, sizeof(blob_magic)) == 0
+        && header.length < ((uint64_t)1 << 32)
+        && (payload = malloc(header.length ? header.length : 1)) != NULL
+        && fread(payload, 1, header.length, f) == header.length;
+    fclose(f);
+    if (ok) {
+        mc_sha256 s;
+        uint8_t digest[32];
+        sha_init(&s);
+        sha_update(&s, payload, header.length);
+        sha_final(&s, digest);
+        ok = memcmp(digest, header.digest, sizeof(digest)) == 0;
+    }
+    if (!ok) {
+        free(payload);
+        unlink(path); // Truncated or corrupt, recompile and replace it
+        return 0;
+    }
+    utimes(path, NULL); // Recently used, for trimming
+    *data = payload;
+    *length = header.length;
+    return 1;
+}
+
+int mc_cache_write(const char* key, const char* ext, const void* data, size_t length) {
+    char path[4096], tmp_path[4200];
+    if (!mc_cache_path(key, ext, path, sizeof(path))) return 0;
+    // Written aside then renamed, so other processes never see a partial entry
+    mc_cache_tmp_path(path, tmp_path, sizeof(tmp_path));
+    FILE* f = fopen(tmp_path, "wb");
+    if (f == NULL) return 0;
+    mc_cache_header header;
+    memcpy(header.magic, blob_magic, sizeof(blob_magic));
+    header.length = length;
+    mc_sha256 s;
+    sha_init(&s);
+    sha_update(&s, data, length);
+    sha_final(&s, header.digest);
+    int ok = fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(data, 1, length, f) == length;
+    ok = (fclose(f) == 0) && ok;
+    if (!ok) {
+        unlink(tmp_path);
+        return 0;
+    }
+    return mc_cache_commit(tmp_path, path);
+}
+
+typedef struct {
+    char name[256];
+    int64_t size;
+    time_t used;
+} mc_cache_entry;
+
+static int is_entry(const char* name) {
+    for (int i = 0; i < MC_CACHE_KEY_SIZE - 1; i++) {
+        char c = name[i];
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) return 0;
+    }
+    return name[MC_CACHE_KEY_SIZE - 1] == '.';
+}
+
+// Entries in the cache directory, or -1 if disabled
+static int list_entries(char** dir_out, mc_cache_entry** entries_out) {
+    char* dir = mc_cache_get_dir();
+    if (dir == NULL) return -1;
+    DIR* d = opendir(dir);
+    mc_cache_entry* entries = NULL;
+    int count = 0, size = 0;
+    struct dirent* ent;
+    while (d && (ent = readdir(d)) != NULL) {
+        char path[4096];
+        struct stat st;
+        if (!is_entry(ent->d_name) || strlen(ent->d_name) >= sizeof(entries->name)) continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+        if (count == size) {
+            size = size ? size * 2 : 64;
+            mc_cache_entry* grown = realloc(entries, size * sizeof(mc_cache_entry));
+            if (grown == NULL) break;
+            entries = grown;
+        }
+        strcpy(entries[count].name, ent->d_name);
+        entries[count].size = st.st_size;
+        entries[count].used = st.st_mtime;
+        count++;
+    }
+    if (d) closedir(d);
+    *dir_out = dir;
+    *entries_out = entries;
+    return count;
+}
+
+static int cmp_used(const void* a, const void* b) {
+    time_t x = ((const mc_cache_entry*)a)->used, y = ((const mc_cache_entry*)b)->used;
+    return x < y ? -1 : x > y;
+}
+
+// Remove least recently used entries until within the disk limit
+void mc_cache_trim_disk(void) {
+    char* dir;
+    mc_cache_entry* entries;
+    int count = list_entries(&dir, &entries);
+    if (count < 0) return;
+    int64_t total = 0;
+    for (int i = 0; i < count; i++) total += entries[i].size;
+    int64_t limit = mc_cache_disk_limit();
+    qsort(entries, count, sizeof(mc_cache_entry), cmp_used);
+    for (int i = 0; i < count && total > limit; i++) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", dir, entries[i].name);
+        if (unlink(path) == 0) {
+            total -= entries[i].size;
+            mc_cache_count(MC_CACHE_EVICTION);
+        }
+    }
+    free(entries);
+    free(dir);
+}
+
+void mc_cache_clear_disk(void) {
+    char* dir;
+    mc_cache_entry* entries;
+    int count = list_entries(&dir, &entries);
+    if (count < 0) return;
+    for (int i = 0; i < count; i++) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", dir, entries[i].name);
+        unlink(path);
+    }
+    free(entries);
+    free(dir);
+}
+
+int64_t mc_cache_disk_usage(void) {
+    char* dir;
+    mc_cache_entry* entries;
+    int count = list_entries(&dir, &entries);
+    if (count < 0) return 0;
+    int64_t total = 0;
+    for (int i = 0; i < count; i++) total += entries[i].size;
+    free(entries);
+    free(dir);
+    return total;
+}
@@ -0,0 +1,61 @@
+// Content addressed cache of compiled kernels, shared by the backends
+
+// Entries are keyed by a SHA-256 of everything which affects compilation:
+// backend and artifact version, device, compile options and source.
+// Backends keep their own in-process tier of compiled libraries, and store
+// compiled artifacts in the on-disk tier here so warm processes skip work.
+
+#ifndef MC_CACHE_H
+#define MC_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define MC_CACHE_KEY_SIZE 65 // Hex digest and terminator
+
+// Events counted by mc_cache_count
+#define MC_CACHE_MEMORY_HIT 0
+#define MC_CACHE_DISK_HIT 1
+#define MC_CACHE_MISS 2
+#define MC_CACHE_EVICTION 3
+
+typedef struct {
+    int64_t memory_hits;
+    int64_t disk_hits;
+    int64_t misses;
+    int64_t evictions;
+    int64_t memory_entries; // Held by the backend's in-process tier
+    int64_t memory_bytes;
+} mc_cache_stats;
+
+void mc_cache_key(const char* backend, const char* device, const char* options,
+                  const char* program, char* key);
+
+// Settings. The directory defaults to $METALCOMPUTE_CACHE_DIR, or else
+// $XDG_CACHE_HOME/metalcompute or ~/.cache/metalcompute. An empty or NULL
+// directory disables the on-disk tier.
+void mc_cache_set_dir(const char* dir);
+char* mc_cache_get_dir(void); // Must free, NULL if disabled
+void mc_cache_set_limits(int64_t memory_bytes, int64_t disk_bytes); // Negative leaves unchanged
+int64_t mc_cache_memory_limit(void);
+int64_t mc_cache_disk_limit(void);
+
+void mc_cache_count(int event);
+void mc_cache_set_memory_usage(int64_t entries, int64_t bytes);
+void mc_cache_get_stats(mc_cache_stats* stats);
+
+// On-disk tier. Entries are files named <key>.<ext> in the cache directory.
+// Path of an entry, returns 0 if the on-disk tier is disabled
+int mc_cache_path(const char* key, const char* ext, char* path, size_t size);
+// Path to write an entry aside at, unique to each call in any process and thread
+void mc_cache_tmp_path(const char* path, char* tmp_path, size_t size);
+// Move a completed file into place as an entry, then trim to the disk limit
+int mc_cache_commit(const char* tmp_path, const char* path);
+// Checksummed blobs. Read returns 1 with *data (must free) if a valid entry exists.
+int mc_cache_read(const char* key, const char* ext, void** data, size_t* length);
+int mc_cache_write(const char* key, const char* ext, const void* data, size_t length);
+void mc_cache_trim_disk(void);
+void mc_cache_clear_disk(void);
+int64_t mc_cache_disk_usage(void);
+
+#endif
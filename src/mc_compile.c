@@ -0,0 +1,160 @@
+/*
+mc_compile.c
+
+Kernel compiles on background threads, shared by the backends
+
+(c) Andrew Baldwin 2021
+*/
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metalcompute.h"
+#include "mc_compile.h"
+#include "mc_notify.h"
+
+extern const RetCode Success;
+extern const RetCode NotReadyToCompile;
+extern const RetCode FailedToCompile;
+extern const RetCode KernelNotFound;
+
+#define MC_COMPILE_THREADS 4 // Most compiles at once
+
+struct mc_compile_job {
+    mc_dev_handle dev_handle;
+    char* program;              // Freed once compiled
+    mc_kern_handle kern_handle; // Result, with error set for FailedToCompile
+    RetCode ret;
+    bool done;
+    bool taken; // Kernel moved to the caller
+    struct mc_compile_job* next;
+};
+
+// Jobs waiting for a worker, first to last. Workers never exit
+static pthread_mutex_t compile_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compile_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t compile_done = PTHREAD_COND_INITIALIZER;
+static mc_compile_job* queue_first = NULL;
+static mc_compile_job* queue_last = NULL;
+static int workers = 0;
+static int idle = 0;
+
+static void* compile_worker(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&compile_lock);
+    for (;;) {
+        while (queue_first == NULL) {
+            idle++;
+            pthread_cond_wait(&compile_queued, &compile_lock);
+            idle--;
+        }
+        mc_compile_job* job = queue_first;
+        queue_first = job->next;
+        if (queue_first == NULL) queue_last = NULL;
+        pthread_mutex_unlock(&compile_lock);
+
+        mc_kern_handle kern_handle = { 0, NULL };
+        RetCode ret = mc_sw_kern_open(&job->dev_handle, job->program, &kern_handle);
+        free(job->program);
+        job->program = NULL;
+
+        pthread_mutex_lock(&compile_lock);
+        job->kern_handle = kern_handle;
+        job->ret = ret;
+        job->done = true;
+        pthread_cond_broadcast(&compile_done);
+        pthread_mutex_unlock(&compile_lock);
+        mc_notify_signal(); // Wake event loops awaiting the job
+        pthread_mutex_lock(&compile_lock);
+    }
+    return NULL;
+}
+
+mc_compile_job* mc_compile_start(const mc_dev_handle* dev_handle, const char* program) {
+    mc_compile_job* job = calloc(1, sizeof(mc_compile_job));
+    if (job == NULL) return NULL;
+    job->dev_handle = *dev_handle;
+    job->program = strdup(program);
+    if (job->program == NULL) {
+        free(job);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&compile_lock);
+    // Another worker while every one is busy, up to one per processor
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    int limit = processors > 0 && processors < MC_COMPILE_THREADS ? (int)processors : MC_COMPILE_THREADS;
+    int queued = 0;
+    for (mc_compile_job* j = queue_first; j; j = j->next) queued++;
+    if (idle <= queued && workers < limit) {
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, compile_worker, NULL) == 0)
+            workers++;
+        pthread_attr_destroy(&attr);
+    }
+    if (workers == 0) {
+        pthread_mutex_unlock(&compile_lock);
+        free(job->program);
+        free(job);
+        return NULL;
+    }
+    if (queue_last) queue_last->next = job;
+    else queue_first = job;
+    queue_last = job;
+    pthread_cond_signal(&compile_queued);
+    pthread_mutex_unlock(&compile_lock);
+    return job;
+}
+
+bool mc_compile_wait(mc_compile_job* job, double timeout) {
+    pthread_mutex_lock(&compile_lock);
+    if (timeout < 0) {
+        while (!job->done) pthread_cond_wait(&compile_done, &compile_lock);
+    } else if (timeout > 0) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        double whole = floor(timeout);
+        deadline.tv_sec += (time_t)whole;
+        deadline.tv_nsec += (long)((timeout - whole) * 1e9);
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (!job->done && pthread_cond_timedwait(&compile_done, &compile_lock, &deadline) == 0) {}
+    }
+    bool done = job->done;
+    pthread_mutex_unlock(&compile_lock);
+    return done;
+}
+
+RetCode mc_compile_take(mc_compile_job* job, mc_kern_handle* kern_handle) {
+    pthread_mutex_lock(&compile_lock);
+    RetCode ret = job->done ? job->ret : NotReadyToCompile;
+    if (ret == Success) {
+        if (job->taken) {
+            ret = KernelNotFound;
+        } else {
+            *kern_handle = job->kern_handle;
+            job->taken = true;
+        }
+    } else if (ret == FailedToCompile) {
+        kern_handle->error = job->kern_handle.error ? strdup(job->kern_handle.error) : NULL;
+    }
+    pthread_mutex_unlock(&compile_lock);
+    return ret;
+}
+
+void mc_compile_free(mc_compile_job* job) {
+    mc_compile_wait(job, -1);
+    if (job->ret == Success && !job->taken)
+        mc_sw_kern_close(&job->dev_handle, &job->kern_handle);
+    free(job->kern_handle.error);
+    free(job);
+}
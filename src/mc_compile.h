@@ -0,0 +1,29 @@
+// Kernel compiles on background threads, shared by the backends
+
+// Each job compiles one program with mc_sw_kern_open on a small pool of worker
+// threads, so several compiles run at once and callers need not hold the GIL
+// while they wait. Completion is signalled through mc_notify like runs.
+
+#ifndef MC_COMPILE_H
+#define MC_COMPILE_H
+
+#include <stdbool.h>
+
+// Uses the types of metalcompute.h, which must be included first
+
+typedef struct mc_compile_job mc_compile_job;
+
+// Queue a compile of program for a device, which must stay open until the job
+// is freed. Returns NULL if the job or a worker could not be created.
+mc_compile_job* mc_compile_start(const mc_dev_handle* dev_handle, const char* program);
+// Block until the compile completes, or timeout seconds pass (negative: no limit, 0: poll).
+// Returns true if completed
+bool mc_compile_wait(mc_compile_job* job, double timeout);
+// Result of a completed compile. On Success the kernel is moved to kern_handle, once,
+// and later calls give KernelNotFound. On FailedToCompile kern_handle->error is the
+// compiler's message, which the caller frees.
+RetCode mc_compile_take(mc_compile_job* job, mc_kern_handle* kern_handle);
+// Waits for the compile, and closes a kernel which was never taken
+void mc_compile_free(mc_compile_job* job);
+
+#endif
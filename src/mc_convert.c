@@ -0,0 +1,360 @@
+/*
+mc_convert.c
+
+Conversion between item formats while copying, shared by the backends
+
+(c) Andrew Baldwin 2021
+*/
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define MC_CONVERT_F16C 1 // Built for any x86, so half conversions check for F16C when run
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "mc_convert.h"
+#include "mc_copy.h"
+
+extern const long FormatI8;
+extern const long FormatU8;
+extern const long FormatI16;
+extern const long FormatU16;
+extern const long FormatI32;
+extern const long FormatU32;
+extern const long FormatI64;
+extern const long FormatU64;
+extern const long FormatF16;
+extern const long FormatF32;
+extern const long FormatF64;
+
+#define MC_CONVERT_BLOCK 256 // Items at a time through the stack for other conversions
+
+int mc_format_stride(long format) {
+    if (format == FormatI8 || format == FormatU8) return 1;
+    if (format == FormatI16 || format == FormatU16 || format == FormatF16) return 2;
+    if (format == FormatI32 || format == FormatU32 || format == FormatF32) return 4;
+    if (format == FormatI64 || format == FormatU64 || format == FormatF64) return 8;
+    return 0;
+}
+
+static int is_float(long format) {
+    return format == FormatF16 || format == FormatF32 || format == FormatF64;
+}
+
+// Integer standing for 1.0 when normalized
+static double normal_max(long format) {
+    if (format == FormatI8) return INT8_MAX;
+    if (format == FormatU8) return UINT8_MAX;
+    if (format == FormatI16) return INT16_MAX;
+    return UINT16_MAX;
+}
+
+static float half_to_float(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f, mantissa = h & 0x3ff;
+    uint32_t bits;
+    float f;
+    if (exponent == 0x1f) {
+        bits = sign | 0x7f800000 | (mantissa << 13); // Infinity or NaN
+    } else if (exponent != 0) {
+        bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+    } else {
+        f = (float)mantissa * 0x1p-24f; // Zero or subnormal, exact as a float
+        memcpy(&bits, &f, sizeof(bits));
+        bits |= sign;
+    }
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// Rounds to nearest even, as the hardware conversions do
+static uint16_t float_to_half(float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    uint16_t sign = (bits >> 16) & 0x8000;
+    uint32_t magnitude = bits & 0x7fffffff;
+    if (magnitude > 0x7f800000) return sign | 0x7e00; // NaN
+    if (magnitude >= 0x477ff000) return sign | 0x7c00; // Rounds past 65504 to infinity
+    if (magnitude < 0x38800000) { // Below 2^-14, so subnormal or zero
+        float scaled;
+        memcpy(&scaled, &magnitude, sizeof(scaled));
+        return sign | (uint16_t)lrintf(scaled * 0x1p24f);
+    }
+    uint32_t rebiased = magnitude - ((127 - 15) << 23);
+    rebiased += 0xfff + ((rebiased >> 13) & 1);
+    return sign | (uint16_t)(rebiased >> 13);
+}
+
+// SIMD conversions for the common cases. Each converts a leading part of the
+// items, and returns how many, leaving the rest to the block conversions
+
+static size_t convert_f64_f32(float* dst, const double* src, size_t count) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 4 <= count; i += 4) {
+        __m128 lo = _mm_cvtpd_ps(_mm_loadu_pd(src + i));
+        __m128 hi = _mm_cvtpd_ps(_mm_loadu_pd(src + i + 2));
+        _mm_storeu_ps(dst + i, _mm_movelh_ps(lo, hi));
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    for (; i + 4 <= count; i += 4)
+        vst1q_f32(dst + i, vcvt_high_f32_f64(vcvt_f32_f64(vld1q_f64(src + i)), vld1q_f64(src + i + 2)));
+#endif
+    return i;
+}
+
+static size_t convert_f32_f64(double* dst, const float* src, size_t count) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 4 <= count; i += 4) {
+        __m128 v = _mm_loadu_ps(src + i);
+        _mm_storeu_pd(dst + i, _mm_cvtps_pd(v));
+        _mm_storeu_pd(dst + i + 2, _mm_cvtps_pd(_mm_movehl_ps(v, v)));
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    for (; i + 4 <= count; i += 4) {
+        float32x4_t v = vld1q_f32(src + i);
+        vst1q_f64(dst + i, vcvt_f64_f32(vget_low_f32(v)));
+        vst1q_f64(dst + i + 2, vcvt_high_f64_f32(v));
+    }
+#endif
+    return i;
+}
+
+#if defined(MC_CONVERT_F16C)
+__attribute__((target("f16c")))
+static size_t convert_f32_f16_f16c(uint16_t* dst, const float* src, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i lo = _mm_cvtps_ph(_mm_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT);
+        __m128i hi = _mm_cvtps_ph(_mm_loadu_ps(src + i + 4), _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_unpacklo_epi64(lo, hi));
+    }
+    return i;
+}
+
+__attribute__((target("f16c")))
+static size_t convert_f16_f32_f16c(float* dst, const uint16_t* src, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i halves = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm_storeu_ps(dst + i, _mm_cvtph_ps(halves));
+        _mm_storeu_ps(dst + i + 4, _mm_cvtph_ps(_mm_unpackhi_epi64(halves, halves)));
+    }
+    return i;
+}
+#endif
+
+static size_t convert_f32_f16(uint16_t* dst, const float* src, size_t count) {
+    size_t i = 0;
+#if defined(MC_CONVERT_F16C)
+    if (__builtin_cpu_supports("f16c")) i = convert_f32_f16_f16c(dst, src, count);
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    for (; i + 4 <= count; i += 4)
+        vst1_u16(dst + i, vreinterpret_u16_f16(vcvt_f16_f32(vld1q_f32(src + i))));
+#endif
+    return i;
+}
+
+static size_t convert_f16_f32(float* dst, const uint16_t* src, size_t count) {
+    size_t i = 0;
+#if defined(MC_CONVERT_F16C)
+    if (__builtin_cpu_supports("f16c")) i = convert_f16_f32_f16c(dst, src, count);
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    for (; i + 4 <= count; i += 4)
+        vst1q_f32(dst + i, vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(src + i))));
+#endif
+    return i;
+}
+
+static size_t convert_u8_f32(float* dst, const uint8_t* src, size_t count, int normalize) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 max = _mm_set1_ps(UINT8_MAX);
+    for (; i + 16 <= count; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i lo = _mm_unpacklo_epi8(bytes, zero), hi = _mm_unpackhi_epi8(bytes, zero);
+        __m128 v[4] = {
+            _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)), _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)),
+            _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)), _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)),
+        };
+        for (int j = 0; j < 4; j++)
+            _mm_storeu_ps(dst + i + 4 * j, normalize ? _mm_div_ps(v[j], max) : v[j]);
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    const float32x4_t max = vdupq_n_f32(UINT8_MAX);
+    for (; i + 16 <= count; i += 16) {
+        uint8x16_t bytes = vld1q_u8(src + i);
+        uint16x8_t lo = vmovl_u8(vget_low_u8(bytes)), hi = vmovl_high_u8(bytes);
+        float32x4_t v[4] = {
+            vcvtq_f32_u32(vmovl_u16(vget_low_u16(lo))), vcvtq_f32_u32(vmovl_high_u16(lo)),
+            vcvtq_f32_u32(vmovl_u16(vget_low_u16(hi))), vcvtq_f32_u32(vmovl_high_u16(hi)),
+        };
+        for (int j = 0; j < 4; j++)
+            vst1q_f32(dst + i + 4 * j, normalize ? vdivq_f32(v[j], max) : v[j]);
+    }
+#endif
+    return i;
+}
+
+static size_t convert_f32_u8(uint8_t* dst, const float* src, size_t count, int normalize) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    // Large values would convert to INT32_MIN, so limit them first. NaN passes
+    // the limit, converts to INT32_MIN and saturates to 0
+    const __m128 limit = _mm_set1_ps(normalize ? 1.0f : UINT8_MAX);
+    const __m128 scale = _mm_set1_ps(normalize ? UINT8_MAX : 1.0f);
+    for (; i + 16 <= count; i += 16) {
+        __m128i w[4];
+        for (int j = 0; j < 4; j++) {
+            __m128 v = _mm_mul_ps(_mm_min_ps(limit, _mm_loadu_ps(src + i + 4 * j)), scale);
+            w[j] = normalize ? _mm_cvtps_epi32(v) : _mm_cvttps_epi32(v);
+        }
+        __m128i lo = _mm_packs_epi32(w[0], w[1]), hi = _mm_packs_epi32(w[2], w[3]);
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(lo, hi));
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    for (; i + 16 <= count; i += 16) {
+        uint32x4_t w[4];
+        for (int j = 0; j < 4; j++) {
+            float32x4_t v = vld1q_f32(src + i + 4 * j); // Conversions saturate, with NaN as 0
+            w[j] = normalize ? vcvtnq_u32_f32(vmulq_n_f32(v, UINT8_MAX)) : vcvtq_u32_f32(v);
+        }
+        uint16x8_t lo = vcombine_u16(vqmovn_u32(w[0]), vqmovn_u32(w[1]));
+        uint16x8_t hi = vcombine_u16(vqmovn_u32(w[2]), vqmovn_u32(w[3]));
+        vst1q_u8(dst + i, vcombine_u8(vqmovn_u16(lo), vqmovn_u16(hi)));
+    }
+#endif
+    return i;
+}
+
+static size_t convert_simd(void* dst, long format, const void* src, long src_format, size_t count, int normalize) {
+    if (src_format == FormatU8 && format == FormatF32) return convert_u8_f32(dst, src, count, normalize);
+    if (src_format == FormatF32 && format == FormatU8) return convert_f32_u8(dst, src, count, normalize);
+    if (normalize) return 0;
+    if (src_format == FormatF64 && format == FormatF32) return convert_f64_f32(dst, src, count);
+    if (src_format == FormatF32 && format == FormatF64) return convert_f32_f64(dst, src, count);
+    if (src_format == FormatF32 && format == FormatF16) return convert_f32_f16(dst, src, count);
+    if (src_format == FormatF16 && format == FormatF32) return convert_f16_f32(dst, src, count);
+    return 0;
+}
+
+// Block conversions: through 64 bit integers between integer formats, so
+// none lose precision, and through doubles when either format is a float
+
+#define LOAD(T, expr) for (size_t i = 0; i < n; i++) { T x = ((const T*)src)[i]; out[i] = (expr); }
+
+static void load_ints(int64_t* out, const char* src, long format, size_t n) {
+    if (format == FormatI8) LOAD(int8_t, x)
+    else if (format == FormatU8) LOAD(uint8_t, x)
+    else if (format == FormatI16) LOAD(int16_t, x)
+    else if (format == FormatU16) LOAD(uint16_t, x)
+    else if (format == FormatI32) LOAD(int32_t, x)
+    else if (format == FormatU32) LOAD(uint32_t, x)
+    else if (format == FormatI64) LOAD(int64_t, x)
+    else LOAD(uint64_t, (int64_t)x) // Keeps the bits, so stores wrap as casts do
+}
+
+static void load_doubles(double* out, const char* src, long format, size_t n) {
+    if (format == FormatI8) LOAD(int8_t, x)
+    else if (format == FormatU8) LOAD(uint8_t, x)
+    else if (format == FormatI16) LOAD(int16_t, x)
+    else if (format == FormatU16) LOAD(uint16_t, x)
+    else if (format == FormatI32) LOAD(int32_t, x)
+    else if (format == FormatU32) LOAD(uint32_t, x)
+    else if (format == FormatI64) LOAD(int64_t, (double)x)
+    else if (format == FormatU64) LOAD(uint64_t, (double)x)
+    else if (format == FormatF16) LOAD(uint16_t, half_to_float(x))
+    else if (format == FormatF32) LOAD(float, x)
+    else LOAD(double, x)
+}
+
+#define STORE_INT(T) for (size_t i = 0; i < n; i++) ((T*)dst)[i] = (T)in[i];
+
+static void store_ints(char* dst, long format, const int64_t* in, size_t n) {
+    if (format == FormatI8) STORE_INT(int8_t)
+    else if (format == FormatU8) STORE_INT(uint8_t)
+    else if (format == FormatI16) STORE_INT(int16_t)
+    else if (format == FormatU16) STORE_INT(uint16_t)
+    else if (format == FormatI32) STORE_INT(int32_t)
+    else if (format == FormatU32) STORE_INT(uint32_t)
+    else if (format == FormatI64) STORE_INT(int64_t)
+    else STORE_INT(uint64_t)
+}
+
+#define STORE(T, expr) for (size_t i = 0; i < n; i++) { double x = in[i]; ((T*)dst)[i] = (expr); }
+
+// Whole number for an integer format, saturated to [lo, hi], or 0 for NaN
+static double whole(double x, double lo, double hi, int round) {
+    if (x != x) return 0;
+    x = round ? nearbyint(x) : trunc(x);
+    return x < lo ? lo : x > hi ? hi : x;
+}
+
+static void store_doubles(char* dst, long format, const double* in, size_t n, int round) {
+    if (format == FormatI8) STORE(int8_t, (int8_t)whole(x, INT8_MIN, INT8_MAX, round))
+    else if (format == FormatU8) STORE(uint8_t, (uint8_t)whole(x, 0, UINT8_MAX, round))
+    else if (format == FormatI16) STORE(int16_t, (int16_t)whole(x, INT16_MIN, INT16_MAX, round))
+    else if (format == FormatU16) STORE(uint16_t, (uint16_t)whole(x, 0, UINT16_MAX, round))
+    else if (format == FormatI32) STORE(int32_t, (int32_t)whole(x, INT32_MIN, INT32_MAX, round))
+    else if (format == FormatU32) STORE(uint32_t, (uint32_t)whole(x, 0, UINT32_MAX, round))
+    // 2^63 and 2^64 are the nearest doubles to the largest 64 bit integers, but out of range
+    else if (format == FormatI64) STORE(int64_t, (x = whole(x, -0x1p63, 0x1p63, round)) >= 0x1p63 ? INT64_MAX : (int64_t)x)
+    else if (format == FormatU64) STORE(uint64_t, (x = whole(x, 0, 0x1p64, round)) >= 0x1p64 ? UINT64_MAX : (uint64_t)x)
+    else if (format == FormatF16) STORE(uint16_t, float_to_half((float)x))
+    else if (format == FormatF32) STORE(float, (float)x)
+    else STORE(double, x)
+}
+
+int mc_convert(void* dst, long format, const void* src, long src_format, size_t count, int flags) {
+    int stride = mc_format_stride(format), src_stride = mc_format_stride(src_format);
+    if (stride == 0 || src_stride == 0) return -1;
+    int normalize = (flags & MC_CONVERT_NORMALIZE) != 0;
+    double max = 0;
+    if (normalize) {
+        long integer = is_float(format) ? src_format : format;
+        if (is_float(format) == is_float(src_format) || mc_format_stride(integer) > 2) return -1;
+        max = normal_max(integer);
+    } else if (format == src_format) {
+        mc_copy(dst, src, count * stride);
+        return 0;
+    }
+
+    size_t i = convert_simd(dst, format, src, src_format, count, normalize);
+    char* out = dst;
+    const char* in = src;
+    int integers = !is_float(format) && !is_float(src_format);
+    while (i < count) {
+        size_t n = count - i < MC_CONVERT_BLOCK ? count - i : MC_CONVERT_BLOCK;
+        if (integers) {
+            int64_t block[MC_CONVERT_BLOCK];
+            load_ints(block, in + i * src_stride, src_format, n);
+            store_ints(out + i * stride, format, block, n);
+        } else {
+            double block[MC_CONVERT_BLOCK];
+            load_doubles(block, in + i * src_stride, src_format, n);
+            for (size_t j = 0; normalize && j < n; j++) {
+                double x = block[j];
+                if (is_float(format)) {
+                    x /= max;
+                    block[j] = x < -1 ? -1 : x; // INT8_MIN is -1 too, as for snorm
+                } else {
+                    block[j] = (x < -1 ? -1 : x > 1 ? 1 : x) * max; // NaN passes, and stores as 0
+                }
+            }
+            store_doubles(out + i * stride, format, block, n, normalize);
+        }
+        i += n;
+    }
+    return 0;
+}
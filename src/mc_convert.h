@@ -0,0 +1,23 @@
+// Conversion between item formats while copying, shared by the backends
+
+// Formats are the Format constants of metalcompute.c. Common conversions (f64 to
+// f32, f32 to f16 and back, u8 to f32 and back) use SIMD instructions, others go
+// a block at a time through a small buffer on the stack, never a full size copy.
+
+#ifndef MC_CONVERT_H
+#define MC_CONVERT_H
+
+#include <stddef.h>
+
+// Integers stand for floats in [0, 1] (unsigned) or [-1, 1] (signed), as for
+// the unorm and snorm pixel formats. Only between 8 or 16 bit integers and floats
+#define MC_CONVERT_NORMALIZE 1
+
+int mc_format_stride(long format); // Bytes per item, or 0 for an unknown format
+// Convert count items from src in src_format to dst in format. Floats converted to
+// integers round toward zero (to nearest when normalized) and saturate, with NaN
+// as 0. Integers converted to integers wrap, as C casts do. Returns 0, or -1 if
+// the formats are unknown, or flags do not apply to them.
+int mc_convert(void* dst, long format, const void* src, long src_format, size_t count, int flags);
+
+#endif
@@ -0,0 +1,165 @@
+/*
+mc_copy.c
+
+Host memory copies, shared by the backends
+
+(c) Andrew Baldwin 2021
+*/
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "mc_copy.h"
+
+#define MC_COPY_MAX_THREADS 8
+#define MC_COPY_CHUNK (4 << 20)         // Share of a copy taken at a time
+#define MC_COPY_PARALLEL_MIN (16 << 20) // Smaller copies stay on the caller
+
+typedef struct mc_copy_job {
+    char* dst;
+    const char* src;
+    size_t length;
+    size_t chunks;
+    size_t next;     // Chunk to take next
+    size_t finished; // Chunks copied. The caller returns once all are
+    int helpers;     // Workers which may still join, so each copy keeps to its setting
+    struct mc_copy_job* next_job;
+} mc_copy_job;
+
+// Jobs with chunks left to take. Workers never exit
+static pthread_mutex_t copy_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t copy_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t copy_done = PTHREAD_COND_INITIALIZER;
+static mc_copy_job* queue = NULL;
+static int workers = 0;
+static atomic_int threads_setting = 0; // 0 for the default
+static atomic_int threads_last = 0;    // Threads which took part in the last copy large enough to share
+
+static int copy_threads_default(void) {
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    if (processors < 1) return 1;
+    return processors < MC_COPY_MAX_THREADS ? (int)processors : MC_COPY_MAX_THREADS;
+}
+
+// Copy with stores which skip the cache, so a large copy does not evict
+// everything else only to be evicted itself before it is read. memcpy makes
+// this choice itself from the length, but cannot for chunks of a shared copy.
+static void copy_stream(char* dst, const char* src, size_t length) {
+#if defined(__SSE2__)
+    size_t head = (16 - ((uintptr_t)dst & 15)) & 15;
+    if (head > length) head = length;
+    memcpy(dst, src, head);
+    size_t i = head;
+    for (; i + 64 <= length; i += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i*)(src + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i*)(src + i + 48));
+        _mm_stream_si128((__m128i*)(dst + i), a);
+        _mm_stream_si128((__m128i*)(dst + i + 16), b);
+        _mm_stream_si128((__m128i*)(dst + i + 32), c);
+        _mm_stream_si128((__m128i*)(dst + i + 48), d);
+    }
+    memcpy(dst + i, src + i, length - i);
+    _mm_sfence(); // Streamed stores are visible before the copy is reported done
+#else
+    memcpy(dst, src, length); // Leave it to the platform's memcpy, which chooses its own stores
+#endif
+}
+
+static void copy_chunk(mc_copy_job* job, size_t index) {
+    size_t start = index * MC_COPY_CHUNK;
+    size_t length = job->length - start < MC_COPY_CHUNK ? job->length - start : MC_COPY_CHUNK;
+    copy_stream(job->dst + start, job->src + start, length); // Shared copies are all large
+}
+
+// Take and copy chunks of job until none are left. Called with copy_lock held,
+// which is released while copying
+static void copy_work(mc_copy_job* job) {
+    while (job->next < job->chunks) {
+        size_t index = job->next++;
+        if (job->next == job->chunks) { // Last chunk taken
+            mc_copy_job** link = &queue;
+            while (*link != job) link = &(*link)->next_job;
+            *link = job->next_job;
+        }
+        pthread_mutex_unlock(&copy_lock);
+        copy_chunk(job, index);
+        pthread_mutex_lock(&copy_lock);
+        if (++job->finished == job->chunks) {
+            pthread_cond_broadcast(&copy_done);
+            return; // The caller may return, and the job with it
+        }
+    }
+}
+
+// First queued job which may take another worker, or NULL
+static mc_copy_job* copy_wanted(void) {
+    for (mc_copy_job* job = queue; job != NULL; job = job->next_job) {
+        if (job->helpers > 0) return job;
+    }
+    return NULL;
+}
+
+static void* copy_worker(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&copy_lock);
+    for (;;) {
+        mc_copy_job* job;
+        while ((job = copy_wanted()) == NULL) pthread_cond_wait(&copy_queued, &copy_lock);
+        job->helpers--;
+        copy_work(job);
+    }
+    return NULL;
+}
+
+void mc_copy(void* dst, const void* src, size_t length) {
+    int threads = length >= MC_COPY_PARALLEL_MIN ? atomic_load(&threads_setting) : 1;
+    if (threads == 0) threads = copy_threads_default();
+    if (threads == 1) {
+        if (length >= MC_COPY_PARALLEL_MIN) atomic_store(&threads_last, 1);
+        memcpy(dst, src, length);
+        return;
+    }
+
+    pthread_mutex_lock(&copy_lock);
+    while (workers < threads - 1) {
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        int failed = pthread_create(&thread, &attr, copy_worker, NULL);
+        pthread_attr_destroy(&attr);
+        if (failed) break; // The caller copies what workers do not
+        workers++;
+    }
+
+    // Workers are shared by every copy, and may have been started for a higher
+    // setting, so each job admits only threads - 1 of them
+    mc_copy_job job = { dst, src, length, (length + MC_COPY_CHUNK - 1) / MC_COPY_CHUNK, 0, 0, threads - 1, NULL };
+    mc_copy_job** last = &queue;
+    while (*last) last = &(*last)->next_job;
+    *last = &job;
+    pthread_cond_broadcast(&copy_queued);
+    copy_work(&job);
+    while (job.finished < job.chunks) pthread_cond_wait(&copy_done, &copy_lock);
+    atomic_store(&threads_last, threads - job.helpers);
+    pthread_mutex_unlock(&copy_lock);
+}
+
+int mc_copy_threads(int threads) {
+    if (threads >= 0) atomic_store(&threads_setting, threads < MC_COPY_MAX_THREADS ? threads : MC_COPY_MAX_THREADS);
+    int setting = atomic_load(&threads_setting);
+    return setting ? setting : copy_threads_default();
+}
+
+int mc_copy_last_threads(void) {
+    return atomic_load(&threads_last);
+}
@@ -0,0 +1,22 @@
+// Host memory copies, shared by the backends
+
+// Large copies are split across a pool of worker threads, with the caller
+// taking a share. The shares are written with non-temporal stores, as the
+// destination is too large to stay in cache anyway. Callers copying
+// MC_COPY_LARGE bytes or more should not hold the GIL.
+
+#ifndef MC_COPY_H
+#define MC_COPY_H
+
+#include <stddef.h>
+
+#define MC_COPY_LARGE (1 << 20) // Copies worth releasing the GIL for
+
+void mc_copy(void* dst, const void* src, size_t length);
+// Threads sharing each large copy, the caller included: 1 copies on the caller
+// alone, 0 restores the default of one per processor, up to 8. Negative only
+// reads the setting. Returns the setting in effect.
+int mc_copy_threads(int threads);
+int mc_copy_last_threads(void); // Threads which took part in the last copy large enough to share, 0 before any
+
+#endif
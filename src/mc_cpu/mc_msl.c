@@ -0,0 +1,2169 @@
+/*
+mc_msl.c
+
+Metal Shading Language subset compiler and vectorised interpreter
+for the CPU backend
+
+(c) Andrew Baldwin 2021
+*/
+
+#include <math.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mc_msl.h"
+
+// -------------------------------------------------
+// Values, types and IR
+
+typedef union {
+    float f;
+    int32_t i;
+    uint32_t u;
+} mc_msl_val;
+
+// Declared types. Narrow types are promoted to a value kind when loaded.
+enum { T_VOID, T_BOOL, T_CHAR, T_UCHAR, T_SHORT, T_USHORT, T_INT, T_UINT, T_HALF, T_FLOAT };
+// Value kinds held in lanes
+enum { K_BOOL, K_INT, K_UINT, K_FLOAT };
+
+static const int type_size[] = { 0, 1, 1, 1, 2, 2, 4, 4, 2, 4 };
+
+static int kind_of(int type) {
+    switch (type) {
+        case T_BOOL: return K_BOOL;
+        case T_UINT: return K_UINT;
+        case T_HALF: case T_FLOAT: return K_FLOAT;
+        default: return K_INT;
+    }
+}
+
+enum {
+    // Expressions
+    E_LIT, E_VAR, E_LOAD, E_CONV, E_NEG, E_NOT, E_BNOT,
+    E_ADD, E_SUB, E_MUL, E_DIV, E_MOD, E_AND, E_OR, E_XOR, E_SHL, E_SHR,
+    E_LT, E_LE, E_GT, E_GE, E_EQ, E_NE, E_LAND, E_LOR, E_SEL, E_CALL,
+    // Statements
+    S_BLOCK, S_SET, S_STORE, S_IF, S_LOOP, S_BREAK, S_CONT, S_RET, S_NOP
+};
+
+// Thread position attributes
+enum {
+    A_THREAD_POSITION_IN_GRID, A_THREAD_POSITION_IN_THREADGROUP, A_THREAD_INDEX_IN_THREADGROUP,
+    A_THREADGROUP_POSITION_IN_GRID, A_THREADS_PER_THREADGROUP, A_THREADS_PER_GRID,
+    A_THREADGROUPS_PER_GRID, A_COUNT
+};
+
+static const char* attr_names[A_COUNT] = {
+    "thread_position_in_grid", "thread_position_in_threadgroup", "thread_index_in_threadgroup",
+    "threadgroup_position_in_grid", "threads_per_threadgroup", "threads_per_grid",
+    "threadgroups_per_grid"
+};
+
+typedef struct mc_msl_loop {
+    int end_pos;
+} mc_msl_loop;
+
+typedef struct mc_msl_var {
+    int type;
+    int decl_pos;
+    int last_pos;
+    int loop_depth;          // Loop nesting depth at declaration
+    mc_msl_loop* pending;    // Outermost later loop using the var - extends lifetime to its end
+    int assigned;
+    int slot;
+    struct mc_msl_var* next;
+} mc_msl_var;
+
+typedef struct mc_msl_node {
+    int op;
+    int type;       // Result type (expressions) or stored type (S_SET/S_STORE)
+    int bind;       // Buffer parameter for E_LOAD/S_STORE
+    int fn;         // Builtin id for E_CALL
+    int depth;      // Control nesting depth for S_IF/S_LOOP masks
+    int need;       // Temporaries needed to evaluate
+    int linear;     // Index is thread_position_in_grid
+    int nargs;
+    mc_msl_val lit;
+    mc_msl_var* var;
+    struct mc_msl_node *a, *b, *c;
+    struct mc_msl_node** args;
+    struct mc_msl_node* next;
+} mc_msl_node;
+
+typedef struct {
+    int index;      // [[ buffer(index) ]] or [[ threadgroup(index) ]]
+    int type;       // Element type
+    int readonly;
+    int threadgroup; // Threadgroup memory rather than a device buffer
+} mc_msl_bufparam;
+
+// Vector attributes (uint2, uint3) have one scalar variable per component
+typedef struct {
+    int attr;
+    int component;
+    mc_msl_var* var;
+} mc_msl_attrparam;
+
+#define MC_MSL_MAX_ATTRS (A_COUNT * 3)
+
+#define MC_MSL_MAX_BUFFERS 31
+
+struct mc_msl_fn {
+    char* name;
+    mc_msl_node* body;
+    int nbufs;
+    mc_msl_bufparam bufs[MC_MSL_MAX_BUFFERS];
+    int nattrs;
+    mc_msl_attrparam attrs[MC_MSL_MAX_ATTRS];
+    mc_msl_var* gid;
+    int buffer_count;
+    int var_slots;
+    int temp_base;
+    int mask_base;
+    int slot_count;
+    struct mc_msl_fn* next;
+};
+
+typedef struct mc_msl_block {
+    struct mc_msl_block* next;
+    size_t used, size;
+    _Alignas(16) char data[];
+} mc_msl_block;
+
+struct mc_msl_lib {
+    mc_msl_block* blocks;
+    mc_msl_fn* fns;
+};
+
+static void* arena_alloc(mc_msl_lib* lib, size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    mc_msl_block* b = lib->blocks;
+    if (b == NULL || b->used + size > b->size) {
+        size_t block_size = size > 65536 ? size : 65536;
+        b = calloc(1, sizeof(mc_msl_block) + block_size);
+        if (b == NULL) return NULL;
+        b->size = block_size;
+        b->next = lib->blocks;
+        lib->blocks = b;
+    }
+    void* p = b->data + b->used;
+    b->used += size;
+    return p;
+}
+
+// -------------------------------------------------
+// Builtin functions
+
+enum {
+    // float f(float)
+    B_SIN, B_COS, B_TAN, B_ASIN, B_ACOS, B_ATAN, B_SINH, B_COSH, B_TANH,
+    B_EXP, B_EXP2, B_EXP10, B_LOG, B_LOG2, B_LOG10, B_SQRT, B_RSQRT,
+    B_FLOOR, B_CEIL, B_ROUND, B_TRUNC, B_RINT, B_FRACT, B_SIGN, B_FABS, B_SATURATE,
+    // float f(float, float)
+    B_POW, B_ATAN2, B_FMOD, B_FMIN, B_FMAX, B_STEP, B_COPYSIGN,
+    // float f(float, float, float)
+    B_MIX, B_FMA, B_SMOOTHSTEP,
+    // T f(T...)
+    B_ABS, B_MIN, B_MAX, B_CLAMP,
+    // bool f(float)
+    B_ISNAN, B_ISINF, B_ISFINITE,
+    // T select(T, T, bool)
+    B_SELECT
+};
+
+enum { C_F1, C_F2, C_F3, C_G1, C_G2, C_G3, C_B1, C_SEL };
+
+static const struct {
+    const char* name;
+    int id;
+    int cls;
+} builtins[] = {
+    { "sin", B_SIN, C_F1 }, { "cos", B_COS, C_F1 }, { "tan", B_TAN, C_F1 },
+    { "asin", B_ASIN, C_F1 }, { "acos", B_ACOS, C_F1 }, { "atan", B_ATAN, C_F1 },
+    { "sinh", B_SINH, C_F1 }, { "cosh", B_COSH, C_F1 }, { "tanh", B_TANH, C_F1 },
+    { "exp", B_EXP, C_F1 }, { "exp2", B_EXP2, C_F1 }, { "exp10", B_EXP10, C_F1 },
+    { "log", B_LOG, C_F1 }, { "log2", B_LOG2, C_F1 }, { "log10", B_LOG10, C_F1 },
+    { "sqrt", B_SQRT, C_F1 }, { "rsqrt", B_RSQRT, C_F1 },
+    { "floor", B_FLOOR, C_F1 }, { "ceil", B_CEIL, C_F1 }, { "round", B_ROUND, C_F1 },
+    { "trunc", B_TRUNC, C_F1 }, { "rint", B_RINT, C_F1 }, { "fract", B_FRACT, C_F1 },
+    { "sign", B_SIGN, C_F1 }, { "fabs", B_FABS, C_F1 }, { "saturate", B_SATURATE, C_F1 },
+    { "pow", B_POW, C_F2 }, { "powr", B_POW, C_F2 }, { "atan2", B_ATAN2, C_F2 },
+    { "fmod", B_FMOD, C_F2 }, { "fmin", B_FMIN, C_F2 }, { "fmax", B_FMAX, C_F2 },
+    { "step", B_STEP, C_F2 }, { "copysign", B_COPYSIGN, C_F2 },
+    { "mix", B_MIX, C_F3 }, { "fma", B_FMA, C_F3 }, { "mad", B_FMA, C_F3 },
+    { "smoothstep", B_SMOOTHSTEP, C_F3 },
+    { "abs", B_ABS, C_G1 }, { "min", B_MIN, C_G2 }, { "max", B_MAX, C_G2 },
+    { "clamp", B_CLAMP, C_G3 },
+    { "isnan", B_ISNAN, C_B1 }, { "isinf", B_ISINF, C_B1 }, { "isfinite", B_ISFINITE, C_B1 },
+    { "select", B_SELECT, C_SEL },
+    { NULL, 0, 0 }
+};
+
+static int class_args(int cls) {
+    switch (cls) {
+        case C_F1: case C_G1: case C_B1: return 1;
+        case C_F2: case C_G2: return 2;
+        default: return 3;
+    }
+}
+
+// -------------------------------------------------
+// Half precision conversion (round to nearest even)
+
+static float half_to_float(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000u) << 16;
+    uint32_t exp = (h >> 10) & 0x1fu;
+    uint32_t mant = h & 0x3ffu;
+    uint32_t bits;
+    if (exp == 0) {
+        if (mant == 0) {
+            bits = sign;
+        } else {
+            exp = 113;
+            while (!(mant & 0x400u)) { mant <<= 1; exp--; }
+            bits = sign | (exp << 23) | ((mant & 0x3ffu) << 13);
+        }
+    } else if (exp == 31) {
+        bits = sign | 0x7f800000u | (mant << 13);
+    } else {
+        bits = sign | ((exp + 112) << 23) | (mant << 13);
+    }
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+static uint16_t float_to_half(float f) {
+    const uint32_t f32infty = 255u << 23;
+    const uint32_t f16max = (127u + 16u) << 23;
+    const uint32_t denorm_magic = ((127u - 15u) + (23u - 10u) + 1u) << 23;
+    uint32_t fu;
+    memcpy(&fu, &f, sizeof(fu));
+    uint32_t sign = fu & 0x80000000u;
+    uint16_t o;
+    fu ^= sign;
+    if (fu >= f16max) {
+        o = (fu > f32infty) ? 0x7e00 : 0x7c00;
+    } else if (fu < (113u << 23)) {
+        float ff, dm;
+        memcpy(&ff, &fu, sizeof(ff));
+        memcpy(&dm, &denorm_magic, sizeof(dm));
+        ff += dm;
+        memcpy(&fu, &ff, sizeof(fu));
+        o = (uint16_t)(fu - denorm_magic);
+    } else {
+        uint32_t mant_odd = (fu >> 13) & 1u;
+        fu += ((uint32_t)(15 - 127) << 23) + 0xfffu;
+        fu += mant_odd;
+        o = (uint16_t)(fu >> 13);
+    }
+    return o | (uint16_t)(sign >> 16);
+}
+
+// Float to integer conversions saturate like the GPU rather than being undefined
+static inline int32_t f2i(float f) {
+    if (f != f) return 0;
+    if (f >= 2147483648.0f) return INT32_MAX;
+    if (f <= -2147483648.0f) return INT32_MIN;
+    return (int32_t)f;
+}
+
+static inline uint32_t f2u(float f) {
+    if (!(f > 0.0f)) return 0;
+    if (f >= 4294967296.0f) return UINT32_MAX;
+    return (uint32_t)f;
+}
+
+static inline int32_t f2range(float f, int32_t lo, int32_t hi) {
+    int32_t v = f2i(f);
+    return v < lo ? lo : (v > hi ? hi : v);
+}
+
+// -------------------------------------------------
+// Lexer
+
+enum { TK_EOF, TK_IDENT, TK_INT, TK_FLOAT, TK_PUNCT };
+
+typedef struct {
+    int kind;
+    const char* s;
+    int len;
+    int line;
+    int is_unsigned;
+    double fval;
+    uint64_t ival;
+} mc_msl_token;
+
+typedef struct mc_msl_sym {
+    const char* name;
+    int len;
+    int scope;
+    int bind;            // Buffer parameter index, or -1 for variables
+    int ref;             // Buffer parameter declared as reference
+    mc_msl_var* var;
+    int components;      // Vector attribute, used through the vars of its components
+    mc_msl_var* component_vars[3];
+    struct mc_msl_sym* prev;
+} mc_msl_sym;
+
+#define MC_MSL_MAX_LOOPS 64
+
+typedef struct {
+    mc_msl_lib* lib;
+    mc_msl_token* toks;
+    int ntoks;
+    int pos;
+    jmp_buf fail;
+    char* error;
+    // Current function
+    mc_msl_fn* fn;
+    mc_msl_sym* syms;
+    int scope;
+    mc_msl_var* vars;
+    mc_msl_var* vars_tail;
+    int stmt_pos;
+    mc_msl_loop* loops[MC_MSL_MAX_LOOPS];
+    int loop_depth;
+    int ctl_depth;
+    int max_depth;
+    int max_temps;
+} mc_msl_parser;
+
+static void fail(mc_msl_parser* p, int line, const char* fmt, ...) {
+    char msg[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    size_t len = strlen(msg) + 64;
+    p->error = malloc(len);
+    if (p->error != NULL)
+        snprintf(p->error, len, "program_source:%d: error: %s", line, msg);
+    longjmp(p->fail, 1);
+}
+
+static const char* puncts[] = {
+    "<<=", ">>=", "<<", ">>", "<=", ">=", "==", "!=", "&&", "||", "++", "--",
+    "+=", "-=", "*=", "/=", "%=", "&=", "|=", "^=", "::", "->", NULL
+};
+
+static void lex(mc_msl_parser* p, const char* src) {
+    int cap = 256, line = 1, line_start = 1;
+    p->toks = malloc(cap * sizeof(mc_msl_token));
+    if (p->toks == NULL) fail(p, 0, "out of memory");
+    const char* s = src;
+    for (;;) {
+        // Whitespace, comments and preprocessor lines
+        while (*s) {
+            if (*s == '\n') { line++; line_start = 1; s++; }
+            else if (*s == ' ' || *s == '\t' || *s == '\r' || *s == '\f' || *s == '\v') s++;
+            else if (s[0] == '/' && s[1] == '/') { while (*s && *s != '\n') s++; }
+            else if (s[0] == '/' && s[1] == '*') {
+                s += 2;
+                while (*s && !(s[0] == '*' && s[1] == '/')) { if (*s == '\n') line++; s++; }
+                if (*s) s += 2;
+            } else if (*s == '#' && line_start) {
+                const char* d = s + 1;
+                while (*d == ' ' || *d == '\t') d++;
+                if (strncmp(d, "include", 7) && strncmp(d, "pragma", 6))
+                    fail(p, line, "preprocessor directive not supported by the CPU backend");
+                while (*s && *s != '\n') s++;
+            } else break;
+        }
+        if (p->ntoks + 1 >= cap) {
+            cap *= 2;
+            mc_msl_token* toks = realloc(p->toks, cap * sizeof(mc_msl_token));
+            if (toks == NULL) fail(p, line, "out of memory");
+            p->toks = toks;
+        }
+        mc_msl_token* t = &p->toks[p->ntoks];
+        memset(t, 0, sizeof(*t));
+        t->s = s;
+        t->line = line;
+        line_start = 0;
+        if (*s == 0) {
+            t->kind = TK_EOF;
+            p->ntoks++;
+            return;
+        }
+        if ((*s >= 'a' && *s <= 'z') || (*s >= 'A' && *s <= 'Z') || *s == '_') {
+            while ((*s >= 'a' && *s <= 'z') || (*s >= 'A' && *s <= 'Z') || (*s >= '0' && *s <= '9') || *s == '_') s++;
+            t->kind = TK_IDENT;
+        } else if ((*s >= '0' && *s <= '9') || (*s == '.' && s[1] >= '0' && s[1] <= '9')) {
+            char* end;
+            int is_float = 0;
+            if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+                t->ival = strtoull(s, &end, 16);
+            } else {
+                const char* q = s;
+                while ((*q >= '0' && *q <= '9')) q++;
+                is_float = (*q == '.' || *q == 'e' || *q == 'E');
+                if (is_float) t->fval = strtod(s, &end);
+                else t->ival = strtoull(s, &end, 10);
+            }
+            s = end;
+            while (*s == 'u' || *s == 'U' || *s == 'l' || *s == 'L' || *s == 'f' || *s == 'F' || *s == 'h' || *s == 'H') {
+                if (*s == 'u' || *s == 'U') t->is_unsigned = 1;
+                if (*s == 'f' || *s == 'F' || *s == 'h' || *s == 'H') {
+                    if (!is_float) t->fval = (double)t->ival;
+                    is_float = 1;
+                }
+                s++;
+            }
+            t->kind = is_float ? TK_FLOAT : TK_INT;
+        } else {
+            int len = 1;
+            for (int i = 0; puncts[i]; i++) {
+                int l = (int)strlen(puncts[i]);
+                if (!strncmp(s, puncts[i], l)) { len = l; break; }
+            }
+            s += len;
+            t->kind = TK_PUNCT;
+        }
+        t->len = (int)(s - t->s);
+        p->ntoks++;
+    }
+}
+
+// -------------------------------------------------
+// Parser helpers
+
+static mc_msl_token* peek(mc_msl_parser* p, int ahead) {
+    int i = p->pos + ahead;
+    return &p->toks[i < p->ntoks ? i : p->ntoks - 1];
+}
+
+static int tok_is(const mc_msl_token* t, const char* s) {
+    return t->kind != TK_EOF && (int)strlen(s) == t->len && !strncmp(t->s, s, t->len);
+}
+
+static int is(mc_msl_parser* p, const char* s) {
+    return tok_is(peek(p, 0), s);
+}
+
+static int accept(mc_msl_parser* p, const char* s) {
+    if (is(p, s)) { p->pos++; return 1; }
+    return 0;
+}
+
+static int line(mc_msl_parser* p) {
+    return peek(p, 0)->line;
+}
+
+static void expect(mc_msl_parser* p, const char* s) {
+    if (!accept(p, s)) {
+        mc_msl_token* t = peek(p, 0);
+        if (t->kind == TK_EOF) fail(p, t->line, "expected '%s' at end of input", s);
+        fail(p, t->line, "expected '%s' before '%.*s'", s, t->len, t->s);
+    }
+}
+
+static mc_msl_token* expect_ident(mc_msl_parser* p) {
+    mc_msl_token* t = peek(p, 0);
+    if (t->kind != TK_IDENT) fail(p, t->line, "expected identifier");
+    p->pos++;
+    return t;
+}
+
+static char* tok_strdup(mc_msl_parser* p, const mc_msl_token* t) {
+    char* s = arena_alloc(p->lib, t->len + 1);
+    if (s == NULL) fail(p, t->line, "out of memory");
+    memcpy(s, t->s, t->len);
+    s[t->len] = 0;
+    return s;
+}
+
+static mc_msl_node* new_node(mc_msl_parser* p, int op, int type) {
+    mc_msl_node* n = arena_alloc(p->lib, sizeof(mc_msl_node));
+    if (n == NULL) fail(p, line(p), "out of memory");
+    n->op = op;
+    n->type = type;
+    return n;
+}
+
+static int max2(int a, int b) { return a > b ? a : b; }
+
+// Scalar type names. Returns T_VOID if not a type.
+static int type_at(mc_msl_parser* p, int ahead, int* ntoks) {
+    static const struct { const char* name; int type; } names[] = {
+        { "bool", T_BOOL }, { "char", T_CHAR }, { "uchar", T_UCHAR }, { "short", T_SHORT },
+        { "ushort", T_USHORT }, { "int", T_INT }, { "uint", T_UINT }, { "half", T_HALF },
+        { "float", T_FLOAT }, { "int8_t", T_CHAR }, { "uint8_t", T_UCHAR },
+        { "int16_t", T_SHORT }, { "uint16_t", T_USHORT }, { "int32_t", T_INT },
+        { "uint32_t", T_UINT }, { "size_t", T_UINT }, { NULL, 0 }
+    };
+    mc_msl_token* t = peek(p, ahead);
+    if (t->kind != TK_IDENT) return T_VOID;
+    if (tok_is(t, "unsigned")) {
+        mc_msl_token* u = peek(p, ahead + 1);
+        *ntoks = 2;
+        if (tok_is(u, "char")) return T_UCHAR;
+        if (tok_is(u, "short")) return T_USHORT;
+        if (tok_is(u, "int")) return T_UINT;
+        *ntoks = 1;
+        return T_UINT;
+    }
+    *ntoks = 1;
+    for (int i = 0; names[i].name; i++)
+        if (tok_is(t, names[i].name)) return names[i].type;
+    // Vector and matrix types are recognised only to give a useful error
+    const char* vec[] = { "float", "half", "int", "uint", "short", "ushort", "char", "uchar", "bool", NULL };
+    for (int i = 0; vec[i]; i++) {
+        int l = (int)strlen(vec[i]);
+        if (!strncmp(t->s, vec[i], l) && t->s[l] >= '2' && t->s[l] <= '4'
+            && (t->len == l + 1 || (t->len == l + 3 && t->s[l + 1] == 'x')))
+            fail(p, t->line, "vector type '%.*s' is not supported by the CPU backend", t->len, t->s);
+    }
+    return T_VOID;
+}
+
+static int parse_type(mc_msl_parser* p) {
+    int n;
+    int type = type_at(p, 0, &n);
+    if (type == T_VOID) {
+        mc_msl_token* t = peek(p, 0);
+        fail(p, t->line, "unknown type name '%.*s'", t->len, t->s);
+    }
+    p->pos += n;
+    return type;
+}
+
+static mc_msl_sym* lookup(mc_msl_parser* p, const mc_msl_token* t) {
+    for (mc_msl_sym* s = p->syms; s; s = s->prev)
+        if (s->len == t->len && !strncmp(s->name, t->s, t->len)) return s;
+    return NULL;
+}
+
+static mc_msl_sym* declare(mc_msl_parser* p, const mc_msl_token* t) {
+    for (mc_msl_sym* s = p->syms; s && s->scope == p->scope; s = s->prev)
+        if (s->len == t->len && !strncmp(s->name, t->s, t->len))
+            fail(p, t->line, "redefinition of '%.*s'", t->len, t->s);
+    mc_msl_sym* s = arena_alloc(p->lib, sizeof(mc_msl_sym));
+    if (s == NULL) fail(p, t->line, "out of memory");
+    s->name = t->s;
+    s->len = t->len;
+    s->scope = p->scope;
+    s->bind = -1;
+    s->prev = p->syms;
+    p->syms = s;
+    return s;
+}
+
+static mc_msl_var* new_var(mc_msl_parser* p, int type) {
+    mc_msl_var* v = arena_alloc(p->lib, sizeof(mc_msl_var));
+    if (v == NULL) fail(p, line(p), "out of memory");
+    v->type = type;
+    v->decl_pos = p->stmt_pos;
+    v->last_pos = p->stmt_pos;
+    v->loop_depth = p->loop_depth;
+    if (p->vars_tail) p->vars_tail->next = v; else p->vars = v;
+    p->vars_tail = v;
+    return v;
+}
+
+static void use_var(mc_msl_parser* p, mc_msl_var* v) {
+    v->last_pos = max2(v->last_pos, p->stmt_pos);
+    if (p->loop_depth > v->loop_depth)
+        v->pending = p->loops[v->loop_depth]; // Live across every iteration of this loop
+}
+
+static void push_scope(mc_msl_parser* p) {
+    p->scope++;
+}
+
+static void pop_scope(mc_msl_parser* p) {
+    while (p->syms && p->syms->scope == p->scope) p->syms = p->syms->prev;
+    p->scope--;
+}
+
+// -------------------------------------------------
+// Typed node construction
+
+static int common_type(int a, int b) {
+    int ka = kind_of(a), kb = kind_of(b);
+    if (ka == K_FLOAT || kb == K_FLOAT) return T_FLOAT;
+    if (ka == K_UINT || kb == K_UINT) return T_UINT;
+    return T_INT;
+}
+
+static int is_narrow(int type) {
+    return type == T_CHAR || type == T_UCHAR || type == T_SHORT || type == T_USHORT || type == T_HALF;
+}
+
+static void convert_lit(mc_msl_val* v, int from, int to);
+
+static mc_msl_node* coerce(mc_msl_parser* p, mc_msl_node* e, int type) {
+    if (e->type == type) return e;
+    if (kind_of(e->type) == kind_of(type) && !is_narrow(type)) return e;
+    if (e->op == E_LIT) {
+        convert_lit(&e->lit, e->type, type);
+        e->type = type;
+        return e;
+    }
+    mc_msl_node* n = new_node(p, E_CONV, type);
+    n->a = e;
+    n->need = max2(1, e->need);
+    return n;
+}
+
+static mc_msl_node* make_unary(mc_msl_parser* p, int op, mc_msl_node* a) {
+    int type;
+    if (op == E_NOT) {
+        a = coerce(p, a, T_BOOL);
+        type = T_BOOL;
+    } else if (op == E_BNOT) {
+        if (kind_of(a->type) == K_FLOAT) fail(p, line(p), "invalid argument type to bitwise operator");
+        type = common_type(a->type, T_INT);
+        a = coerce(p, a, type);
+    } else {
+        type = common_type(a->type, T_INT);
+        a = coerce(p, a, type);
+    }
+    mc_msl_node* n = new_node(p, op, type);
+    n->a = a;
+    n->need = max2(1, a->need);
+    return n;
+}
+
+static mc_msl_node* make_binary(mc_msl_parser* p, int op, mc_msl_node* a, mc_msl_node* b) {
+    int operand, result;
+    if (op == E_LAND || op == E_LOR) {
+        operand = T_BOOL;
+        result = T_BOOL;
+    } else {
+        operand = common_type(a->type, b->type);
+        if (op == E_SHL || op == E_SHR) operand = common_type(a->type, T_INT);
+        if ((op == E_MOD || op == E_AND || op == E_OR || op == E_XOR || op == E_SHL || op == E_SHR)
+            && kind_of(operand) == K_FLOAT)
+            fail(p, line(p), "invalid operands to binary expression ('float')");
+        result = (op >= E_LT && op <= E_NE) ? T_BOOL : operand;
+    }
+    mc_msl_node* n = new_node(p, op, result);
+    n->a = coerce(p, a, operand);
+    n->b = coerce(p, b, (op == E_SHL || op == E_SHR) ? common_type(b->type, T_INT) : operand);
+    n->need = max2(1, max2(n->a->need, 1 + n->b->need));
+    return n;
+}
+
+static mc_msl_node* make_select(mc_msl_parser* p, mc_msl_node* c, mc_msl_node* a, mc_msl_node* b) {
+    int type = (a->type == b->type) ? a->type : common_type(a->type, b->type);
+    mc_msl_node* n = new_node(p, E_SEL, type);
+    n->c = coerce(p, c, T_BOOL);
+    n->a = coerce(p, a, type);
+    n->b = coerce(p, b, type);
+    n->need = max2(1, max2(n->c->need, max2(1 + n->a->need, 2 + n->b->need)));
+    return n;
+}
+
+static mc_msl_node* make_load(mc_msl_parser* p, mc_msl_sym* s, mc_msl_node* index) {
+    mc_msl_node* n = new_node(p, E_LOAD, p->fn->bufs[s->bind].type);
+    n->bind = s->bind;
+    if (index != NULL) {
+        if (kind_of(index->type) == K_FLOAT) fail(p, line(p), "array subscript is not an integer");
+        n->a = coerce(p, index, T_UINT);
+        n->linear = (index->op == E_VAR && index->var == p->fn->gid);
+        n->need = max2(1, n->a->need);
+    } else {
+        n->need = 1;
+    }
+    return n;
+}
+
+static mc_msl_node* make_lit(mc_msl_parser* p, int type, double fval, uint64_t ival) {
+    mc_msl_node* n = new_node(p, E_LIT, type);
+    if (kind_of(type) == K_FLOAT) n->lit.f = (float)fval;
+    else n->lit.u = (uint32_t)ival;
+    n->need = 1;
+    return n;
+}
+
+// -------------------------------------------------
+// Expression parsing
+
+static mc_msl_node* parse_expr(mc_msl_parser* p);
+static mc_msl_node* parse_unary(mc_msl_parser* p);
+
+static void skip_namespace(mc_msl_parser* p) {
+    while (peek(p, 0)->kind == TK_IDENT && tok_is(peek(p, 1), "::")) {
+        mc_msl_token* t = peek(p, 0);
+        if (!tok_is(t, "metal") && !tok_is(t, "fast") && !tok_is(t, "precise"))
+            fail(p, t->line, "unknown namespace '%.*s'", t->len, t->s);
+        p->pos += 2;
+    }
+}
+
+static mc_msl_node* parse_call(mc_msl_parser* p, mc_msl_token* name) {
+    int id = -1, cls = 0;
+    for (int i = 0; builtins[i].name; i++) {
+        if (tok_is(name, builtins[i].name)) { id = builtins[i].id; cls = builtins[i].cls; break; }
+    }
+    if (id < 0) fail(p, name->line, "use of undeclared identifier '%.*s'", name->len, name->s);
+    int nargs = class_args(cls);
+    mc_msl_node* args[3];
+    expect(p, "(");
+    for (int i = 0; i < nargs; i++) {
+        if (i) expect(p, ",");
+        args[i] = parse_expr(p);
+    }
+    if (!is(p, ")"))
+        fail(p, name->line, "wrong number of arguments to '%.*s' (expected %d)", name->len, name->s, nargs);
+    expect(p, ")");
+
+    int arg_type = T_FLOAT, result;
+    switch (cls) {
+        case C_G1: arg_type = common_type(args[0]->type, T_INT); break;
+        case C_G2: arg_type = common_type(args[0]->type, args[1]->type); break;
+        case C_G3: arg_type = common_type(common_type(args[0]->type, args[1]->type), args[2]->type); break;
+        case C_SEL: arg_type = common_type(args[0]->type, args[1]->type); break;
+    }
+    result = (cls == C_B1) ? T_BOOL : arg_type;
+    mc_msl_node* n = new_node(p, E_CALL, result);
+    n->fn = id;
+    n->nargs = nargs;
+    n->args = arena_alloc(p->lib, nargs * sizeof(mc_msl_node*));
+    if (n->args == NULL) fail(p, name->line, "out of memory");
+    n->need = 1;
+    for (int i = 0; i < nargs; i++) {
+        n->args[i] = coerce(p, args[i], (cls == C_SEL && i == 2) ? T_BOOL : arg_type);
+        n->need = max2(n->need, i + n->args[i]->need);
+    }
+    return n;
+}
+
+// Variable named by a symbol, or by a component of a vector attribute (gid.x)
+static mc_msl_var* sym_var(mc_msl_parser* p, mc_msl_sym* s, const mc_msl_token* name) {
+    if (s->components == 0) return s->var;
+    if (accept(p, ".")) {
+        mc_msl_token* c = expect_ident(p);
+        for (int i = 0; i < s->components; i++)
+            if (c->len == 1 && c->s[0] == "xyz"[i]) return s->component_vars[i];
+        fail(p, c->line, "no member named '%.*s' in '%.*s'", c->len, c->s, name->len, name->s);
+    }
+    fail(p, name->line, "vector '%.*s' can only be used through its components by the CPU backend",
+         name->len, name->s);
+    return NULL;
+}
+
+static mc_msl_node* parse_primary(mc_msl_parser* p) {
+    mc_msl_token* t = peek(p, 0);
+    if (t->kind == TK_INT) {
+        p->pos++;
+        int type = (t->is_unsigned || t->ival > INT32_MAX) ? T_UINT : T_INT;
+        return make_lit(p, type, 0, t->ival);
+    }
+    if (t->kind == TK_FLOAT) {
+        p->pos++;
+        return make_lit(p, T_FLOAT, t->fval, 0);
+    }
+    if (accept(p, "(")) {
+        mc_msl_node* e = parse_expr(p);
+        expect(p, ")");
+        return e;
+    }
+    if (t->kind != TK_IDENT) fail(p, t->line, "expected expression");
+
+    skip_namespace(p);
+    t = peek(p, 0);
+    if (tok_is(t, "true") || tok_is(t, "false")) {
+        p->pos++;
+        return make_lit(p, T_BOOL, 0, tok_is(t, "true"));
+    }
+    static const struct { const char* name; float value; } constants[] = {
+        { "M_PI_F", 3.14159265358979323846f }, { "M_PI_2_F", 1.57079632679489661923f },
+        { "M_E_F", 2.71828182845904523536f }, { "M_SQRT2_F", 1.41421356237309504880f },
+        { "M_LN2_F", 0.69314718055994530942f }, { "MAXFLOAT", 3.402823466e+38f },
+        { "INFINITY", INFINITY }, { "NAN", NAN }, { NULL, 0 }
+    };
+    for (int i = 0; constants[i].name; i++) {
+        if (tok_is(t, constants[i].name)) {
+            p->pos++;
+            return make_lit(p, T_FLOAT, constants[i].value, 0);
+        }
+    }
+
+    // Constructor style conversion: float(x)
+    int n;
+    int type = type_at(p, 0, &n);
+    if (type != T_VOID) {
+        p->pos += n;
+        expect(p, "(");
+        mc_msl_node* e = parse_expr(p);
+        expect(p, ")");
+        return coerce(p, e, type);
+    }
+
+    p->pos++;
+    if (is(p, "(")) return parse_call(p, t);
+
+    mc_msl_sym* s = lookup(p, t);
+    if (s == NULL) fail(p, t->line, "use of undeclared identifier '%.*s'", t->len, t->s);
+    if (s->bind >= 0) {
+        if (s->ref) return make_load(p, s, NULL);
+        expect(p, "[");
+        mc_msl_node* index = parse_expr(p);
+        expect(p, "]");
+        return make_load(p, s, index);
+    }
+    mc_msl_var* v = sym_var(p, s, t);
+    use_var(p, v);
+    mc_msl_node* e = new_node(p, E_VAR, v->type);
+    e->var = v;
+    return e;
+}
+
+static mc_msl_node* parse_unary(mc_msl_parser* p) {
+    if (accept(p, "-")) {
+        mc_msl_node* a = parse_unary(p);
+        if (a->op == E_LIT && kind_of(a->type) != K_BOOL) {
+            if (kind_of(a->type) == K_FLOAT) a->lit.f = -a->lit.f;
+            else a->lit.u = 0u - a->lit.u;
+            if (a->type != T_UINT && kind_of(a->type) == K_INT) a->type = T_INT;
+            return a;
+        }
+        return make_unary(p, E_NEG, a);
+    }
+    if (accept(p, "+")) return parse_unary(p);
+    if (accept(p, "!")) return make_unary(p, E_NOT, parse_unary(p));
+    if (accept(p, "~")) return make_unary(p, E_BNOT, parse_unary(p));
+    if (is(p, "++") || is(p, "--"))
+        fail(p, line(p), "increment in expression not supported by the CPU backend");
+    if (is(p, "(")) {
+        int n;
+        int type = type_at(p, 1, &n);
+        if (type != T_VOID && tok_is(peek(p, 1 + n), ")")) {
+            p->pos += 2 + n;
+            return coerce(p, parse_unary(p), type);
+        }
+    }
+    return parse_primary(p);
+}
+
+static int binary_op(mc_msl_token* t, int* prec) {
+    static const struct { const char* s; int op; int prec; } ops[] = {
+        { "||", E_LOR, 1 }, { "&&", E_LAND, 2 }, { "|", E_OR, 3 }, { "^", E_XOR, 4 },
+        { "&", E_AND, 5 }, { "==", E_EQ, 6 }, { "!=", E_NE, 6 }, { "<", E_LT, 7 },
+        { ">", E_GT, 7 }, { "<=", E_LE, 7 }, { ">=", E_GE, 7 }, { "<<", E_SHL, 8 },
+        { ">>", E_SHR, 8 }, { "+", E_ADD, 9 }, { "-", E_SUB, 9 }, { "*", E_MUL, 10 },
+        { "/", E_DIV, 10 }, { "%", E_MOD, 10 }, { NULL, 0, 0 }
+    };
+    if (t->kind != TK_PUNCT) return -1;
+    for (int i = 0; ops[i].s; i++) {
+        if (tok_is(t, ops[i].s)) { *prec = ops[i].prec; return ops[i].op; }
+    }
+    return -1;
+}
+
+static mc_msl_node* parse_binary(mc_msl_parser* p, int min_prec) {
+    mc_msl_node* lhs = parse_unary(p);
+    for (;;) {
+        int prec;
+        int op = binary_op(peek(p, 0), &prec);
+        if (op < 0 || prec < min_prec) return lhs;
+        p->pos++;
+        mc_msl_node* rhs = parse_binary(p, prec + 1);
+        lhs = make_binary(p, op, lhs, rhs);
+    }
+}
+
+static mc_msl_node* parse_expr(mc_msl_parser* p) {
+    mc_msl_node* c = parse_binary(p, 1);
+    if (accept(p, "?")) {
+        mc_msl_node* a = parse_expr(p);
+        expect(p, ":");
+        mc_msl_node* b = parse_expr(p);
+        return make_select(p, c, a, b);
+    }
+    return c;
+}
+
+// -------------------------------------------------
+// Statement parsing
+
+static mc_msl_node* parse_stmt(mc_msl_parser* p);
+
+static mc_msl_node* make_set(mc_msl_parser* p, mc_msl_var* v, mc_msl_node* value) {
+    mc_msl_node* n = new_node(p, S_SET, v->type);
+    n->var = v;
+    n->a = coerce(p, value, v->type);
+    n->need = n->a->need;
+    v->assigned = 1;
+    p->max_temps = max2(p->max_temps, n->need);
+    return n;
+}
+
+static mc_msl_node* make_store(mc_msl_parser* p, mc_msl_sym* s, mc_msl_node* index, mc_msl_node* value) {
+    mc_msl_node* n = new_node(p, S_STORE, p->fn->bufs[s->bind].type);
+    n->bind = s->bind;
+    if (index != NULL) {
+        n->a = coerce(p, index, T_UINT);
+        n->linear = (index->op == E_VAR && index->var == p->fn->gid);
+    }
+    n->b = coerce(p, value, n->type);
+    n->need = max2(n->a ? n->a->need : 0, 1 + n->b->need);
+    p->max_temps = max2(p->max_temps, n->need);
+    return n;
+}
+
+// Assignment, compound assignment or increment
+static mc_msl_node* parse_simple(mc_msl_parser* p) {
+    static const struct { const char* s; int op; int incr; } assign_ops[] = {
+        { "=", -1, 0 }, { "+=", E_ADD, 0 }, { "-=", E_SUB, 0 }, { "*=", E_MUL, 0 },
+        { "/=", E_DIV, 0 }, { "%=", E_MOD, 0 }, { "&=", E_AND, 0 }, { "|=", E_OR, 0 },
+        { "^=", E_XOR, 0 }, { "<<=", E_SHL, 0 }, { ">>=", E_SHR, 0 }, { "++", E_ADD, 1 },
+        { "--", E_SUB, 1 }, { NULL, 0, 0 }
+    };
+    int prefix = -1;
+    if (accept(p, "++")) prefix = E_ADD;
+    else if (accept(p, "--")) prefix = E_SUB;
+
+    mc_msl_token* name = expect_ident(p);
+    mc_msl_sym* s = lookup(p, name);
+    if (s == NULL) fail(p, name->line, "use of undeclared identifier '%.*s'", name->len, name->s);
+    mc_msl_node* index = NULL;
+    mc_msl_var* v = s->bind < 0 ? sym_var(p, s, name) : NULL;
+    if (s->bind >= 0) {
+        if (p->fn->bufs[s->bind].readonly)
+            fail(p, name->line, "cannot assign to '%.*s' which is const", name->len, name->s);
+        if (!s->ref) {
+            expect(p, "[");
+            index = parse_expr(p);
+            expect(p, "]");
+        }
+    }
+
+    int op = prefix;
+    mc_msl_node* rhs = NULL;
+    if (prefix < 0) {
+        int i;
+        for (i = 0; assign_ops[i].s; i++)
+            if (accept(p, assign_ops[i].s)) break;
+        if (!assign_ops[i].s) fail(p, line(p), "expected assignment");
+        op = assign_ops[i].op;
+        if (!assign_ops[i].incr) rhs = parse_expr(p);
+    }
+    if (rhs == NULL) rhs = make_lit(p, T_INT, 0, 1);
+
+    if (s->bind >= 0) {
+        if (op >= 0) rhs = make_binary(p, op, make_load(p, s, index), rhs);
+        return make_store(p, s, index, rhs);
+    }
+    if (op >= 0) {
+        use_var(p, v);
+        mc_msl_node* cur = new_node(p, E_VAR, v->type);
+        cur->var = v;
+        rhs = make_binary(p, op, cur, rhs);
+    }
+    use_var(p, v);
+    return make_set(p, v, rhs);
+}
+
+static int at_decl(mc_msl_parser* p) {
+    int n;
+    if (is(p, "const") || is(p, "thread")) return 1;
+    return type_at(p, 0, &n) != T_VOID && peek(p, n)->kind == TK_IDENT;
+}
+
+// Declaration of one or more local variables, as a block of initialisers
+static mc_msl_node* parse_decl(mc_msl_parser* p) {
+    while (accept(p, "const") || accept(p, "thread")) {}
+    int type = parse_type(p);
+    mc_msl_node* head = NULL;
+    mc_msl_node* tail = NULL;
+    do {
+        mc_msl_token* name = expect_ident(p);
+        mc_msl_node* init = NULL;
+        if (accept(p, "=")) init = parse_expr(p);
+        else init = make_lit(p, type, 0, 0); // Zero rather than undefined
+        // Declare after the initialiser so it cannot refer to itself
+        mc_msl_sym* s = declare(p, name);
+        s->var = new_var(p, type);
+        mc_msl_node* set = make_set(p, s->var, init);
+        if (tail) tail->next = set; else head = set;
+        tail = set;
+    } while (accept(p, ","));
+    if (head->next == NULL) return head;
+    mc_msl_node* block = new_node(p, S_BLOCK, T_VOID);
+    block->a = head;
+    return block;
+}
+
+static mc_msl_node* parse_block(mc_msl_parser* p) {
+    mc_msl_node* block = new_node(p, S_BLOCK, T_VOID);
+    mc_msl_node* tail = NULL;
+    push_scope(p);
+    while (!accept(p, "}")) {
+        if (peek(p, 0)->kind == TK_EOF) fail(p, line(p), "expected '}' at end of input");
+        mc_msl_node* s = parse_stmt(p);
+        if (tail) tail->next = s; else block->a = s;
+        tail = s;
+    }
+    pop_scope(p);
+    return block;
+}
+
+static mc_msl_node* parse_loop(mc_msl_parser* p, int is_for) {
+    mc_msl_node* init = NULL;
+    push_scope(p);
+    expect(p, "(");
+    if (is_for) {
+        if (!accept(p, ";")) {
+            init = at_decl(p) ? parse_decl(p) : parse_simple(p);
+            expect(p, ";");
+        }
+    }
+    if (p->loop_depth >= MC_MSL_MAX_LOOPS) fail(p, line(p), "loops nested too deeply");
+    mc_msl_loop* loop = arena_alloc(p->lib, sizeof(mc_msl_loop));
+    if (loop == NULL) fail(p, line(p), "out of memory");
+    p->loops[p->loop_depth++] = loop;
+
+    mc_msl_node* n = new_node(p, S_LOOP, T_VOID);
+    n->depth = p->ctl_depth++;
+    p->max_depth = max2(p->max_depth, p->ctl_depth);
+    if (!(is_for && is(p, ";"))) {
+        n->a = coerce(p, parse_expr(p), T_BOOL);
+        p->max_temps = max2(p->max_temps, n->a->need);
+    }
+    if (is_for) {
+        expect(p, ";");
+        mc_msl_node* tail = NULL;
+        if (!is(p, ")")) {
+            mc_msl_node* step = new_node(p, S_BLOCK, T_VOID);
+            do {
+                mc_msl_node* s = parse_simple(p);
+                if (tail) tail->next = s; else step->a = s;
+                tail = s;
+            } while (accept(p, ","));
+            n->c = step;
+        }
+    }
+    expect(p, ")");
+    n->b = parse_stmt(p);
+    p->stmt_pos++;
+    loop->end_pos = p->stmt_pos;
+    p->loop_depth--;
+    p->ctl_depth--;
+    pop_scope(p);
+
+    if (init == NULL) return n;
+    mc_msl_node* block = new_node(p, S_BLOCK, T_VOID);
+    block->a = init;
+    init->next = n;
+    return block;
+}
+
+static mc_msl_node* parse_stmt(mc_msl_parser* p) {
+    p->stmt_pos++;
+    if (accept(p, "{")) return parse_block(p);
+    if (accept(p, ";")) return new_node(p, S_NOP, T_VOID);
+    if (accept(p, "if")) {
+        mc_msl_node* n = new_node(p, S_IF, T_VOID);
+        expect(p, "(");
+        n->a = coerce(p, parse_expr(p), T_BOOL);
+        p->max_temps = max2(p->max_temps, n->a->need);
+        expect(p, ")");
+        n->depth = p->ctl_depth++;
+        p->max_depth = max2(p->max_depth, p->ctl_depth);
+        push_scope(p);
+        n->b = parse_stmt(p);
+        pop_scope(p);
+        if (accept(p, "else")) {
+            push_scope(p);
+            n->c = parse_stmt(p);
+            pop_scope(p);
+        }
+        p->ctl_depth--;
+        return n;
+    }
+    if (accept(p, "for")) return parse_loop(p, 1);
+    if (accept(p, "while")) return parse_loop(p, 0);
+    if (is(p, "break") || is(p, "continue")) {
+        int op = is(p, "break") ? S_BREAK : S_CONT;
+        if (p->loop_depth == 0) fail(p, line(p), "'%s' statement not in loop statement", op == S_BREAK ? "break" : "continue");
+        p->pos++;
+        expect(p, ";");
+        return new_node(p, op, T_VOID);
+    }
+    if (accept(p, "return")) {
+        expect(p, ";");
+        return new_node(p, S_RET, T_VOID);
+    }
+    if (is(p, "threadgroup_barrier") || is(p, "simdgroup_barrier")) {
+        // A whole threadgroup executes each statement before the next, so
+        // barriers outside divergent control flow hold already
+        p->pos++;
+        expect(p, "(");
+        for (int depth = 1; depth > 0; p->pos++) {
+            if (peek(p, 0)->kind == TK_EOF) fail(p, line(p), "expected ')'");
+            if (is(p, "(")) depth++;
+            if (is(p, ")")) depth--;
+        }
+        expect(p, ";");
+        return new_node(p, S_NOP, T_VOID);
+    }
+    if (is(p, "do") || is(p, "switch") || is(p, "goto")) {
+        mc_msl_token* t = peek(p, 0);
+        fail(p, t->line, "'%.*s' statement not supported by the CPU backend", t->len, t->s);
+    }
+    mc_msl_node* n = at_decl(p) ? parse_decl(p) : parse_simple(p);
+    expect(p, ";");
+    return n;
+}
+
+// -------------------------------------------------
+// Kernel functions
+
+static int parse_attr(mc_msl_parser* p, int* buffer_index, int* threadgroup) {
+    expect(p, "[");
+    expect(p, "[");
+    mc_msl_token* name = expect_ident(p);
+    int attr = -1;
+    *threadgroup = tok_is(name, "threadgroup");
+    if (tok_is(name, "buffer") || *threadgroup) {
+        expect(p, "(");
+        mc_msl_token* index = peek(p, 0);
+        if (index->kind != TK_INT || index->ival >= MC_MSL_MAX_BUFFERS)
+            fail(p, index->line, "invalid %s index", *threadgroup ? "threadgroup" : "buffer");
+        p->pos++;
+        *buffer_index = (int)index->ival;
+        expect(p, ")");
+    } else {
+        for (int i = 0; i < A_COUNT; i++)
+            if (tok_is(name, attr_names[i])) attr = i;
+        if (attr < 0)
+            fail(p, name->line, "attribute '%.*s' not supported by the CPU backend", name->len, name->s);
+    }
+    expect(p, "]");
+    expect(p, "]");
+    return attr;
+}
+
+// Integer vector types allowed for thread position attributes. Returns the component count, or 0.
+static int attr_vector_at(mc_msl_parser* p, int* type) {
+    mc_msl_token* t = peek(p, 0);
+    static const struct { const char* name; int type; int components; } names[] = {
+        { "uint2", T_UINT, 2 }, { "uint3", T_UINT, 3 }, { "ushort2", T_USHORT, 2 }, { "ushort3", T_USHORT, 3 },
+        { NULL, 0, 0 }
+    };
+    for (int i = 0; names[i].name; i++) {
+        if (tok_is(t, names[i].name)) {
+            p->pos++;
+            *type = names[i].type;
+            return names[i].components;
+        }
+    }
+    return 0;
+}
+
+static void parse_param(mc_msl_parser* p) {
+    mc_msl_fn* fn = p->fn;
+    int readonly = 0, address_space = 0, threadgroup_space = 0;
+    for (;;) {
+        if (accept(p, "const")) readonly = 1;
+        else if (accept(p, "device")) address_space = 1;
+        else if (accept(p, "constant")) { address_space = 1; readonly = 1; }
+        else if (accept(p, "threadgroup")) threadgroup_space = 1;
+        else break;
+    }
+    int type;
+    int components = attr_vector_at(p, &type);
+    if (components == 0) type = parse_type(p);
+    while (accept(p, "const")) readonly = 1;
+    int pointer = accept(p, "*");
+    int ref = !pointer && accept(p, "&");
+    while (accept(p, "const")) readonly = 1;
+    mc_msl_token* name = expect_ident(p);
+    int buffer_index = -1, threadgroup;
+    int attr = parse_attr(p, &buffer_index, &threadgroup);
+    mc_msl_sym* s = declare(p, name);
+
+    if (buffer_index >= 0) {
+        if (threadgroup && (!pointer || !threadgroup_space))
+            fail(p, name->line, "threadgroup argument '%.*s' must be a threadgroup pointer", name->len, name->s);
+        if (!threadgroup && (!(pointer || ref) || !address_space))
+            fail(p, name->line, "buffer argument '%.*s' must be a device or constant pointer", name->len, name->s);
+        if (components) fail(p, name->line, "vector type buffers are not supported by the CPU backend");
+        if (fn->nbufs >= MC_MSL_MAX_BUFFERS) fail(p, name->line, "too many buffer arguments");
+        fn->bufs[fn->nbufs].index = buffer_index;
+        fn->bufs[fn->nbufs].type = type;
+        fn->bufs[fn->nbufs].readonly = readonly;
+        fn->bufs[fn->nbufs].threadgroup = threadgroup;
+        s->bind = fn->nbufs++;
+        s->ref = ref;
+        if (!threadgroup) fn->buffer_count = max2(fn->buffer_count, buffer_index + 1);
+    } else {
+        if (pointer || ref || kind_of(type) == K_FLOAT || type == T_BOOL)
+            fail(p, name->line, "'%s' argument must be an integer scalar or vector", attr_names[attr]);
+        if (components && attr == A_THREAD_INDEX_IN_THREADGROUP)
+            fail(p, name->line, "'%s' argument must be an integer scalar", attr_names[attr]);
+        s->components = components;
+        for (int c = 0; c < (components ? components : 1); c++) {
+            if (fn->nattrs >= MC_MSL_MAX_ATTRS) fail(p, name->line, "too many attribute arguments");
+            mc_msl_var* v = new_var(p, type);
+            v->last_pos = INT32_MAX; // Live for the whole function
+            if (components) s->component_vars[c] = v; else s->var = v;
+            fn->attrs[fn->nattrs].attr = attr;
+            fn->attrs[fn->nattrs].component = c;
+            fn->attrs[fn->nattrs].var = v;
+            fn->nattrs++;
+        }
+        // Lanes of a 1-D grid have consecutive positions, which makes loads and stores contiguous
+        if (attr == A_THREAD_POSITION_IN_GRID && components == 0 && fn->gid == NULL) fn->gid = s->var;
+    }
+}
+
+// Assign variable slots by linear scan over live ranges
+static int assign_slots(mc_msl_parser* p) {
+    int nslots = 0, nfree = 0, nactive = 0, cap = 0;
+    int* free_slots = NULL;
+    mc_msl_var** active = NULL;
+    for (mc_msl_var* v = p->vars; v; v = v->next) {
+        if (v->pending) v->last_pos = max2(v->last_pos, v->pending->end_pos);
+        // Expire vars no longer live
+        for (int i = 0; i < nactive; ) {
+            if (active[i]->last_pos < v->decl_pos) {
+                free_slots[nfree++] = active[i]->slot;
+                active[i] = active[--nactive];
+            } else i++;
+        }
+        if (nactive + 1 > cap) {
+            cap = cap ? cap * 2 : 64;
+            mc_msl_var** na = realloc(active, cap * sizeof(mc_msl_var*));
+            int* nf = realloc(free_slots, cap * sizeof(int));
+            if (na) active = na;
+            if (nf) free_slots = nf;
+            if (!na || !nf) { free(active); free(free_slots); fail(p, 0, "out of memory"); }
+        }
+        v->slot = nfree ? free_slots[--nfree] : nslots++;
+        active[nactive++] = v;
+    }
+    free(active);
+    free(free_slots);
+    return nslots;
+}
+
+static void parse_kernel(mc_msl_parser* p) {
+    mc_msl_fn* fn = arena_alloc(p->lib, sizeof(mc_msl_fn));
+    if (fn == NULL) fail(p, line(p), "out of memory");
+    p->fn = fn;
+    p->vars = p->vars_tail = NULL;
+    p->stmt_pos = 0;
+    p->loop_depth = 0;
+    p->ctl_depth = 0;
+    p->max_depth = 0;
+    p->max_temps = 0;
+
+    if (!accept(p, "void")) fail(p, line(p), "kernel function must return void");
+    fn->name = tok_strdup(p, expect_ident(p));
+    push_scope(p);
+    expect(p, "(");
+    if (!is(p, ")")) {
+        do parse_param(p); while (accept(p, ","));
+    }
+    expect(p, ")");
+    expect(p, "{");
+    fn->body = parse_block(p);
+    pop_scope(p);
+
+    fn->var_slots = assign_slots(p);
+    fn->temp_base = fn->var_slots;
+    fn->mask_base = fn->temp_base + p->max_temps;
+    fn->slot_count = fn->mask_base + 1 + 4 * p->max_depth;
+
+    for (mc_msl_fn* other = p->lib->fns; other; other = other->next)
+        if (!strcmp(other->name, fn->name)) fail(p, line(p), "redefinition of '%s'", fn->name);
+    fn->next = p->lib->fns;
+    p->lib->fns = fn;
+}
+
+mc_msl_lib* mc_msl_compile(const char* program, char** error) {
+    mc_msl_parser parser;
+    mc_msl_parser* p = &parser;
+    memset(p, 0, sizeof(*p));
+    *error = NULL;
+    p->lib = calloc(1, sizeof(mc_msl_lib));
+    if (p->lib == NULL) {
+        *error = strdup("out of memory");
+        return NULL;
+    }
+    if (setjmp(p->fail)) {
+        free(p->toks);
+        mc_msl_lib_free(p->lib);
+        *error = p->error ? p->error : strdup("out of memory");
+        return NULL;
+    }
+    lex(p, program);
+    while (peek(p, 0)->kind != TK_EOF) {
+        if (accept(p, ";")) continue;
+        if (accept(p, "using")) {
+            while (!accept(p, ";")) {
+                if (peek(p, 0)->kind == TK_EOF) fail(p, line(p), "expected ';'");
+                p->pos++;
+            }
+            continue;
+        }
+        if (is(p, "[") && tok_is(peek(p, 1), "[") && tok_is(peek(p, 2), "kernel")) {
+            p->pos += 3;
+            expect(p, "]");
+            expect(p, "]");
+            parse_kernel(p);
+        } else if (accept(p, "kernel")) {
+            parse_kernel(p);
+        } else {
+            fail(p, line(p), "only kernel functions are supported by the CPU backend");
+        }
+    }
+    free(p->toks);
+    return p->lib;
+}
+
+void mc_msl_lib_free(mc_msl_lib* lib) {
+    if (lib == NULL) return;
+    mc_msl_block* b = lib->blocks;
+    while (b) {
+        mc_msl_block* next = b->next;
+        free(b);
+        b = next;
+    }
+    free(lib);
+}
+
+const mc_msl_fn* mc_msl_lib_find(const mc_msl_lib* lib, const char* name) {
+    for (const mc_msl_fn* fn = lib->fns; fn; fn = fn->next)
+        if (!strcmp(fn->name, name)) return fn;
+    return NULL;
+}
+
+int mc_msl_fn_buffer_count(const mc_msl_fn* fn) {
+    return fn->buffer_count;
+}
+
+uint64_t mc_msl_fn_written_mask(const mc_msl_fn* fn) {
+    uint64_t mask = 0;
+    for (int i = 0; i < fn->nbufs; i++) {
+        const mc_msl_bufparam* b = &fn->bufs[i];
+        if (!b->threadgroup && !b->readonly && b->index < 64)
+            mask |= (uint64_t)1 << b->index;
+    }
+    return mask;
+}
+
+static size_t lane_stride(int lanes) {
+    return ((size_t)lanes + 15) & ~(size_t)15;
+}
+
+size_t mc_msl_fn_scratch_size(const mc_msl_fn* fn, int lanes) {
+    return (size_t)fn->slot_count * lane_stride(lanes) * sizeof(mc_msl_val);
+}
+
+size_t mc_msl_lib_size(const mc_msl_lib* lib) {
+    size_t size = sizeof(mc_msl_lib);
+    for (const mc_msl_block* b = lib->blocks; b; b = b->next)
+        size += sizeof(mc_msl_block) + b->size;
+    return size;
+}
+
+// -------------------------------------------------
+// Library images
+//
+// A compiled library is written as flat tables of variables, nodes and
+// functions, with pointers replaced by 1-based table indices (0 for NULL).
+// Loading rebuilds the same structures without parsing. Images are only
+// read back by the build which wrote them, so values are in host order.
+
+#define MC_MSL_IMAGE_MAGIC 0x324c534d // "MSL2"
+
+typedef struct {
+    char* data;
+    size_t length, size;
+    int failed;
+} mc_msl_writer;
+
+static void put(mc_msl_writer* w, const void* src, size_t n) {
+    if (w->failed) return;
+    if (w->length + n > w->size) {
+        size_t size = w->size ? w->size : 4096;
+        while (size < w->length + n) size *= 2;
+        char* data = realloc(w->data, size);
+        if (data == NULL) {
+            w->failed = 1;
+            return;
+        }
+        w->data = data;
+        w->size = size;
+    }
+    memcpy(w->data + w->length, src, n);
+    w->length += n;
+}
+
+static void put_int(mc_msl_writer* w, int32_t v) {
+    put(w, &v, sizeof(v));
+}
+
+// Distinct pointers, sorted so they can be numbered by binary search
+typedef struct {
+    const void** ptrs;
+    int count, size;
+    int failed;
+} mc_msl_ptrs;
+
+static void ptrs_add(mc_msl_ptrs* s, const void* ptr) {
+    if (ptr == NULL || s->failed) return;
+    if (s->count == s->size) {
+        int size = s->size ? s->size * 2 : 256;
+        const void** ptrs = realloc(s->ptrs, size * sizeof(void*));
+        if (ptrs == NULL) {
+            s->failed = 1;
+            return;
+        }
+        s->ptrs = ptrs;
+        s->size = size;
+    }
+    s->ptrs[s->count++] = ptr;
+}
+
+static int cmp_ptr(const void* a, const void* b) {
+    uintptr_t x = (uintptr_t)*(const void* const*)a;
+    uintptr_t y = (uintptr_t)*(const void* const*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void ptrs_sort(mc_msl_ptrs* s) {
+    if (s->count == 0) return;
+    qsort(s->ptrs, s->count, sizeof(void*), cmp_ptr);
+    int n = 1;
+    for (int i = 1; i < s->count; i++)
+        if (s->ptrs[i] != s->ptrs[n - 1]) s->ptrs[n++] = s->ptrs[i];
+    s->count = n;
+}
+
+static int32_t ptrs_index(const mc_msl_ptrs* s, const void* ptr) {
+    if (ptr == NULL) return 0;
+    const void** found = bsearch(&ptr, s->ptrs, s->count, sizeof(void*), cmp_ptr);
+    return (int32_t)(found - s->ptrs) + 1;
+}
+
+// Nodes may be shared (e.g. the index of a compound assignment), so are
+// collected with duplicates then made distinct by ptrs_sort
+static void collect(mc_msl_ptrs* nodes, mc_msl_ptrs* vars, const mc_msl_node* n) {
+    for (; n; n = n->next) {
+        ptrs_add(nodes, n);
+        ptrs_add(vars, n->var);
+        collect(nodes, vars, n->a);
+        collect(nodes, vars, n->b);
+        collect(nodes, vars, n->c);
+        for (int i = 0; i < n->nargs; i++) collect(nodes, vars, n->args[i]);
+    }
+}
+
+void* mc_msl_lib_save(const mc_msl_lib* lib, size_t* length) {
+    mc_msl_ptrs nodes = { 0 }, vars = { 0 };
+    int nfns = 0;
+    for (const mc_msl_fn* fn = lib->fns; fn; fn = fn->next, nfns++) {
+        collect(&nodes, &vars, fn->body);
+        ptrs_add(&vars, fn->gid);
+        for (int i = 0; i < fn->nattrs; i++) ptrs_add(&vars, fn->attrs[i].var);
+    }
+    ptrs_sort(&nodes);
+    ptrs_sort(&vars);
+
+    mc_msl_writer w = { 0 };
+    w.failed = nodes.failed || vars.failed;
+    put_int(&w, MC_MSL_IMAGE_MAGIC);
+    put_int(&w, vars.count);
+    put_int(&w, nodes.count);
+    put_int(&w, nfns);
+    for (int i = 0; i < vars.count; i++) {
+        const mc_msl_var* v = vars.ptrs[i];
+        put_int(&w, v->type);
+        put_int(&w, v->slot);
+        put_int(&w, v->assigned);
+    }
+    for (int i = 0; i < nodes.count; i++) {
+        const mc_msl_node* n = nodes.ptrs[i];
+        int32_t fields[] = { n->op, n->type, n->bind, n->fn, n->depth, n->need, n->linear, n->nargs };
+        put(&w, fields, sizeof(fields));
+        put(&w, &n->lit, sizeof(n->lit));
+        put_int(&w, ptrs_index(&vars, n->var));
+        put_int(&w, ptrs_index(&nodes, n->a));
+        put_int(&w, ptrs_index(&nodes, n->b));
+        put_int(&w, ptrs_index(&nodes, n->c));
+        put_int(&w, ptrs_index(&nodes, n->next));
+        for (int a = 0; a < n->nargs; a++) put_int(&w, ptrs_index(&nodes, n->args[a]));
+    }
+    for (const mc_msl_fn* fn = lib->fns; fn; fn = fn->next) {
+        int32_t name_len = (int32_t)strlen(fn->name);
+        put_int(&w, name_len);
+        put(&w, fn->name, name_len);
+        put_int(&w, ptrs_index(&nodes, fn->body));
+        put_int(&w, fn->nbufs);
+        for (int i = 0; i < fn->nbufs; i++) {
+            put_int(&w, fn->bufs[i].index);
+            put_int(&w, fn->bufs[i].type);
+            put_int(&w, fn->bufs[i].readonly);
+            put_int(&w, fn->bufs[i].threadgroup);
+        }
+        put_int(&w, fn->nattrs);
+        for (int i = 0; i < fn->nattrs; i++) {
+            put_int(&w, fn->attrs[i].attr);
+            put_int(&w, fn->attrs[i].component);
+            put_int(&w, ptrs_index(&vars, fn->attrs[i].var));
+        }
+        put_int(&w, ptrs_index(&vars, fn->gid));
+        int32_t fields[] = { fn->buffer_count, fn->var_slots, fn->temp_base, fn->mask_base, fn->slot_count };
+        put(&w, fields, sizeof(fields));
+    }
+
+    free(nodes.ptrs);
+    free(vars.ptrs);
+    if (w.failed) {
+        free(w.data);
+        return NULL;
+    }
+    *length = w.length;
+    return w.data;
+}
+
+typedef struct {
+    const char* data;
+    size_t left;
+    int failed;
+} mc_msl_reader;
+
+static void get(mc_msl_reader* r, void* dst, size_t n) {
+    if (r->failed || n > r->left) {
+        r->failed = 1;
+        memset(dst, 0, n);
+        return;
+    }
+    memcpy(dst, r->data, n);
+    r->data += n;
+    r->left -= n;
+}
+
+// Next int, which must be in [lo, hi]
+static int32_t get_int(mc_msl_reader* r, int32_t lo, int32_t hi) {
+    int32_t v;
+    get(r, &v, sizeof(v));
+    if (v < lo || v > hi) r->failed = 1;
+    return r->failed ? lo : v;
+}
+
+static void* table_entry(void* table, size_t size, int32_t index) {
+    return index ? (char*)table + (index - 1) * size : NULL;
+}
+
+mc_msl_lib* mc_msl_lib_load(const void* image, size_t length) {
+    mc_msl_reader reader = { image, length, 0 };
+    mc_msl_reader* r = &reader;
+    if (get_int(r, INT32_MIN, INT32_MAX) != MC_MSL_IMAGE_MAGIC) return NULL;
+    // Every entry takes at least 4 bytes, which bounds the table sizes
+    int32_t limit = (int32_t)(length / 4 < INT32_MAX ? length / 4 : INT32_MAX);
+    int32_t nvars = get_int(r, 0, limit);
+    int32_t nnodes = get_int(r, 0, limit);
+    int32_t nfns = get_int(r, 0, limit);
+    mc_msl_lib* lib = calloc(1, sizeof(mc_msl_lib));
+    mc_msl_var* vars = lib ? arena_alloc(lib, (nvars ? nvars : 1) * sizeof(mc_msl_var)) : NULL;
+    mc_msl_node* nodes = lib ? arena_alloc(lib, (nnodes ? nnodes : 1) * sizeof(mc_msl_node)) : NULL;
+    if (r->failed || vars == NULL || nodes == NULL) {
+        mc_msl_lib_free(lib);
+        return NULL;
+    }
+    // Table references, 0 for NULL
+#define VAR(lo) table_entry(vars, sizeof(mc_msl_var), get_int(r, lo, nvars))
+#define NODE() table_entry(nodes, sizeof(mc_msl_node), get_int(r, 0, nnodes))
+
+    for (int i = 0; i < nvars; i++) {
+        vars[i].type = get_int(r, T_VOID, T_FLOAT);
+        vars[i].slot = get_int(r, 0, INT32_MAX);
+        vars[i].assigned = get_int(r, 0, 1);
+    }
+    for (int i = 0; i < nnodes && !r->failed; i++) {
+        mc_msl_node* n = &nodes[i];
+        n->op = get_int(r, E_LIT, S_NOP);
+        n->type = get_int(r, T_VOID, T_FLOAT);
+        n->bind = get_int(r, 0, MC_MSL_MAX_BUFFERS - 1);
+        n->fn = get_int(r, 0, B_SELECT);
+        n->depth = get_int(r, 0, INT32_MAX);
+        n->need = get_int(r, 0, INT32_MAX);
+        n->linear = get_int(r, 0, 1);
+        n->nargs = get_int(r, 0, 3);
+        get(r, &n->lit, sizeof(n->lit));
+        n->var = VAR(0);
+        n->a = NODE();
+        n->b = NODE();
+        n->c = NODE();
+        n->next = NODE();
+        if (n->nargs) {
+            n->args = arena_alloc(lib, n->nargs * sizeof(mc_msl_node*));
+            if (n->args == NULL) r->failed = 1;
+            for (int a = 0; a < n->nargs && !r->failed; a++) n->args[a] = NODE();
+        }
+    }
+    mc_msl_fn** tail = &lib->fns;
+    for (int f = 0; f < nfns && !r->failed; f++) {
+        int32_t name_len = get_int(r, 1, (int32_t)(r->left < INT32_MAX ? r->left : INT32_MAX));
+        mc_msl_fn* fn = arena_alloc(lib, sizeof(mc_msl_fn));
+        char* name = arena_alloc(lib, name_len + 1);
+        if (fn == NULL || name == NULL) {
+            r->failed = 1;
+            break;
+        }
+        get(r, name, name_len);
+        name[name_len] = 0;
+        fn->name = name;
+        fn->body = NODE();
+        fn->nbufs = get_int(r, 0, MC_MSL_MAX_BUFFERS);
+        for (int i = 0; i < fn->nbufs; i++) {
+            fn->bufs[i].index = get_int(r, 0, MC_MSL_MAX_BUFFERS - 1);
+            fn->bufs[i].type = get_int(r, T_BOOL, T_FLOAT);
+            fn->bufs[i].readonly = get_int(r, 0, 1);
+            fn->bufs[i].threadgroup = get_int(r, 0, 1);
+        }
+        fn->nattrs = get_int(r, 0, MC_MSL_MAX_ATTRS);
+        for (int i = 0; i < fn->nattrs; i++) {
+            fn->attrs[i].attr = get_int(r, 0, A_COUNT - 1);
+            fn->attrs[i].component = get_int(r, 0, 2);
+            fn->attrs[i].var = VAR(1);
+        }
+        fn->gid = VAR(0);
+        fn->buffer_count = get_int(r, 0, MC_MSL_MAX_BUFFERS);
+        fn->var_slots = get_int(r, 0, INT32_MAX);
+        fn->temp_base = get_int(r, 0, INT32_MAX);
+        fn->mask_base = get_int(r, 0, INT32_MAX);
+        fn->slot_count = get_int(r, 0, INT32_MAX);
+        if (fn->body == NULL) r->failed = 1;
+        *tail = fn;
+        tail = &fn->next;
+    }
+#undef VAR
+#undef NODE
+
+    if (r->failed || r->left != 0) {
+        mc_msl_lib_free(lib);
+        return NULL;
+    }
+    return lib;
+}
+
+// -------------------------------------------------
+// Vectorised execution
+
+typedef struct {
+    const char* data;
+    uint64_t count; // Elements
+} mc_msl_binding;
+
+typedef struct {
+    const mc_msl_fn* fn;
+    mc_msl_binding binds[MC_MSL_MAX_BUFFERS];
+    mc_msl_val* slots;
+    size_t stride;
+    int n;
+    int consecutive; // Lanes have consecutive thread_position_in_grid
+    mc_msl_val* brk;
+    mc_msl_val* cont;
+} mc_msl_ctx;
+
+#define LANES(body) for (int i = 0; i < n; i++) { body; }
+
+static inline mc_msl_val* slot(mc_msl_ctx* c, int s) {
+    return c->slots + (size_t)s * c->stride;
+}
+
+static inline mc_msl_val* temp(mc_msl_ctx* c, int t) {
+    return slot(c, c->fn->temp_base + t);
+}
+
+static inline mc_msl_val* mask(mc_msl_ctx* c, int depth, int k) {
+    return slot(c, c->fn->mask_base + 1 + 4 * depth + k);
+}
+
+static int any(const mc_msl_val* m, int n) {
+    uint32_t r = 0;
+    LANES(r |= m[i].u);
+    return r != 0;
+}
+
+static int all(const mc_msl_val* m, int n) {
+    uint32_t r = 1;
+    LANES(r &= m[i].u);
+    return r != 0;
+}
+
+// Elementwise, so d may alias a
+static void convert_lanes(mc_msl_val* d, const mc_msl_val* a, int from, int to, int n) {
+    int k = kind_of(from);
+    switch (to) {
+        case T_BOOL:
+            if (k == K_FLOAT) LANES(d[i].i = a[i].f != 0.0f)
+            else LANES(d[i].i = a[i].u != 0)
+            break;
+        case T_FLOAT:
+        case T_HALF:
+            if (k == K_FLOAT) LANES(d[i].f = a[i].f)
+            else if (k == K_UINT) LANES(d[i].f = (float)a[i].u)
+            else LANES(d[i].f = (float)a[i].i)
+            if (to == T_HALF) LANES(d[i].f = half_to_float(float_to_half(d[i].f)))
+            break;
+        case T_INT:
+            if (k == K_FLOAT) LANES(d[i].i = f2i(a[i].f))
+            else LANES(d[i].u = a[i].u)
+            break;
+        case T_UINT:
+            if (k == K_FLOAT) LANES(d[i].u = f2u(a[i].f))
+            else LANES(d[i].u = a[i].u)
+            break;
+        case T_CHAR:
+            if (k == K_FLOAT) LANES(d[i].i = f2range(a[i].f, -128, 127))
+            else LANES(d[i].i = (int8_t)a[i].u)
+            break;
+        case T_UCHAR:
+            if (k == K_FLOAT) LANES(d[i].i = f2range(a[i].f, 0, 255))
+            else LANES(d[i].i = (uint8_t)a[i].u)
+            break;
+        case T_SHORT:
+            if (k == K_FLOAT) LANES(d[i].i = f2range(a[i].f, -32768, 32767))
+            else LANES(d[i].i = (int16_t)a[i].u)
+            break;
+        case T_USHORT:
+            if (k == K_FLOAT) LANES(d[i].i = f2range(a[i].f, 0, 65535))
+            else LANES(d[i].i = (uint16_t)a[i].u)
+            break;
+    }
+}
+
+static void convert_lit(mc_msl_val* v, int from, int to) {
+    mc_msl_val r;
+    convert_lanes(&r, v, from, to, 1);
+    *v = r;
+}
+
+static void load(mc_msl_ctx* c, const mc_msl_node* e, const mc_msl_val* idx, const mc_msl_val* m, mc_msl_val* d) {
+    int n = c->n;
+    const mc_msl_binding* b = &c->binds[e->bind];
+    uint64_t count = b->count;
+    if (idx == NULL) {
+        // Reference argument: element 0 for every lane
+        mc_msl_val v = { 0 };
+        if (count > 0) {
+            mc_msl_val one;
+            switch (e->type) {
+                case T_BOOL: v.i = *(const uint8_t*)b->data != 0; break;
+                case T_CHAR: v.i = *(const int8_t*)b->data; break;
+                case T_UCHAR: v.i = *(const uint8_t*)b->data; break;
+                case T_SHORT: v.i = *(const int16_t*)b->data; break;
+                case T_USHORT: v.i = *(const uint16_t*)b->data; break;
+                case T_HALF: v.f = half_to_float(*(const uint16_t*)b->data); break;
+                default: memcpy(&one, b->data, 4); v = one; break;
+            }
+        }
+        LANES(d[i] = v);
+        return;
+    }
+    if (e->linear && c->consecutive && idx[0].u + (uint64_t)n <= count) {
+        // Contiguous: lanes read consecutive elements
+        uint32_t j = idx[0].u;
+        switch (e->type) {
+            case T_BOOL: { const uint8_t* p = (const uint8_t*)b->data + j; LANES(d[i].i = p[i] != 0) break; }
+            case T_CHAR: { const int8_t* p = (const int8_t*)b->data + j; LANES(d[i].i = p[i]) break; }
+            case T_UCHAR: { const uint8_t* p = (const uint8_t*)b->data + j; LANES(d[i].i = p[i]) break; }
+            case T_SHORT: { const int16_t* p = (const int16_t*)b->data + j; LANES(d[i].i = p[i]) break; }
+            case T_USHORT: { const uint16_t* p = (const uint16_t*)b->data + j; LANES(d[i].i = p[i]) break; }
+            case T_HALF: { const uint16_t* p = (const uint16_t*)b->data + j; LANES(d[i].f = half_to_float(p[i])) break; }
+            case T_FLOAT: { const float* p = (const float*)b->data + j; LANES(d[i].f = p[i]) break; }
+            default: { const uint32_t* p = (const uint32_t*)b->data + j; LANES(d[i].u = p[i]) break; }
+        }
+        return;
+    }
+    // Gather. Inactive or out of range lanes read zero rather than faulting
+#define GATHER(ctype, field, expr) { const ctype* p = (const ctype*)b->data; \
+        LANES(uint32_t j = idx[i].u; if (m[i].u && j < count) d[i].field = expr; else d[i].u = 0) break; }
+    switch (e->type) {
+        case T_BOOL: GATHER(uint8_t, i, p[j] != 0)
+        case T_CHAR: GATHER(int8_t, i, p[j])
+        case T_UCHAR: GATHER(uint8_t, i, p[j])
+        case T_SHORT: GATHER(int16_t, i, p[j])
+        case T_USHORT: GATHER(uint16_t, i, p[j])
+        case T_HALF: GATHER(uint16_t, f, half_to_float(p[j]))
+        case T_FLOAT: GATHER(float, f, p[j])
+        default: GATHER(uint32_t, u, p[j])
+    }
+#undef GATHER
+}
+
+static void store(mc_msl_ctx* c, const mc_msl_node* s, const mc_msl_val* idx, const mc_msl_val* v, const mc_msl_val* m) {
+    int n = c->n;
+    const mc_msl_binding* b = &c->binds[s->bind];
+    uint64_t count = b->count;
+    char* data = (char*)b->data;
+    if (idx == NULL) {
+        // Reference argument. Last active lane wins.
+        if (count == 0) return;
+        for (int i = n - 1; i >= 0; i--) {
+            if (!m[i].u) continue;
+            switch (s->type) {
+                case T_BOOL: case T_CHAR: case T_UCHAR: *(uint8_t*)data = (uint8_t)v[i].u; break;
+                case T_SHORT: case T_USHORT: *(uint16_t*)data = (uint16_t)v[i].u; break;
+                case T_HALF: *(uint16_t*)data = float_to_half(v[i].f); break;
+                default: memcpy(data, &v[i], 4); break;
+            }
+            break;
+        }
+        return;
+    }
+    if (s->linear && c->consecutive && idx[0].u + (uint64_t)n <= count && all(m, n)) {
+        uint32_t j = idx[0].u;
+        switch (s->type) {
+            case T_BOOL: case T_CHAR: case T_UCHAR: { uint8_t* p = (uint8_t*)data + j; LANES(p[i] = (uint8_t)v[i].u) break; }
+            case T_SHORT: case T_USHORT: { uint16_t* p = (uint16_t*)data + j; LANES(p[i] = (uint16_t)v[i].u) break; }
+            case T_HALF: { uint16_t* p = (uint16_t*)data + j; LANES(p[i] = float_to_half(v[i].f)) break; }
+            case T_FLOAT: { float* p = (float*)data + j; LANES(p[i] = v[i].f) break; }
+            default: { uint32_t* p = (uint32_t*)data + j; LANES(p[i] = v[i].u) break; }
+        }
+        return;
+    }
+#define SCATTER(ctype, expr) { ctype* p = (ctype*)data; \
+        LANES(uint32_t j = idx[i].u; if (m[i].u && j < count) p[j] = expr) break; }
+    switch (s->type) {
+        case T_BOOL: case T_CHAR: case T_UCHAR: SCATTER(uint8_t, (uint8_t)v[i].u)
+        case T_SHORT: case T_USHORT: SCATTER(uint16_t, (uint16_t)v[i].u)
+        case T_HALF: SCATTER(uint16_t, float_to_half(v[i].f))
+        case T_FLOAT: SCATTER(float, v[i].f)
+        default: SCATTER(uint32_t, v[i].u)
+    }
+#undef SCATTER
+}
+
+static void binary(int op, int k, mc_msl_val* d, const mc_msl_val* a, const mc_msl_val* b, int n) {
+    switch (op) {
+        case E_ADD:
+            if (k == K_FLOAT) LANES(d[i].f = a[i].f + b[i].f) else LANES(d[i].u = a[i].u + b[i].u)
+            break;
+        case E_SUB:
+            if (k == K_FLOAT) LANES(d[i].f = a[i].f - b[i].f) else LANES(d[i].u = a[i].u - b[i].u)
+            break;
+        case E_MUL:
+            if (k == K_FLOAT) LANES(d[i].f = a[i].f * b[i].f) else LANES(d[i].u = a[i].u * b[i].u)
+            break;
+        case E_DIV:
+            if (k == K_FLOAT) LANES(d[i].f = a[i].f / b[i].f)
+            else if (k == K_UINT) LANES(d[i].u = b[i].u ? a[i].u / b[i].u : 0)
+            else LANES(d[i].i = b[i].i == 0 ? 0 : (b[i].i == -1 ? (int32_t)(0u - a[i].u) : a[i].i / b[i].i))
+            break;
+        case E_MOD:
+            if (k == K_UINT) LANES(d[i].u = b[i].u ? a[i].u % b[i].u : 0)
+            else LANES(d[i].i = (b[i].i == 0 || b[i].i == -1) ? 0 : a[i].i % b[i].i)
+            break;
+        case E_AND: LANES(d[i].u = a[i].u & b[i].u) break;
+        case E_OR: LANES(d[i].u = a[i].u | b[i].u) break;
+        case E_XOR: LANES(d[i].u = a[i].u ^ b[i].u) break;
+        case E_SHL: LANES(d[i].u = a[i].u << (b[i].u & 31)) break;
+        case E_SHR:
+            if (k == K_UINT) LANES(d[i].u = a[i].u >> (b[i].u & 31))
+            else LANES(d[i].i = a[i].i >> (b[i].u & 31))
+            break;
+        case E_LAND: LANES(d[i].i = a[i].i & b[i].i) break;
+        case E_LOR: LANES(d[i].i = a[i].i | b[i].i) break;
+#define COMPARE(OP) \
+            if (k == K_FLOAT) LANES(d[i].i = a[i].f OP b[i].f) \
+            else if (k == K_UINT) LANES(d[i].i = a[i].u OP b[i].u) \
+            else LANES(d[i].i = a[i].i OP b[i].i) \
+            break;
+        case E_LT: COMPARE(<)
+        case E_LE: COMPARE(<=)
+        case E_GT: COMPARE(>)
+        case E_GE: COMPARE(>=)
+        case E_EQ: COMPARE(==)
+        case E_NE: COMPARE(!=)
+#undef COMPARE
+    }
+}
+
+static void call(int fn, int k, mc_msl_val* d, mc_msl_val** args, int n) {
+    const mc_msl_val* a = args[0];
+    const mc_msl_val* b = args[1];
+    const mc_msl_val* c = args[2];
+    switch (fn) {
+        case B_SIN: LANES(d[i].f = sinf(a[i].f)) break;
+        case B_COS: LANES(d[i].f = cosf(a[i].f)) break;
+        case B_TAN: LANES(d[i].f = tanf(a[i].f)) break;
+        case B_ASIN: LANES(d[i].f = asinf(a[i].f)) break;
+        case B_ACOS: LANES(d[i].f = acosf(a[i].f)) break;
+        case B_ATAN: LANES(d[i].f = atanf(a[i].f)) break;
+        case B_SINH: LANES(d[i].f = sinhf(a[i].f)) break;
+        case B_COSH: LANES(d[i].f = coshf(a[i].f)) break;
+        case B_TANH: LANES(d[i].f = tanhf(a[i].f)) break;
+        case B_EXP: LANES(d[i].f = expf(a[i].f)) break;
+        case B_EXP2: LANES(d[i].f = exp2f(a[i].f)) break;
+        case B_EXP10: LANES(d[i].f = powf(10.0f, a[i].f)) break;
+        case B_LOG: LANES(d[i].f = logf(a[i].f)) break;
+        case B_LOG2: LANES(d[i].f = log2f(a[i].f)) break;
+        case B_LOG10: LANES(d[i].f = log10f(a[i].f)) break;
+        case B_SQRT: LANES(d[i].f = sqrtf(a[i].f)) break;
+        case B_RSQRT: LANES(d[i].f = 1.0f / sqrtf(a[i].f)) break;
+        case B_FLOOR: LANES(d[i].f = floorf(a[i].f)) break;
+        case B_CEIL: LANES(d[i].f = ceilf(a[i].f)) break;
+        case B_ROUND: LANES(d[i].f = roundf(a[i].f)) break;
+        case B_TRUNC: LANES(d[i].f = truncf(a[i].f)) break;
+        case B_RINT: LANES(d[i].f = rintf(a[i].f)) break;
+        case B_FRACT: LANES(d[i].f = fminf(a[i].f - floorf(a[i].f), 0x1.fffffep-1f)) break;
+        case B_SIGN: LANES(d[i].f = a[i].f > 0.0f ? 1.0f : (a[i].f < 0.0f ? -1.0f : 0.0f)) break;
+        case B_FABS: LANES(d[i].f = fabsf(a[i].f)) break;
+        case B_SATURATE: LANES(d[i].f = fminf(fmaxf(a[i].f, 0.0f), 1.0f)) break;
+        case B_POW: LANES(d[i].f = powf(a[i].f, b[i].f)) break;
+        case B_ATAN2: LANES(d[i].f = atan2f(a[i].f, b[i].f)) break;
+        case B_FMOD: LANES(d[i].f = fmodf(a[i].f, b[i].f)) break;
+        case B_FMIN: LANES(d[i].f = fminf(a[i].f, b[i].f)) break;
+        case B_FMAX: LANES(d[i].f = fmaxf(a[i].f, b[i].f)) break;
+        case B_STEP: LANES(d[i].f = b[i].f < a[i].f ? 0.0f : 1.0f) break;
+        case B_COPYSIGN: LANES(d[i].f = copysignf(a[i].f, b[i].f)) break;
+        case B_MIX: LANES(d[i].f = a[i].f + (b[i].f - a[i].f) * c[i].f) break;
+        case B_FMA: LANES(d[i].f = fmaf(a[i].f, b[i].f, c[i].f)) break;
+        case B_SMOOTHSTEP:
+            LANES(float t = fminf(fmaxf((c[i].f - a[i].f) / (b[i].f - a[i].f), 0.0f), 1.0f);
+                  d[i].f = t * t * (3.0f - 2.0f * t))
+            break;
+        case B_ABS:
+            if (k == K_FLOAT) LANES(d[i].f = fabsf(a[i].f))
+            else if (k == K_INT) LANES(d[i].u = a[i].i < 0 ? 0u - a[i].u : a[i].u)
+            else LANES(d[i] = a[i])
+            break;
+        case B_MIN:
+            if (k == K_FLOAT) LANES(d[i].f = fminf(a[i].f, b[i].f))
+            else if (k == K_UINT) LANES(d[i].u = a[i].u < b[i].u ? a[i].u : b[i].u)
+            else LANES(d[i].i = a[i].i < b[i].i ? a[i].i : b[i].i)
+            break;
+        case B_MAX:
+            if (k == K_FLOAT) LANES(d[i].f = fmaxf(a[i].f, b[i].f))
+            else if (k == K_UINT) LANES(d[i].u = a[i].u > b[i].u ? a[i].u : b[i].u)
+            else LANES(d[i].i = a[i].i > b[i].i ? a[i].i : b[i].i)
+            break;
+        case B_CLAMP:
+            if (k == K_FLOAT) LANES(d[i].f = fminf(fmaxf(a[i].f, b[i].f), c[i].f))
+            else if (k == K_UINT) LANES(uint32_t v = a[i].u < b[i].u ? b[i].u : a[i].u; d[i].u = v > c[i].u ? c[i].u : v)
+            else LANES(int32_t v = a[i].i < b[i].i ? b[i].i : a[i].i; d[i].i = v > c[i].i ? c[i].i : v)
+            break;
+        case B_ISNAN: LANES(d[i].i = isnan(a[i].f) != 0) break;
+        case B_ISINF: LANES(d[i].i = isinf(a[i].f) != 0) break;
+        case B_ISFINITE: LANES(d[i].i = isfinite(a[i].f) != 0) break;
+        case B_SELECT: LANES(d[i] = c[i].i ? b[i] : a[i]) break;
+    }
+}
+
+// Evaluate expression into temporary t (or return variable storage directly)
+static mc_msl_val* eval(mc_msl_ctx* c, const mc_msl_node* e, int t, const mc_msl_val* m) {
+    int n = c->n;
+    mc_msl_val* d = temp(c, t);
+    switch (e->op) {
+        case E_VAR:
+            return slot(c, e->var->slot);
+        case E_LIT: {
+            mc_msl_val v = e->lit;
+            LANES(d[i] = v);
+            return d;
+        }
+        case E_LOAD: {
+            mc_msl_val* idx = e->a ? eval(c, e->a, t, m) : NULL;
+            load(c, e, idx, m, d);
+            return d;
+        }
+        case E_CONV: {
+            mc_msl_val* a = eval(c, e->a, t, m);
+            convert_lanes(d, a, e->a->type, e->type, n);
+            return d;
+        }
+        case E_NEG: {
+            mc_msl_val* a = eval(c, e->a, t, m);
+            if (kind_of(e->type) == K_FLOAT) LANES(d[i].f = -a[i].f)
+            else LANES(d[i].u = 0u - a[i].u)
+            return d;
+        }
+        case E_NOT: {
+            mc_msl_val* a = eval(c, e->a, t, m);
+            LANES(d[i].i = a[i].i ^ 1);
+            return d;
+        }
+        case E_BNOT: {
+            mc_msl_val* a = eval(c, e->a, t, m);
+            LANES(d[i].u = ~a[i].u);
+            return d;
+        }
+        case E_SEL: {
+            mc_msl_val* cond = eval(c, e->c, t, m);
+            mc_msl_val* a = eval(c, e->a, t + 1, m);
+            mc_msl_val* b = eval(c, e->b, t + 2, m);
+            LANES(d[i] = cond[i].i ? a[i] : b[i]);
+            return d;
+        }
+        case E_CALL: {
+            mc_msl_val* args[3] = { NULL, NULL, NULL };
+            for (int i = 0; i < e->nargs; i++)
+                args[i] = eval(c, e->args[i], t + i, m);
+            call(e->fn, kind_of(e->args[0]->type), d, args, n);
+            return d;
+        }
+        default: {
+            mc_msl_val* a = eval(c, e->a, t, m);
+            mc_msl_val* b = eval(c, e->b, t + 1, m);
+            binary(e->op, kind_of(e->a->type), d, a, b, n);
+            return d;
+        }
+    }
+}
+
+// Execute statement for lanes active in m. Lanes which leave (return/break/continue) are cleared from m.
+static void exec(mc_msl_ctx* c, const mc_msl_node* s, mc_msl_val* m) {
+    int n = c->n;
+    switch (s->op) {
+        case S_BLOCK:
+            for (const mc_msl_node* child = s->a; child; child = child->next) {
+                exec(c, child, m);
+                if (child->op != S_SET && child->op != S_STORE && !any(m, n)) return;
+            }
+            break;
+        case S_SET: {
+            mc_msl_val* v = eval(c, s->a, 0, m);
+            mc_msl_val* d = slot(c, s->var->slot);
+            if (v != d) LANES(d[i].u = m[i].u ? v[i].u : d[i].u);
+            break;
+        }
+        case S_STORE: {
+            mc_msl_val* idx = s->a ? eval(c, s->a, 0, m) : NULL;
+            mc_msl_val* v = eval(c, s->b, 1, m);
+            store(c, s, idx, v, m);
+            break;
+        }
+        case S_IF: {
+            mc_msl_val* cond = eval(c, s->a, 0, m);
+            mc_msl_val* mt = mask(c, s->depth, 0);
+            mc_msl_val* me = mask(c, s->depth, 1);
+            LANES(mt[i].u = m[i].u & (uint32_t)cond[i].i; me[i].u = m[i].u & (uint32_t)(cond[i].i ^ 1));
+            if (any(mt, n)) exec(c, s->b, mt);
+            if (s->c && any(me, n)) exec(c, s->c, me);
+            LANES(m[i].u = mt[i].u | me[i].u);
+            break;
+        }
+        case S_LOOP: {
+            mc_msl_val* lm = mask(c, s->depth, 0);
+            mc_msl_val* ex = mask(c, s->depth, 1);
+            mc_msl_val* brk = mask(c, s->depth, 2);
+            mc_msl_val* cont = mask(c, s->depth, 3);
+            mc_msl_val* outer_brk = c->brk;
+            mc_msl_val* outer_cont = c->cont;
+            c->brk = brk;
+            c->cont = cont;
+            LANES(lm[i].u = m[i].u; ex[i].u = 0);
+            for (;;) {
+                if (s->a) {
+                    mc_msl_val* cond = eval(c, s->a, 0, lm);
+                    LANES(uint32_t ci = (uint32_t)cond[i].i; ex[i].u |= lm[i].u & (ci ^ 1); lm[i].u &= ci);
+                }
+                if (!any(lm, n)) break;
+                LANES(brk[i].u = 0; cont[i].u = 0);
+                exec(c, s->b, lm);
+                LANES(ex[i].u |= brk[i].u; lm[i].u |= cont[i].u);
+                if (s->c && any(lm, n)) exec(c, s->c, lm);
+            }
+            c->brk = outer_brk;
+            c->cont = outer_cont;
+            LANES(m[i].u = ex[i].u);
+            break;
+        }
+        case S_BREAK: {
+            mc_msl_val* brk = c->brk;
+            LANES(brk[i].u |= m[i].u; m[i].u = 0);
+            break;
+        }
+        case S_CONT: {
+            mc_msl_val* cont = c->cont;
+            LANES(cont[i].u |= m[i].u; m[i].u = 0);
+            break;
+        }
+        case S_RET:
+            LANES(m[i].u = 0);
+            break;
+        case S_NOP:
+            break;
+    }
+}
+
+// Component dim of each lane's position within a threadgroup of the given shape, plus offset
+static void lane_positions(mc_msl_val* d, int dim, const uint32_t* shape, uint32_t offset, int n) {
+    uint32_t w = shape[0], wh = shape[0] * shape[1];
+    if (dim == 0) {
+        if (wh == w && shape[2] == 1) LANES(d[i].u = offset + i) // 1-D: lanes are consecutive
+        else LANES(d[i].u = offset + i % w)
+    } else if (dim == 1) {
+        LANES(d[i].u = offset + (i / w) % shape[1])
+    } else {
+        LANES(d[i].u = offset + i / wh)
+    }
+}
+
+void mc_msl_exec(const mc_msl_fn* fn, const mc_msl_buffer* bufs, int buf_count,
+                 const mc_msl_buffer* tg_bufs, int tg_count,
+                 const mc_msl_dispatch* dispatch, uint32_t group, void* scratch) {
+    mc_msl_ctx ctx;
+    mc_msl_ctx* c = &ctx;
+    const uint32_t* grid = dispatch->grid;
+    const uint32_t* shape = dispatch->group;
+    uint32_t groups[3], pos[3], origin[3];
+    uint32_t rest = group;
+    for (int k = 0; k < 3; k++) {
+        groups[k] = (grid[k] + shape[k] - 1) / shape[k];
+        pos[k] = rest % groups[k];
+        rest /= groups[k];
+        origin[k] = pos[k] * shape[k];
+    }
+    int lanes = (int)(shape[0] * shape[1] * shape[2]);
+    int one_d = shape[1] == 1 && shape[2] == 1;
+    // A ragged 1-D group just runs fewer lanes. Otherwise lanes outside the grid are masked off.
+    int n = one_d && grid[0] - origin[0] < shape[0] ? (int)(grid[0] - origin[0]) : lanes;
+    c->fn = fn;
+    c->slots = scratch;
+    c->stride = lane_stride(lanes);
+    c->n = n;
+    c->consecutive = one_d && fn->gid != NULL && fn->gid->assigned == 0;
+    c->brk = c->cont = NULL;
+    for (int b = 0; b < fn->nbufs; b++) {
+        int index = fn->bufs[b].index;
+        int size = type_size[fn->bufs[b].type];
+        const mc_msl_buffer* from = fn->bufs[b].threadgroup ? tg_bufs : bufs;
+        int from_count = fn->bufs[b].threadgroup ? tg_count : buf_count;
+        if (index < from_count && from[index].data != NULL) {
+            c->binds[b].data = from[index].data;
+            c->binds[b].count = from[index].length / size;
+        } else {
+            c->binds[b].data = NULL;
+            c->binds[b].count = 0;
+        }
+    }
+    for (int a = 0; a < fn->nattrs; a++) {
+        mc_msl_val* d = slot(c, fn->attrs[a].var->slot);
+        int k = fn->attrs[a].component;
+        switch (fn->attrs[a].attr) {
+            case A_THREAD_POSITION_IN_GRID: lane_positions(d, k, shape, origin[k], n); break;
+            case A_THREAD_POSITION_IN_THREADGROUP: lane_positions(d, k, shape, 0, n); break;
+            case A_THREAD_INDEX_IN_THREADGROUP: LANES(d[i].u = i) break;
+            case A_THREADGROUP_POSITION_IN_GRID: LANES(d[i].u = pos[k]) break;
+            case A_THREADS_PER_THREADGROUP: LANES(d[i].u = shape[k]) break;
+            case A_THREADS_PER_GRID: LANES(d[i].u = grid[k]) break;
+            case A_THREADGROUPS_PER_GRID: LANES(d[i].u = groups[k]) break;
+        }
+        // Narrow declared types see the truncated value
+        if (is_narrow(fn->attrs[a].var->type)) convert_lanes(d, d, T_UINT, fn->attrs[a].var->type, n);
+    }
+    mc_msl_val* root = slot(c, fn->mask_base);
+    if (one_d) {
+        LANES(root[i].u = 1);
+    } else {
+        uint32_t w = shape[0], wh = shape[0] * shape[1];
+        uint32_t left_x = grid[0] - origin[0], left_y = grid[1] - origin[1], left_z = grid[2] - origin[2];
+        LANES(root[i].u = i % w < left_x && (i / w) % shape[1] < left_y && i / wh < left_z);
+    }
+    exec(c, fn->body, root);
+}
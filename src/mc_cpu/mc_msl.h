@@ -0,0 +1,59 @@
+// Metal Shading Language subset for the CPU backend
+
+// A small compiler for the scalar subset of MSL used by metalcompute kernels,
+// and a vectorised interpreter which runs one threadgroup of lanes at a time.
+// Every operation is applied to all lanes of a batch in a tight loop so the
+// C compiler can auto-vectorise it. Divergent control flow is handled with
+// per-lane masks.
+
+#ifndef MC_MSL_H
+#define MC_MSL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Largest threadgroup (batch of lanes) which can be executed at once
+#define MC_MSL_MAX_LANES 1024
+
+typedef struct mc_msl_lib mc_msl_lib; // All kernel functions from one source
+typedef struct mc_msl_fn mc_msl_fn;   // One kernel function
+
+typedef struct {
+    char* data;
+    uint64_t length; // In bytes
+} mc_msl_buffer;
+
+// Compile a program. On failure returns NULL and sets *error (must free)
+mc_msl_lib* mc_msl_compile(const char* program, char** error);
+void mc_msl_lib_free(mc_msl_lib* lib);
+const mc_msl_fn* mc_msl_lib_find(const mc_msl_lib* lib, const char* name);
+// Bytes of memory held by a compiled library
+size_t mc_msl_lib_size(const mc_msl_lib* lib);
+
+// Save a compiled library as a flat image of *length bytes (must free), or NULL if out of memory
+void* mc_msl_lib_save(const mc_msl_lib* lib, size_t* length);
+// Load an image from mc_msl_lib_save of the same build. Returns NULL if it is not valid.
+mc_msl_lib* mc_msl_lib_load(const void* image, size_t length);
+
+// Number of buffer indices the function needs bound (highest [[buffer(n)]] + 1)
+int mc_msl_fn_buffer_count(const mc_msl_fn* fn);
+// Bit n set if [[buffer(n)]] is not const, so may be written. Indices past 63 are not included
+uint64_t mc_msl_fn_written_mask(const mc_msl_fn* fn);
+// Bytes of scratch memory needed to execute batches of up to lanes threads
+size_t mc_msl_fn_scratch_size(const mc_msl_fn* fn, int lanes);
+
+// Shape of a dispatch: threads in the grid and in each threadgroup, per dimension
+typedef struct {
+    uint32_t grid[3];
+    uint32_t group[3];
+} mc_msl_dispatch;
+
+// Execute threadgroup number group of a dispatch, numbering x fastest.
+// A threadgroup has at most MC_MSL_MAX_LANES threads, and threads outside the
+// grid at ragged edges are not run. tg_bufs is the threadgroup memory for
+// [[threadgroup(n)]] arguments, shared by the threads of the group.
+void mc_msl_exec(const mc_msl_fn* fn, const mc_msl_buffer* bufs, int buf_count,
+                 const mc_msl_buffer* tg_bufs, int tg_count,
+                 const mc_msl_dispatch* dispatch, uint32_t group, void* scratch);
+
+#endif
@@ -0,0 +1,100 @@
+/*
+mc_notify.c
+
+Completion notification through pollable file descriptors, shared by the backends
+
+(c) Andrew Baldwin 2021
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "mc_notify.h"
+
+typedef struct {
+    int read_fd;
+    int write_fd;
+} mc_notify_pipe;
+
+static pthread_mutex_t notify_lock = PTHREAD_MUTEX_INITIALIZER;
+static mc_notify_pipe* pipes = NULL;
+static int pipe_count = 0;
+static int pipe_capacity = 0;
+static atomic_int subscribed = 0; // Lets signal skip the lock when nobody listens
+
+static int set_flags(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    return flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0 || fcntl(fd, F_SETFD, FD_CLOEXEC) < 0;
+}
+
+static void remove_pipe(int index) {
+    close(pipes[index].write_fd);
+    pipes[index] = pipes[--pipe_count];
+    atomic_store(&subscribed, pipe_count);
+}
+
+int mc_notify_open(void) {
+    int fds[2];
+    if (pipe(fds) != 0) return -1;
+    if (set_flags(fds[0]) || set_flags(fds[1])) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    pthread_mutex_lock(&notify_lock);
+    if (pipe_count == pipe_capacity) {
+        int capacity = pipe_capacity ? pipe_capacity * 2 : 4;
+        mc_notify_pipe* grown = realloc(pipes, capacity * sizeof(mc_notify_pipe));
+        if (grown == NULL) {
+            pthread_mutex_unlock(&notify_lock);
+            close(fds[0]);
+            close(fds[1]);
+            return -1;
+        }
+        pipes = grown;
+        pipe_capacity = capacity;
+    }
+    pipes[pipe_count].read_fd = fds[0];
+    pipes[pipe_count].write_fd = fds[1];
+    pipe_count++;
+    atomic_store(&subscribed, pipe_count);
+    pthread_mutex_unlock(&notify_lock);
+    return fds[0];
+}
+
+void mc_notify_close(int fd) {
+    pthread_mutex_lock(&notify_lock);
+    for (int i = 0; i < pipe_count; i++) {
+        if (pipes[i].read_fd == fd) {
+            remove_pipe(i);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&notify_lock);
+    close(fd);
+}
+
+void mc_notify_drain(int fd) {
+    char scratch[256];
+    while (read(fd, scratch, sizeof(scratch)) > 0);
+}
+
+void mc_notify_signal(void) {
+    if (atomic_load(&subscribed) == 0) return;
+    static const char byte = 1;
+    pthread_mutex_lock(&notify_lock);
+    for (int i = 0; i < pipe_count; ) {
+        // A full pipe is already readable, so EAGAIN loses nothing.
+        // EPIPE means the reader closed its end without unsubscribing.
+        if (write(pipes[i].write_fd, &byte, 1) < 0 && errno == EPIPE) {
+            remove_pipe(i);
+        } else {
+            i++;
+        }
+    }
+    pthread_mutex_unlock(&notify_lock);
+}
@@ -0,0 +1,20 @@
+// Completion notification through pollable file descriptors, shared by the backends
+
+// Each subscriber gets its own pipe. Backends call mc_notify_signal whenever
+// a run completes, which makes every subscribed descriptor readable, so an
+// event loop can watch it and then poll its outstanding runs.
+// Notifications are coalesced: one readable descriptor may cover many runs.
+
+#ifndef MC_NOTIFY_H
+#define MC_NOTIFY_H
+
+// Open a new non-blocking notification descriptor. Returns -1 on failure.
+// Closing it with mc_notify_close (or close) unsubscribes it.
+int mc_notify_open(void);
+void mc_notify_close(int fd);
+// Discard pending notifications, before polling the runs they cover
+void mc_notify_drain(int fd);
+// Called by backends after a run is marked complete
+void mc_notify_signal(void);
+
+#endif
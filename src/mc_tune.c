@@ -0,0 +1,166 @@
+/*
+mc_tune.c
+
+Threadgroup sizes chosen by the autotuner, persisted across processes
+
+(c) Andrew Baldwin 2021
+*/
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mc_tune.h"
+
+static pthread_mutex_t tune_lock = PTHREAD_MUTEX_INITIALIZER;
+static mc_tune_entry* entries = NULL;
+static int64_t entry_count = 0;
+static int64_t entry_size = 0;
+static int loaded = 0;
+static char* loaded_dir = NULL; // Cache directory the entries were loaded from
+
+void mc_tune_bucket(const int64_t* grid, int64_t* bucket) {
+    for (int k = 0; k < 3; k++) {
+        int64_t b = 1;
+        while (b < grid[k] && b < ((int64_t)1 << 62)) b <<= 1;
+        bucket[k] = b;
+    }
+}
+
+static int64_t find_entry(const char* fn_key, const int64_t* bucket) {
+    for (int64_t i = 0; i < entry_count; i++) {
+        if (memcmp(entries[i].bucket, bucket, sizeof(entries[i].bucket)) == 0
+            && strcmp(entries[i].fn_key, fn_key) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static mc_tune_entry* add_entry(const char* fn_key, const int64_t* bucket) {
+    if (entry_count == entry_size) {
+        int64_t size = entry_size ? entry_size * 2 : 64;
+        mc_tune_entry* grown = realloc(entries, size * sizeof(mc_tune_entry));
+        if (grown == NULL) return NULL;
+        entries = grown;
+        entry_size = size;
+    }
+    mc_tune_entry* entry = &entries[entry_count++];
+    snprintf(entry->fn_key, sizeof(entry->fn_key), "%s", fn_key);
+    memcpy(entry->bucket, bucket, sizeof(entry->bucket));
+    return entry;
+}
+
+static int valid_key(const char* key) {
+    for (int i = 0; i < MC_CACHE_KEY_SIZE - 1; i++) {
+        char c = key[i];
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) return 0;
+    }
+    return key[MC_CACHE_KEY_SIZE - 1] == 0;
+}
+
+// Add entries saved on disk which are not already in memory
+static void read_entries(void) {
+    char path[4096];
+    if (!mc_cache_path("autotune", "txt", path, sizeof(path))) return;
+    FILE* f = fopen(path, "r");
+    if (f == NULL) return;
+    char line[256];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char key[MC_CACHE_KEY_SIZE + 1] = { 0 };
+        int64_t bucket[3], group[3];
+        if (sscanf(line, "%65s %" SCNd64 " %" SCNd64 " %" SCNd64 " %" SCNd64 " %" SCNd64 " %" SCNd64,
+                   key, &bucket[0], &bucket[1], &bucket[2], &group[0], &group[1], &group[2]) != 7)
+            continue;
+        if (!valid_key(key) || group[0] < 1 || group[1] < 1 || group[2] < 1)
+            continue;
+        if (find_entry(key, bucket) >= 0)
+            continue;
+        mc_tune_entry* entry = add_entry(key, bucket);
+        if (entry == NULL) break;
+        memcpy(entry->group, group, sizeof(entry->group));
+    }
+    fclose(f);
+}
+
+// Load when first used, and again whenever the cache directory changes
+static void sync_entries(void) {
+    char* dir = mc_cache_get_dir();
+    int same = (dir == NULL && loaded_dir == NULL) || (dir && loaded_dir && strcmp(dir, loaded_dir) == 0);
+    if (loaded && same) {
+        free(dir);
+        return;
+    }
+    free(loaded_dir);
+    loaded_dir = dir;
+    loaded = 1;
+    entry_count = 0;
+    read_entries();
+}
+
+static void write_entries(void) {
+    char path[4096], tmp_path[4200];
+    if (!mc_cache_path("autotune", "txt", path, sizeof(path))) return;
+    read_entries(); // Keep what other processes tuned meanwhile
+    // Written aside then renamed, so other processes never see a partial file
+    mc_cache_tmp_path(path, tmp_path, sizeof(tmp_path));
+    FILE* f = fopen(tmp_path, "w");
+    if (f == NULL) return;
+    int ok = 1;
+    for (int64_t i = 0; i < entry_count && ok; i++) {
+        const mc_tune_entry* e = &entries[i];
+        ok = fprintf(f, "%s %" PRId64 " %" PRId64 " %" PRId64 " %" PRId64 " %" PRId64 " %" PRId64 "\n",
+                     e->fn_key, e->bucket[0], e->bucket[1], e->bucket[2],
+                     e->group[0], e->group[1], e->group[2]) > 0;
+    }
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || rename(tmp_path, path) != 0)
+        unlink(tmp_path);
+}
+
+int mc_tune_get(const char* fn_key, const int64_t* bucket, int64_t* group) {
+    pthread_mutex_lock(&tune_lock);
+    sync_entries();
+    int64_t i = find_entry(fn_key, bucket);
+    if (i >= 0)
+        memcpy(group, entries[i].group, sizeof(entries[i].group));
+    pthread_mutex_unlock(&tune_lock);
+    return i >= 0;
+}
+
+void mc_tune_put(const char* fn_key, const int64_t* bucket, const int64_t* group) {
+    pthread_mutex_lock(&tune_lock);
+    sync_entries();
+    int64_t i = find_entry(fn_key, bucket);
+    mc_tune_entry* entry = i >= 0 ? &entries[i] : add_entry(fn_key, bucket);
+    if (entry != NULL) {
+        memcpy(entry->group, group, sizeof(entry->group));
+        write_entries();
+    }
+    pthread_mutex_unlock(&tune_lock);
+}
+
+int64_t mc_tune_list(const char* fn_key, mc_tune_entry** out) {
+    pthread_mutex_lock(&tune_lock);
+    sync_entries();
+    int64_t count = 0;
+    *out = malloc((entry_count ? entry_count : 1) * sizeof(mc_tune_entry));
+    for (int64_t i = 0; *out != NULL && i < entry_count; i++) {
+        if (fn_key == NULL || strcmp(entries[i].fn_key, fn_key) == 0)
+            (*out)[count++] = entries[i];
+    }
+    pthread_mutex_unlock(&tune_lock);
+    return count;
+}
+
+void mc_tune_clear(void) {
+    char path[4096];
+    pthread_mutex_lock(&tune_lock);
+    sync_entries();
+    entry_count = 0;
+    if (mc_cache_path("autotune", "txt", path, sizeof(path)))
+        unlink(path);
+    pthread_mutex_unlock(&tune_lock);
+}
@@ -0,0 +1,31 @@
+// Threadgroup sizes chosen by the autotuner, persisted across processes
+
+// Entries map a function key and a grid size bucket to the threadgroup shape
+// which ran fastest. They are kept in memory, and saved as text to autotune.txt
+// in the kernel cache directory (see mc_cache.h), so later processes start tuned.
+
+#ifndef MC_TUNE_H
+#define MC_TUNE_H
+
+#include <stdint.h>
+
+#include "mc_cache.h"
+
+typedef struct {
+    char fn_key[MC_CACHE_KEY_SIZE];
+    int64_t bucket[3];
+    int64_t group[3];
+} mc_tune_entry;
+
+// Bucket of a grid: each dimension rounded up to a power of two
+void mc_tune_bucket(const int64_t* grid, int64_t* bucket);
+// Returns 1 and the tuned shape in group if there is an entry
+int mc_tune_get(const char* fn_key, const int64_t* bucket, int64_t* group);
+// Add or replace an entry, and save
+void mc_tune_put(const char* fn_key, const int64_t* bucket, const int64_t* group);
+// Entries for a function, or all entries if fn_key is NULL. *entries must be freed.
+int64_t mc_tune_list(const char* fn_key, mc_tune_entry** entries);
+// Remove all entries, in memory and on disk
+void mc_tune_clear(void);
+
+#endif
@@ -8,8 +8,24 @@ Python extension to use Metal for compute
 
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
+#include <structmember.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "metalcompute.h"
+#include "mc_cache.h"
+#include "mc_compile.h"
+#include "mc_convert.h"
+#include "mc_copy.h"
+#include "mc_notify.h"
+#include "mc_tune.h"
 
 // Value symbols are shared with Swift, so declared extern in shared header and defined here
 
@@ -40,11 +56,27 @@ const RetCode CouldNotMakeBuffer = -1003;
 const RetCode BufferNotFound = -1004;
 const RetCode RunNotFound = -1005;
 const RetCode DeviceBuffersAllocated = -1006;
+const RetCode InvalidDispatch = -1007;
+const RetCode CannotWrapMemory = -1008;
+const RetCode StreamNotFound = -1009;
+const RetCode EventNotFound = -1010;
 
 // Python level errors
 const RetCode FirstArgumentNotDevice = -2000;
 const RetCode FirstArgumentNotKernel = -2001;
 const RetCode CountNotGiven = -2002;
+const RetCode FirstArgumentNotFunction = -2003;
+const RetCode FunctionNotOnDevice = -2004;
+const RetCode NothingToRun = -2005;
+const RetCode InvalidBufferView = -2006;
+
+// Buffers can start part way into an allocation (views, file windows) at multiples
+// of the largest alignment of a Metal type, so any argument type can be bound there.
+#define MC_VIEW_ALIGNMENT 16
+
+// Largest length for a new buffer. The pools round lengths up to a size class,
+// which must still fit in an int64_t
+#define MC_BUFFER_MAX ((int64_t)1 << 62)
 
 // Buffer formats
 const long FormatUnknown = -1;
@@ -61,9 +93,58 @@ const long FormatF32 = 9;
 const long FormatF64 = 10;
 
 
-static PyObject *MetalComputeError;
+// Per module state. Each interpreter which imports the module has its own types,
+// error and asyncio hooks, so it can be used from subinterpreters. What the
+// backends hold is shared by the whole process, and locked where it needs to be.
+typedef struct {
+    PyObject* error;
+    PyTypeObject* DeviceInfo;
+    PyTypeObject* DeviceType;
+    PyTypeObject* KernelType;
+    PyTypeObject* KernelFutureType;
+    PyTypeObject* FunctionType;
+    PyTypeObject* BoundFunctionType;
+    PyTypeObject* BufferType;
+    PyTypeObject* ConstantType;
+    PyTypeObject* RunType;
+    PyTypeObject* CommandListType;
+    PyTypeObject* EventType;
+    PyTypeObject* CommandStreamType;
+    PyTypeObject* StreamType;
+    PyTypeObject* DeviceGroupType;
+    PyTypeObject* GroupKernelType;
+    PyTypeObject* GroupFunctionType;
+    PyObject* tune_timer_fn;
+    PyObject* async_loops; // loop -> [fd, [(run or kernel future, future), ...]]
+    PyObject* async_ready_fn;
+    PyObject* async_get_running_loop;
+} mc_state;
+
+// State of the module which made an object's type. The types cannot be
+// subclassed, so this is always the module's own.
+static mc_state* obj_state(void* obj)
+{
+    return (mc_state*)PyType_GetModuleState(Py_TYPE((PyObject*)obj));
+}
+
+// Types behave like the static types they replaced, and cannot be changed
+#ifdef Py_TPFLAGS_IMMUTABLETYPE
+#define MC_TYPE_FLAGS (Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE)
+#else
+#define MC_TYPE_FLAGS Py_TPFLAGS_DEFAULT
+#endif
+
+// Fields of an object changed after creation are updated in critical sections,
+// which lock the object on free-threaded builds. With the GIL they are blocks.
+#ifndef Py_BEGIN_CRITICAL_SECTION
+#define Py_BEGIN_CRITICAL_SECTION(op) {
+#define Py_END_CRITICAL_SECTION() }
+#endif
+
+static atomic_llong bytes_copied = 0;  // Into buffers from python objects, reported by stats
+static atomic_llong bytes_wrapped = 0; // Of python objects used in place
 
-RetCode mc_err(RetCode ret) {
+RetCode mc_err(mc_state* state, RetCode ret) {
     // Map error codes to exception with string
     if (ret != Success) {
         const char* errString = "Unknown error";
@@ -93,32 +174,71 @@ RetCode mc_err(RetCode ret) {
             case BufferNotFound: errString = "Buffer not found"; break;
             case RunNotFound: errString = "Run not found"; break;
             case DeviceBuffersAllocated: errString = "Device closed while buffers still allocated"; break;
+            case InvalidDispatch: errString = "Invalid grid, threadgroup size or threadgroup memory"; break;
+            case CannotWrapMemory: errString = "Memory cannot be used in place: it must be writable, contiguous, page aligned and whole pages"; break;
+            case StreamNotFound: errString = "Stream not found"; break;
+            case EventNotFound: errString = "Event not found"; break;
             // Python level errors
             case FirstArgumentNotDevice: errString = "First argument should be a metalcompute.Device object"; break;
             case FirstArgumentNotKernel: errString = "First argument should be a metalcompute.Kernel object"; break;
-            case CountNotGiven: errString = "First argument should be an integer kernel count"; break;
+            case CountNotGiven: errString = "First argument should be an integer kernel count or grid shape tuple"; break;
+            case FirstArgumentNotFunction: errString = "First argument should be a metalcompute.Function object"; break;
+            case FunctionNotOnDevice: errString = "Function was compiled for a different device"; break;
+            case NothingToRun: errString = "Command list is empty"; break;
+            case InvalidBufferView: errString = "Buffer view is out of range, or its offset is not aligned"; break;
             // C level errors below
         }
 
         if (ret == FailedToCompile) {
             char* compileErrString = mc_sw_get_compile_error(); 
-            PyErr_SetString(MetalComputeError, compileErrString);
+            PyErr_SetString(state->error, compileErrString);
             free(compileErrString);
         } else {
-            PyErr_SetString(MetalComputeError, errString);
+            PyErr_SetString(state->error, errString);
         }
 
     }
     return ret;
 }
 
+// mc_err for a kernel open, raising the message of that compile rather than
+// the last one made by any thread
+static RetCode kern_err(mc_state* state, RetCode ret, mc_kern_handle* kern_handle)
+{
+    if (ret == FailedToCompile && kern_handle->error != NULL) {
+        PyErr_SetString(state->error, kern_handle->error);
+        free(kern_handle->error);
+        kern_handle->error = NULL;
+        return ret;
+    }
+    return mc_err(state, ret);
+}
+
+// The v0.1 functions use one device, program and set of buffers kept by the
+// backend for the whole process, so calls from any thread or interpreter take
+// turns. Taken with the GIL released, as the holder may be waiting for it.
+static pthread_mutex_t legacy_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void legacy_acquire(void)
+{
+    if (pthread_mutex_trylock(&legacy_lock) == 0)
+        return;
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&legacy_lock);
+    Py_END_ALLOW_THREADS
+}
+
 static PyObject *
 mc_py_1_init(PyObject *self, PyObject *args)
  {
+    mc_state* state = PyModule_GetState(self);
     uint64_t device_index = -1; // Default device
     PyArg_ParseTuple(args, "|L", &device_index); // Device is optional argument
 
-    if (mc_err(mc_sw_init(device_index)))
+    legacy_acquire();
+    RetCode ret = mc_sw_init(device_index);
+    pthread_mutex_unlock(&legacy_lock);
+    if (mc_err(state, ret))
         return NULL;
 
     Py_RETURN_NONE;
@@ -127,7 +247,11 @@ mc_py_1_init(PyObject *self, PyObject *args)
 static PyObject *
 mc_py_1_release(PyObject *self, PyObject *args)
 {
-    if (mc_err(mc_sw_release()))
+    mc_state* state = PyModule_GetState(self);
+    legacy_acquire();
+    RetCode ret = mc_sw_release();
+    pthread_mutex_unlock(&legacy_lock);
+    if (mc_err(state, ret))
         return NULL;
 
     Py_RETURN_NONE;
@@ -136,37 +260,81 @@ mc_py_1_release(PyObject *self, PyObject *args)
 static PyObject *
 mc_py_1_compile(PyObject *self, PyObject *args)
 {
+    mc_state* state = PyModule_GetState(self);
     const char *program;
     const char *functionName;
 
     if (!PyArg_ParseTuple(args, "ss", &program, &functionName))
         return NULL;
 
-    if (mc_err(mc_sw_compile(program, functionName)))
+    legacy_acquire();
+    RetCode ret = mc_err(state, mc_sw_compile(program, functionName)); // Before another compile replaces the message
+    pthread_mutex_unlock(&legacy_lock);
+    if (ret)
         return NULL;
 
     Py_RETURN_NONE;
 }
 
-int format_buf_to_mc(char* buf_format) {
+// Format of a python buffer's items, from its struct module format string.
+// Native or little endian only, which is what every device host is.
+int format_buf_to_mc(const char* buf_format) {
     if (buf_format == 0) {
         // NULL -> "B" -> uint8
         return FormatU8;
-    } else if (buf_format[0]=='f' && buf_format[1]==0) {
-        // OK "f" -> float32
-        return FormatF32;
-    } else if (buf_format[0]=='B' && buf_format[1]==0) {
-        // OK "B" -> uint8
-        return FormatU8;
-    } else {
-        // Unrecognized output format
+    }
+    size_t long_size = sizeof(long), size_size = sizeof(size_t);
+    if (buf_format[0] == '@') {
+        buf_format++;
+    } else if (buf_format[0] == '=' || buf_format[0] == '<') {
+        long_size = 4; // Standard sizes, which have no size_t
+        size_size = 0;
+        buf_format++;
+    }
+    if (buf_format[0] == 0 || buf_format[1] != 0) {
+        // Structures, or items with a repeat count
         return FormatUnknown;
     }
+    switch (buf_format[0]) {
+        case 'b': return FormatI8;
+        case 'B': return FormatU8;
+        case '?': return FormatU8; // bool, 0 or 1
+        case 'h': return FormatI16;
+        case 'H': return FormatU16;
+        case 'i': return FormatI32;
+        case 'I': return FormatU32;
+        case 'l': return long_size == 8 ? FormatI64 : FormatI32;
+        case 'L': return long_size == 8 ? FormatU64 : FormatU32;
+        case 'q': return FormatI64;
+        case 'Q': return FormatU64;
+        case 'n': return size_size == 8 ? FormatI64 : size_size == 4 ? FormatI32 : FormatUnknown;
+        case 'N': return size_size == 8 ? FormatU64 : size_size == 4 ? FormatU32 : FormatUnknown;
+        case 'e': return FormatF16;
+        case 'f': return FormatF32;
+        case 'd': return FormatF64;
+        default: return FormatUnknown; // Including big endian, complex and pointers
+    }
+}
+
+// Format named by a struct module format string argument, None for no conversion
+static int
+parse_format(const char* name, long* format)
+{
+    *format = FormatUnknown;
+    if (name == NULL)
+        return 0;
+    *format = format_buf_to_mc(name);
+    if (*format == FormatUnknown) {
+        PyErr_Format(PyExc_ValueError, "unsupported format '%s'", name);
+        return -1;
+    }
+    return 0;
 }
 
 static PyObject *
 mc_py_1_run(PyObject *self, PyObject *args)
 {
+    mc_state* state = PyModule_GetState(self);
     PyObject* input_object;
     PyObject* output_object;
     Py_buffer input;
@@ -178,13 +346,13 @@ mc_py_1_run(PyObject *self, PyObject *args)
 
     ret = PyObject_GetBuffer(input_object, &input, PyBUF_FORMAT|PyBUF_ND|PyBUF_C_CONTIGUOUS);
     if (ret != 0) {
-        mc_err(UnsupportedInputFormat);
+        mc_err(state, UnsupportedInputFormat);
         return NULL;
     }
 
     ret = PyObject_GetBuffer(output_object, &output, PyBUF_FORMAT|PyBUF_WRITEABLE|PyBUF_ND|PyBUF_C_CONTIGUOUS);
     if (ret != 0) {
-        mc_err(UnsupportedOutputFormat);
+        mc_err(state, UnsupportedOutputFormat);
         PyBuffer_Release(&input);
         return NULL;
     }
@@ -197,33 +365,26 @@ mc_py_1_run(PyObject *self, PyObject *args)
     int output_format = format_buf_to_mc(output.format);
     if (input_format == FormatUnknown) ret = UnsupportedInputFormat;
     if (output_format == FormatUnknown) ret = UnsupportedOutputFormat;
-    if (mc_err(ret)) {
+    if (mc_err(state, ret)) {
         PyBuffer_Release(&input);
         PyBuffer_Release(&output);
         return NULL;
     }
-    ret = mc_sw_alloc(icount, input.buf, input_format, ocount, output_format);
-    PyBuffer_Release(&input);
-    if (mc_err(ret)) {
-        PyBuffer_Release(&output);
-        return NULL;
-    }
-
-    // Run compute without lock
+    // The buffers must not change between the copy in and the copy out.
+    // Copy, compute and retrieve without the GIL
+    legacy_acquire();
     Py_BEGIN_ALLOW_THREADS
-    ret = mc_sw_run(kcount);
+    ret = mc_sw_alloc(icount, input.buf, input_format, ocount, output_format);
+    if (ret == Success)
+        ret = mc_sw_run(kcount);
+    if (ret == Success)
+        ret = mc_sw_retrieve(ocount, output.buf);
     Py_END_ALLOW_THREADS
-    
-    if (mc_err(ret)) {
-        PyBuffer_Release(&output);
-        return NULL;
-    }
-
-    // Retrieve result
-    ret = mc_sw_retrieve(ocount, output.buf);
+    pthread_mutex_unlock(&legacy_lock);
+    PyBuffer_Release(&input);
     PyBuffer_Release(&output);
 
-    if (mc_err(ret))
+    if (mc_err(state, ret))
         return NULL;
 
     Py_RETURN_NONE;
@@ -232,35 +393,37 @@ mc_py_1_run(PyObject *self, PyObject *args)
 static PyObject *
 mc_py_1_rerun(PyObject *self, PyObject *args)
 {
+    mc_state* state = PyModule_GetState(self);
     int kcount;
 
     if (!PyArg_ParseTuple(args, "i", &kcount))
         return NULL;
 
     int ret = 0;
-    // Run compute without lock
+    // Run compute without the GIL
+    legacy_acquire();
     Py_BEGIN_ALLOW_THREADS
     ret = mc_sw_run(kcount);
     Py_END_ALLOW_THREADS
-    
-    if (mc_err(ret)) {
+    pthread_mutex_unlock(&legacy_lock);
+
+    if (mc_err(state, ret)) {
         return NULL;
     }
 
     Py_RETURN_NONE;
 }
 
-static PyTypeObject *DeviceInfo;
-
 static PyObject *
 mc_py_2_get_devices(PyObject *self, PyObject *args)
  {
+    mc_state* state = PyModule_GetState(self);
     mc_devices devices;
-    if (mc_err(mc_sw_count_devs(&devices)))
+    if (mc_err(state, mc_sw_count_devs(&devices)))
         return NULL;
     PyObject *dev_result = PyTuple_New(devices.dev_count);
     for (int i=0; i<devices.dev_count; i++) {
-        PyObject* device_item = PyStructSequence_New(DeviceInfo);
+        PyObject* device_item = PyStructSequence_New(state->DeviceInfo);
         PyObject* name = PyUnicode_FromString(devices.devs[i].name);
         Py_INCREF(name);
         PyStructSequence_SetItem(device_item, 0, name);
@@ -281,6 +444,92 @@ mc_py_2_get_devices(PyObject *self, PyObject *args)
     return dev_result;
 }
 
+static PyObject *
+mc_py_2_stats(PyObject *self, PyObject *args)
+{
+    mc_state* state = PyModule_GetState(self);
+    mc_stats stats;
+    mc_cache_stats cache;
+    if (mc_err(state, mc_sw_get_stats(&stats)))
+        return NULL;
+    mc_cache_get_stats(&cache);
+    return Py_BuildValue("{s:L,s:L,s:L,s:L,s:L,s:L,s:L,s:i}",
+        "pipelines_created", (long long)stats.pipelines_created,
+        "kernel_cache_hits", (long long)cache.memory_hits,
+        "kernel_cache_disk_hits", (long long)cache.disk_hits,
+        "kernel_cache_misses", (long long)cache.misses,
+        "kernel_cache_evictions", (long long)cache.evictions,
+        "buffer_bytes_copied", (long long)atomic_load(&bytes_copied),
+        "buffer_bytes_wrapped", (long long)atomic_load(&bytes_wrapped),
+        "copy_threads_last", mc_copy_last_threads());
+}
+
+static PyObject *
+mc_py_2_copy_threads(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"threads", NULL};
+    int threads = -1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|i", kwlist, &threads))
+        return NULL;
+    if (threads < -1) { // -1, as when not given, leaves the setting unchanged
+        PyErr_SetString(PyExc_ValueError, "threads must be -1 (unchanged), 0 (default) or more");
+        return NULL;
+    }
+    return PyLong_FromLong(mc_copy_threads(threads));
+}
+
+static PyObject *
+mc_py_2_kernel_cache(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    // Change any given settings, then return them all with current usage
+    static char *kwlist[] = {"dir", "memory_limit", "disk_limit", "clear", NULL};
+    mc_state* state = PyModule_GetState(self);
+    PyObject* dir = NULL;
+    long long memory_limit = -1;
+    long long disk_limit = -1;
+    int clear = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$OLLp", kwlist, &dir, &memory_limit, &disk_limit, &clear))
+        return NULL;
+
+    if (dir == Py_None) {
+        mc_cache_set_dir(NULL);
+    } else if (dir != NULL) {
+        PyObject* path;
+        if (!PyUnicode_FSConverter(dir, &path))
+            return NULL;
+        mc_cache_set_dir(PyBytes_AS_STRING(path));
+        Py_DECREF(path);
+    }
+    mc_cache_set_limits(memory_limit, disk_limit);
+    if (memory_limit >= 0 || clear) {
+        if (mc_err(state, mc_sw_kern_cache_trim(clear ? 0 : mc_cache_memory_limit())))
+            return NULL;
+    }
+    if (clear)
+        mc_cache_clear_disk();
+
+    mc_cache_stats cache;
+    mc_cache_get_stats(&cache);
+    char* cache_dir = mc_cache_get_dir();
+    PyObject* dir_obj = Py_None;
+    if (cache_dir != NULL) {
+        dir_obj = PyUnicode_DecodeFSDefault(cache_dir);
+        free(cache_dir);
+        if (dir_obj == NULL)
+            return NULL;
+    } else {
+        Py_INCREF(dir_obj);
+    }
+    PyObject* info = Py_BuildValue("{s:N,s:L,s:L,s:L,s:L,s:L}",
+        "dir", dir_obj,
+        "memory_limit", (long long)mc_cache_memory_limit(),
+        "disk_limit", (long long)mc_cache_disk_limit(),
+        "memory_entries", (long long)cache.memory_entries,
+        "memory_bytes", (long long)cache.memory_bytes,
+        "disk_bytes", (long long)mc_cache_disk_usage());
+    return info;
+}
+
 typedef struct {
     PyObject_HEAD
     mc_dev_handle dev_handle;
@@ -290,22 +539,54 @@ typedef struct {
     PyObject_HEAD
     Device* dev_obj;
     mc_kern_handle kern_handle;
+    char source_key[MC_CACHE_KEY_SIZE]; // Identifies the program and device
 } Kernel;
 
+// Kernel being compiled in the background
+typedef struct {
+    PyObject_HEAD
+    Device* dev_obj;
+    mc_compile_job* job;
+    char source_key[MC_CACHE_KEY_SIZE];
+    PyObject* kernel; // Once compiled, or NULL
+} KernelFuture;
+
 typedef struct {
     PyObject_HEAD
+    vectorcallfunc vectorcall; // Calls make runs directly, without argument tuples
     Kernel* kern_obj;
     mc_fn_handle fn_handle;
+    bool autotune;
+    PyObject* tune_timer; // Called as timer(launch, threadgroup) for seconds. NULL for the default
+    char tune_key[MC_CACHE_KEY_SIZE]; // Tuning results are saved under this
 } Function;
 
-typedef struct {
+typedef struct Buffer {
     PyObject_HEAD
     Device* dev_obj;
     mc_buf_handle buf_handle;
     uint64_t length;
     uint64_t exports;
+    struct Buffer* parent; // Set for views, which share the parent's allocation
+    bool wrapped;          // Uses the memory of another object in place
+    Py_buffer source;      // Export of the wrapped object, held until the buffer is closed
+    char* mapping;         // File mapping backing the buffer, unmapped when closed
+    size_t mapping_length;
+    bool mapping_shared;   // Writes reach the file
 } Buffer;
 
+// How Buffer_init uses the memory of a python object
+#define MC_BUF_COPY 0         // Always copy
+#define MC_BUF_WRAP_OR_COPY 1 // In place if possible, else copy
+#define MC_BUF_WRAP 2         // In place, or fail
+
+// Bytes passed to a kernel inline, without a buffer
+typedef struct {
+    PyObject_VAR_HEAD     // Size is the length in bytes
+    mc_buf_handle buf_handle; // Id 0, pointing at data
+    char data[];
+} Constant;
+
 typedef struct {
     PyObject_HEAD
     Function* fn_obj;
@@ -313,13 +594,28 @@ typedef struct {
     mc_run_handle run_handle;
 } Run;
 
+typedef struct {
+    PyObject_HEAD
+    Device* dev_obj;
+    mc_event_handle event_handle;
+    uint64_t last; // Highest value given to signal, the default for wait
+} Event;
+
+typedef struct {
+    PyObject_HEAD
+    Device* dev_obj;
+    mc_stream_handle stream_handle;
+    Event* done; // Signalled and waited for by synchronize
+} CommandStream;
+
 static int
 Device_init(Device *self, PyObject *args, PyObject *kwds)
 {
+    mc_state* state = obj_state(self);
     uint64_t device_index = -1; // Default device
     PyArg_ParseTuple(args, "|L", &device_index); // Device is optional argument
 
-    if (mc_err(mc_sw_dev_open(device_index, &(self->dev_handle))))
+    if (mc_err(state, mc_sw_dev_open(device_index, &(self->dev_handle))))
         return -1;
 
     return 0;
@@ -332,7 +628,9 @@ Device_dealloc(Device *self)
         free(self->dev_handle.name); // Name string allocated by Swift on open
         mc_sw_dev_close(&(self->dev_handle));
     }
-    Py_TYPE(self)->tp_free((PyObject *) self);
+    PyTypeObject* tp = Py_TYPE(self);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
 }
 
 static PyObject *
@@ -341,80 +639,312 @@ Device_str(Device* self)
     return PyUnicode_FromFormat("metalcompute.Device(%s)", self->dev_handle.name);
 }
 
-static PyTypeObject KernelType; // Forward reference
-static PyTypeObject BufferType; // Forward reference
 
 static PyObject *
 Device_kernel(Device* self, PyObject* args, PyObject* kwargs)
 {
+    mc_state* state = obj_state(self);
     PyObject* first_arg;
 
     if (!PyArg_ParseTuple(args, "O", &first_arg))
         return NULL;
 
     PyObject *kernelArgList = Py_BuildValue("OO", self, first_arg);
-    PyObject *newKernelObj = PyObject_CallObject((PyObject *) &KernelType, kernelArgList);
+    PyObject *newKernelObj = PyObject_CallObject((PyObject *) state->KernelType, kernelArgList);
     Py_DECREF(kernelArgList);
     return newKernelObj;
 }
 
+static PyObject *
+Device_kernel_async(Device* self, PyObject* args, PyObject* kwargs)
+{
+    mc_state* state = obj_state(self);
+    const char* program;
+
+    if (!PyArg_ParseTuple(args, "s", &program))
+        return NULL;
+
+    KernelFuture* future = (KernelFuture*)state->KernelFutureType->tp_alloc(state->KernelFutureType, 0);
+    if (future == NULL)
+        return NULL;
+    future->job = mc_compile_start(&(self->dev_handle), program);
+    if (future->job == NULL) {
+        Py_DECREF(future);
+        return PyErr_NoMemory();
+    }
+    future->dev_obj = self;
+    Py_INCREF(self); // Cannot close device while compiling
+    mc_cache_key("kernel", self->dev_handle.name, NULL, program, future->source_key);
+    return (PyObject*)future;
+}
+
 static PyObject *
 Device_buffer(Device* self, PyObject* args, PyObject* kwargs)
 {
+    static char *kwlist[] = {"obj", "format", "normalize", NULL};
+    mc_state* state = obj_state(self);
     PyObject* first_arg;
+    const char* format = NULL;
+    int normalize = 0;
 
-    if (!PyArg_ParseTuple(args, "O", &first_arg))
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|$zp", kwlist, &first_arg, &format, &normalize))
         return NULL;
 
-    PyObject *bufferArgList = Py_BuildValue("OO", self, first_arg);
-    PyObject *newBufferObj = PyObject_CallObject((PyObject *) &BufferType, bufferArgList);
+    PyObject *bufferArgList = Py_BuildValue("OOizi", self, first_arg, MC_BUF_COPY, format, normalize);
+    PyObject *newBufferObj = PyObject_CallObject((PyObject *) state->BufferType, bufferArgList);
     Py_DECREF(bufferArgList);
     return newBufferObj;
 }
 
+static PyObject *
+Device_wrap(Device* self, PyObject* args, PyObject* kwargs)
+{
+    static char *kwlist[] = {"obj", "copy", NULL};
+    mc_state* state = obj_state(self);
+    PyObject* obj;
+    int copy = 1;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|$p", kwlist, &obj, &copy))
+        return NULL;
+
+    PyObject *bufferArgList = Py_BuildValue("OOi", self, obj, copy ? MC_BUF_WRAP_OR_COPY : MC_BUF_WRAP);
+    PyObject *newBufferObj = PyObject_CallObject((PyObject *) state->BufferType, bufferArgList);
+    Py_DECREF(bufferArgList);
+    return newBufferObj;
+}
+
+static PyObject *
+Device_buffer_from_file(Device* self, PyObject* args, PyObject* kwargs)
+{
+    static char *kwlist[] = {"path", "offset", "length", "writable", "sequential", NULL};
+    mc_state* state = obj_state(self);
+    PyObject* path;
+    long long offset = 0;
+    PyObject* length_obj = Py_None;
+    int writable = 0;
+    int sequential = 1;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O&|LO$pp", kwlist, PyUnicode_FSConverter, &path,
+                                     &offset, &length_obj, &writable, &sequential))
+        return NULL;
+
+    int fd = open(PyBytes_AS_STRING(path), writable ? O_RDWR : O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, PyBytes_AS_STRING(path));
+        if (fd >= 0) close(fd);
+        Py_DECREF(path);
+        return NULL;
+    }
+    Py_DECREF(path);
+
+    long long length = st.st_size - offset;
+    if (length_obj != Py_None)
+        length = PyLong_AsLongLong(length_obj);
+    if ((length == -1 && PyErr_Occurred()) || offset < 0 || length <= 0 || offset > st.st_size - length) {
+        close(fd);
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_ValueError, "offset and length must give a non-empty range of the file");
+        return NULL;
+    }
+    // Map whole pages, placing the buffer at its offset within them.
+    // Pages past the end of the file are never touched.
+    long long page = sysconf(_SC_PAGESIZE);
+    long long start = offset - offset % page;
+    long long skip = offset - start;
+    if (skip % MC_VIEW_ALIGNMENT != 0) {
+        close(fd);
+        mc_err(state, InvalidBufferView);
+        return NULL;
+    }
+    size_t mapping_length = (size_t)((skip + length + page - 1) / page * page);
+    // Read-only files are mapped copy-on-write, so kernels writing to them cannot fault
+    char* mapping = mmap(NULL, mapping_length, PROT_READ | PROT_WRITE, writable ? MAP_SHARED : MAP_PRIVATE, fd, start);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return PyErr_SetFromErrno(PyExc_OSError);
+    if (sequential)
+        madvise(mapping, mapping_length, MADV_SEQUENTIAL); // More read ahead, pages dropped sooner
+
+    Buffer* buf = (Buffer*)state->BufferType->tp_alloc(state->BufferType, 0);
+    RetCode ret = buf ? mc_sw_buf_wrap(&(self->dev_handle), mapping, mapping_length, &(buf->buf_handle)) : Success;
+    if (buf == NULL || mc_err(state, ret)) {
+        Py_XDECREF(buf);
+        munmap(mapping, mapping_length);
+        return NULL;
+    }
+    buf->buf_handle.buf += skip;
+    buf->buf_handle.length = length;
+    buf->buf_handle.offset = skip;
+    buf->length = length;
+    buf->mapping = mapping;
+    buf->mapping_length = mapping_length;
+    buf->mapping_shared = writable;
+    buf->dev_obj = self;
+    Py_INCREF(self);
+    bytes_wrapped += length;
+    return (PyObject*)buf;
+}
+
+static PyObject *
+Device_working_set(Device* self, PyObject* Py_UNUSED(ignored))
+{
+    mc_state* state = obj_state(self);
+    int64_t recommended, allocated;
+    if (mc_err(state, mc_sw_dev_memory(&(self->dev_handle), &recommended, &allocated)))
+        return NULL;
+    return Py_BuildValue("{s:L,s:L,s:L}",
+        "recommended", (long long)recommended,
+        "allocated", (long long)allocated,
+        "headroom", (long long)(recommended > allocated ? recommended - allocated : 0));
+}
+
+static PyObject *
+Device_batch(Device* self, PyObject* Py_UNUSED(ignored))
+{
+    mc_state* state = obj_state(self);
+    PyObject *batchArgList = Py_BuildValue("(O)", self);
+    PyObject *newBatchObj = PyObject_CallObject((PyObject *) state->CommandListType, batchArgList);
+    Py_DECREF(batchArgList);
+    return newBatchObj;
+}
+
+static PyObject *
+Device_stream(Device* self, PyObject* args, PyObject* kwargs)
+{
+    static char *kwlist[] = {"priority", NULL};
+    mc_state* state = obj_state(self);
+    long long priority = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|L", kwlist, &priority))
+        return NULL;
+    PyObject *streamArgList = Py_BuildValue("(OL)", self, priority);
+    PyObject *newStreamObj = PyObject_CallObject((PyObject *) state->CommandStreamType, streamArgList);
+    Py_DECREF(streamArgList);
+    return newStreamObj;
+}
+
+static PyObject *
+Device_event(Device* self, PyObject* Py_UNUSED(ignored))
+{
+    mc_state* state = obj_state(self);
+    return PyObject_CallOneArg((PyObject *) state->EventType, (PyObject *) self);
+}
+
+static PyObject *
+Device_buffer_pool(Device* self, PyObject* args, PyObject* kwargs)
+{
+    // Change any given settings, then return them with the pool's counters
+    static char *kwlist[] = {"limit", "trim", NULL};
+    mc_state* state = obj_state(self);
+    long long limit = -1;
+    PyObject* trim = Py_False;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$LO", kwlist, &limit, &trim))
+        return NULL;
+    long long trim_to = -1;
+    if (trim == Py_True) {
+        trim_to = 0;
+    } else if (trim != Py_False && trim != Py_None) {
+        if (!PyLong_Check(trim)) {
+            PyErr_SetString(PyExc_TypeError, "trim must be a bool or a number of bytes to keep");
+            return NULL;
+        }
+        trim_to = PyLong_AsLongLong(trim); // Bytes to keep
+        if (trim_to == -1 && PyErr_Occurred())
+            return NULL;
+        if (trim_to < 0)
+            trim_to = 0;
+    }
+    mc_pool_stats stats;
+    if (mc_err(state, mc_sw_buf_pool(&(self->dev_handle), limit, trim_to, &stats)))
+        return NULL;
+    return Py_BuildValue("{s:L,s:L,s:L,s:L,s:L,s:L}",
+        "limit", (long long)stats.limit,
+        "cached_bytes", (long long)stats.cached_bytes,
+        "cached_buffers", (long long)stats.cached_buffers,
+        "hits", (long long)stats.hits,
+        "misses", (long long)stats.misses,
+        "evictions", (long long)stats.evictions);
+}
+
 static PyMethodDef Device_methods[] = {
     {"kernel", (PyCFunction) Device_kernel, METH_VARARGS,
      "Compile a kernel for this device"
     },
-    {"buffer", (PyCFunction) Device_buffer, METH_VARARGS,
-     "Create a buffer for this device"
+    {"kernel_async", (PyCFunction) Device_kernel_async, METH_VARARGS,
+     "Start compiling a kernel for this device in the background. Returns a KernelFuture"
+    },
+    {"buffer", (PyCFunction) Device_buffer, METH_VARARGS | METH_KEYWORDS,
+     "Create a buffer for this device: buffer(length or obj, format=None, normalize=False). "
+     "format converts obj's items as they are copied in"
+    },
+    {"wrap", (PyCFunction) Device_wrap, METH_VARARGS | METH_KEYWORDS,
+     "Buffer using an object's memory in place: wrap(obj, copy=True). Copies if that is not possible, or raises if copy=False"
+    },
+    {"buffer_from_file", (PyCFunction) Device_buffer_from_file, METH_VARARGS | METH_KEYWORDS,
+     "Buffer backed by a memory mapping of a file: buffer_from_file(path, offset=0, length=None, writable=False, sequential=True)"
+    },
+    {"working_set", (PyCFunction) Device_working_set, METH_NOARGS,
+     "Recommended working set size of the device, bytes allocated, and the headroom between them"
+    },
+    {"batch", (PyCFunction) Device_batch, METH_NOARGS,
+     "Create a command list to submit many function runs at once"
+    },
+    {"stream", (PyCFunction) Device_stream, METH_VARARGS | METH_KEYWORDS,
+     "Create a command stream, a further queue for runs: stream(priority=0)"
+    },
+    {"event", (PyCFunction) Device_event, METH_NOARGS,
+     "Create an event, for ordering work between streams"
+    },
+    {"buffer_pool", (PyCFunction) Device_buffer_pool, METH_VARARGS | METH_KEYWORDS,
+     "Configure the pool of recycled buffer memory: limit, trim. Returns settings and counters"
     },
     {NULL}  /* Sentinel */
 };
 
-static PyTypeObject DeviceType = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_name = "metalcompute.Device",
-    .tp_doc = "A Metal device which can be to allocated buffer, compile and run kernels",
-    .tp_basicsize = sizeof(Device),
-    .tp_itemsize = 0,
-    .tp_flags = Py_TPFLAGS_DEFAULT,
-    .tp_new = PyType_GenericNew,
-    .tp_init = (initproc) Device_init,
-    .tp_dealloc = (destructor) Device_dealloc,
-    .tp_str = (reprfunc) Device_str,
-    .tp_methods = Device_methods,
+static PyType_Slot Device_slots[] = {
+    {Py_tp_doc, "A Metal device which can be to allocated buffer, compile and run kernels"},
+    {Py_tp_new, PyType_GenericNew},
+    {Py_tp_init, Device_init},
+    {Py_tp_dealloc, Device_dealloc},
+    {Py_tp_str, Device_str},
+    {Py_tp_methods, Device_methods},
+    {0, NULL}
+};
+
+static PyType_Spec Device_spec = {
+    .name = "metalcompute.Device",
+    .basicsize = sizeof(Device),
+    .itemsize = 0,
+    .flags = MC_TYPE_FLAGS,
+    .slots = Device_slots,
 };
 
 static int
 Kernel_init(Kernel *self, PyObject *args, PyObject *kwds)
 {
     // Private - can only be called via device.kernel
+    mc_state* state = obj_state(self);
     PyObject* dev_obj;
     const char *program;
 
     if (!PyArg_ParseTuple(args, "Os", &dev_obj, &program))
         return -1;
 
-    if (dev_obj->ob_type != &DeviceType) {
-        mc_err(FirstArgumentNotDevice);
+    if (Py_TYPE(dev_obj) != state->DeviceType) {
+        mc_err(state, FirstArgumentNotDevice);
         return -1;
     }
 
     self->dev_obj = (Device*)dev_obj;
 
-    if (mc_err(mc_sw_kern_open(&(self->dev_obj->dev_handle), program, &(self->kern_handle))))
+    // Other threads run while compiling
+    RetCode ret;
+    Py_BEGIN_ALLOW_THREADS
+    ret = mc_sw_kern_open(&(self->dev_obj->dev_handle), program, &(self->kern_handle));
+    Py_END_ALLOW_THREADS
+    if (kern_err(state, ret, &(self->kern_handle)))
         return -1;
+    mc_cache_key("kernel", self->dev_obj->dev_handle.name, NULL, program, self->source_key);
 
     Py_INCREF(dev_obj); // Cannot close device while kernel open
 
@@ -428,7 +958,9 @@ Kernel_dealloc(Kernel *self)
         mc_sw_kern_close(&(self->dev_obj->dev_handle), &(self->kern_handle));
         Py_DECREF(self->dev_obj);
     }
-    Py_TYPE(self)->tp_free((PyObject *) self);
+    PyTypeObject* tp = Py_TYPE(self);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
 }
 
 static PyObject *
@@ -437,18 +969,18 @@ Kernel_str(Kernel* self)
     return PyUnicode_FromFormat("metalcompute.Kernel");
 }
 
-static PyTypeObject FunctionType; // Forward reference
 
 static PyObject *
 Kernel_function(Kernel* self, PyObject* args, PyObject* kwargs)
 {
+    mc_state* state = obj_state(self);
     PyObject* first_arg;
 
     if (!PyArg_ParseTuple(args, "O", &first_arg))
         return NULL;
 
     PyObject *functionArgList = Py_BuildValue("OO", self, first_arg);
-    PyObject *newFunctionObj = PyObject_CallObject((PyObject *) &FunctionType, functionArgList);
+    PyObject *newFunctionObj = PyObject_CallObject((PyObject *) state->FunctionType, functionArgList);
     Py_DECREF(functionArgList);
     return newFunctionObj;
 }
@@ -460,39 +992,49 @@ static PyMethodDef Kernel_methods[] = {
     {NULL}  /* Sentinel */
 };
 
-static PyTypeObject KernelType = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_name = "metalcompute.Kernel",
-    .tp_doc = "A Metal compute kernel with one or more functions",
-    .tp_basicsize = sizeof(Kernel),
-    .tp_itemsize = 0,
-    .tp_flags = Py_TPFLAGS_DEFAULT,
-    .tp_new = PyType_GenericNew,
-    .tp_init = (initproc) Kernel_init,
-    .tp_dealloc = (destructor) Kernel_dealloc,
-    .tp_str = (reprfunc) Kernel_str,
-    .tp_methods = Kernel_methods
+static PyType_Slot Kernel_slots[] = {
+    {Py_tp_doc, "A Metal compute kernel with one or more functions"},
+    {Py_tp_new, PyType_GenericNew},
+    {Py_tp_init, Kernel_init},
+    {Py_tp_dealloc, Kernel_dealloc},
+    {Py_tp_str, Kernel_str},
+    {Py_tp_methods, Kernel_methods},
+    {0, NULL}
+};
+
+static PyType_Spec Kernel_spec = {
+    .name = "metalcompute.Kernel",
+    .basicsize = sizeof(Kernel),
+    .itemsize = 0,
+    .flags = MC_TYPE_FLAGS,
+    .slots = Kernel_slots,
 };
 
+static PyObject *
+Function_vectorcall(Function* self, PyObject* const* args, size_t nargsf, PyObject* kwnames);
+
 static int
 Function_init(Function *self, PyObject *args, PyObject *kwds)
 {
     // Private - can only be called via kernel.function
+    mc_state* state = obj_state(self);
     PyObject* kern_obj;
     const char *func_name;
 
     if (!PyArg_ParseTuple(args, "Os", &kern_obj, &func_name))
         return -1;
 
-    if (!PyObject_TypeCheck(kern_obj, &KernelType)) {
-        mc_err(FirstArgumentNotKernel);
+    if (!PyObject_TypeCheck(kern_obj, state->KernelType)) {
+        mc_err(state, FirstArgumentNotKernel);
         return -1;
     }
 
     self->kern_obj = (Kernel*)kern_obj;
+    self->vectorcall = (vectorcallfunc)Function_vectorcall;
 
-    if (mc_err(mc_sw_fn_open(&(self->kern_obj->dev_obj->dev_handle), &(self->kern_obj->kern_handle), func_name, &(self->fn_handle))))
+    if (mc_err(state, mc_sw_fn_open(&(self->kern_obj->dev_obj->dev_handle), &(self->kern_obj->kern_handle), func_name, &(self->fn_handle))))
         return -1;
+    mc_cache_key("autotune", NULL, func_name, self->kern_obj->source_key, self->tune_key);
 
     Py_INCREF(kern_obj); // Cannot close kernel while function open
 
@@ -506,7 +1048,10 @@ Function_dealloc(Function *self)
         mc_sw_fn_close(&(self->kern_obj->dev_obj->dev_handle), &(self->kern_obj->kern_handle), &(self->fn_handle));
         Py_DECREF(self->kern_obj);
     }
-    Py_TYPE(self)->tp_free((PyObject *) self);
+    Py_XDECREF(self->tune_timer);
+    PyTypeObject* tp = Py_TYPE(self);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
 }
 
 static PyObject *
@@ -515,74 +1060,276 @@ Function_str(Function* self)
     return PyUnicode_FromFormat("metalcompute.Function");
 }
 
-static PyTypeObject RunType; // Forward reference
 
+static int run_open(Run* self, Function* fn_obj, PyObject* const* args, Py_ssize_t nargs,
+                    PyObject* threadgroup, PyObject* threadgroup_memory, PyObject* reads, PyObject* writes);
+
+// Keyword arguments of a vectorcall, by their position in names. values are NULL if not given
+static int parse_kwnames(PyObject* const* kwvalues, PyObject* kwnames, const char* const* names, int count,
+                         PyObject** values)
+{
+    for (int k = 0; k < count; k++)
+        values[k] = NULL;
+    for (Py_ssize_t i = 0; kwnames != NULL && i < PyTuple_GET_SIZE(kwnames); i++) {
+        PyObject* name = PyTuple_GET_ITEM(kwnames, i);
+        int k = 0;
+        while (k < count && PyUnicode_CompareWithASCIIString(name, names[k]) != 0)
+            k++;
+        if (k == count) {
+            PyErr_Format(PyExc_TypeError, "'%U' is an invalid keyword argument for this function", name);
+            return -1;
+        }
+        values[k] = kwvalues[i];
+    }
+    return 0;
+}
+
+static PyObject *
+Function_vectorcall(Function* self, PyObject* const* args, size_t nargsf, PyObject* kwnames)
+{
+    static const char* kwlist[] = {"threadgroup", "threadgroup_memory", "reads", "writes"};
+    mc_state* state = obj_state(self);
+    Py_ssize_t nargs = PyVectorcall_NARGS(nargsf);
+    PyObject* kw[4];
+    if (parse_kwnames(args + nargs, kwnames, kwlist, 4, kw))
+        return NULL;
+    Run* run = (Run*)state->RunType->tp_alloc(state->RunType, 0);
+    if (run == NULL)
+        return NULL;
+    if (run_open(run, self, args, nargs, kw[0], kw[1], kw[2], kw[3])) {
+        Py_DECREF(run); // Not opened, so nothing to wait for
+        return NULL;
+    }
+    return (PyObject*)run;
+}
+
+static PyObject *
+Function_stream(Function* self, PyObject *args, PyObject *kwargs)
+{
+    mc_state* state = obj_state(self);
+    PyObject* fn_args = PyTuple_Pack(1, self);
+    PyObject* stream_args = fn_args ? PySequence_Concat(fn_args, args) : NULL;
+    Py_XDECREF(fn_args);
+    if (stream_args == NULL)
+        return NULL;
+    PyObject* stream = PyObject_Call((PyObject*)state->StreamType, stream_args, kwargs);
+    Py_DECREF(stream_args);
+    return stream;
+}
+
+static PyObject *
+Function_autotune(Function* self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"enable", "timer", NULL};
+    int enable = 1;
+    PyObject* timer = Py_None;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|p$O", kwlist, &enable, &timer))
+        return NULL;
+    if (timer != Py_None && !PyCallable_Check(timer)) {
+        PyErr_SetString(PyExc_TypeError, "timer must be callable");
+        return NULL;
+    }
+    PyObject* old;
+    Py_BEGIN_CRITICAL_SECTION(self);
+    self->autotune = enable;
+    old = self->tune_timer;
+    self->tune_timer = NULL;
+    if (timer != Py_None) {
+        Py_INCREF(timer);
+        self->tune_timer = timer;
+    }
+    Py_END_CRITICAL_SECTION();
+    Py_XDECREF(old); // Outside, as freeing it may run arbitrary code
+    Py_RETURN_NONE;
+}
+
+// Tuned threadgroup shapes of the function, by grid size bucket
 static PyObject *
-Function_call(Function* self, PyObject *args, PyObject *kwargs) {
-    PyObject *runArgList = Py_BuildValue("OO", self, args);
-    PyObject *newRunObj = PyObject_CallObject((PyObject *) &RunType, runArgList);
-    Py_DECREF(runArgList);
-    return newRunObj;
+Function_get_tuned(Function* self, void* closure)
+{
+    mc_tune_entry* entries;
+    int64_t count = mc_tune_list(self->tune_key, &entries);
+    if (entries == NULL)
+        return PyErr_NoMemory();
+    PyObject* tuned = PyDict_New();
+    for (int64_t i = 0; tuned != NULL && i < count; i++) {
+        PyObject* bucket = Py_BuildValue("(LLL)", (long long)entries[i].bucket[0],
+                                         (long long)entries[i].bucket[1], (long long)entries[i].bucket[2]);
+        PyObject* group = Py_BuildValue("(LLL)", (long long)entries[i].group[0],
+                                        (long long)entries[i].group[1], (long long)entries[i].group[2]);
+        if (bucket == NULL || group == NULL || PyDict_SetItem(tuned, bucket, group))
+            Py_CLEAR(tuned);
+        Py_XDECREF(bucket);
+        Py_XDECREF(group);
+    }
+    free(entries);
+    return tuned;
 }
 
-static PyTypeObject FunctionType = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_name = "metalcompute.Function",
-    .tp_doc = "A Metal compute kernel function which can be run",
-    .tp_basicsize = sizeof(Function),
-    .tp_itemsize = 0,
-    .tp_flags = Py_TPFLAGS_DEFAULT,
-    .tp_new = PyType_GenericNew,
-    .tp_init = (initproc) Function_init,
-    .tp_dealloc = (destructor) Function_dealloc,
-    .tp_str = (reprfunc) Function_str,
-    .tp_call = (ternaryfunc) Function_call
+static PyObject* Function_bind(Function* self, PyObject *args, PyObject *kwargs);
+
+static PyMethodDef Function_methods[] = {
+    {"bind", (PyCFunction) Function_bind, METH_VARARGS | METH_KEYWORDS,
+     "Function with its arguments resolved once, for repeated runs: bind(buffer_0, ..., buffer_n, "
+     "threadgroup=None, threadgroup_memory=None, reads=None, writes=None)"},
+    {"stream", (PyCFunction) Function_stream, METH_VARARGS | METH_KEYWORDS,
+     "Run over each chunk of an iterable, several in flight, giving results in order: "
+     "stream(chunks, buffer_1, ..., buffer_n-1, out_size=None, count=None, depth=3, threadgroup=None, threadgroup_memory=None)"},
+    {"autotune", (PyCFunction) Function_autotune, METH_VARARGS | METH_KEYWORDS,
+     "Choose the threadgroup size of runs by timing candidates: autotune(enable=True, timer=None)"},
+    {NULL}  /* Sentinel */
+};
+
+static PyGetSetDef Function_getset[] = {
+    {"tuned", (getter) Function_get_tuned, NULL,
+     "Threadgroup shapes chosen by autotuning, by grid size bucket", NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyMemberDef Function_members[] = {
+    {"__vectorcalloffset__", T_PYSSIZET, offsetof(Function, vectorcall), READONLY},
+    {"thread_execution_width", T_LONGLONG, offsetof(Function, fn_handle.thread_execution_width), READONLY,
+     "SIMD width of the function's pipeline"},
+    {"max_total_threads_per_threadgroup", T_LONGLONG, offsetof(Function, fn_handle.max_total_threads_per_threadgroup), READONLY,
+     "Largest threadgroup the function's pipeline can run"},
+    {"threadgroup_size", T_LONGLONG, offsetof(Function, fn_handle.threadgroup_size), READONLY,
+     "Threadgroup size used when the function is run"},
+    {NULL}  /* Sentinel */
+};
+
+static PyType_Slot Function_slots[] = {
+    {Py_tp_doc, "A Metal compute kernel function which can be run"},
+    {Py_tp_new, PyType_GenericNew},
+    {Py_tp_init, Function_init},
+    {Py_tp_dealloc, Function_dealloc},
+    {Py_tp_str, Function_str},
+    {Py_tp_call, PyVectorcall_Call},
+    {Py_tp_methods, Function_methods},
+    {Py_tp_members, Function_members},
+    {Py_tp_getset, Function_getset},
+    {0, NULL}
+};
+
+static PyType_Spec Function_spec = {
+    .name = "metalcompute.Function",
+    .basicsize = sizeof(Function),
+    .itemsize = 0,
+    .flags = MC_TYPE_FLAGS | Py_TPFLAGS_HAVE_VECTORCALL,
+    .slots = Function_slots,
 };
 
 static int
 Buffer_init(Buffer *self, PyObject *args, PyObject *kwds)
 {
-    // Private - can only be called via device.buffer
+    // Private - can only be called via device.buffer, device.wrap or to_buffer
+    mc_state* state = obj_state(self);
     Device* dev_obj;
     PyObject* length_or_buffer;
+    int mode = MC_BUF_COPY;
+    const char* format_name = NULL;
+    int normalize = 0;
+    long format;
     Py_buffer buffer;
     int64_t length;
     char* src;
 
-    if (!PyArg_ParseTuple(args, "OO", &dev_obj, &length_or_buffer))
+    if (!PyArg_ParseTuple(args, "OO|izp", &dev_obj, &length_or_buffer, &mode, &format_name, &normalize))
         return -1;
+    if (parse_format(format_name, &format))
+        return -1;
+    if (normalize && format == FormatUnknown) {
+        PyErr_SetString(PyExc_ValueError, "normalize needs a format to convert to");
+        return -1;
+    }
 
-    if (!PyObject_TypeCheck(dev_obj, &DeviceType)) {
-        mc_err(FirstArgumentNotDevice);
+    if (!PyObject_TypeCheck(dev_obj, state->DeviceType)) {
+        mc_err(state, FirstArgumentNotDevice);
         return -1;
     }
 
+    // Use the object's memory in place if allowed. Kernels may write
+    // to it, so only writable exports qualify.
+    int possible_buffer = PyObject_CheckBuffer(length_or_buffer);
+    if (possible_buffer && mode != MC_BUF_COPY) {
+        if (!PyObject_GetBuffer(length_or_buffer, &(self->source), PyBUF_ND | PyBUF_WRITABLE)) {
+            RetCode ret = mc_sw_buf_wrap(&(dev_obj->dev_handle), self->source.buf, self->source.len, &(self->buf_handle));
+            if (ret == Success) {
+                bytes_wrapped += self->source.len;
+                self->wrapped = true;
+                length = self->source.len;
+                goto opened;
+            }
+            PyBuffer_Release(&(self->source));
+            if (ret != CannotWrapMemory) {
+                mc_err(state, ret);
+                return -1;
+            }
+        }
+        PyErr_Clear();
+        if (mode == MC_BUF_WRAP) {
+            mc_err(state, CannotWrapMemory);
+            return -1;
+        }
+    }
+
     // Is the argument an integer length?
 
     PyObject* as_long = PyNumber_Long(length_or_buffer);
-    int possible_buffer = PyObject_CheckBuffer(length_or_buffer);
     PyErr_Clear();
-    if (possible_buffer && !PyObject_GetBuffer(length_or_buffer, &buffer, PyBUF_ND)) {
+    if (possible_buffer && !PyObject_GetBuffer(length_or_buffer, &buffer, PyBUF_ND | PyBUF_FORMAT)) {
         length = buffer.len;
         src = buffer.buf;
-    } else if (as_long != NULL) {
+    } else if (as_long != NULL && format == FormatUnknown) {
         // Yes
         length = PyLong_AsLongLong(as_long);
         src = NULL;
     } else {
         // Nothing we can use
-        mc_err(UnsupportedInputFormat);
+        Py_XDECREF(as_long);
+        mc_err(state, UnsupportedInputFormat);
         return -1;
     }
-
-    if (mc_err(mc_sw_buf_open(&(dev_obj->dev_handle), length, src, &(self->buf_handle)))) {
+    Py_XDECREF(as_long);
+    if (src == NULL && (length < 0 || length > MC_BUFFER_MAX)) {
+        if (!PyErr_Occurred()) // Else too large for an int64_t
+            PyErr_Format(PyExc_ValueError, "buffer length must be 0 to %lld bytes", (long long)MC_BUFFER_MAX);
         return -1;
     }
 
+    RetCode ret;
+    if (format != FormatUnknown) {
+        // Items converted as they are copied in
+        long src_format = format_buf_to_mc(buffer.format);
+        int64_t count = buffer.len / buffer.itemsize;
+        length = count * mc_format_stride(format);
+        if (src_format == FormatUnknown) {
+            ret = UnsupportedInputFormat;
+        } else if (length >= MC_COPY_LARGE) {
+            Py_BEGIN_ALLOW_THREADS
+            ret = mc_sw_buf_convert(&(dev_obj->dev_handle), count, src, src_format, format,
+                                    normalize ? MC_CONVERT_NORMALIZE : 0, &(self->buf_handle));
+            Py_END_ALLOW_THREADS
+        } else {
+            ret = mc_sw_buf_convert(&(dev_obj->dev_handle), count, src, src_format, format,
+                                    normalize ? MC_CONVERT_NORMALIZE : 0, &(self->buf_handle));
+        }
+    } else if (src != NULL && length >= MC_COPY_LARGE) {
+        Py_BEGIN_ALLOW_THREADS
+        ret = mc_sw_buf_open(&(dev_obj->dev_handle), length, src, &(self->buf_handle));
+        Py_END_ALLOW_THREADS
+    } else {
+        ret = mc_sw_buf_open(&(dev_obj->dev_handle), length, src, &(self->buf_handle));
+    }
     if (src != NULL) {
         PyBuffer_Release(&buffer);
+        if (ret == Success)
+            bytes_copied += length;
+    }
+    if (mc_err(state, ret)) {
+        return -1;
     }
 
+opened:
     self->length = length;
     self->exports = 0;
     self->dev_obj = (Device*)dev_obj;
@@ -594,20 +1341,108 @@ Buffer_init(Buffer *self, PyObject *args, PyObject *kwds)
 static void
 Buffer_dealloc(Buffer *self)
 {   
-    if (self->buf_handle.id != 0) {
+    if (self->parent != NULL) {
+        Py_DECREF(self->parent); // The allocation is closed with its last view
+        Py_DECREF(self->dev_obj);
+    } else if (self->buf_handle.id != 0) {
         mc_sw_buf_close(&(self->dev_obj->dev_handle), &(self->buf_handle));
+        if (self->wrapped)
+            PyBuffer_Release(&(self->source)); // Only once the device is done with it
+        if (self->mapping != NULL)
+            munmap(self->mapping, self->mapping_length); // Shared writes stay in the page cache for the file
         Py_DECREF(self->dev_obj);
     }
-    Py_TYPE(self)->tp_free((PyObject *) self);
+    PyTypeObject* tp = Py_TYPE(self);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
+}
+
+static PyObject *
+buffer_view(Buffer* self, long long offset, long long length)
+{
+    mc_state* state = obj_state(self);
+    if (offset < 0 || length < 0 || offset > (long long)self->length
+        || length > (long long)self->length - offset
+        || (self->buf_handle.offset + offset) % MC_VIEW_ALIGNMENT != 0) {
+        mc_err(state, InvalidBufferView);
+        return NULL;
+    }
+    Buffer* root = self->parent ? self->parent : self;
+    Buffer* view = (Buffer*)state->BufferType->tp_alloc(state->BufferType, 0);
+    if (view == NULL)
+        return NULL;
+    view->buf_handle.id = self->buf_handle.id;
+    view->buf_handle.buf = self->buf_handle.buf + offset;
+    view->buf_handle.length = length;
+    view->buf_handle.offset = self->buf_handle.offset + offset;
+    view->length = length;
+    view->exports = 0;
+    view->parent = root;
+    Py_INCREF(root);
+    view->dev_obj = self->dev_obj;
+    Py_INCREF(self->dev_obj);
+    return (PyObject*)view;
+}
+
+static PyObject *
+Buffer_view(Buffer* self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"offset", "length", NULL};
+    long long offset;
+    PyObject* length_obj = Py_None;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "L|O", kwlist, &offset, &length_obj))
+        return NULL;
+    long long length = (long long)self->length - offset;
+    if (length_obj != Py_None) {
+        length = PyLong_AsLongLong(length_obj);
+        if (length == -1 && PyErr_Occurred())
+            return NULL;
+    }
+    return buffer_view(self, offset, length);
+}
+
+static Py_ssize_t
+Buffer_length(Buffer* self)
+{
+    return (Py_ssize_t)self->length;
+}
+
+static PyObject *
+Buffer_subscript(Buffer* self, PyObject* key)
+{
+    // Slices are views. Single bytes are read through memoryview
+    if (!PySlice_Check(key)) {
+        PyErr_SetString(PyExc_TypeError, "Buffer indices must be slices, use memoryview for items");
+        return NULL;
+    }
+    Py_ssize_t start, stop, step;
+    if (PySlice_Unpack(key, &start, &stop, &step) < 0)
+        return NULL;
+    if (step != 1) {
+        PyErr_SetString(PyExc_ValueError, "Buffer views must be contiguous");
+        return NULL;
+    }
+    Py_ssize_t length = PySlice_AdjustIndices((Py_ssize_t)self->length, &start, &stop, step);
+    return buffer_view(self, start, length);
 }
 
 static PyObject *
 Buffer_str(Buffer* self)
 {
+    if (self->parent != NULL)
+        return PyUnicode_FromFormat("metalcompute.Buffer(length=%lld, offset=%lld)",
+                                    self->length, (long long)self->buf_handle.offset);
     return PyUnicode_FromFormat("metalcompute.Buffer(length=%lld)",self->length);
 }
 
+static int access_wait_host(const mc_buf_handle* buf, bool write);
+
 int Buffer_getbuffer(Buffer *self, Py_buffer *view, int flags) {
+    // Host access sees the results of runs writing the buffer. The view is
+    // writable whatever flags asked for (memoryview never asks), so runs still
+    // to read the buffer must finish before the host can change it too
+    if (access_wait_host(&(self->buf_handle), true))
+        return -1;
     view->buf = self->buf_handle.buf;
     view->obj = (PyObject*)self;
     Py_INCREF(view->obj);
@@ -620,153 +1455,3562 @@ int Buffer_getbuffer(Buffer *self, Py_buffer *view, int flags) {
     view->shape = (Py_ssize_t*)&(self->length);
     view->strides = NULL;
     view->suboffsets = NULL;
+    Py_BEGIN_CRITICAL_SECTION(self);
     self->exports++;
+    Py_END_CRITICAL_SECTION();
 
     return 0;
 }
 
 int Buffer_releasebuffer(Buffer *self, Py_buffer *view, int flags) {
+    Py_BEGIN_CRITICAL_SECTION(self);
     self->exports--;
+    Py_END_CRITICAL_SECTION();
     return 0;
 }
 
-static PyBufferProcs BufferProcs = {
-    .bf_getbuffer = (getbufferproc) Buffer_getbuffer,
-    .bf_releasebuffer = (releasebufferproc) Buffer_releasebuffer
-};
-
-static PyTypeObject BufferType = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_name = "metalcompute.Buffer",
-    .tp_doc = "A Metal compute buffer",
-    .tp_basicsize = sizeof(Buffer),
-    .tp_itemsize = 0,
-    .tp_flags = Py_TPFLAGS_DEFAULT,
-    .tp_new = PyType_GenericNew,
-    .tp_init = (initproc) Buffer_init,
-    .tp_dealloc = (destructor) Buffer_dealloc,
-    .tp_str = (reprfunc) Buffer_str,
-    .tp_as_buffer = &BufferProcs,
-};
-
-int to_buffer(PyObject* possible_buffer, Device* dev, Buffer** buffer) {
-    // The input is either
-    // 1. Already a metalcompute Buffer*, if so give and return 0;
+// Page range of a file backed buffer (or a view of one), for madvise and msync
+static int buffer_pages(Buffer* self, PyObject* offset_obj, PyObject* length_obj, char** start, size_t* length)
+{
+    mc_state* state = obj_state(self);
+    Buffer* root = self->parent ? self->parent : self;
+    if (root->mapping == NULL) {
+        PyErr_SetString(PyExc_ValueError, "Buffer is not backed by a file");
+        return -1;
+    }
+    long long offset = offset_obj ? PyLong_AsLongLong(offset_obj) : 0;
+    long long count = length_obj && length_obj != Py_None ? PyLong_AsLongLong(length_obj) : (long long)self->length - offset;
+    if (PyErr_Occurred())
+        return -1;
+    if (offset < 0 || count < 0 || offset > (long long)self->length || count > (long long)self->length - offset) {
+        mc_err(state, InvalidBufferView);
+        return -1;
+    }
+    long long page = sysconf(_SC_PAGESIZE);
+    long long first = (self->buf_handle.offset + offset) / page * page;
+    long long end = self->buf_handle.offset + offset + count;
+    *start = root->mapping + first;
+    *length = (size_t)(end - first);
+    return 0;
+}
+
+static PyObject *
+Buffer_advise(Buffer* self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"advice", "offset", "length", NULL};
+    static const char* names[] = {"normal", "sequential", "random", "willneed", "dontneed", NULL};
+    static const int advice_values[] = {MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM, MADV_WILLNEED, MADV_DONTNEED};
+    const char* advice;
+    PyObject* offset_obj = NULL;
+    PyObject* length_obj = NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|OO", kwlist, &advice, &offset_obj, &length_obj))
+        return NULL;
+    int index = 0;
+    while (names[index] != NULL && strcmp(names[index], advice) != 0)
+        index++;
+    if (names[index] == NULL) {
+        PyErr_Format(PyExc_ValueError, "Unknown advice '%s'", advice);
+        return NULL;
+    }
+    char* start;
+    size_t length;
+    if (buffer_pages(self, offset_obj, length_obj, &start, &length))
+        return NULL;
+    if (length > 0 && madvise(start, length, advice_values[index]) != 0)
+        return PyErr_SetFromErrno(PyExc_OSError);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+Buffer_flush(Buffer* self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"offset", "length", NULL};
+    PyObject* offset_obj = NULL;
+    PyObject* length_obj = NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OO", kwlist, &offset_obj, &length_obj))
+        return NULL;
+    char* start;
+    size_t length;
+    if (buffer_pages(self, offset_obj, length_obj, &start, &length))
+        return NULL;
+    Buffer* root = self->parent ? self->parent : self;
+    if (!root->mapping_shared || length == 0)
+        Py_RETURN_NONE; // Private copy, nothing goes to the file
+    int failed;
+    Py_BEGIN_ALLOW_THREADS
+    failed = msync(start, length, MS_SYNC);
+    Py_END_ALLOW_THREADS
+    if (failed)
+        return PyErr_SetFromErrno(PyExc_OSError);
+    Py_RETURN_NONE;
+}
+
+// Copy between the buffer at offset and another object's memory, without the GIL.
+// Waits first for runs writing that part of the buffer, and when writing to it,
+// for those reading it as well. With a format, the buffer holds items in that
+// format, converted from or to the object's items. Returns the buffer bytes copied.
+static PyObject *
+buffer_copy(Buffer* self, PyObject *args, PyObject *kwargs, bool write)
+{
+    static char *kwlist[] = {"obj", "offset", "format", "normalize", NULL};
+    mc_state* state = obj_state(self);
+    PyObject* obj;
+    long long offset = 0;
+    const char* format_name = NULL;
+    int normalize = 0;
+    long format, other_format = FormatUnknown;
+    Py_buffer other;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|L$zp", kwlist, &obj, &offset, &format_name, &normalize))
+        return NULL;
+    if (parse_format(format_name, &format))
+        return NULL;
+    if (normalize && format == FormatUnknown) {
+        PyErr_SetString(PyExc_ValueError, "normalize needs a format to convert to");
+        return NULL;
+    }
+    if (PyObject_GetBuffer(obj, &other, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT | (write ? 0 : PyBUF_WRITABLE)))
+        return NULL;
+    Py_ssize_t length = other.len;
+    Py_ssize_t count = other.len / other.itemsize;
+    if (format != FormatUnknown) {
+        other_format = format_buf_to_mc(other.format);
+        if (other_format == FormatUnknown) {
+            mc_err(state, write ? UnsupportedInputFormat : UnsupportedOutputFormat);
+            PyBuffer_Release(&other);
+            return NULL;
+        }
+        length = count * mc_format_stride(format);
+    }
+    if (offset < 0 || offset > (long long)self->length || length > (long long)self->length - offset) {
+        PyErr_Format(PyExc_ValueError, "%zd bytes at offset %lld do not fit in a buffer of %lld bytes",
+                     length, offset, self->length);
+        PyBuffer_Release(&other);
+        return NULL;
+    }
+    mc_buf_handle range = self->buf_handle;
+    range.buf += offset;
+    range.offset += offset;
+    range.length = length;
+    if (access_wait_host(&range, write)) {
+        PyBuffer_Release(&other);
+        return NULL;
+    }
+    int flags = normalize ? MC_CONVERT_NORMALIZE : 0;
+    int failed = 0;
+    Py_BEGIN_ALLOW_THREADS
+    if (format == FormatUnknown)
+        mc_copy(write ? range.buf : other.buf, write ? other.buf : range.buf, length);
+    else if (write)
+        failed = mc_convert(range.buf, format, other.buf, other_format, count, flags);
+    else
+        failed = mc_convert(other.buf, other_format, range.buf, format, count, flags);
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&other);
+    if (failed) {
+        mc_err(state, write ? UnsupportedInputFormat : UnsupportedOutputFormat);
+        return NULL;
+    }
+    return PyLong_FromSsize_t(length);
+}
+
+static PyObject *
+Buffer_write_from(Buffer* self, PyObject *args, PyObject *kwargs)
+{
+    return buffer_copy(self, args, kwargs, true);
+}
+
+static PyObject *
+Buffer_read_into(Buffer* self, PyObject *args, PyObject *kwargs)
+{
+    return buffer_copy(self, args, kwargs, false);
+}
+
+static PyMethodDef Buffer_methods[] = {
+    {"write_from", (PyCFunction) Buffer_write_from, METH_VARARGS | METH_KEYWORDS,
+     "Copy all of an object's bytes into the buffer at offset, without the GIL: write_from(obj, offset=0, format=None, "
+     "normalize=False). format converts the object's items as they are copied. Returns the buffer bytes written"},
+    {"read_into", (PyCFunction) Buffer_read_into, METH_VARARGS | METH_KEYWORDS,
+     "Fill a writable object with the buffer's bytes from offset, without the GIL: read_into(obj, offset=0, format=None, "
+     "normalize=False). format is that of the buffer's items, converted to the object's. Returns the buffer bytes read"},
+    {"view", (PyCFunction) Buffer_view, METH_VARARGS | METH_KEYWORDS,
+     "View of part of the buffer, sharing its memory: view(offset, length=None). Offset must be 16 byte aligned"},
+    {"advise", (PyCFunction) Buffer_advise, METH_VARARGS | METH_KEYWORDS,
+     "Paging hint for a file backed buffer: advise('normal'|'sequential'|'random'|'willneed'|'dontneed', offset=0, length=None)"},
+    {"flush", (PyCFunction) Buffer_flush, METH_VARARGS | METH_KEYWORDS,
+     "Write changes to a writable file backed buffer back to the file: flush(offset=0, length=None)"},
+    {NULL}  /* Sentinel */
+};
+
+static PyMemberDef Buffer_members[] = {
+    {"offset", T_LONGLONG, offsetof(Buffer, buf_handle.offset), READONLY,
+     "Bytes from the start of the allocation, non-zero for views"},
+    {"parent", T_OBJECT, offsetof(Buffer, parent), READONLY,
+     "Buffer whose memory this view shares, or None"},
+    {NULL}  /* Sentinel */
+};
+
+static PyType_Slot Buffer_slots[] = {
+    {Py_tp_doc, "A Metal compute buffer"},
+    {Py_tp_new, PyType_GenericNew},
+    {Py_tp_init, Buffer_init},
+    {Py_tp_dealloc, Buffer_dealloc},
+    {Py_tp_str, Buffer_str},
+    {Py_bf_getbuffer, Buffer_getbuffer},
+    {Py_bf_releasebuffer, Buffer_releasebuffer},
+    {Py_mp_length, Buffer_length},
+    {Py_mp_subscript, Buffer_subscript},
+    {Py_tp_methods, Buffer_methods},
+    {Py_tp_members, Buffer_members},
+    {0, NULL}
+};
+
+static PyType_Spec Buffer_spec = {
+    .name = "metalcompute.Buffer",
+    .basicsize = sizeof(Buffer),
+    .itemsize = 0,
+    .flags = MC_TYPE_FLAGS,
+    .slots = Buffer_slots,
+};
+
+static PyObject* constant_new(mc_state* state, const void* data, Py_ssize_t length)
+{
+    if (length < 1 || length > MC_INLINE_MAX) {
+        PyErr_Format(PyExc_ValueError, "inline arguments must be 1 to %d bytes", MC_INLINE_MAX);
+        return NULL;
+    }
+    Constant* self = (Constant*)state->ConstantType->tp_alloc(state->ConstantType, length);
+    if (self == NULL)
+        return NULL;
+    memcpy(self->data, data, length);
+    self->buf_handle.id = 0;
+    self->buf_handle.buf = self->data;
+    self->buf_handle.length = length;
+    return (PyObject*)self;
+}
+
+static void
+Constant_dealloc(Constant *self)
+{
+    PyTypeObject* tp = Py_TYPE(self);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
+}
+
+static PyObject *
+Constant_str(Constant* self)
+{
+    return PyUnicode_FromFormat("metalcompute.Constant(length=%zd)", Py_SIZE(self));
+}
+
+static int
+Constant_getbuffer(Constant *self, Py_buffer *view, int flags)
+{
+    return PyBuffer_FillInfo(view, (PyObject*)self, self->data, Py_SIZE(self), 1, flags);
+}
+
+static Py_ssize_t
+Constant_length(Constant* self)
+{
+    return Py_SIZE(self);
+}
+
+static PyType_Slot Constant_slots[] = {
+    {Py_tp_doc, "Bytes passed to a kernel inline as a constant argument, made by f32, i32, u32 or bytes_arg"},
+    {Py_tp_dealloc, Constant_dealloc},
+    {Py_tp_str, Constant_str},
+    {Py_bf_getbuffer, Constant_getbuffer},
+    {Py_mp_length, Constant_length},
+    {0, NULL}
+};
+
+static PyType_Spec Constant_spec = {
+    .name = "metalcompute.Constant",
+    .basicsize = offsetof(Constant, data),
+    .itemsize = 1,
+    .flags = MC_TYPE_FLAGS,
+    .slots = Constant_slots,
+};
+
+// 32 bits of an int, accepted as signed or unsigned
+static int constant_int32(PyObject* obj, uint32_t* value)
+{
+    long long v = PyLong_AsLongLong(obj);
+    if (v == -1 && PyErr_Occurred())
+        return -1;
+    if (v < INT32_MIN || v > UINT32_MAX) {
+        PyErr_SetString(PyExc_OverflowError, "int arguments are passed as 32 bits, use bytes_arg for wider values");
+        return -1;
+    }
+    *value = (uint32_t)v;
+    return 0;
+}
+
+int to_buffer(PyObject* possible_buffer, Device* dev, Buffer** buffer) {
+    mc_state* state = obj_state(dev);
+    // The input is either
+    // 1. Already a metalcompute Buffer*, if so give and return 0;
     // 2. A python object which can expose a buffer
-    //    If so create and give a temporary metalcompute buffer with a copy of the data and return 0
+    //    If so create and give a temporary metalcompute buffer, wrapping the data in place
+    //    when it is suitably aligned and sized, else with a copy of the data, and return 0
     // 3. Something else. Return -1
-    if (possible_buffer->ob_type == &BufferType) {
+    if (Py_TYPE(possible_buffer) == state->BufferType) {
         *buffer = (Buffer*)possible_buffer;
         Py_INCREF(*buffer); // Take a new reference to the existing buffer
         return 0;
     }
 
-    // Create a new Buffer* and copy the data to it
-    PyObject *bufferArgList = Py_BuildValue("OO", dev, possible_buffer);
-    Buffer *newBufferObj = (Buffer*)PyObject_CallObject((PyObject *) &BufferType, bufferArgList);
-    Py_DECREF(bufferArgList);
+    // Create a new Buffer* using the data in place if possible, else with a copy
+    PyObject *bufferArgList = Py_BuildValue("OOi", dev, possible_buffer, MC_BUF_WRAP_OR_COPY);
+    Buffer *newBufferObj = (Buffer*)PyObject_CallObject((PyObject *) state->BufferType, bufferArgList);
+    Py_DECREF(bufferArgList);
+
+    if (newBufferObj != NULL) {
+        *buffer = newBufferObj;
+        return 0;
+    }
+
+    return -1; // Failed
+}
+
+// Argument index of a run of fn_obj, given as obj. Buffers and constants are used as
+// they are. Ints (as 32 bits) and floats (as f32) are passed inline, and so are objects
+// of up to MC_INLINE_MAX bytes where the function only reads. Else as for to_buffer.
+static int to_arg(PyObject* obj, Function* fn_obj, Py_ssize_t index, PyObject** arg)
+{
+    mc_state* state = obj_state(fn_obj);
+    bool written = index >= 64 || ((fn_obj->fn_handle.written_mask >> index) & 1);
+    if (index < 64 && written && ( // Past 64 the mask cannot tell, so only buffers are held back
+        Py_IS_TYPE(obj, state->ConstantType) || PyFloat_Check(obj) || PyLong_Check(obj))) {
+        // Inline bytes are the run's own copy, so the kernel's writes would be lost
+        PyErr_Format(PyExc_TypeError, "argument %zd is written by the kernel and must be a Buffer", index);
+        return -1;
+    }
+    if (Py_IS_TYPE(obj, state->BufferType) || Py_IS_TYPE(obj, state->ConstantType)) {
+        Py_INCREF(obj);
+        *arg = obj;
+        return 0;
+    }
+    if (PyFloat_Check(obj)) {
+        float value = (float)PyFloat_AS_DOUBLE(obj);
+        *arg = constant_new(state, &value, sizeof(value));
+        return *arg == NULL ? -1 : 0;
+    }
+    if (PyLong_Check(obj)) {
+        uint32_t value;
+        if (constant_int32(obj, &value))
+            return -1;
+        *arg = constant_new(state, &value, sizeof(value));
+        return *arg == NULL ? -1 : 0;
+    }
+    Py_buffer view;
+    if (!written && PyObject_CheckBuffer(obj)) {
+        if (!PyObject_GetBuffer(obj, &view, PyBUF_C_CONTIGUOUS)) {
+            bool small = view.len >= 1 && view.len <= MC_INLINE_MAX;
+            *arg = small ? constant_new(state, view.buf, view.len) : NULL;
+            PyBuffer_Release(&view);
+            if (small)
+                return *arg == NULL ? -1 : 0;
+        }
+        PyErr_Clear();
+    }
+    return to_buffer(obj, fn_obj->kern_obj->dev_obj, (Buffer**)arg);
+}
+
+static mc_buf_handle* arg_handle(mc_state* state, PyObject* arg)
+{
+    if (Py_IS_TYPE(arg, state->ConstantType))
+        return &(((Constant*)arg)->buf_handle);
+    return &(((Buffer*)arg)->buf_handle);
+}
+
+// Shape of 1 to 3 dimensions, given as an int or a tuple/list. Missing dimensions are 1.
+static int parse_shape(mc_state* state, PyObject* obj, int64_t* dims)
+{
+    dims[0] = dims[1] = dims[2] = 1;
+    if (PyLong_Check(obj)) {
+        dims[0] = PyLong_AsLongLong(obj);
+        return dims[0] == -1 && PyErr_Occurred() ? -1 : 0;
+    }
+    if (!PyTuple_Check(obj) && !PyList_Check(obj)) {
+        mc_err(state, InvalidDispatch);
+        return -1;
+    }
+    Py_ssize_t n = PySequence_Size(obj);
+    if (n < 1 || n > 3) {
+        mc_err(state, InvalidDispatch);
+        return -1;
+    }
+    for (Py_ssize_t i = 0; i < n; i++) {
+        PyObject* item = PySequence_GetItem(obj, i);
+        if (item == NULL)
+            return -1;
+        dims[i] = PyLong_AsLongLong(item);
+        Py_DECREF(item);
+        if (dims[i] == -1 && PyErr_Occurred())
+            return -1;
+    }
+    return 0;
+}
+
+// Dispatch shape of a run: the kernel count or grid shape, and the optional
+// threadgroup shape and threadgroup memory lengths (an int for index 0, or a sequence).
+// Sets run_handle->threadgroup_mem, which must be freed with PyMem_Free.
+static int parse_dispatch(mc_state* state, PyObject* grid, PyObject* threadgroup, PyObject* threadgroup_memory,
+                          mc_run_handle* run_handle)
+{
+    run_handle->threadgroup_mem_count = 0;
+    run_handle->threadgroup_mem = NULL;
+    for (int k = 0; k < 3; k++)
+        run_handle->grid[k] = run_handle->threadgroup[k] = 0;
+
+    if (PyLong_CheckExact(grid)) {
+        run_handle->kcount = PyLong_AsLongLong(grid);
+        if (run_handle->kcount == -1 && PyErr_Occurred())
+            return -1;
+    } else if (PyTuple_Check(grid) || PyList_Check(grid)) {
+        if (parse_shape(state, grid, run_handle->grid))
+            return -1;
+        run_handle->kcount = run_handle->grid[0] * run_handle->grid[1] * run_handle->grid[2];
+    } else if (PyNumber_Check(grid) == 1) {
+        PyObject* count = PyNumber_Long(grid);
+        if (count == NULL)
+            return -1;
+        run_handle->kcount = PyLong_AsLongLong(count);
+        Py_DECREF(count);
+        if (run_handle->kcount == -1 && PyErr_Occurred())
+            return -1;
+    } else {
+        mc_err(state, CountNotGiven);
+        return -1;
+    }
+
+    if (threadgroup != NULL && threadgroup != Py_None && parse_shape(state, threadgroup, run_handle->threadgroup))
+        return -1;
+
+    if (threadgroup_memory != NULL && threadgroup_memory != Py_None) {
+        PyObject* lengths = PyLong_Check(threadgroup_memory)
+            ? PyTuple_Pack(1, threadgroup_memory)
+            : PySequence_Fast(threadgroup_memory, "threadgroup_memory must be an int or a sequence of ints");
+        if (lengths == NULL)
+            return -1;
+        Py_ssize_t count = PySequence_Fast_GET_SIZE(lengths);
+        run_handle->threadgroup_mem = PyMem_Malloc((count ? count : 1) * sizeof(int64_t));
+        if (run_handle->threadgroup_mem == NULL) {
+            Py_DECREF(lengths);
+            PyErr_NoMemory();
+            return -1;
+        }
+        run_handle->threadgroup_mem_count = count;
+        for (Py_ssize_t i = 0; i < count; i++) {
+            run_handle->threadgroup_mem[i] = PyLong_AsLongLong(PySequence_Fast_GET_ITEM(lengths, i));
+            if (run_handle->threadgroup_mem[i] == -1 && PyErr_Occurred()) {
+                Py_DECREF(lengths);
+                return -1;
+            }
+        }
+        Py_DECREF(lengths);
+    }
+    return 0;
+}
+
+// Keyword arguments of a run: threadgroup, threadgroup_memory, reads and writes
+static int parse_dispatch_kwargs(PyObject* kwargs, PyObject** threadgroup, PyObject** threadgroup_memory,
+                                 PyObject** reads, PyObject** writes)
+{
+    static char *kwlist[] = {"threadgroup", "threadgroup_memory", "reads", "writes", NULL};
+    *threadgroup = *threadgroup_memory = *reads = *writes = NULL;
+    if (kwargs == NULL || kwargs == Py_None)
+        return 0;
+    PyObject* no_args = PyTuple_New(0);
+    if (no_args == NULL)
+        return -1;
+    int ok = PyArg_ParseTupleAndKeywords(no_args, kwargs, "|$OOOO", kwlist, threadgroup, threadgroup_memory,
+                                         reads, writes);
+    Py_DECREF(no_args);
+    return ok ? 0 : -1;
+}
+
+// Dependency tracking. The memory each run in flight uses is recorded, with
+// whether the run may write it. A new run waits for those which write memory
+// it uses, or use memory it writes, and may otherwise execute concurrently
+// with them. Entries are removed when runs are freed, and completed runs are
+// pruned as the table grows. Runs are kept by id, and ids of closed runs are
+// never found again, so they count as complete.
+//
+// Runs are opened with the GIL released, so other threads can submit while
+// one encodes. Entries are added before that under a negative placeholder id,
+// and given the run's id once it opens. A run which conflicts with one still
+// opening cannot name it as a dependency yet, so waits until it has an id.
+//
+// The table is shared by every interpreter, and on free-threaded builds is
+// used by threads in parallel, so it is guarded by access_lock. Finding a
+// run's dependencies and adding its entries happen under one hold, so that
+// two conflicting runs cannot both miss each other. Nothing done while it is
+// held takes the GIL or calls Python code.
+
+typedef struct {
+    const char* start;
+    const char* end;
+    int64_t run_id;
+    bool write;
+} mc_access;
+
+static mc_access* accesses = NULL;
+static Py_ssize_t access_count = 0;
+static Py_ssize_t access_size = 0;
+static Py_ssize_t access_pruned = 0; // Entries kept by the last prune
+static int64_t access_opening = 0; // Last placeholder id given out
+static pthread_mutex_t access_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct {
+    int64_t* ids;
+    Py_ssize_t count;
+    Py_ssize_t size;
+    int64_t first[8]; // Where ids starts, so that most runs allocate nothing
+} mc_deps;
+
+static void deps_init(mc_deps* deps)
+{
+    deps->ids = deps->first;
+    deps->count = 0;
+    deps->size = 8;
+}
+
+static void deps_free(mc_deps* deps)
+{
+    if (deps->ids != deps->first)
+        PyMem_Free(deps->ids);
+    deps_init(deps);
+}
+
+static int deps_add(mc_deps* deps, int64_t id)
+{
+    for (Py_ssize_t i = 0; i < deps->count; i++)
+        if (deps->ids[i] == id)
+            return 0;
+    if (deps->count == deps->size) {
+        Py_ssize_t size = deps->size * 2;
+        int64_t* grown = deps->ids == deps->first ? PyMem_Malloc(size * sizeof(int64_t))
+                                                  : PyMem_Realloc(deps->ids, size * sizeof(int64_t));
+        if (grown == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        if (deps->ids == deps->first)
+            memcpy(grown, deps->first, sizeof(deps->first));
+        deps->ids = grown;
+        deps->size = size;
+    }
+    deps->ids[deps->count++] = id;
+    return 0;
+}
+
+// Wait for a run by id. timeout as for mc_sw_run_wait
+static bool access_wait(int64_t run_id, double timeout)
+{
+    mc_run_handle handle = { .id = run_id };
+    const mc_run_handle* handles[1] = { &handle };
+    bool complete = true;
+    if (mc_sw_run_wait(1, handles, true, timeout, &complete) != Success)
+        return true; // Closed
+    return complete;
+}
+
+static void access_prune(void)
+{
+    Py_ssize_t kept = 0;
+    int64_t last_id = 0;
+    bool last_complete = false;
+    for (Py_ssize_t i = 0; i < access_count; i++) {
+        // A run's entries are together, so poll once for each
+        if (accesses[i].run_id != last_id) {
+            last_id = accesses[i].run_id;
+            last_complete = last_id > 0 && access_wait(last_id, 0);
+        }
+        if (!last_complete)
+            accesses[kept++] = accesses[i];
+    }
+    access_count = access_pruned = kept;
+}
+
+// Make room for more entries, so that adding them for a run cannot fail
+static int access_reserve(Py_ssize_t more)
+{
+    if (access_count > 64 && access_count > 2 * access_pruned)
+        access_prune();
+    if (access_count + more <= access_size)
+        return 0;
+    Py_ssize_t size = access_size ? access_size : 64;
+    while (size < access_count + more)
+        size *= 2;
+    mc_access* grown = PyMem_Realloc(accesses, size * sizeof(mc_access));
+    if (grown == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    accesses = grown;
+    access_size = size;
+    return 0;
+}
+
+// Add runs in flight which conflict with a use of buf to deps. access_lock is held
+static int access_conflicts(const mc_buf_handle* buf, bool write, mc_deps* deps)
+{
+    const char* start = buf->buf;
+    const char* end = start + buf->length;
+    for (Py_ssize_t i = 0; start != end && i < access_count; i++) {
+        const mc_access* a = &accesses[i];
+        if (!(a->start < end && start < a->end && (write || a->write)))
+            continue;
+        if (a->run_id < 0) {
+            // Still opening on another thread. Let it finish, then look again
+            pthread_mutex_unlock(&access_lock);
+            Py_BEGIN_ALLOW_THREADS
+            sched_yield();
+            Py_END_ALLOW_THREADS
+            pthread_mutex_lock(&access_lock);
+            i = -1;
+            continue;
+        }
+        if (deps_add(deps, a->run_id))
+            return -1;
+    }
+    return 0;
+}
+
+// Inline arguments are the run's own, so conflict with nothing
+static int access_deps(mc_buf_handle* const* bufs, Py_ssize_t count, const bool* written, mc_deps* deps)
+{
+    for (Py_ssize_t i = 0; i < count; i++)
+        if (bufs[i]->id != 0 && access_conflicts(bufs[i], written[i], deps))
+            return -1;
+    return 0;
+}
+
+static void access_add(int64_t run_id, const mc_buf_handle* buf, bool write)
+{
+    if (buf->id == 0 || buf->length == 0)
+        return;
+    mc_access* a = &accesses[access_count++];
+    a->start = buf->buf;
+    a->end = a->start + buf->length;
+    a->run_id = run_id;
+    a->write = write;
+}
+
+// Placeholder id for the entries of a run about to open
+static int64_t access_placeholder(void)
+{
+    if (--access_opening >= 0)
+        access_opening = -1;
+    return access_opening;
+}
+
+// Give entries added under a placeholder the id of the opened run
+static void access_opened(int64_t placeholder, int64_t run_id)
+{
+    pthread_mutex_lock(&access_lock);
+    for (Py_ssize_t i = 0; i < access_count; i++)
+        if (accesses[i].run_id == placeholder)
+            accesses[i].run_id = run_id;
+    pthread_mutex_unlock(&access_lock);
+}
+
+static void access_remove(int64_t run_id)
+{
+    pthread_mutex_lock(&access_lock);
+    Py_ssize_t kept = 0;
+    for (Py_ssize_t i = 0; i < access_count; i++)
+        if (accesses[i].run_id != run_id)
+            accesses[kept++] = accesses[i];
+    access_count = kept;
+    if (access_pruned > kept)
+        access_pruned = kept;
+    pthread_mutex_unlock(&access_lock);
+}
+
+// Wait, with the GIL released, for runs in flight which conflict with the host
+// using memory of buf: those writing it, and those reading it too if the host writes
+static int access_wait_host(const mc_buf_handle* buf, bool write)
+{
+    mc_deps runs;
+    deps_init(&runs);
+    pthread_mutex_lock(&access_lock);
+    int failed = access_conflicts(buf, write, &runs);
+    pthread_mutex_unlock(&access_lock);
+    if (failed) {
+        deps_free(&runs);
+        return -1;
+    }
+    if (runs.count > 0) {
+        Py_BEGIN_ALLOW_THREADS
+        for (Py_ssize_t i = 0; i < runs.count; i++)
+            access_wait(runs.ids[i], -1);
+        Py_END_ALLOW_THREADS
+    }
+    deps_free(&runs);
+    return 0;
+}
+
+// Set written[i] for each buffer a run may write. By default those the function
+// does not declare const. Listed in writes=, only those are written, and listed in
+// reads=, those are not. Items are buffer positions, or the objects passed.
+static int access_mark(PyObject* list, PyObject* const* passed, PyObject* tuple_bufs, bool write, bool* written)
+{
+    PyObject* items = PySequence_Fast(list, "reads and writes must be sequences of buffers or positions");
+    if (items == NULL)
+        return -1;
+    Py_ssize_t count = PyTuple_GET_SIZE(tuple_bufs);
+    for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(items); i++) {
+        PyObject* item = PySequence_Fast_GET_ITEM(items, i);
+        Py_ssize_t index = -1;
+        for (Py_ssize_t b = 0; b < count && index < 0; b++)
+            if (item == passed[b] || item == PyTuple_GET_ITEM(tuple_bufs, b))
+                index = b;
+        if (index < 0 && PyLong_Check(item)) {
+            index = PyLong_AsSsize_t(item);
+            if (index == -1 && PyErr_Occurred()) {
+                Py_DECREF(items);
+                return -1;
+            }
+            if (index < 0 || index >= count) {
+                Py_DECREF(items);
+                PyErr_Format(PyExc_IndexError, "buffer position %zd out of range", index);
+                return -1;
+            }
+        }
+        if (index < 0) {
+            Py_DECREF(items);
+            PyErr_SetString(PyExc_ValueError, "reads and writes items must be buffers of the run");
+            return -1;
+        }
+        written[index] = write;
+    }
+    Py_DECREF(items);
+    return 0;
+}
+
+// passed holds the objects given for each buffer, and tuple_bufs the Buffers used
+static int access_written(const Function* fn_obj, PyObject* const* passed, PyObject* tuple_bufs,
+                          PyObject* reads, PyObject* writes, bool* written)
+{
+    Py_ssize_t count = PyTuple_GET_SIZE(tuple_bufs);
+    bool explicit = writes != NULL && writes != Py_None;
+    for (Py_ssize_t i = 0; i < count; i++)
+        written[i] = !explicit && (i >= 64 || ((fn_obj->fn_handle.written_mask >> i) & 1));
+    if (explicit && access_mark(writes, passed, tuple_bufs, true, written))
+        return -1;
+    if (reads != NULL && reads != Py_None && access_mark(reads, passed, tuple_bufs, false, written))
+        return -1;
+    return 0;
+}
+
+static int autotune_run(Function* fn_obj, PyObject* grid, PyObject* threadgroup_memory,
+                        PyObject* tuple_bufs, mc_run_handle* run_handle);
+
+// Arguments of a run held on the stack while it opens. More are allocated
+#define MC_RUN_INLINE_ARGS 16
+
+// Submit a run of fn_obj on self, with its arguments already resolved: tuple_bufs
+// holds them, bufs their handles, and written says which it may write. The run takes
+// a reference to tuple_bufs. self->run_handle.stream is set by the caller for runs
+// on a stream, and self->run_handle.args for arguments the backend has resolved.
+static int run_submit(Run* self, Function* fn_obj, PyObject* grid, PyObject* threadgroup,
+                      PyObject* threadgroup_memory, PyObject* tuple_bufs, mc_buf_handle** bufs,
+                      const bool* written)
+{
+    mc_state* state = obj_state(self);
+    int64_t buffer_count = PyTuple_GET_SIZE(tuple_bufs);
+    self->run_handle.buf_count = buffer_count;
+    self->run_handle.bufs = bufs;
+
+    // Get count or grid
+    if (parse_dispatch(state, grid, threadgroup, threadgroup_memory, &(self->run_handle)))
+        goto fail;
+
+    if (fn_obj->autotune && (threadgroup == NULL || threadgroup == Py_None) && self->run_handle.kcount > 0
+        && autotune_run(fn_obj, grid, threadgroup_memory, tuple_bufs, &(self->run_handle)))
+        goto fail;
+
+    // Runs in flight which this one must wait for
+    mc_deps deps;
+    deps_init(&deps);
+    int64_t placeholder = 0;
+    pthread_mutex_lock(&access_lock);
+    int failed = access_deps(bufs, buffer_count, written, &deps) || access_reserve(buffer_count);
+    if (!failed) {
+        placeholder = access_placeholder();
+        for (int64_t i = 0; i < buffer_count; i++)
+            access_add(placeholder, bufs[i], written[i]);
+    }
+    pthread_mutex_unlock(&access_lock);
+    if (failed) {
+        deps_free(&deps);
+        goto fail;
+    }
+    self->run_handle.dep_count = deps.count;
+    self->run_handle.deps = deps.ids;
+
+    // Encode and commit while other threads run. tuple_bufs keeps the buffers alive
+    RetCode ret;
+    Py_BEGIN_ALLOW_THREADS
+    ret = mc_sw_run_open(
+        &(fn_obj->kern_obj->dev_obj->dev_handle),
+        &(fn_obj->kern_obj->kern_handle),
+        &(fn_obj->fn_handle),
+        &(self->run_handle));
+    Py_END_ALLOW_THREADS
+    self->run_handle.dep_count = 0;
+    self->run_handle.deps = NULL;
+    deps_free(&deps);
+    if (mc_err(state, ret)) {
+        access_remove(placeholder);
+        goto fail;
+    }
+    access_opened(placeholder, self->run_handle.id);
+    self->run_handle.bufs = NULL;
+    PyMem_Free(self->run_handle.threadgroup_mem);
+    self->run_handle.threadgroup_mem = NULL;
+
+    self->fn_obj = fn_obj;
+    Py_INCREF(fn_obj);
+    // Keep this so that we have reference to all argument objects
+    self->tuple_bufs = tuple_bufs;
+    Py_INCREF(tuple_bufs);
+
+    return 0;
+
+fail:
+    self->run_handle.bufs = NULL;
+    PyMem_Free(self->run_handle.threadgroup_mem);
+    self->run_handle.threadgroup_mem = NULL;
+    return -1;
+}
+
+// Open a run of fn_obj on self, which the caller has allocated. args[0] is the count
+// or grid, and the rest are the kernel's arguments. Keyword arguments are NULL if not
+// given.
+static int run_open(Run* self, Function* fn_obj, PyObject* const* args, Py_ssize_t nargs,
+                    PyObject* threadgroup, PyObject* threadgroup_memory, PyObject* reads, PyObject* writes)
+{
+    mc_state* state = obj_state(self);
+    Py_ssize_t buffer_count = nargs - 1;
+    if (buffer_count <= 0) {
+        mc_err(state, nargs < 1 ? CountNotGiven : BufferNotFound);
+        return -1;
+    }
+
+    // Pointers to buffers and what is written, on the stack for typical arity
+    mc_buf_handle* bufs_inline[MC_RUN_INLINE_ARGS];
+    bool written_inline[MC_RUN_INLINE_ARGS];
+    bool small = buffer_count <= MC_RUN_INLINE_ARGS;
+    mc_buf_handle** bufs = small ? bufs_inline : PyMem_Malloc(buffer_count * sizeof(mc_buf_handle*));
+    bool* written = small ? written_inline : PyMem_Malloc(buffer_count * sizeof(bool));
+    PyObject* tuple_bufs = PyTuple_New(buffer_count);
+    int failed = bufs == NULL || written == NULL || tuple_bufs == NULL;
+    if (failed && !PyErr_Occurred())
+        PyErr_NoMemory();
+    for (Py_ssize_t i = 0; !failed && i < buffer_count; i++) {
+        PyObject* buf;
+        failed = to_arg(args[i + 1], fn_obj, i, &buf);
+        if (!failed) {
+            // TODO: Should check here that the buffer is from the same Metal device
+            bufs[i] = arg_handle(state, buf);
+            PyTuple_SET_ITEM(tuple_bufs, i, buf);
+        }
+    }
+    failed = failed
+        || access_written(fn_obj, args + 1, tuple_bufs, reads, writes, written)
+        || run_submit(self, fn_obj, args[0], threadgroup, threadgroup_memory, tuple_bufs, bufs, written);
+    if (!small) {
+        PyMem_Free(bufs);
+        PyMem_Free(written);
+    }
+    Py_XDECREF(tuple_bufs);
+    return failed ? -1 : 0;
+}
+
+static int
+Run_init(Run *self, PyObject *args, PyObject *kwds)
+{
+    // Private - can only be called via function.run
+    Function* fn_obj;
+    PyObject* arg_tuple;
+    PyObject* run_kwargs = NULL;
+    PyObject* stream = NULL;
+    PyObject* threadgroup;
+    PyObject* threadgroup_memory;
+    PyObject* reads;
+    PyObject* writes;
+
+    if (!PyArg_ParseTuple(args, "OO!|OO", &fn_obj, &PyTuple_Type, &arg_tuple, &run_kwargs, &stream)) {
+        return -1;
+    }
+    // Reachable as type(run), so checked as for any caller
+    mc_state* state = obj_state(self);
+    if (!PyObject_TypeCheck((PyObject*)fn_obj, state->FunctionType)) {
+        mc_err(state, FirstArgumentNotFunction);
+        return -1;
+    }
+    if (stream != NULL && stream != Py_None) {
+        if (!PyObject_TypeCheck(stream, state->CommandStreamType)) {
+            PyErr_SetString(PyExc_TypeError, "stream must be a metalcompute.CommandStream");
+            return -1;
+        }
+        if (((CommandStream*)stream)->dev_obj != fn_obj->kern_obj->dev_obj) {
+            PyErr_SetString(PyExc_ValueError, "stream must be from the same device as the function");
+            return -1;
+        }
+        self->run_handle.stream = ((CommandStream*)stream)->stream_handle.id;
+    }
+    if (parse_dispatch_kwargs(run_kwargs, &threadgroup, &threadgroup_memory, &reads, &writes))
+        return -1;
+    return run_open(self, fn_obj, PySequence_Fast_ITEMS(arg_tuple), PyTuple_GET_SIZE(arg_tuple),
+                    threadgroup, threadgroup_memory, reads, writes);
+}
+
+static void
+Run_dealloc(Run *self)
+{
+    if (self->run_handle.id != 0) {
+        // Waits for completion, so let other threads run meanwhile
+        Py_BEGIN_ALLOW_THREADS
+        mc_sw_run_close(&(self->run_handle));
+        Py_END_ALLOW_THREADS
+        access_remove(self->run_handle.id);
+        Py_DECREF(self->tuple_bufs);
+        Py_XDECREF(self->fn_obj); // Not set for command lists
+    }
+    PyTypeObject* tp = Py_TYPE(self);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
+}
+
+static PyObject *
+Run_str(Run* self)
+{
+    return PyUnicode_FromFormat("metalcompute.Run");
+}
+
+// Timeout argument in seconds. None (or missing) waits without limit.
+static int parse_timeout(PyObject* obj, double* timeout)
+{
+    if (obj == NULL || obj == Py_None) {
+        *timeout = -1;
+        return 0;
+    }
+    double t = PyFloat_AsDouble(obj);
+    if (t == -1.0 && PyErr_Occurred())
+        return -1;
+    *timeout = t > 0 ? t : 0;
+    return 0;
+}
+
+// Wait for all or any of the runs, setting complete[i] for each.
+// Returns -1 with an exception set on failure.
+static int wait_runs(mc_state* state, Py_ssize_t count, Run** runs, bool all, double timeout, bool* complete)
+{
+    const mc_run_handle** handles = PyMem_Malloc((count ? count : 1) * sizeof(mc_run_handle*));
+    if (handles == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (Py_ssize_t i = 0; i < count; i++)
+        handles[i] = &(runs[i]->run_handle);
+    RetCode ret;
+    if (timeout == 0) {
+        ret = mc_sw_run_wait(count, handles, all, timeout, complete);
+    } else {
+        Py_BEGIN_ALLOW_THREADS
+        ret = mc_sw_run_wait(count, handles, all, timeout, complete);
+        Py_END_ALLOW_THREADS
+    }
+    PyMem_Free(handles);
+    return mc_err(state, ret) ? -1 : 0;
+}
+
+static PyObject *
+Run_wait(Run* self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"timeout", NULL};
+    PyObject* timeout_obj = NULL;
+    double timeout;
+    bool complete;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O", kwlist, &timeout_obj))
+        return NULL;
+    if (parse_timeout(timeout_obj, &timeout) || wait_runs(obj_state(self), 1, &self, true, timeout, &complete))
+        return NULL;
+    return PyBool_FromLong(complete);
+}
+
+static PyObject *
+Run_done(Run* self, PyObject *Py_UNUSED(ignored))
+{
+    bool complete;
+    if (wait_runs(obj_state(self), 1, &self, true, 0, &complete))
+        return NULL;
+    return PyBool_FromLong(complete);
+}
+
+// Autotuning. The first run of a function for each grid size bucket times a
+// set of candidate threadgroup shapes, and the fastest is used from then on.
+
+#define MC_TUNE_MAX_CANDIDATES 24
+#define MC_TUNE_REPEATS 3
+
+// Candidate shapes: powers of two from SIMD width to the pipeline's limit,
+// which do not overhang the grid bucket by more than one SIMD group
+static int tune_candidates(const mc_fn_handle* fn, const int64_t* bucket, int64_t (*out)[3])
+{
+    int64_t width = fn->thread_execution_width > 0 ? fn->thread_execution_width : 1;
+    int64_t first = width < 32 ? width : 32;
+    int64_t limit = fn->max_total_threads_per_threadgroup;
+    int count = 0;
+    for (int64_t total = first; total <= limit && count < MC_TUNE_MAX_CANDIDATES; total *= 2) {
+        if (bucket[1] == 1 && bucket[2] == 1) {
+            if (total <= (bucket[0] > first ? bucket[0] : first)) {
+                out[count][0] = total;
+                out[count][1] = out[count][2] = 1;
+                count++;
+            }
+            continue;
+        }
+        // Multi-dimensional grids spread each total across x and y
+        for (int64_t x = first; x <= total && count < MC_TUNE_MAX_CANDIDATES; x *= 2) {
+            int64_t y = total / x;
+            if (x > (bucket[0] > first ? bucket[0] : first) || y > bucket[1])
+                continue;
+            out[count][0] = x;
+            out[count][1] = y;
+            out[count][2] = 1;
+            count++;
+        }
+    }
+    if (count == 0) {
+        out[0][0] = fn->threadgroup_size;
+        out[0][1] = out[0][2] = 1;
+        count = 1;
+    }
+    return count;
+}
+
+// Run a candidate to completion. self is (function, args, kwargs)
+static PyObject *
+mc_py_2_tune_launch(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    PyObject* run = PyObject_Call(PyTuple_GET_ITEM(self, 0), PyTuple_GET_ITEM(self, 1), PyTuple_GET_ITEM(self, 2));
+    if (run == NULL)
+        return NULL;
+    bool complete;
+    int failed = wait_runs(obj_state(run), 1, (Run**)&run, true, -1, &complete);
+    Py_DECREF(run);
+    if (failed)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef tune_launch_def = {
+    "launch", (PyCFunction) mc_py_2_tune_launch, METH_NOARGS, "Run one autotuning candidate to completion"
+};
+
+static double monotonic_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// Default timer: best time of a few launches, after one to warm up
+static PyObject *
+mc_py_2_tune_timer(PyObject *self, PyObject *args)
+{
+    PyObject* launch;
+    PyObject* threadgroup;
+    if (!PyArg_ParseTuple(args, "OO", &launch, &threadgroup))
+        return NULL;
+    double best = -1;
+    for (int i = 0; i <= MC_TUNE_REPEATS; i++) {
+        double start = monotonic_seconds();
+        PyObject* ret = PyObject_CallObject(launch, NULL);
+        if (ret == NULL)
+            return NULL;
+        Py_DECREF(ret);
+        double elapsed = monotonic_seconds() - start;
+        if (i > 0 && (best < 0 || elapsed < best))
+            best = elapsed;
+    }
+    return PyFloat_FromDouble(best);
+}
+
+static PyMethodDef tune_timer_def = {
+    "autotune_timer", (PyCFunction) mc_py_2_tune_timer, METH_VARARGS,
+    "Default autotuning timer: autotune_timer(launch, threadgroup) returns seconds"
+};
+
+// Time one candidate shape, giving -1 if the shape cannot run the function
+static int tune_time(Function* fn_obj, PyObject* launch_args, PyObject* threadgroup_memory,
+                     const int64_t* group, double* seconds)
+{
+    mc_state* state = obj_state(fn_obj);
+    PyObject* timer;
+    Py_BEGIN_CRITICAL_SECTION(fn_obj); // Held, as autotune() may replace it meanwhile
+    timer = fn_obj->tune_timer ? fn_obj->tune_timer : state->tune_timer_fn;
+    Py_INCREF(timer);
+    Py_END_CRITICAL_SECTION();
+    PyObject* shape = Py_BuildValue("(LLL)", (long long)group[0], (long long)group[1], (long long)group[2]);
+    PyObject* kwargs = shape ? Py_BuildValue("{s:O,s:O}", "threadgroup", shape, "threadgroup_memory",
+                                             threadgroup_memory ? threadgroup_memory : Py_None) : NULL;
+    PyObject* bound = kwargs ? PyTuple_Pack(3, fn_obj, launch_args, kwargs) : NULL;
+    PyObject* launch = bound ? PyCFunction_New(&tune_launch_def, bound) : NULL;
+    PyObject* result = launch ? PyObject_CallFunctionObjArgs(timer, launch, shape, NULL) : NULL;
+    Py_XDECREF(launch);
+    Py_XDECREF(bound);
+    Py_XDECREF(kwargs);
+    Py_XDECREF(shape);
+    Py_DECREF(timer);
+    if (result == NULL) {
+        if (!PyErr_ExceptionMatches(state->error))
+            return -1;
+        PyErr_Clear(); // e.g. threadgroup memory does not fit
+        *seconds = -1;
+        return 0;
+    }
+    *seconds = PyFloat_AsDouble(result);
+    Py_DECREF(result);
+    return *seconds == -1 && PyErr_Occurred() ? -1 : 0;
+}
+
+// Threadgroup shape for an autotuned run: saved from an earlier tuning of the
+// function for grids of this size, or else found now by timing candidates
+static int autotune_run(Function* fn_obj, PyObject* grid, PyObject* threadgroup_memory,
+                        PyObject* tuple_bufs, mc_run_handle* run_handle)
+{
+    mc_state* state = obj_state(fn_obj);
+    int64_t dims[3] = { run_handle->kcount, 1, 1 };
+    int64_t bucket[3];
+    if (run_handle->grid[0] != 0 || run_handle->grid[1] != 0 || run_handle->grid[2] != 0)
+        memcpy(dims, run_handle->grid, sizeof(dims));
+    mc_tune_bucket(dims, bucket);
+    if (mc_tune_get(fn_obj->tune_key, bucket, run_handle->threadgroup))
+        return 0;
+
+    int64_t candidates[MC_TUNE_MAX_CANDIDATES][3];
+    int count = tune_candidates(&(fn_obj->fn_handle), bucket, candidates);
+
+    // Candidates run on copies of the buffers, so the run itself still happens exactly once
+    Py_ssize_t buf_count = PyTuple_GET_SIZE(tuple_bufs);
+    PyObject* launch_args = PyTuple_New(buf_count + 1);
+    if (launch_args == NULL)
+        return -1;
+    Py_INCREF(grid);
+    PyTuple_SET_ITEM(launch_args, 0, grid);
+    for (Py_ssize_t i = 0; i < buf_count; i++) {
+        PyObject* copy = PyTuple_GET_ITEM(tuple_bufs, i);
+        if (Py_IS_TYPE(copy, state->ConstantType))
+            Py_INCREF(copy); // Never written, so shared
+        else
+            copy = PyObject_CallFunction((PyObject *) state->BufferType, "OO", fn_obj->kern_obj->dev_obj, copy);
+        if (copy == NULL) {
+            Py_DECREF(launch_args);
+            return -1;
+        }
+        PyTuple_SET_ITEM(launch_args, i + 1, copy);
+    }
+
+    int best = -1;
+    double best_seconds = 0;
+    for (int c = 0; c < count; c++) {
+        double seconds;
+        if (tune_time(fn_obj, launch_args, threadgroup_memory, candidates[c], &seconds)) {
+            Py_DECREF(launch_args);
+            return -1;
+        }
+        if (seconds >= 0 && (best < 0 || seconds < best_seconds)) {
+            best = c;
+            best_seconds = seconds;
+        }
+    }
+    Py_DECREF(launch_args);
+    if (best < 0)
+        return 0; // Nothing ran, so leave the default for the run to report
+    mc_tune_put(fn_obj->tune_key, bucket, candidates[best]);
+    memcpy(run_handle->threadgroup, candidates[best], sizeof(run_handle->threadgroup));
+    return 0;
+}
+
+static PyObject *
+mc_py_2_autotune_results(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    // All saved tuning results, as {(function key, grid bucket): threadgroup}
+    static char *kwlist[] = {"clear", NULL};
+    int clear = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$p", kwlist, &clear))
+        return NULL;
+    if (clear)
+        mc_tune_clear();
+
+    mc_tune_entry* entries;
+    int64_t count = mc_tune_list(NULL, &entries);
+    if (entries == NULL)
+        return PyErr_NoMemory();
+    PyObject* results = PyDict_New();
+    for (int64_t i = 0; results != NULL && i < count; i++) {
+        PyObject* key = Py_BuildValue("(s(LLL))", entries[i].fn_key, (long long)entries[i].bucket[0],
+                                      (long long)entries[i].bucket[1], (long long)entries[i].bucket[2]);
+        PyObject* group = Py_BuildValue("(LLL)", (long long)entries[i].group[0],
+                                        (long long)entries[i].group[1], (long long)entries[i].group[2]);
+        if (key == NULL || group == NULL || PyDict_SetItem(results, key, group))
+            Py_CLEAR(results);
+        Py_XDECREF(key);
+        Py_XDECREF(group);
+    }
+    free(entries);
+    return results;
+}
+
+// asyncio support. Each event loop with runs outstanding watches its own
+// notification fd, and when it becomes readable resolves the futures of the
+// runs which completed. No thread is needed per run. Only the thread running
+// a loop uses its entry, so entries need no further locking. Kernel futures
+// are awaited the same way, as background compiles also signal the fd.
+
+static PyObject* kernel_future_get(KernelFuture* self);
+
+// Resolve the future of a completed run with the run, or of a compile with
+// its kernel or compile error
+static int async_resolve(mc_state* state, PyObject* obj, PyObject* fut)
+{
+    PyObject* ret;
+    if (Py_TYPE(obj) != state->KernelFutureType) {
+        ret = PyObject_CallMethod(fut, "set_result", "O", obj);
+    } else {
+        PyObject* kernel = kernel_future_get((KernelFuture*)obj);
+        if (kernel != NULL) {
+            ret = PyObject_CallMethod(fut, "set_result", "O", kernel);
+            Py_DECREF(kernel);
+        } else {
+#if PY_VERSION_HEX >= 0x030C0000
+            PyObject* value = PyErr_GetRaisedException();
+#else // PyErr_Fetch is deprecated from 3.12
+            PyObject *type, *value, *traceback;
+            PyErr_Fetch(&type, &value, &traceback);
+            PyErr_NormalizeException(&type, &value, &traceback);
+            if (value != NULL && traceback != NULL) PyException_SetTraceback(value, traceback);
+            Py_XDECREF(type);
+            Py_XDECREF(traceback);
+#endif
+            ret = value ? PyObject_CallMethod(fut, "set_exception", "O", value) : NULL;
+            Py_XDECREF(value);
+        }
+    }
+    Py_XDECREF(ret);
+    return ret == NULL ? -1 : 0;
+}
+
+// Poll a run or kernel future without blocking
+static int async_poll(mc_state* state, PyObject* obj, bool* complete)
+{
+    if (Py_TYPE(obj) == state->KernelFutureType) {
+        *complete = mc_compile_wait(((KernelFuture*)obj)->job, 0);
+        return 0;
+    }
+    return wait_runs(state, 1, (Run**)&obj, true, 0, complete);
+}
+
+// Stop watching once a loop has nothing outstanding
+static int async_release(mc_state* state, PyObject* loop, PyObject* entry)
+{
+    if (PyList_GET_SIZE(PyList_GET_ITEM(entry, 1)) > 0)
+        return 0;
+    int fd = (int)PyLong_AsLong(PyList_GET_ITEM(entry, 0));
+    PyObject* ret = PyObject_CallMethod(loop, "remove_reader", "i", fd);
+    mc_notify_close(fd);
+    Py_XDECREF(ret);
+    if (PyDict_DelItem(state->async_loops, loop) || ret == NULL)
+        return -1;
+    return 0;
+}
+
+static PyObject *
+mc_py_2_async_ready(PyObject *self, PyObject *loop)
+{
+    mc_state* state = PyModule_GetState(self);
+    PyObject* entry = PyDict_GetItemWithError(state->async_loops, loop);
+    if (entry == NULL) {
+        if (PyErr_Occurred()) return NULL;
+        Py_RETURN_NONE;
+    }
+    Py_INCREF(entry);
+    // Drain first, so a completion after the poll below signals again
+    mc_notify_drain((int)PyLong_AsLong(PyList_GET_ITEM(entry, 0)));
+
+    PyObject* pending = PyList_GET_ITEM(entry, 1);
+    Py_ssize_t count = PyList_GET_SIZE(pending);
+    Run** runs = PyMem_Malloc((count ? count : 1) * sizeof(Run*));
+    bool* complete = PyMem_Malloc(count ? count : 1);
+    bool* runs_complete = PyMem_Malloc(count ? count : 1);
+    PyObject* remaining = PyList_New(0);
+    int failed = runs == NULL || complete == NULL || runs_complete == NULL || remaining == NULL;
+    if (!failed) {
+        // Runs are polled together, and kernel futures one by one
+        Py_ssize_t run_count = 0;
+        for (Py_ssize_t i = 0; i < count; i++) {
+            PyObject* obj = PyTuple_GET_ITEM(PyList_GET_ITEM(pending, i), 0);
+            if (Py_TYPE(obj) == state->KernelFutureType)
+                complete[i] = mc_compile_wait(((KernelFuture*)obj)->job, 0);
+            else
+                runs[run_count++] = (Run*)obj;
+        }
+        failed = wait_runs(state, run_count, runs, false, 0, runs_complete);
+        for (Py_ssize_t i = 0, r = 0; !failed && i < count; i++)
+            if (Py_TYPE(PyTuple_GET_ITEM(PyList_GET_ITEM(pending, i), 0)) != state->KernelFutureType)
+                complete[i] = runs_complete[r++];
+    }
+    for (Py_ssize_t i = 0; i < count && !failed; i++) {
+        PyObject* item = PyList_GET_ITEM(pending, i);
+        PyObject* fut = PyTuple_GET_ITEM(item, 1);
+        PyObject* fut_done = PyObject_CallMethod(fut, "done", NULL);
+        if (fut_done == NULL) {
+            failed = 1;
+            break;
+        }
+        int cancelled = PyObject_IsTrue(fut_done);
+        Py_DECREF(fut_done);
+        if (cancelled) continue; // Nobody waiting any more
+        if (complete[i])
+            failed = async_resolve(state, PyTuple_GET_ITEM(item, 0), fut);
+        else
+            failed = PyList_Append(remaining, item);
+    }
+    PyMem_Free(runs);
+    PyMem_Free(complete);
+    PyMem_Free(runs_complete);
+    if (!failed) {
+        PyList_SetItem(entry, 1, remaining); // Steals the reference
+        remaining = NULL;
+        failed = async_release(state, loop, entry);
+    }
+    Py_XDECREF(remaining);
+    Py_DECREF(entry);
+    if (failed)
+        return PyErr_Occurred() ? NULL : PyErr_NoMemory();
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef async_ready_def = {
+    "_async_ready", (PyCFunction) mc_py_2_async_ready, METH_O, "Resolve completed runs for an event loop"
+};
+
+// Awaiting a run or kernel future: an asyncio future resolved by the loop's watcher
+static PyObject *
+async_await(PyObject* self)
+{
+    mc_state* state = obj_state(self);
+    bool complete;
+    if (async_poll(state, self, &complete))
+        return NULL;
+    if (state->async_get_running_loop == NULL) {
+        PyObject* asyncio = PyImport_ImportModule("asyncio");
+        if (asyncio == NULL)
+            return NULL;
+        PyObject* get_running_loop = PyObject_GetAttrString(asyncio, "get_running_loop");
+        Py_DECREF(asyncio);
+        if (get_running_loop == NULL)
+            return NULL;
+        // Another thread may have got there first
+        Py_BEGIN_CRITICAL_SECTION(state->async_loops);
+        if (state->async_get_running_loop == NULL) {
+            state->async_get_running_loop = get_running_loop;
+            get_running_loop = NULL;
+        }
+        Py_END_CRITICAL_SECTION();
+        Py_XDECREF(get_running_loop);
+    }
+    PyObject* loop = PyObject_CallObject(state->async_get_running_loop, NULL);
+    if (loop == NULL)
+        return NULL;
+    PyObject* fut = PyObject_CallMethod(loop, "create_future", NULL);
+    if (fut == NULL) {
+        Py_DECREF(loop);
+        return NULL;
+    }
+
+    PyObject* entry = NULL;
+    int failed = 0;
+    if (!complete) {
+        entry = PyDict_GetItemWithError(state->async_loops, loop);
+        Py_XINCREF(entry);
+        if (entry == NULL && !PyErr_Occurred()) {
+            int fd = mc_notify_open();
+            if (fd < 0) {
+                PyErr_SetFromErrno(PyExc_OSError);
+            } else if ((entry = Py_BuildValue("[i[]]", fd)) == NULL) {
+                mc_notify_close(fd);
+            } else if (PyDict_SetItem(state->async_loops, loop, entry)) {
+                mc_notify_close(fd);
+                Py_CLEAR(entry);
+            } else {
+                PyObject* ret = PyObject_CallMethod(loop, "add_reader", "iOO", fd, state->async_ready_fn, loop);
+                if (ret == NULL) {
+                    PyDict_DelItem(state->async_loops, loop);
+                    mc_notify_close(fd);
+                    Py_CLEAR(entry);
+                }
+                Py_XDECREF(ret);
+            }
+        }
+        // Poll again now subscribed, so completion is either seen here or signalled later
+        failed = entry == NULL || async_poll(state, self, &complete);
+        if (!failed && !complete) {
+            PyObject* item = PyTuple_Pack(2, self, fut);
+            failed = item == NULL || PyList_Append(PyList_GET_ITEM(entry, 1), item);
+            Py_XDECREF(item);
+        }
+        if (!failed)
+            failed = async_release(state, loop, entry);
+        Py_XDECREF(entry);
+    }
+    if (!failed && complete)
+        failed = async_resolve(state, self, fut);
+    PyObject* result = failed ? NULL : PyObject_CallMethod(fut, "__await__", NULL);
+    Py_DECREF(fut);
+    Py_DECREF(loop);
+    return result;
+}
+
+static PyMethodDef Run_methods[] = {
+    {"wait", (PyCFunction) Run_wait, METH_VARARGS | METH_KEYWORDS,
+     "Block until the run completes, or timeout seconds pass. Returns True if completed"},
+    {"done", (PyCFunction) Run_done, METH_NOARGS,
+     "True if the run has completed"},
+    {NULL}  /* Sentinel */
+};
+
+static PyType_Slot Run_slots[] = {
+    {Py_tp_doc, "A Metal compute kernel function run"},
+    {Py_tp_new, PyType_GenericNew},
+    {Py_tp_init, Run_init},
+    {Py_tp_dealloc, Run_dealloc},
+    {Py_tp_str, Run_str},
+    {Py_tp_methods, Run_methods},
+    {Py_am_await, async_await},
+    {0, NULL}
+};
+
+static PyType_Spec Run_spec = {
+    .name = "metalcompute.Run",
+    .basicsize = sizeof(Run),
+    .itemsize = 0,
+    .flags = MC_TYPE_FLAGS,
+    .slots = Run_slots,
+};
+
+// The compiled kernel, made once. Raises the compile error if it failed
+static PyObject* kernel_future_get(KernelFuture* self)
+{
+    mc_state* state = obj_state(self);
+    if (self->kernel != NULL) {
+        Py_INCREF(self->kernel);
+        return self->kernel;
+    }
+    mc_kern_handle kern_handle = { 0, NULL };
+    if (kern_err(state, mc_compile_take(self->job, &kern_handle), &kern_handle))
+        return NULL;
+    Kernel* kernel = (Kernel*)state->KernelType->tp_alloc(state->KernelType, 0);
+    if (kernel == NULL) {
+        mc_sw_kern_close(&(self->dev_obj->dev_handle), &kern_handle);
+        return NULL;
+    }
+    kernel->dev_obj = self->dev_obj;
+    Py_INCREF(self->dev_obj);
+    kernel->kern_handle = kern_handle;
+    memcpy(kernel->source_key, self->source_key, sizeof(kernel->source_key));
+    self->kernel = (PyObject*)kernel;
+    Py_INCREF(self->kernel);
+    return self->kernel;
+}
+
+static PyObject *
+KernelFuture_done(KernelFuture* self, PyObject *Py_UNUSED(ignored))
+{
+    return PyBool_FromLong(mc_compile_wait(self->job, 0));
+}
+
+static PyObject *
+KernelFuture_wait(KernelFuture* self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"timeout", NULL};
+    PyObject* timeout_obj = NULL;
+    double timeout;
+    bool done;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O", kwlist, &timeout_obj) || parse_timeout(timeout_obj, &timeout))
+        return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    done = mc_compile_wait(self->job, timeout);
+    Py_END_ALLOW_THREADS
+    return PyBool_FromLong(done);
+}
+
+static PyObject *
+KernelFuture_result(KernelFuture* self, PyObject *args, PyObject *kwargs)
+{
+    PyObject* done = KernelFuture_wait(self, args, kwargs);
+    if (done == NULL)
+        return NULL;
+    int complete = done == Py_True;
+    Py_DECREF(done);
+    if (!complete) {
+        PyErr_SetString(PyExc_TimeoutError, "Kernel is still compiling");
+        return NULL;
+    }
+    return kernel_future_get(self);
+}
+
+static void
+KernelFuture_dealloc(KernelFuture *self)
+{
+    if (self->job != NULL) {
+        // The device stays open until the compile completes
+        Py_BEGIN_ALLOW_THREADS
+        mc_compile_free(self->job);
+        Py_END_ALLOW_THREADS
+    }
+    Py_XDECREF(self->kernel);
+    Py_XDECREF(self->dev_obj);
+    PyTypeObject* tp = Py_TYPE(self);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
+}
+
+static PyObject *
+KernelFuture_str(KernelFuture* self)
+{
+    return PyUnicode_FromFormat("metalcompute.KernelFuture(done=%s)",
+                                mc_compile_wait(self->job, 0) ? "True" : "False");
+}
+
+static PyMethodDef KernelFuture_methods[] = {
+    {"done", (PyCFunction) KernelFuture_done, METH_NOARGS,
+     "True if the compile has completed"},
+    {"wait", (PyCFunction) KernelFuture_wait, METH_VARARGS | METH_KEYWORDS,
+     "Block until the compile completes, or timeout seconds pass. Returns True if completed"},
+    {"result", (PyCFunction) KernelFuture_result, METH_VARARGS | METH_KEYWORDS,
+     "The compiled Kernel, waiting up to timeout seconds (default forever). Raises the compile error if it failed"},
+    {NULL}  /* Sentinel */
+};
+
+static PyType_Slot KernelFuture_slots[] = {
+    {Py_tp_doc, "A Metal compute kernel compiling in the background"},
+    {Py_tp_dealloc, KernelFuture_dealloc},
+    {Py_tp_str, KernelFuture_str},
+    {Py_tp_methods, KernelFuture_methods},
+    {Py_am_await, async_await},
+    {0, NULL}
+};
+
+static PyType_Spec KernelFuture_spec = {
+    .name = "metalcompute.KernelFuture",
+    .basicsize = sizeof(KernelFuture),
+    .itemsize = 0,
+    .flags = MC_TYPE_FLAGS,
+    .slots = KernelFuture_slots,
+};
+
+// Function with its arguments resolved, to run again and again with little work
+typedef struct {
+    PyObject_HEAD
+    vectorcallfunc vectorcall;
+    Function* fn_obj;
+    PyObject* tuple_bufs;        // Buffers and constants passed to every run
+    mc_buf_handle** bufs;        // Their handles
+    bool* written;               // Set for those runs may write
+    mc_args_handle args_handle;  // The same, resolved by the backend
+    PyObject* threadgroup;       // Defaults for runs, or NULL
+    PyObject* threadgroup_memory;
+} BoundFunction;
+
+static PyObject *
+bound_launch(BoundFunction* self, PyObject* const* args, Py_ssize_t nargs, PyObject* kwnames)
+{
+    static const char* kwlist[] = {"threadgroup", "threadgroup_memory"};
+    mc_state* state = obj_state(self);
+    PyObject* kw[2];
+    if (parse_kwnames(args + nargs, kwnames, kwlist, 2, kw))
+        return NULL;
+    if (nargs != 1) {
+        mc_err(state, CountNotGiven);
+        return NULL;
+    }
+    Run* run = (Run*)state->RunType->tp_alloc(state->RunType, 0);
+    if (run == NULL)
+        return NULL;
+    run->run_handle.args = self->args_handle.id;
+    if (run_submit(run, self->fn_obj, args[0], kw[0] ? kw[0] : self->threadgroup,
+                   kw[1] ? kw[1] : self->threadgroup_memory, self->tuple_bufs, self->bufs, self->written)) {
+        Py_DECREF(run); // Not opened, so nothing to wait for
+        return NULL;
+    }
+    return (PyObject*)run;
+}
+
+static PyObject *
+BoundFunction_vectorcall(BoundFunction* self, PyObject* const* args, size_t nargsf, PyObject* kwnames)
+{
+    return bound_launch(self, args, PyVectorcall_NARGS(nargsf), kwnames);
+}
+
+static PyObject*
+Function_bind(Function* self, PyObject *args, PyObject *kwargs)
+{
+    mc_state* state = obj_state(self);
+    PyObject* threadgroup;
+    PyObject* threadgroup_memory;
+    PyObject* reads;
+    PyObject* writes;
+    if (parse_dispatch_kwargs(kwargs, &threadgroup, &threadgroup_memory, &reads, &writes))
+        return NULL;
+    Py_ssize_t count = PyTuple_GET_SIZE(args);
+    if (count == 0) {
+        mc_err(state, BufferNotFound);
+        return NULL;
+    }
+    // Check the dispatch settings now, so errors are raised where they were given
+    mc_run_handle shape;
+    PyObject* one = PyLong_FromLong(1);
+    int invalid = one == NULL || parse_dispatch(state, one, threadgroup, threadgroup_memory, &shape);
+    Py_XDECREF(one);
+    if (one != NULL)
+        PyMem_Free(shape.threadgroup_mem);
+    if (invalid)
+        return NULL;
+
+    BoundFunction* bound = (BoundFunction*)state->BoundFunctionType->tp_alloc(state->BoundFunctionType, 0);
+    if (bound == NULL)
+        return NULL;
+    bound->vectorcall = (vectorcallfunc)BoundFunction_vectorcall;
+    bound->fn_obj = self;
+    Py_INCREF(self);
+    bound->threadgroup = threadgroup;
+    Py_XINCREF(threadgroup);
+    bound->threadgroup_memory = threadgroup_memory;
+    Py_XINCREF(threadgroup_memory);
+    bound->tuple_bufs = PyTuple_New(count);
+    bound->bufs = PyMem_Malloc(count * sizeof(mc_buf_handle*));
+    bound->written = PyMem_Malloc(count * sizeof(bool));
+    if (bound->tuple_bufs == NULL || bound->bufs == NULL || bound->written == NULL) {
+        if (!PyErr_Occurred()) PyErr_NoMemory();
+        Py_DECREF(bound);
+        return NULL;
+    }
+    for (Py_ssize_t i = 0; i < count; i++) {
+        PyObject* buf;
+        if (to_arg(PyTuple_GET_ITEM(args, i), self, i, &buf)) {
+            Py_DECREF(bound);
+            return NULL;
+        }
+        bound->bufs[i] = arg_handle(state, buf);
+        PyTuple_SET_ITEM(bound->tuple_bufs, i, buf);
+    }
+    if (access_written(self, PySequence_Fast_ITEMS(args), bound->tuple_bufs, reads, writes, bound->written)
+        || mc_err(state, mc_sw_args_open(&(self->kern_obj->dev_obj->dev_handle), count, bound->bufs,
+                                         &(bound->args_handle)))) {
+        Py_DECREF(bound);
+        return NULL;
+    }
+    return (PyObject*)bound;
+}
+
+static void
+BoundFunction_dealloc(BoundFunction *self)
+{
+    if (self->args_handle.id != 0)
+        mc_sw_args_close(&(self->fn_obj->kern_obj->dev_obj->dev_handle), &(self->args_handle));
+    Py_XDECREF(self->fn_obj);
+    Py_XDECREF(self->tuple_bufs);
+    Py_XDECREF(self->threadgroup);
+    Py_XDECREF(self->threadgroup_memory);
+    PyMem_Free(self->bufs);
+    PyMem_Free(self->written);
+    PyTypeObject* tp = Py_TYPE(self);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
+}
+
+static PyObject *
+BoundFunction_str(BoundFunction* self)
+{
+    return PyUnicode_FromFormat("metalcompute.BoundFunction(arguments=%zd)", PyTuple_GET_SIZE(self->tuple_bufs));
+}
+
+static PyMethodDef BoundFunction_methods[] = {
+    {"launch", (PyCFunction)(void(*)(void)) bound_launch, METH_FASTCALL | METH_KEYWORDS,
+     "Run over a count or grid, as calling does: launch(grid, threadgroup=None, threadgroup_memory=None)"},
+    {NULL}  /* Sentinel */
+};
+
+static PyMemberDef BoundFunction_members[] = {
+    {"__vectorcalloffset__", T_PYSSIZET, offsetof(BoundFunction, vectorcall), READONLY},
+    {"function", T_OBJECT, offsetof(BoundFunction, fn_obj), READONLY, "Function which is run"},
+    {"arguments", T_OBJECT, offsetof(BoundFunction, tuple_bufs), READONLY,
+     "Buffers and constants given to every run"},
+    {NULL}  /* Sentinel */
+};
+
+static PyType_Slot BoundFunction_slots[] = {
+    {Py_tp_doc, "A function with its arguments bound. Call with a count or grid to run it"},
+    {Py_tp_dealloc, BoundFunction_dealloc},
+    {Py_tp_str, BoundFunction_str},
+    {Py_tp_call, PyVectorcall_Call},
+    {Py_tp_methods, BoundFunction_methods},
+    {Py_tp_members, BoundFunction_members},
+    {0, NULL}
+};
+
+static PyType_Spec BoundFunction_spec = {
+    .name = "metalcompute.BoundFunction",
+    .basicsize = sizeof(BoundFunction),
+    .itemsize = 0,
+    .flags = MC_TYPE_FLAGS | Py_TPFLAGS_HAVE_VECTORCALL,
+    .slots = BoundFunction_slots,
+};
+
+// Wait for all or any of a sequence of runs
+static PyObject *
+mc_py_2_wait(PyObject *self, PyObject *args, PyObject *kwargs, bool all)
+{
+    mc_state* state = PyModule_GetState(self);
+    static char *kwlist[] = {"runs", "timeout", NULL};
+    PyObject* runs_obj;
+    PyObject* timeout_obj = NULL;
+    double timeout;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O", kwlist, &runs_obj, &timeout_obj))
+        return NULL;
+    if (parse_timeout(timeout_obj, &timeout))
+        return NULL;
+    PyObject* runs = PySequence_Fast(runs_obj, "runs must be an iterable of metalcompute.Run");
+    if (runs == NULL)
+        return NULL;
+    Py_ssize_t count = PySequence_Fast_GET_SIZE(runs);
+    PyObject** items = PySequence_Fast_ITEMS(runs);
+    for (Py_ssize_t i = 0; i < count; i++) {
+        if (!PyObject_TypeCheck(items[i], state->RunType)) {
+            PyErr_SetString(PyExc_TypeError, "runs must be an iterable of metalcompute.Run");
+            Py_DECREF(runs);
+            return NULL;
+        }
+    }
+    bool* complete = PyMem_Malloc(count ? count : 1);
+    if (complete == NULL) {
+        Py_DECREF(runs);
+        return PyErr_NoMemory();
+    }
+    PyObject* result = NULL;
+    if (!wait_runs(state, count, (Run**)items, all, timeout, complete)) {
+        if (all) {
+            Py_ssize_t i = 0;
+            while (i < count && complete[i]) i++;
+            result = PyBool_FromLong(i == count);
+        } else {
+            result = Py_None;
+            for (Py_ssize_t i = 0; i < count; i++) {
+                if (complete[i]) {
+                    result = items[i];
+                    break;
+                }
+            }
+            Py_INCREF(result);
+        }
+    }
+    PyMem_Free(complete);
+    Py_DECREF(runs);
+    return result;
+}
+
+static PyObject *
+mc_py_2_wait_all(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    return mc_py_2_wait(self, args, kwargs, true);
+}
+
+static PyObject *
+mc_py_2_wait_any(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    return mc_py_2_wait(self, args, kwargs, false);
+}
+
+// Command list. Records function runs, then submits them together
+// as one command buffer with a single completion.
+
+typedef struct {
+    PyObject_HEAD
+    Device* dev_obj;
+    PyObject* items; // List of (function, grid, buffers, threadgroup, threadgroup_memory, written) in submission order
+} CommandList;
+
+static int
+CommandList_init(CommandList *self, PyObject *args, PyObject *kwds)
+{
+    // Private - can only be called via device.batch
+    mc_state* state = obj_state(self);
+    PyObject* dev_obj;
+
+    if (!PyArg_ParseTuple(args, "O", &dev_obj))
+        return -1;
+
+    if (!PyObject_TypeCheck(dev_obj, state->DeviceType)) {
+        mc_err(state, FirstArgumentNotDevice);
+        return -1;
+    }
+
+    self->items = PyList_New(0);
+    if (self->items == NULL)
+        return -1;
+    self->dev_obj = (Device*)dev_obj;
+    Py_INCREF(dev_obj);
+
+    return 0;
+}
+
+static void
+CommandList_dealloc(CommandList *self)
+{
+    Py_XDECREF(self->items);
+    Py_XDECREF(self->dev_obj);
+    PyTypeObject* tp = Py_TYPE(self);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
+}
+
+static PyObject *
+CommandList_str(CommandList* self)
+{
+    return PyUnicode_FromFormat("metalcompute.CommandList(runs=%zd)", PyList_GET_SIZE(self->items));
+}
+
+static PyObject *
+CommandList_add(CommandList* self, PyObject *args, PyObject *kwargs)
+{
+    mc_state* state = obj_state(self);
+    PyObject* threadgroup;
+    PyObject* threadgroup_memory;
+    PyObject* reads;
+    PyObject* writes;
+    if (parse_dispatch_kwargs(kwargs, &threadgroup, &threadgroup_memory, &reads, &writes))
+        return NULL;
+
+    Py_ssize_t buffer_count = PyTuple_Size(args) - 2;
+    if (buffer_count < 0) {
+        mc_err(state, FirstArgumentNotFunction);
+        return NULL;
+    }
+    PyObject* fn_obj = PyTuple_GET_ITEM(args, 0);
+    if (!PyObject_TypeCheck(fn_obj, state->FunctionType)) {
+        mc_err(state, FirstArgumentNotFunction);
+        return NULL;
+    }
+    if (((Function*)fn_obj)->kern_obj->dev_obj != self->dev_obj) {
+        mc_err(state, FunctionNotOnDevice);
+        return NULL;
+    }
+    // Check the dispatch shape now, so errors are raised where the run was added
+    mc_run_handle shape;
+    PyObject* grid = PyTuple_GET_ITEM(args, 1);
+    int invalid = parse_dispatch(state, grid, threadgroup, threadgroup_memory, &shape);
+    PyMem_Free(shape.threadgroup_mem);
+    if (invalid)
+        return NULL;
+    PyObject* count = PyTuple_Check(grid) || PyList_Check(grid)
+        ? PySequence_Tuple(grid)
+        : PyLong_FromLongLong(shape.kcount);
+    if (count == NULL)
+        return NULL;
+    if (buffer_count == 0) {
+        Py_DECREF(count);
+        mc_err(state, BufferNotFound);
+        return NULL;
+    }
+
+    PyObject* tuple_bufs = PyTuple_New(buffer_count);
+    if (tuple_bufs == NULL) {
+        Py_DECREF(count);
+        return NULL;
+    }
+    for (Py_ssize_t i = 0; i < buffer_count; i++) {
+        PyObject* buf;
+        if (to_arg(PyTuple_GET_ITEM(args, i + 2), (Function*)fn_obj, i, &buf)) {
+            Py_DECREF(count);
+            Py_DECREF(tuple_bufs);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(tuple_bufs, i, buf);
+    }
+
+    // One byte per buffer, set if the run may write it
+    PyObject* written = PyBytes_FromStringAndSize(NULL, buffer_count);
+    if (written == NULL
+        || access_written((Function*)fn_obj, PySequence_Fast_ITEMS(args) + 2, tuple_bufs, reads, writes,
+                          (bool*)PyBytes_AS_STRING(written))) {
+        Py_XDECREF(written);
+        Py_DECREF(count);
+        Py_DECREF(tuple_bufs);
+        return NULL;
+    }
+
+    PyObject* item = PyTuple_Pack(6, fn_obj, count, tuple_bufs,
+                                  threadgroup ? threadgroup : Py_None,
+                                  threadgroup_memory ? threadgroup_memory : Py_None,
+                                  written);
+    Py_DECREF(count);
+    Py_DECREF(tuple_bufs);
+    Py_DECREF(written);
+    if (item == NULL || PyList_Append(self->items, item)) {
+        Py_XDECREF(item);
+        return NULL;
+    }
+    Py_DECREF(item);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+CommandList_commit(CommandList* self, PyObject *Py_UNUSED(ignored))
+{
+    mc_state* state = obj_state(self);
+    PyObject* snapshot = PyList_AsTuple(self->items); // Keeps everything used alive until completion
+    if (snapshot == NULL)
+        return NULL;
+    Py_ssize_t count = PyTuple_GET_SIZE(snapshot);
+    if (count == 0) {
+        Py_DECREF(snapshot);
+        mc_err(state, NothingToRun);
+        return NULL;
+    }
+    Py_ssize_t total_bufs = 0;
+    for (Py_ssize_t i = 0; i < count; i++)
+        total_bufs += PyTuple_GET_SIZE(PyTuple_GET_ITEM(PyTuple_GET_ITEM(snapshot, i), 2));
+
+    mc_dispatch* dispatches = PyMem_Malloc(count * sizeof(mc_dispatch));
+    mc_run_handle* run_handles = PyMem_Malloc(count * sizeof(mc_run_handle));
+    for (Py_ssize_t i = 0; run_handles != NULL && i < count; i++)
+        run_handles[i].threadgroup_mem = NULL;
+    mc_buf_handle** bufs = PyMem_Malloc(total_bufs * sizeof(mc_buf_handle*));
+    mc_deps deps;
+    deps_init(&deps);
+    Run* run = (Run*)state->RunType->tp_alloc(state->RunType, 0);
+    if (dispatches == NULL || run_handles == NULL || bufs == NULL || run == NULL) {
+        if (!PyErr_Occurred()) PyErr_NoMemory();
+        goto fail;
+    }
+
+    mc_buf_handle** next_buf = bufs;
+    for (Py_ssize_t i = 0; i < count; i++) {
+        PyObject* item = PyTuple_GET_ITEM(snapshot, i);
+        Function* fn_obj = (Function*)PyTuple_GET_ITEM(item, 0);
+        PyObject* tuple_bufs = PyTuple_GET_ITEM(item, 2);
+        run_handles[i].id = 0;
+        run_handles[i].args = 0;
+        if (parse_dispatch(state, PyTuple_GET_ITEM(item, 1), PyTuple_GET_ITEM(item, 3), PyTuple_GET_ITEM(item, 4),
+                           &run_handles[i]))
+            goto fail;
+        run_handles[i].buf_count = PyTuple_GET_SIZE(tuple_bufs);
+        run_handles[i].bufs = next_buf;
+        for (Py_ssize_t b = 0; b < run_handles[i].buf_count; b++)
+            *next_buf++ = arg_handle(state, PyTuple_GET_ITEM(tuple_bufs, b));
+        dispatches[i].kern_handle = &(fn_obj->kern_obj->kern_handle);
+        dispatches[i].fn_handle = &(fn_obj->fn_handle);
+        dispatches[i].run_handle = &run_handles[i];
+    }
+
+    // The batch waits for runs in flight which conflict with any of its runs
+    int64_t placeholder = 0;
+    pthread_mutex_lock(&access_lock);
+    int failed = 0;
+    for (Py_ssize_t i = 0; !failed && i < count; i++) {
+        PyObject* item = PyTuple_GET_ITEM(snapshot, i);
+        failed = access_deps(run_handles[i].bufs, run_handles[i].buf_count,
+                             (bool*)PyBytes_AS_STRING(PyTuple_GET_ITEM(item, 5)), &deps);
+    }
+    if (!failed)
+        failed = access_reserve(total_bufs);
+    if (!failed) {
+        placeholder = access_placeholder();
+        for (Py_ssize_t i = 0; i < count; i++) {
+            const bool* written = (bool*)PyBytes_AS_STRING(PyTuple_GET_ITEM(PyTuple_GET_ITEM(snapshot, i), 5));
+            for (Py_ssize_t b = 0; b < run_handles[i].buf_count; b++)
+                access_add(placeholder, run_handles[i].bufs[b], written[b]);
+        }
+    }
+    pthread_mutex_unlock(&access_lock);
+    if (failed)
+        goto fail;
+    run->run_handle.dep_count = deps.count;
+    run->run_handle.deps = deps.ids;
+
+    // The snapshot keeps everything alive while other threads run
+    RetCode ret;
+    Py_BEGIN_ALLOW_THREADS
+    ret = mc_sw_batch_open(&(self->dev_obj->dev_handle), count, dispatches, &(run->run_handle));
+    Py_END_ALLOW_THREADS
+    if (mc_err(state, ret)) {
+        access_remove(placeholder);
+        goto fail;
+    }
+    access_opened(placeholder, run->run_handle.id);
+    run->run_handle.dep_count = 0;
+    run->run_handle.deps = NULL;
+
+    run->tuple_bufs = snapshot;
+    deps_free(&deps);
+    for (Py_ssize_t i = 0; i < count; i++)
+        PyMem_Free(run_handles[i].threadgroup_mem);
+    PyMem_Free(dispatches);
+    PyMem_Free(run_handles);
+    PyMem_Free(bufs);
+    return (PyObject*)run;
+
+fail:
+    deps_free(&deps);
+    Py_XDECREF(snapshot);
+    Py_XDECREF(run); // Not opened, so nothing to wait for
+    if (run_handles != NULL)
+        for (Py_ssize_t i = 0; i < count; i++)
+            PyMem_Free(run_handles[i].threadgroup_mem);
+    PyMem_Free(dispatches);
+    PyMem_Free(run_handles);
+    PyMem_Free(bufs);
+    return NULL;
+}
+
+static PyObject *
+CommandList_enter(CommandList* self, PyObject *Py_UNUSED(ignored))
+{
+    Py_INCREF(self);
+    return (PyObject*)self;
+}
+
+static PyObject *
+CommandList_exit(CommandList* self, PyObject *args)
+{
+    // Submit and wait for the recorded runs, unless the block raised
+    if (PyTuple_Size(args) > 0 && PyTuple_GET_ITEM(args, 0) != Py_None)
+        Py_RETURN_FALSE;
+    if (PyList_GET_SIZE(self->items) == 0)
+        Py_RETURN_FALSE;
+    PyObject* run = CommandList_commit(self, NULL);
+    if (run == NULL)
+        return NULL;
+    Py_DECREF(run); // Blocks until complete, with the GIL released
+    Py_RETURN_FALSE;
+}
+
+static PyMethodDef CommandList_methods[] = {
+    {"add", (PyCFunction) CommandList_add, METH_VARARGS | METH_KEYWORDS,
+     "Record a run of a function: add(function, count or grid, buffer_0, ..., buffer_n, threadgroup=None, threadgroup_memory=None)"},
+    {"commit", (PyCFunction) CommandList_commit, METH_NOARGS,
+     "Submit the recorded runs in order, as one command buffer. Returns a single Run handle"},
+    {"__enter__", (PyCFunction) CommandList_enter, METH_NOARGS, NULL},
+    {"__exit__", (PyCFunction) CommandList_exit, METH_VARARGS, NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyType_Slot CommandList_slots[] = {
+    {Py_tp_doc, "Function runs recorded to be submitted together"},
+    {Py_tp_new, PyType_GenericNew},
+    {Py_tp_init, CommandList_init},
+    {Py_tp_dealloc, CommandList_dealloc},
+    {Py_tp_str, CommandList_str},
+    {Py_tp_methods, CommandList_methods},
+    {0, NULL}
+};
+
+static PyType_Spec CommandList_spec = {
+    .name = "metalcompute.CommandList",
+    .basicsize = sizeof(CommandList),
+    .itemsize = 0,
+    .flags = MC_TYPE_FLAGS,
+    .slots = CommandList_slots,
+};
+
+// Events and command streams. A stream is a further command queue of a device,
+// so work submitted to it does not wait behind work on other streams. Streams
+// order work between each other by signalling and waiting on events, whose
+// values only rise, as well as through the buffers their runs share.
+
+static int
+Event_init(Event *self, PyObject *args, PyObject *kwds)
+{
+    // Private - can only be called via device.event
+    mc_state* state = obj_state(self);
+    PyObject* dev_obj;
+
+    if (!PyArg_ParseTuple(args, "O", &dev_obj))
+        return -1;
+
+    if (!PyObject_TypeCheck(dev_obj, state->DeviceType)) {
+        mc_err(state, FirstArgumentNotDevice);
+        return -1;
+    }
+
+    if (mc_err(state, mc_sw_event_open(&(((Device*)dev_obj)->dev_handle), &(self->event_handle))))
+        return -1;
+    self->dev_obj = (Device*)dev_obj;
+    Py_INCREF(dev_obj);
+
+    return 0;
+}
+
+static void
+Event_dealloc(Event *self)
+{
+    if (self->event_handle.id != 0) {
+        mc_sw_event_close(&(self->event_handle));
+        Py_DECREF(self->dev_obj);
+    }
+    PyTypeObject* tp = Py_TYPE(self);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
+}
+
+// Value argument of signal and wait. None gives the default
+static int parse_event_value(PyObject* obj, uint64_t default_value, uint64_t* value)
+{
+    if (obj == NULL || obj == Py_None) {
+        *value = default_value;
+        return 0;
+    }
+    *value = PyLong_AsUnsignedLongLong(obj);
+    return *value == (uint64_t)-1 && PyErr_Occurred() ? -1 : 0;
+}
+
+// Value argument of signal, by default one more than the last. Values only rise,
+// else a wait already satisfied could be undone
+static int parse_signal_value(Event* event, PyObject* obj, uint64_t* value)
+{
+    if (parse_event_value(obj, event->last + 1, value))
+        return -1;
+    if (*value < event->last) {
+        PyErr_Format(PyExc_ValueError, "event value %llu is below the last signalled, %llu",
+                     (unsigned long long)*value, (unsigned long long)event->last);
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject *
+Event_str(Event* self)
+{
+    return PyUnicode_FromFormat("metalcompute.Event");
+}
+
+static PyObject *
+Event_get_value(Event* self, void* Py_UNUSED(closure))
+{
+    mc_state* state = obj_state(self);
+    uint64_t current;
+    if (mc_err(state, mc_sw_event_wait(&(self->event_handle), 0, 0, &current)))
+        return NULL;
+    return PyLong_FromUnsignedLongLong(current);
+}
+
+static PyObject *
+Event_signal(Event* self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"value", NULL};
+    mc_state* state = obj_state(self);
+    PyObject* value_obj = NULL;
+    uint64_t value;
+    int failed;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O", kwlist, &value_obj))
+        return NULL;
+    Py_BEGIN_CRITICAL_SECTION(self); // So concurrent signals each default to one more than the last
+    failed = parse_signal_value(self, value_obj, &value)
+        || mc_err(state, mc_sw_event_signal(&(self->event_handle), value));
+    if (!failed)
+        self->last = value;
+    Py_END_CRITICAL_SECTION();
+    if (failed)
+        return NULL;
+    return PyLong_FromUnsignedLongLong(value);
+}
+
+static PyObject *
+Event_wait(Event* self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"value", "timeout", NULL};
+    mc_state* state = obj_state(self);
+    PyObject* value_obj = NULL;
+    PyObject* timeout_obj = NULL;
+    uint64_t value, current;
+    double timeout;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OO", kwlist, &value_obj, &timeout_obj)
+        || parse_event_value(value_obj, self->last, &value) || parse_timeout(timeout_obj, &timeout))
+        return NULL;
+    RetCode ret;
+    Py_BEGIN_ALLOW_THREADS
+    ret = mc_sw_event_wait(&(self->event_handle), value, timeout, &current);
+    Py_END_ALLOW_THREADS
+    if (mc_err(state, ret))
+        return NULL;
+    return PyBool_FromLong(current >= value);
+}
+
+static PyMethodDef Event_methods[] = {
+    {"signal", (PyCFunction) Event_signal, METH_VARARGS | METH_KEYWORDS,
+     "Set the value from the host: signal(value=None). None is one more than the last value signalled. Returns the value"},
+    {"wait", (PyCFunction) Event_wait, METH_VARARGS | METH_KEYWORDS,
+     "Block until the value reaches value (default the last signalled), or timeout seconds pass. Returns True if it did"},
+    {NULL}  /* Sentinel */
+};
+
+static PyGetSetDef Event_getset[] = {
+    {"value", (getter) Event_get_value, NULL, "Current value", NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyType_Slot Event_slots[] = {
+    {Py_tp_doc, "A value which streams and the host raise, and streams can wait for"},
+    {Py_tp_new, PyType_GenericNew},
+    {Py_tp_init, Event_init},
+    {Py_tp_dealloc, Event_dealloc},
+    {Py_tp_str, Event_str},
+    {Py_tp_methods, Event_methods},
+    {Py_tp_getset, Event_getset},
+    {0, NULL}
+};
+
+static PyType_Spec Event_spec = {
+    .name = "metalcompute.Event",
+    .basicsize = sizeof(Event),
+    .itemsize = 0,
+    .flags = MC_TYPE_FLAGS,
+    .slots = Event_slots,
+};
+
+static int
+CommandStream_init(CommandStream *self, PyObject *args, PyObject *kwds)
+{
+    // Private - can only be called via device.stream
+    mc_state* state = obj_state(self);
+    PyObject* dev_obj;
+    long long priority;
+
+    if (!PyArg_ParseTuple(args, "OL", &dev_obj, &priority))
+        return -1;
+
+    if (!PyObject_TypeCheck(dev_obj, state->DeviceType)) {
+        mc_err(state, FirstArgumentNotDevice);
+        return -1;
+    }
+
+    self->done = (Event*)PyObject_CallOneArg((PyObject*)state->EventType, dev_obj);
+    if (self->done == NULL)
+        return -1;
+    self->stream_handle.priority = priority;
+    if (mc_err(state, mc_sw_stream_open(&(((Device*)dev_obj)->dev_handle), &(self->stream_handle)))) {
+        Py_CLEAR(self->done);
+        return -1;
+    }
+    self->dev_obj = (Device*)dev_obj;
+    Py_INCREF(dev_obj);
+
+    return 0;
+}
+
+static void
+CommandStream_dealloc(CommandStream *self)
+{
+    if (self->stream_handle.id != 0) {
+        mc_sw_stream_close(&(self->stream_handle)); // Queued work still runs
+        Py_DECREF(self->dev_obj);
+    }
+    Py_XDECREF(self->done);
+    PyTypeObject* tp = Py_TYPE(self);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
+}
+
+static PyObject *
+CommandStream_str(CommandStream* self)
+{
+    return PyUnicode_FromFormat("metalcompute.CommandStream(priority=%lld)", (long long)self->stream_handle.priority);
+}
+
+static PyObject *
+CommandStream_run(CommandStream* self, PyObject *args, PyObject *kwargs)
+{
+    mc_state* state = obj_state(self);
+    if (PyTuple_Size(args) < 1 || !PyObject_TypeCheck(PyTuple_GET_ITEM(args, 0), state->FunctionType)) {
+        mc_err(state, FirstArgumentNotFunction);
+        return NULL;
+    }
+    Function* fn_obj = (Function*)PyTuple_GET_ITEM(args, 0);
+    if (fn_obj->kern_obj->dev_obj != self->dev_obj) {
+        mc_err(state, FunctionNotOnDevice);
+        return NULL;
+    }
+    PyObject* fn_args = PyTuple_GetSlice(args, 1, PyTuple_GET_SIZE(args));
+    if (fn_args == NULL)
+        return NULL;
+    PyObject* run_args = Py_BuildValue("OOOO", fn_obj, fn_args, kwargs ? kwargs : Py_None, self);
+    Py_DECREF(fn_args);
+    if (run_args == NULL)
+        return NULL;
+    PyObject* run = PyObject_CallObject((PyObject*)state->RunType, run_args);
+    Py_DECREF(run_args);
+    return run;
+}
+
+static int parse_stream_event(CommandStream* self, PyObject* event_obj)
+{
+    mc_state* state = obj_state(self);
+    if (!PyObject_TypeCheck(event_obj, state->EventType)) {
+        PyErr_SetString(PyExc_TypeError, "event must be a metalcompute.Event");
+        return -1;
+    }
+    if (((Event*)event_obj)->dev_obj != self->dev_obj) {
+        PyErr_SetString(PyExc_ValueError, "event must be from the same device as the stream");
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject *
+CommandStream_signal(CommandStream* self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"event", "value", NULL};
+    mc_state* state = obj_state(self);
+    PyObject* event_obj;
+    PyObject* value_obj = NULL;
+    uint64_t value;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O", kwlist, &event_obj, &value_obj)
+        || parse_stream_event(self, event_obj))
+        return NULL;
+    Event* event = (Event*)event_obj;
+    int failed;
+    Py_BEGIN_CRITICAL_SECTION(event);
+    failed = parse_signal_value(event, value_obj, &value)
+        || mc_err(state, mc_sw_stream_signal(&(self->stream_handle), &(event->event_handle), value));
+    if (!failed)
+        event->last = value;
+    Py_END_CRITICAL_SECTION();
+    if (failed)
+        return NULL;
+    return PyLong_FromUnsignedLongLong(value);
+}
+
+static PyObject *
+CommandStream_wait(CommandStream* self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"event", "value", NULL};
+    mc_state* state = obj_state(self);
+    PyObject* event_obj;
+    PyObject* value_obj = NULL;
+    uint64_t value;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O", kwlist, &event_obj, &value_obj)
+        || parse_stream_event(self, event_obj))
+        return NULL;
+    Event* event = (Event*)event_obj;
+    if (parse_event_value(value_obj, event->last, &value))
+        return NULL;
+    if (mc_err(state, mc_sw_stream_wait(&(self->stream_handle), &(event->event_handle), value)))
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+CommandStream_synchronize(CommandStream* self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"timeout", NULL};
+    PyObject* timeout_obj = NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O", kwlist, &timeout_obj))
+        return NULL;
+    PyObject* signal_args = PyTuple_Pack(1, self->done);
+    PyObject* value = signal_args ? CommandStream_signal(self, signal_args, NULL) : NULL;
+    Py_XDECREF(signal_args);
+    if (value == NULL)
+        return NULL;
+    PyObject* wait_args = PyTuple_Pack(2, value, timeout_obj ? timeout_obj : Py_None);
+    Py_DECREF(value);
+    PyObject* reached = wait_args ? Event_wait(self->done, wait_args, NULL) : NULL;
+    Py_XDECREF(wait_args);
+    return reached;
+}
+
+static PyMethodDef CommandStream_methods[] = {
+    {"run", (PyCFunction) CommandStream_run, METH_VARARGS | METH_KEYWORDS,
+     "Run a function on this stream: run(function, count or grid, buffer_0, ..., buffer_n, **options). Returns a Run"},
+    {"signal", (PyCFunction) CommandStream_signal, METH_VARARGS | METH_KEYWORDS,
+     "Set the event to value once the work submitted so far completes: signal(event, value=None). Returns the value"},
+    {"wait", (PyCFunction) CommandStream_wait, METH_VARARGS | METH_KEYWORDS,
+     "Hold back work submitted from now on until the event reaches value: wait(event, value=None)"},
+    {"synchronize", (PyCFunction) CommandStream_synchronize, METH_VARARGS | METH_KEYWORDS,
+     "Block until the work submitted so far completes, or timeout seconds pass. Returns True if it did"},
+    {NULL}  /* Sentinel */
+};
+
+static PyMemberDef CommandStream_members[] = {
+    {"priority", T_LONGLONG, offsetof(CommandStream, stream_handle.priority), READONLY,
+     "Higher priority streams are served first, where the device can choose"},
+    {NULL}  /* Sentinel */
+};
+
+static PyType_Slot CommandStream_slots[] = {
+    {Py_tp_doc, "A command queue of a device, with its own order of work"},
+    {Py_tp_new, PyType_GenericNew},
+    {Py_tp_init, CommandStream_init},
+    {Py_tp_dealloc, CommandStream_dealloc},
+    {Py_tp_str, CommandStream_str},
+    {Py_tp_methods, CommandStream_methods},
+    {Py_tp_members, CommandStream_members},
+    {0, NULL}
+};
+
+static PyType_Spec CommandStream_spec = {
+    .name = "metalcompute.CommandStream",
+    .basicsize = sizeof(CommandStream),
+    .itemsize = 0,
+    .flags = MC_TYPE_FLAGS,
+    .slots = CommandStream_slots,
+};
+
+// Stream. Runs a function over a sequence of input chunks, keeping a ring of
+// depth buffer sets in flight so that filling the next chunks, running the
+// kernel and reading back earlier results overlap. Results come back in order.
+
+#define MC_STREAM_FILL 0
+#define MC_STREAM_DISPATCH 1
+#define MC_STREAM_COMPUTE 2 // Blocked waiting for the device
+#define MC_STREAM_DRAIN 3
+#define MC_STREAM_STAGES 4
+
+static const char* stream_stage_names[MC_STREAM_STAGES] = { "fill", "dispatch", "compute", "drain" };
+
+typedef struct {
+    Buffer* in;          // Reused for each chunk through the slot, grown as needed
+    Buffer* out;
+    Run* run;            // NULL when the chunk was empty
+    Py_ssize_t out_length;
+} mc_stream_slot;
+
+typedef struct {
+    PyObject_HEAD
+    Function* fn_obj;
+    PyObject* chunks;     // Iterator of input chunks
+    PyObject* extra;      // Tuple of buffers passed between the input and output
+    PyObject* out_size;   // None, int, or callable(chunk)
+    PyObject* count;      // None, count or grid, or callable(chunk)
+    PyObject* run_kwargs; // threadgroup and threadgroup_memory for each run, or NULL
+    int depth;
+    mc_stream_slot* slots;
+    int head;             // Oldest slot in flight
+    int pending;          // Slots in flight
+    bool exhausted;
+    long long chunk_count;
+    double times[MC_STREAM_STAGES];
+} Stream;
+
+static int
+Stream_init(Stream *self, PyObject *args, PyObject *kwds)
+{
+    // Private - can only be called via function.stream
+    static char *kwlist[] = {"out_size", "count", "depth", "threadgroup", "threadgroup_memory", NULL};
+    mc_state* state = obj_state(self);
+    PyObject* out_size = Py_None;
+    PyObject* count = Py_None;
+    PyObject* threadgroup = NULL;
+    PyObject* threadgroup_memory = NULL;
+    int depth = 3;
+
+    PyObject* no_args = PyTuple_New(0);
+    int parsed = no_args != NULL && PyArg_ParseTupleAndKeywords(no_args, kwds, "|$OOiOO", kwlist,
+                                                                &out_size, &count, &depth, &threadgroup, &threadgroup_memory);
+    Py_XDECREF(no_args);
+    if (!parsed)
+        return -1;
+    if (PyTuple_Size(args) < 2 || !PyObject_TypeCheck(PyTuple_GET_ITEM(args, 0), state->FunctionType)) {
+        mc_err(state, FirstArgumentNotFunction);
+        return -1;
+    }
+    if (depth < 1) {
+        PyErr_SetString(PyExc_ValueError, "depth must be at least 1");
+        return -1;
+    }
+
+    Function* fn_obj = (Function*)PyTuple_GET_ITEM(args, 0);
+    Py_ssize_t extra_count = PyTuple_GET_SIZE(args) - 2;
+    self->chunks = PyObject_GetIter(PyTuple_GET_ITEM(args, 1));
+    self->extra = PyTuple_New(extra_count);
+    self->slots = PyMem_Calloc(depth, sizeof(mc_stream_slot));
+    if (self->chunks == NULL || self->extra == NULL || self->slots == NULL) {
+        if (!PyErr_Occurred())
+            PyErr_NoMemory();
+        return -1;
+    }
+    // Other arguments are the same for every chunk, so are only converted once
+    for (Py_ssize_t i = 0; i < extra_count; i++) {
+        PyObject* buf;
+        if (to_arg(PyTuple_GET_ITEM(args, i + 2), fn_obj, i + 1, &buf))
+            return -1;
+        PyTuple_SET_ITEM(self->extra, i, buf);
+    }
+    if (threadgroup != NULL || threadgroup_memory != NULL) {
+        self->run_kwargs = PyDict_New();
+        if (self->run_kwargs == NULL
+            || (threadgroup && PyDict_SetItemString(self->run_kwargs, "threadgroup", threadgroup))
+            || (threadgroup_memory && PyDict_SetItemString(self->run_kwargs, "threadgroup_memory", threadgroup_memory)))
+            return -1;
+    }
+
+    self->fn_obj = fn_obj;
+    Py_INCREF(fn_obj);
+    self->out_size = out_size;
+    Py_INCREF(out_size);
+    self->count = count;
+    Py_INCREF(count);
+    self->depth = depth;
+    return 0;
+}
+
+static void
+Stream_dealloc(Stream *self)
+{
+    for (int i = 0; self->slots != NULL && i < self->depth; i++) {
+        Py_XDECREF(self->slots[i].run); // Waits for runs still in flight
+        Py_XDECREF(self->slots[i].in);
+        Py_XDECREF(self->slots[i].out);
+    }
+    PyMem_Free(self->slots);
+    Py_XDECREF(self->chunks);
+    Py_XDECREF(self->extra);
+    Py_XDECREF(self->out_size);
+    Py_XDECREF(self->count);
+    Py_XDECREF(self->run_kwargs);
+    Py_XDECREF(self->fn_obj);
+    PyTypeObject* tp = Py_TYPE(self);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
+}
+
+static PyObject *
+Stream_str(Stream* self)
+{
+    return PyUnicode_FromFormat("metalcompute.Stream(depth=%d, in_flight=%d)", self->depth, self->pending);
+}
+
+// Make sure the slot buffer holds at least length bytes
+static int stream_reserve(Stream* self, Buffer** buf, Py_ssize_t length)
+{
+    mc_state* state = obj_state(self);
+    if (*buf != NULL && (*buf)->length >= (uint64_t)length)
+        return 0;
+    PyObject* buffer_args = Py_BuildValue("On", self->fn_obj->kern_obj->dev_obj, length);
+    Buffer* grown = (Buffer*)PyObject_CallObject((PyObject*)state->BufferType, buffer_args);
+    Py_DECREF(buffer_args);
+    if (grown == NULL)
+        return -1;
+    Py_XSETREF(*buf, grown);
+    return 0;
+}
+
+// Size given as None (the default), an int, or a callable of the chunk
+static PyObject* stream_size(PyObject* size, PyObject* chunk, PyObject* default_size)
+{
+    if (size == Py_None) {
+        Py_INCREF(default_size);
+        return default_size;
+    }
+    if (PyCallable_Check(size))
+        return PyObject_CallFunctionObjArgs(size, chunk, NULL);
+    Py_INCREF(size);
+    return size;
+}
+
+// Take the next chunk into the free slot after those in flight, and start its run.
+// Returns 1 if a chunk was started, 0 if there are no more, -1 on error.
+static int stream_fill(Stream* self)
+{
+    mc_state* state = obj_state(self);
+    mc_stream_slot* slot = &self->slots[(self->head + self->pending) % self->depth];
+    double start = monotonic_seconds();
+    PyObject* chunk = PyIter_Next(self->chunks);
+    if (chunk == NULL) {
+        self->exhausted = !PyErr_Occurred();
+        return PyErr_Occurred() ? -1 : 0;
+    }
+    Py_buffer view;
+    if (PyObject_GetBuffer(chunk, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT)) {
+        Py_DECREF(chunk);
+        return -1;
+    }
+    PyObject* items = PyLong_FromSsize_t(view.itemsize ? view.len / view.itemsize : 0);
+    PyObject* bytes = PyLong_FromSsize_t(view.len);
+    PyObject* grid = items && bytes ? stream_size(self->count, chunk, items) : NULL;
+    PyObject* out_size = grid ? stream_size(self->out_size, chunk, bytes) : NULL;
+    Py_ssize_t out_length = out_size ? PyLong_AsSsize_t(out_size) : -1;
+    Py_XDECREF(items);
+    Py_XDECREF(bytes);
+    Py_XDECREF(out_size);
+    Py_DECREF(chunk);
+    if (out_length < 0 || view.len == 0) {
+        PyBuffer_Release(&view);
+        Py_XDECREF(grid);
+        if (out_length < 0) {
+            if (!PyErr_Occurred())
+                PyErr_SetString(PyExc_ValueError, "out_size must not be negative");
+            return -1;
+        }
+        // Empty chunks give empty results, without a run
+        slot->out_length = 0;
+        self->pending++;
+        self->chunk_count++;
+        self->times[MC_STREAM_FILL] += monotonic_seconds() - start;
+        return 1;
+    }
+    if (stream_reserve(self, &slot->in, view.len) || stream_reserve(self, &slot->out, out_length ? out_length : 1)) {
+        PyBuffer_Release(&view);
+        Py_DECREF(grid);
+        return -1;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    mc_copy(slot->in->buf_handle.buf, view.buf, view.len);
+    Py_END_ALLOW_THREADS
+    Py_ssize_t in_length = view.len;
+    PyBuffer_Release(&view);
+    double filled = monotonic_seconds();
+    self->times[MC_STREAM_FILL] += filled - start;
+
+    // Run on views of exactly the chunk's input and result
+    Py_ssize_t extra_count = PyTuple_GET_SIZE(self->extra);
+    PyObject* run_args = PyTuple_New(extra_count + 3);
+    if (run_args == NULL) {
+        Py_DECREF(grid);
+        return -1;
+    }
+    PyTuple_SET_ITEM(run_args, 0, grid);
+    PyTuple_SET_ITEM(run_args, 1, buffer_view(slot->in, 0, in_length));
+    for (Py_ssize_t i = 0; i < extra_count; i++) {
+        PyObject* buf = PyTuple_GET_ITEM(self->extra, i);
+        Py_INCREF(buf);
+        PyTuple_SET_ITEM(run_args, i + 2, buf);
+    }
+    PyTuple_SET_ITEM(run_args, extra_count + 2, buffer_view(slot->out, 0, out_length ? out_length : 1));
+    Run* run = NULL;
+    if (PyTuple_GET_ITEM(run_args, 1) != NULL && PyTuple_GET_ITEM(run_args, extra_count + 2) != NULL) {
+        PyObject* init_args = Py_BuildValue("OOO", self->fn_obj, run_args, self->run_kwargs ? self->run_kwargs : Py_None);
+        run = init_args ? (Run*)PyObject_CallObject((PyObject*)state->RunType, init_args) : NULL;
+        Py_XDECREF(init_args);
+    }
+    Py_DECREF(run_args);
+    if (run == NULL)
+        return -1;
+    slot->run = run;
+    slot->out_length = out_length;
+    self->pending++;
+    self->chunk_count++;
+    self->times[MC_STREAM_DISPATCH] += monotonic_seconds() - filled;
+    return 1;
+}
+
+// Wait for the oldest chunk in flight and copy out its result
+static PyObject* stream_drain(Stream* self)
+{
+    mc_stream_slot* slot = &self->slots[self->head];
+    double start = monotonic_seconds();
+    bool complete;
+    if (slot->run != NULL && wait_runs(obj_state(self), 1, &slot->run, true, -1, &complete))
+        return NULL;
+    double computed = monotonic_seconds();
+    PyObject* result = PyBytes_FromStringAndSize(NULL, slot->out_length);
+    if (result == NULL)
+        return NULL;
+    if (slot->out_length > 0) {
+        char* dest = PyBytes_AS_STRING(result);
+        Py_BEGIN_ALLOW_THREADS
+        mc_copy(dest, slot->out->buf_handle.buf, slot->out_length);
+        Py_END_ALLOW_THREADS
+    }
+    Py_CLEAR(slot->run);
+    self->head = (self->head + 1) % self->depth;
+    self->pending--;
+    self->times[MC_STREAM_COMPUTE] += computed - start;
+    self->times[MC_STREAM_DRAIN] += monotonic_seconds() - computed;
+    return result;
+}
+
+static PyObject* stream_next(Stream* self)
+{
+    // Only take more chunks while there is a free slot, so a fast producer is held back
+    while (!self->exhausted && self->pending < self->depth) {
+        int started = stream_fill(self);
+        if (started < 0)
+            return NULL;
+        if (started == 0)
+            break;
+    }
+    if (self->pending == 0)
+        return NULL; // Stop iteration
+    return stream_drain(self);
+}
+
+static PyObject *
+Stream_next(Stream* self)
+{
+    // The ring of slots is only advanced by one thread at a time
+    PyObject* result;
+    Py_BEGIN_CRITICAL_SECTION(self);
+    result = stream_next(self);
+    Py_END_CRITICAL_SECTION();
+    return result;
+}
+
+// Seconds spent in each stage so far, and the stage the stream is bound by
+static PyObject *
+Stream_get_timing(Stream* self, void* closure)
+{
+    int bound = 0;
+    for (int i = 1; i < MC_STREAM_STAGES; i++) {
+        if (self->times[i] > self->times[bound])
+            bound = i;
+    }
+    PyObject* timing = Py_BuildValue("{s:L}", "chunks", self->chunk_count);
+    for (int i = 0; timing != NULL && i < MC_STREAM_STAGES; i++) {
+        PyObject* seconds = PyFloat_FromDouble(self->times[i]);
+        if (seconds == NULL || PyDict_SetItemString(timing, stream_stage_names[i], seconds))
+            Py_CLEAR(timing);
+        Py_XDECREF(seconds);
+    }
+    PyObject* bound_name = timing ? PyUnicode_FromString(stream_stage_names[bound]) : NULL;
+    if (bound_name == NULL || PyDict_SetItemString(timing, "bound", bound_name))
+        Py_CLEAR(timing);
+    Py_XDECREF(bound_name);
+    return timing;
+}
+
+static PyGetSetDef Stream_getset[] = {
+    {"timing", (getter) Stream_get_timing, NULL,
+     "Seconds spent filling, dispatching, waiting for the device and draining, and which dominates", NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyMemberDef Stream_members[] = {
+    {"depth", T_INT, offsetof(Stream, depth), READONLY, "Most chunks in flight at once"},
+    {"in_flight", T_INT, offsetof(Stream, pending), READONLY, "Chunks taken but not yet returned"},
+    {NULL}  /* Sentinel */
+};
+
+static PyType_Slot Stream_slots[] = {
+    {Py_tp_doc, "Results of a function run over a sequence of chunks, in order"},
+    {Py_tp_new, PyType_GenericNew},
+    {Py_tp_init, Stream_init},
+    {Py_tp_dealloc, Stream_dealloc},
+    {Py_tp_str, Stream_str},
+    {Py_tp_iter, PyObject_SelfIter},
+    {Py_tp_iternext, Stream_next},
+    {Py_tp_getset, Stream_getset},
+    {Py_tp_members, Stream_members},
+    {0, NULL}
+};
+
+static PyType_Spec Stream_spec = {
+    .name = "metalcompute.Stream",
+    .basicsize = sizeof(Stream),
+    .itemsize = 0,
+    .flags = MC_TYPE_FLAGS,
+    .slots = Stream_slots,
+};
+
+// Device group. Runs one function across several devices, each taking a slice
+// of the grid. Buffers named by the caller are split to match, copied to
+// devices which do not hold them, and copied back once all complete.
+// Slices are sized by each device's measured throughput in earlier calls.
+
+#define MC_GROUP_MIN_SHARE 0.1 // Of an even share, so slow devices are still measured
+
+typedef struct {
+    PyObject_HEAD
+    PyObject* devices; // Tuple of Device
+} DeviceGroup;
+
+typedef struct {
+    PyObject_HEAD
+    DeviceGroup* group;
+    PyObject* kernels; // Tuple of Kernel, one per device
+} GroupKernel;
+
+typedef struct {
+    PyObject_HEAD
+    GroupKernel* kern;
+    PyObject* functions; // Tuple of Function, one per device
+    Py_ssize_t count;
+    double* shares;      // Fraction of each call for each device, summing to 1
+    int64_t* partition;  // Start and end row for each device in the last call
+    bool adaptive;
+} GroupFunction;
+
+
+static int
+DeviceGroup_init(DeviceGroup *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"devices", NULL};
+    mc_state* state = obj_state(self);
+    PyObject* devices = Py_None;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &devices))
+        return -1;
+
+    PyObject* members;
+    if (devices == Py_None) {
+        // Every device
+        mc_devices found;
+        if (mc_err(state, mc_sw_count_devs(&found)))
+            return -1;
+        for (int i = 0; i < found.dev_count; i++)
+            free(found.devs[i].name);
+        free(found.devs);
+        members = PyTuple_New(found.dev_count);
+        for (int i = 0; members != NULL && i < found.dev_count; i++)
+            PyTuple_SET_ITEM(members, i, PyObject_CallFunction((PyObject*)state->DeviceType, "i", i));
+    } else {
+        // Devices, or indexes of devices to open
+        // into a new tuple, as the given one may be the caller's own
+        PyObject* given = PySequence_Tuple(devices);
+        members = given ? PyTuple_New(PyTuple_GET_SIZE(given)) : NULL;
+        for (Py_ssize_t i = 0; members != NULL && i < PyTuple_GET_SIZE(given); i++) {
+            PyObject* member = PyTuple_GET_ITEM(given, i);
+            if (PyObject_TypeCheck(member, state->DeviceType))
+                Py_INCREF(member);
+            else
+                member = PyObject_CallFunctionObjArgs((PyObject*)state->DeviceType, member, NULL);
+            PyTuple_SET_ITEM(members, i, member);
+        }
+        Py_XDECREF(given);
+    }
+    if (members == NULL)
+        return -1;
+    for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(members); i++) {
+        if (PyTuple_GET_ITEM(members, i) == NULL) {
+            Py_DECREF(members);
+            return -1;
+        }
+    }
+    if (PyTuple_GET_SIZE(members) == 0) {
+        Py_DECREF(members);
+        mc_err(state, CannotCreateDevice);
+        return -1;
+    }
+    Py_XSETREF(self->devices, members);
+    return 0;
+}
+
+static void
+DeviceGroup_dealloc(DeviceGroup *self)
+{
+    Py_XDECREF(self->devices);
+    PyTypeObject* tp = Py_TYPE(self);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
+}
 
-    if (newBufferObj != NULL) {
-        *buffer = newBufferObj;
-        return 0;
-    }
+static PyObject *
+DeviceGroup_str(DeviceGroup* self)
+{
+    return PyUnicode_FromFormat("metalcompute.DeviceGroup(%zd devices)", PyTuple_GET_SIZE(self->devices));
+}
 
-    return -1; // Failed
+static PyObject *
+DeviceGroup_kernel(DeviceGroup* self, PyObject* args, PyObject* kwargs)
+{
+    mc_state* state = obj_state(self);
+    PyObject *kernelArgList = Py_BuildValue("(OO)", self, args);
+    PyObject *newKernelObj = PyObject_CallObject((PyObject *) state->GroupKernelType, kernelArgList);
+    Py_DECREF(kernelArgList);
+    return newKernelObj;
 }
 
+static PyMethodDef DeviceGroup_methods[] = {
+    {"kernel", (PyCFunction) DeviceGroup_kernel, METH_VARARGS,
+     "Compile a kernel from source on every device of the group"},
+    {NULL}  /* Sentinel */
+};
+
+static PyMemberDef DeviceGroup_members[] = {
+    {"devices", T_OBJECT, offsetof(DeviceGroup, devices), READONLY, "Devices of the group"},
+    {NULL}  /* Sentinel */
+};
+
+static PyType_Slot DeviceGroup_slots[] = {
+    {Py_tp_doc, "Several devices which share the work of each run: DeviceGroup(devices=None), None for all"},
+    {Py_tp_new, PyType_GenericNew},
+    {Py_tp_init, DeviceGroup_init},
+    {Py_tp_dealloc, DeviceGroup_dealloc},
+    {Py_tp_str, DeviceGroup_str},
+    {Py_tp_methods, DeviceGroup_methods},
+    {Py_tp_members, DeviceGroup_members},
+    {0, NULL}
+};
+
+static PyType_Spec DeviceGroup_spec = {
+    .name = "metalcompute.DeviceGroup",
+    .basicsize = sizeof(DeviceGroup),
+    .itemsize = 0,
+    .flags = MC_TYPE_FLAGS,
+    .slots = DeviceGroup_slots,
+};
+
 static int
-Run_init(Run *self, PyObject *args, PyObject *kwds)
+GroupKernel_init(GroupKernel *self, PyObject *args, PyObject *kwds)
 {
-    // Private - can only be called via function.run
-    Function* fn_obj;
-    PyObject* arg_tuple;
-
-    if (!PyArg_ParseTuple(args, "OO", &fn_obj, &arg_tuple)) {
+    // Private - can only be called via group.kernel
+    mc_state* state = obj_state(self);
+    DeviceGroup* group;
+    PyObject* kernel_args;
+    if (!PyArg_ParseTuple(args, "O!O!", state->DeviceGroupType, &group, &PyTuple_Type, &kernel_args))
         return -1;
+    Py_ssize_t count = PyTuple_GET_SIZE(group->devices);
+    PyObject* kernels = PyTuple_New(count);
+    for (Py_ssize_t i = 0; kernels != NULL && i < count; i++) {
+        PyObject* kernel = Device_kernel((Device*)PyTuple_GET_ITEM(group->devices, i), kernel_args, NULL);
+        if (kernel == NULL)
+            Py_CLEAR(kernels);
+        else
+            PyTuple_SET_ITEM(kernels, i, kernel);
     }
+    if (kernels == NULL)
+        return -1;
+    self->kernels = kernels;
+    self->group = group;
+    Py_INCREF(group);
+    return 0;
+}
 
-    int64_t buffer_count = (int64_t)PyTuple_Size(arg_tuple) - 1;
-    self->run_handle.buf_count = buffer_count;
-    if (buffer_count <= 0) {
-        mc_err(BufferNotFound);
+static void
+GroupKernel_dealloc(GroupKernel *self)
+{
+    Py_XDECREF(self->kernels);
+    Py_XDECREF(self->group);
+    PyTypeObject* tp = Py_TYPE(self);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
+}
+
+static PyObject *
+GroupKernel_function(GroupKernel* self, PyObject* args, PyObject* kwargs)
+{
+    mc_state* state = obj_state(self);
+    PyObject *fnArgList = Py_BuildValue("(OO)", self, args);
+    PyObject *newFnObj = PyObject_CallObject((PyObject *) state->GroupFunctionType, fnArgList);
+    Py_DECREF(fnArgList);
+    return newFnObj;
+}
+
+static PyMethodDef GroupKernel_methods[] = {
+    {"function", (PyCFunction) GroupKernel_function, METH_VARARGS,
+     "Get a function of the kernel, on every device of the group"},
+    {NULL}  /* Sentinel */
+};
+
+static PyType_Slot GroupKernel_slots[] = {
+    {Py_tp_doc, "A Metal kernel compiled for each device of a group"},
+    {Py_tp_new, PyType_GenericNew},
+    {Py_tp_init, GroupKernel_init},
+    {Py_tp_dealloc, GroupKernel_dealloc},
+    {Py_tp_methods, GroupKernel_methods},
+    {0, NULL}
+};
+
+static PyType_Spec GroupKernel_spec = {
+    .name = "metalcompute.GroupKernel",
+    .basicsize = sizeof(GroupKernel),
+    .itemsize = 0,
+    .flags = MC_TYPE_FLAGS,
+    .slots = GroupKernel_slots,
+};
+
+static int
+GroupFunction_init(GroupFunction *self, PyObject *args, PyObject *kwds)
+{
+    // Private - can only be called via group_kernel.function
+    mc_state* state = obj_state(self);
+    GroupKernel* kern;
+    PyObject* fn_args;
+    if (!PyArg_ParseTuple(args, "O!O!", state->GroupKernelType, &kern, &PyTuple_Type, &fn_args))
         return -1;
+    Py_ssize_t count = PyTuple_GET_SIZE(kern->kernels);
+    self->shares = PyMem_Calloc(count, sizeof(double));
+    self->partition = PyMem_Calloc(count * 2, sizeof(int64_t));
+    self->functions = PyTuple_New(count);
+    if (self->shares == NULL || self->partition == NULL || self->functions == NULL) {
+        if (!PyErr_Occurred())
+            PyErr_NoMemory();
+        return -1;
+    }
+    for (Py_ssize_t i = 0; i < count; i++) {
+        PyObject* fn = Kernel_function((Kernel*)PyTuple_GET_ITEM(kern->kernels, i), fn_args, NULL);
+        if (fn == NULL)
+            return -1;
+        PyTuple_SET_ITEM(self->functions, i, fn);
+        self->shares[i] = 1.0 / count; // Even until measured
+    }
+    self->count = count;
+    self->adaptive = true;
+    self->kern = kern;
+    Py_INCREF(kern);
+    return 0;
+}
+
+static void
+GroupFunction_dealloc(GroupFunction *self)
+{
+    PyMem_Free(self->shares);
+    PyMem_Free(self->partition);
+    Py_XDECREF(self->functions);
+    Py_XDECREF(self->kern);
+    PyTypeObject* tp = Py_TYPE(self);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
+}
+
+static PyObject *
+GroupFunction_str(GroupFunction* self)
+{
+    return PyUnicode_FromFormat("metalcompute.GroupFunction(%zd devices)", self->count);
+}
+
+// Move shares towards each device's throughput in the last call, given how long
+// each took. Smoothed, so one noisy measurement does not swing the split.
+static void group_rebalance(GroupFunction* self, const double* seconds)
+{
+    double total = 0;
+    double* rates = PyMem_Calloc(self->count, sizeof(double));
+    if (rates == NULL)
+        return;
+    for (Py_ssize_t i = 0; i < self->count; i++) {
+        int64_t rows = self->partition[i * 2 + 1] - self->partition[i * 2];
+        if (rows > 0 && seconds[i] > 0)
+            rates[i] = rows / seconds[i];
+        total += rates[i];
+    }
+    if (total > 0) {
+        double floor = MC_GROUP_MIN_SHARE / self->count;
+        double sum = 0;
+        for (Py_ssize_t i = 0; i < self->count; i++) {
+            // Devices without a measurement keep their share
+            double measured = rates[i] > 0 ? rates[i] / total : self->shares[i];
+            self->shares[i] = fmax(0.5 * self->shares[i] + 0.5 * measured, floor);
+            sum += self->shares[i];
+        }
+        for (Py_ssize_t i = 0; i < self->count; i++)
+            self->shares[i] /= sum;
     }
+    PyMem_Free(rates);
+}
 
-    // Get count  
-    PyObject* first = PyTuple_GetItem(arg_tuple, 0);
-    if (PyNumber_Check(first) != 1) {
-        mc_err(CountNotGiven);
+// Indexes given as a sequence of ints, as flags for count buffers
+static int group_indexes(PyObject* obj, Py_ssize_t count, bool* flags)
+{
+    PyObject* items = PySequence_Fast(obj, "expected a sequence of buffer indexes");
+    if (items == NULL)
         return -1;
+    for (Py_ssize_t i = 0; i < count; i++)
+        flags[i] = false;
+    for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(items); i++) {
+        Py_ssize_t index = PyLong_AsSsize_t(PySequence_Fast_GET_ITEM(items, i));
+        if (index == -1 && PyErr_Occurred()) {
+            Py_DECREF(items);
+            return -1;
+        }
+        if (index < 0 || index >= count) {
+            Py_DECREF(items);
+            PyErr_Format(PyExc_IndexError, "buffer index %zd out of range", index);
+            return -1;
+        }
+        flags[index] = true;
     }
-    self->run_handle.kcount = PyLong_AsLongLong(PyNumber_Long(first));
+    Py_DECREF(items);
+    return 0;
+}
 
-    // Allocate space to hold pointers to buffers
-    self->run_handle.bufs = (mc_buf_handle**)malloc(buffer_count * sizeof(mc_buf_handle*));  
-    PyObject* tuple_bufs = PyTuple_New(buffer_count);
-    for (int i = 0; i < buffer_count; i++) {
-        PyObject* pos_buf = PyTuple_GetItem(arg_tuple, i+1);
+// Argument buffer j for device i, covering rows [start, end) if split.
+// Sets *temp to a new buffer holding a copy of the data, when one was needed.
+static PyObject* group_buffer(PyObject* arg, Device* dev, Py_buffer* source, bool writable,
+                              int64_t offset, int64_t length, Buffer** temp)
+{
+    mc_state* state = obj_state(dev);
+    *temp = NULL;
+    if (Py_TYPE(arg) == state->BufferType && ((Buffer*)arg)->dev_obj == dev) {
+        if (offset == 0 && length == (int64_t)((Buffer*)arg)->length) {
+            Py_INCREF(arg);
+            return arg;
+        }
+        return buffer_view((Buffer*)arg, offset, length);
+    }
+    // Used in place if the memory allows, else copied
+    PyObject* slice = PyMemoryView_FromMemory((char*)source->buf + offset, length, writable ? PyBUF_WRITE : PyBUF_READ);
+    Buffer* buf;
+    int failed = slice == NULL || to_buffer(slice, dev, &buf);
+    Py_XDECREF(slice);
+    if (failed)
+        return NULL;
+    if (!buf->wrapped) {
+        *temp = buf;
+        Py_INCREF(buf);
+    }
+    return (PyObject*)buf;
+}
 
-        Buffer* buf;
-        if (to_buffer(pos_buf, fn_obj->kern_obj->dev_obj, &buf)) {
-            free(self->run_handle.bufs);
-            Py_DECREF(tuple_bufs);
-            return -1;
+static PyObject *
+GroupFunction_call(GroupFunction* self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"threadgroup", "threadgroup_memory", "split", "outputs", "origin", NULL};
+    mc_state* state = obj_state(self);
+    PyObject* threadgroup = NULL;
+    PyObject* threadgroup_memory = NULL;
+    PyObject* split_obj = NULL;
+    PyObject* outputs_obj = NULL;
+    PyObject* origin_obj = NULL;
+    PyObject* no_args = PyTuple_New(0);
+    int parsed = no_args != NULL && PyArg_ParseTupleAndKeywords(no_args, kwargs, "|$OOOOO", kwlist,
+                                                                &threadgroup, &threadgroup_memory, &split_obj, &outputs_obj,
+                                                                &origin_obj);
+    Py_XDECREF(no_args);
+    if (!parsed)
+        return NULL;
+
+    Py_ssize_t buf_count = PyTuple_GET_SIZE(args) - 1;
+    if (buf_count <= 0) {
+        mc_err(state, buf_count < 0 ? CountNotGiven : BufferNotFound);
+        return NULL;
+    }
+    int64_t dims[3];
+    if (parse_shape(state, PyTuple_GET_ITEM(args, 0), dims))
+        return NULL;
+    if (dims[0] < 1 || dims[1] < 1 || dims[2] < 1) {
+        mc_err(state, InvalidDispatch);
+        return NULL;
+    }
+    // Split along the outermost dimension of the grid, in rows of the others
+    int axis = dims[2] > 1 ? 2 : dims[1] > 1 ? 1 : 0;
+    int64_t rows = dims[axis];
+    bool is_grid = !PyLong_Check(PyTuple_GET_ITEM(args, 0));
+    // Thread positions start again at 0 in each slice, so kernels needing the
+    // position in the whole grid are given their slice's first row as an argument
+    Py_ssize_t origin = -1;
+    if (origin_obj != NULL && origin_obj != Py_None) {
+        origin = PyLong_AsSsize_t(origin_obj);
+        if (origin == -1 && PyErr_Occurred())
+            return NULL;
+        if (origin < 0 || origin >= buf_count || !PyLong_Check(PyTuple_GET_ITEM(args, origin + 1))) {
+            PyErr_Format(PyExc_ValueError, "origin must be the index of an int argument");
+            return NULL;
         }
+    }
 
-        // TODO: Should check here that the buffer is from the same Metal device
-        self->run_handle.bufs[i] = &(buf->buf_handle);
-        PyTuple_SetItem(tuple_bufs, i, (PyObject*)buf);
+    PyObject* result = NULL;
+    PyObject* run_kwargs = NULL;
+    Py_ssize_t n = self->count;
+    Py_buffer* sources = PyMem_Calloc(buf_count, sizeof(Py_buffer));
+    bool* has_source = PyMem_Calloc(buf_count, sizeof(bool));
+    bool* writable = PyMem_Calloc(buf_count, sizeof(bool));
+    bool* split = PyMem_Calloc(buf_count, sizeof(bool));
+    bool* outputs = PyMem_Calloc(buf_count, sizeof(bool));
+    int64_t* row_bytes = PyMem_Calloc(buf_count, sizeof(int64_t));
+    Run** runs = PyMem_Calloc(n, sizeof(Run*));
+    Buffer** temps = PyMem_Calloc(n * buf_count, sizeof(Buffer*));
+    double* submitted = PyMem_Calloc(n, sizeof(double));
+    double* seconds = PyMem_Calloc(n, sizeof(double));
+    int64_t* partition = PyMem_Calloc(n * 2, sizeof(int64_t)); // This call's, as others may run meanwhile
+    if (!sources || !has_source || !writable || !split || !outputs || !row_bytes || !runs || !temps || !submitted || !seconds
+        || !partition) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    if (threadgroup != NULL || threadgroup_memory != NULL) {
+        run_kwargs = PyDict_New();
+        if (run_kwargs == NULL
+            || (threadgroup && PyDict_SetItemString(run_kwargs, "threadgroup", threadgroup))
+            || (threadgroup_memory && PyDict_SetItemString(run_kwargs, "threadgroup_memory", threadgroup_memory)))
+            goto done;
     }
 
-    if (mc_err(mc_sw_run_open(
-        &(fn_obj->kern_obj->dev_obj->dev_handle),
-        &(fn_obj->kern_obj->kern_handle),
-        &(fn_obj->fn_handle),
-        &(self->run_handle)))) {
-        free(self->run_handle.bufs);
-        return -1;
+    // Memory of each argument, split into rows only if asked
+    for (Py_ssize_t j = 0; j < buf_count; j++) {
+        PyObject* arg = PyTuple_GET_ITEM(args, j + 1);
+        if (Py_IS_TYPE(arg, state->ConstantType) || PyLong_Check(arg) || PyFloat_Check(arg))
+            continue; // Passed inline, whole to every device
+        writable[j] = !PyObject_GetBuffer(arg, &sources[j], PyBUF_C_CONTIGUOUS | PyBUF_WRITABLE);
+        if (!writable[j]) {
+            PyErr_Clear();
+            if (PyObject_GetBuffer(arg, &sources[j], PyBUF_C_CONTIGUOUS)) {
+                PyErr_Clear();
+                mc_err(state, UnsupportedInputFormat);
+                goto done;
+            }
+        }
+        has_source[j] = true;
+    }
+    if (split_obj != NULL && split_obj != Py_None && group_indexes(split_obj, buf_count, split))
+        goto done;
+    bool any_split = false;
+    for (Py_ssize_t j = 0; j < buf_count; j++)
+        any_split |= split[j];
+    if (!any_split && origin < 0) {
+        // Each device would run the start of the grid over the same memory
+        PyErr_SetString(PyExc_ValueError, "give the buffers to split, or an origin argument");
+        goto done;
+    }
+    for (Py_ssize_t j = 0; j < buf_count; j++) {
+        if (split[j] && (!has_source[j] || sources[j].len < rows || sources[j].len % rows != 0)) {
+            PyErr_Format(PyExc_ValueError, "buffer %zd does not split into %lld rows", j, (long long)rows);
+            goto done;
+        }
+        row_bytes[j] = split[j] ? sources[j].len / rows : 0;
+        outputs[j] = split[j] && writable[j];
+    }
+    if (outputs_obj != NULL && outputs_obj != Py_None) {
+        if (group_indexes(outputs_obj, buf_count, outputs))
+            goto done;
+        for (Py_ssize_t j = 0; j < buf_count; j++) {
+            if (outputs[j] && !(split[j] && writable[j])) {
+                PyErr_Format(PyExc_ValueError, "output buffer %zd must be split and writable", j);
+                goto done;
+            }
+        }
     }
 
-    free(self->run_handle.bufs);
+    // Slices start at rows which keep every split buffer's views aligned
+    int64_t granule = 1;
+    for (Py_ssize_t j = 0; j < buf_count; j++) {
+        int64_t step = 1;
+        while (split[j] && (row_bytes[j] * step) % MC_VIEW_ALIGNMENT != 0)
+            step *= 2;
+        if (step > granule)
+            granule = step;
+    }
+    int64_t units = (rows + granule - 1) / granule;
+    double cumulative = 0;
+    int64_t start = 0;
+    Py_BEGIN_CRITICAL_SECTION(self);
+    for (Py_ssize_t i = 0; i < n; i++) {
+        cumulative += self->shares[i];
+        int64_t end = i == n - 1 ? rows : (int64_t)(cumulative * units + 0.5) * granule;
+        end = end > rows ? rows : end < start ? start : end;
+        partition[i * 2] = start;
+        partition[i * 2 + 1] = end;
+        start = end;
+    }
+    Py_END_CRITICAL_SECTION();
+
+    // Scatter and start a run on each device with rows to do
+    for (Py_ssize_t i = 0; i < n; i++) {
+        int64_t first = partition[i * 2], slice_rows = partition[i * 2 + 1] - first;
+        if (slice_rows == 0)
+            continue;
+        Device* dev = (Device*)PyTuple_GET_ITEM(self->kern->group->devices, i);
+        PyObject* run_args = PyTuple_New(buf_count + 1);
+        if (run_args == NULL)
+            goto done;
+        int64_t slice_dims[3] = { dims[0], dims[1], dims[2] };
+        slice_dims[axis] = slice_rows;
+        PyObject* grid = is_grid ? Py_BuildValue("(LLL)", (long long)slice_dims[0], (long long)slice_dims[1], (long long)slice_dims[2])
+                                 : PyLong_FromLongLong(slice_rows);
+        PyTuple_SET_ITEM(run_args, 0, grid);
+        int ok = grid != NULL;
+        for (Py_ssize_t j = 0; ok && j < buf_count; j++) {
+            int64_t offset = split[j] ? first * row_bytes[j] : 0;
+            int64_t length = split[j] ? slice_rows * row_bytes[j] : (int64_t)sources[j].len;
+            PyObject* buf = PyTuple_GET_ITEM(args, j + 1);
+            if (has_source[j]) {
+                buf = group_buffer(buf, dev, &sources[j], writable[j], offset, length, &temps[i * buf_count + j]);
+            } else if (j == origin) {
+                PyObject* first_obj = PyLong_FromLongLong(first);
+                buf = first_obj ? PyNumber_Add(buf, first_obj) : NULL;
+                Py_XDECREF(first_obj);
+            } else {
+                Py_INCREF(buf);
+            }
+            PyTuple_SET_ITEM(run_args, j + 1, buf);
+            ok = buf != NULL;
+        }
+        PyObject* init_args = ok ? Py_BuildValue("OOO", PyTuple_GET_ITEM(self->functions, i), run_args,
+                                                 run_kwargs ? run_kwargs : Py_None) : NULL;
+        Py_DECREF(run_args);
+        submitted[i] = monotonic_seconds();
+        runs[i] = init_args ? (Run*)PyObject_CallObject((PyObject*)state->RunType, init_args) : NULL;
+        Py_XDECREF(init_args);
+        if (runs[i] == NULL)
+            goto done;
+    }
 
-    self->fn_obj = fn_obj;
-    Py_INCREF(fn_obj);
-    // Keep this so that we have reference to all argument objects
-    self->tuple_bufs = tuple_bufs;
+    // Time each device to completion
+    Py_ssize_t remaining = 0;
+    Run** waiting = PyMem_Calloc(n, sizeof(Run*));
+    bool* complete = PyMem_Calloc(n, sizeof(bool));
+    Py_ssize_t* owner = PyMem_Calloc(n, sizeof(Py_ssize_t));
+    if (!waiting || !complete || !owner) {
+        PyMem_Free(waiting);
+        PyMem_Free(complete);
+        PyMem_Free(owner);
+        PyErr_NoMemory();
+        goto done;
+    }
+    for (Py_ssize_t i = 0; i < n; i++) {
+        if (runs[i] != NULL) {
+            waiting[remaining] = runs[i];
+            owner[remaining++] = i;
+        }
+    }
+    while (remaining > 0) {
+        if (wait_runs(state, remaining, waiting, false, -1, complete))
+            break;
+        double now = monotonic_seconds();
+        Py_ssize_t kept = 0;
+        for (Py_ssize_t k = 0; k < remaining; k++) {
+            if (complete[k]) {
+                seconds[owner[k]] = now - submitted[owner[k]];
+            } else {
+                waiting[kept] = waiting[k];
+                owner[kept++] = owner[k];
+            }
+        }
+        remaining = kept;
+    }
+    PyMem_Free(waiting);
+    PyMem_Free(complete);
+    PyMem_Free(owner);
+    if (remaining > 0)
+        goto done;
 
-    return 0;
+    // Gather results from copies back into the arguments
+    Py_BEGIN_ALLOW_THREADS
+    for (Py_ssize_t i = 0; i < n; i++) {
+        for (Py_ssize_t j = 0; j < buf_count; j++) {
+            Buffer* temp = temps[i * buf_count + j];
+            if (temp != NULL && outputs[j])
+                mc_copy((char*)sources[j].buf + partition[i * 2] * row_bytes[j], temp->buf_handle.buf, temp->length);
+        }
+    }
+    Py_END_ALLOW_THREADS
+    Py_BEGIN_CRITICAL_SECTION(self);
+    memcpy(self->partition, partition, n * 2 * sizeof(int64_t));
+    if (self->adaptive)
+        group_rebalance(self, seconds);
+    Py_END_CRITICAL_SECTION();
+    result = Py_None;
+    Py_INCREF(result);
+
+done:
+    for (Py_ssize_t i = 0; runs != NULL && i < n; i++)
+        Py_XDECREF(runs[i]); // Waits, if still running after an error
+    for (Py_ssize_t k = 0; temps != NULL && k < n * buf_count; k++)
+        Py_XDECREF(temps[k]);
+    for (Py_ssize_t j = 0; has_source != NULL && j < buf_count; j++) {
+        if (has_source[j])
+            PyBuffer_Release(&sources[j]);
+    }
+    Py_XDECREF(run_kwargs);
+    PyMem_Free(sources);
+    PyMem_Free(has_source);
+    PyMem_Free(writable);
+    PyMem_Free(split);
+    PyMem_Free(outputs);
+    PyMem_Free(row_bytes);
+    PyMem_Free(runs);
+    PyMem_Free(temps);
+    PyMem_Free(submitted);
+    PyMem_Free(seconds);
+    PyMem_Free(partition);
+    return result;
 }
 
-static void
-Run_dealloc(Run *self)
+static PyObject *
+GroupFunction_rebalance(GroupFunction* self, PyObject* args)
 {
-    if (self->run_handle.id != 0) {
-        mc_sw_run_close(&(self->run_handle));
-        Py_DECREF(self->tuple_bufs);
-        Py_DECREF(self->fn_obj);
+    PyObject* seconds_obj;
+    if (!PyArg_ParseTuple(args, "O", &seconds_obj))
+        return NULL;
+    PyObject* items = PySequence_Fast(seconds_obj, "seconds must be a sequence");
+    if (items == NULL)
+        return NULL;
+    if (PySequence_Fast_GET_SIZE(items) != self->count) {
+        Py_DECREF(items);
+        PyErr_Format(PyExc_ValueError, "expected seconds for %zd devices", self->count);
+        return NULL;
     }
-    Py_TYPE(self)->tp_free((PyObject *) self);
+    double* seconds = PyMem_Calloc(self->count, sizeof(double));
+    for (Py_ssize_t i = 0; seconds != NULL && i < self->count; i++)
+        seconds[i] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(items, i));
+    Py_DECREF(items);
+    if (seconds == NULL || PyErr_Occurred()) {
+        PyMem_Free(seconds);
+        return seconds == NULL ? PyErr_NoMemory() : NULL;
+    }
+    Py_BEGIN_CRITICAL_SECTION(self);
+    group_rebalance(self, seconds);
+    Py_END_CRITICAL_SECTION();
+    PyMem_Free(seconds);
+    Py_RETURN_NONE;
 }
 
 static PyObject *
-Run_str(Run* self)
+GroupFunction_get_shares(GroupFunction* self, void* closure)
 {
-    return PyUnicode_FromFormat("metalcompute.Run");
+    PyObject* shares = PyTuple_New(self->count);
+    Py_BEGIN_CRITICAL_SECTION(self);
+    for (Py_ssize_t i = 0; shares != NULL && i < self->count; i++) {
+        PyObject* share = PyFloat_FromDouble(self->shares[i]);
+        if (share == NULL)
+            Py_CLEAR(shares);
+        else
+            PyTuple_SET_ITEM(shares, i, share);
+    }
+    Py_END_CRITICAL_SECTION();
+    return shares;
+}
+
+static int
+GroupFunction_set_shares(GroupFunction* self, PyObject* value, void* closure)
+{
+    PyObject* items = value ? PySequence_Fast(value, "shares must be a sequence") : NULL;
+    if (items == NULL) {
+        if (value == NULL)
+            PyErr_SetString(PyExc_TypeError, "shares cannot be deleted");
+        return -1;
+    }
+    double total = 0;
+    double* shares = PyMem_Calloc(self->count, sizeof(double));
+    int ok = shares != NULL && PySequence_Fast_GET_SIZE(items) == self->count;
+    for (Py_ssize_t i = 0; ok && i < self->count; i++) {
+        shares[i] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(items, i));
+        ok = !PyErr_Occurred() && shares[i] >= 0;
+        total += shares[i];
+    }
+    Py_DECREF(items);
+    if (ok && total > 0) {
+        Py_BEGIN_CRITICAL_SECTION(self);
+        for (Py_ssize_t i = 0; i < self->count; i++)
+            self->shares[i] = shares[i] / total;
+        Py_END_CRITICAL_SECTION();
+    } else if (!PyErr_Occurred()) {
+        PyErr_Format(PyExc_ValueError, "shares must be %zd non-negative numbers, not all zero", self->count);
+    }
+    PyMem_Free(shares);
+    return PyErr_Occurred() ? -1 : 0;
+}
+
+static PyObject *
+GroupFunction_get_partition(GroupFunction* self, void* closure)
+{
+    PyObject* partition = PyTuple_New(self->count);
+    Py_BEGIN_CRITICAL_SECTION(self);
+    for (Py_ssize_t i = 0; partition != NULL && i < self->count; i++) {
+        PyObject* range = Py_BuildValue("(LL)", (long long)self->partition[i * 2], (long long)self->partition[i * 2 + 1]);
+        if (range == NULL)
+            Py_CLEAR(partition);
+        else
+            PyTuple_SET_ITEM(partition, i, range);
+    }
+    Py_END_CRITICAL_SECTION();
+    return partition;
 }
 
-static PyTypeObject RunType = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_name = "metalcompute.Run",
-    .tp_doc = "A Metal compute kernel function run",
-    .tp_basicsize = sizeof(Run),
-    .tp_itemsize = 0,
-    .tp_flags = Py_TPFLAGS_DEFAULT,
-    .tp_new = PyType_GenericNew,
-    .tp_init = (initproc) Run_init,
-    .tp_dealloc = (destructor) Run_dealloc,
-    .tp_str = (reprfunc) Run_str,
+static PyMethodDef GroupFunction_methods[] = {
+    {"rebalance", (PyCFunction) GroupFunction_rebalance, METH_VARARGS,
+     "Adjust shares from the seconds each device took for the last call's partition"},
+    {NULL}  /* Sentinel */
+};
+
+static PyGetSetDef GroupFunction_getset[] = {
+    {"shares", (getter) GroupFunction_get_shares, (setter) GroupFunction_set_shares,
+     "Fraction of each call given to each device", NULL},
+    {"partition", (getter) GroupFunction_get_partition, NULL,
+     "Rows (start, end) of the grid run by each device in the last call", NULL},
+    {NULL}  /* Sentinel */
+};
+
+static PyMemberDef GroupFunction_members[] = {
+    {"adaptive", T_BOOL, offsetof(GroupFunction, adaptive), 0,
+     "Rebalance shares after each call from measured throughput"},
+    {"functions", T_OBJECT, offsetof(GroupFunction, functions), READONLY,
+     "The function on each device"},
+    {NULL}  /* Sentinel */
+};
+
+static PyType_Slot GroupFunction_slots[] = {
+    {Py_tp_doc, "A Metal compute kernel function run across the devices of a group"},
+    {Py_tp_new, PyType_GenericNew},
+    {Py_tp_init, GroupFunction_init},
+    {Py_tp_dealloc, GroupFunction_dealloc},
+    {Py_tp_str, GroupFunction_str},
+    {Py_tp_call, GroupFunction_call},
+    {Py_tp_methods, GroupFunction_methods},
+    {Py_tp_getset, GroupFunction_getset},
+    {Py_tp_members, GroupFunction_members},
+    {0, NULL}
+};
+
+static PyType_Spec GroupFunction_spec = {
+    .name = "metalcompute.GroupFunction",
+    .basicsize = sizeof(GroupFunction),
+    .itemsize = 0,
+    .flags = MC_TYPE_FLAGS,
+    .slots = GroupFunction_slots,
 };
 
+static PyObject *
+mc_py_2_completion_fd(PyObject *self, PyObject *args)
+{
+    int fd = mc_notify_open();
+    if (fd < 0)
+        return PyErr_SetFromErrno(PyExc_OSError);
+    return PyLong_FromLong(fd);
+}
+
+
+static PyObject *
+mc_py_2_f32(PyObject *self, PyObject *arg)
+{
+    float value = (float)PyFloat_AsDouble(arg);
+    if (value == -1.0f && PyErr_Occurred())
+        return NULL;
+    return constant_new(PyModule_GetState(self), &value, sizeof(value));
+}
+
+static PyObject *
+mc_py_2_i32(PyObject *self, PyObject *arg)
+{
+    long value = PyLong_AsLong(arg);
+    if (value == -1 && PyErr_Occurred())
+        return NULL;
+    if (value < INT32_MIN || value > INT32_MAX) {
+        PyErr_SetString(PyExc_OverflowError, "i32 value out of range");
+        return NULL;
+    }
+    int32_t v = (int32_t)value;
+    return constant_new(PyModule_GetState(self), &v, sizeof(v));
+}
+
+static PyObject *
+mc_py_2_u32(PyObject *self, PyObject *arg)
+{
+    unsigned long value = PyLong_AsUnsignedLong(arg);
+    if (value == (unsigned long)-1 && PyErr_Occurred())
+        return NULL;
+    if (value > UINT32_MAX) {
+        PyErr_SetString(PyExc_OverflowError, "u32 value out of range");
+        return NULL;
+    }
+    uint32_t v = (uint32_t)value;
+    return constant_new(PyModule_GetState(self), &v, sizeof(v));
+}
+
+static PyObject *
+mc_py_2_bytes_arg(PyObject *self, PyObject *arg)
+{
+    Py_buffer view;
+    if (PyObject_GetBuffer(arg, &view, PyBUF_C_CONTIGUOUS))
+        return NULL;
+    PyObject* constant = constant_new(PyModule_GetState(self), view.buf, view.len);
+    PyBuffer_Release(&view);
+    return constant;
+}
 
 static PyMethodDef MetalComputeMethods[] = {
     // v0.1 functions - simple/deprecated
@@ -783,21 +5027,30 @@ static PyMethodDef MetalComputeMethods[] = {
 
     // v0.2 functions - more flexible/current
     { "get_devices", mc_py_2_get_devices, METH_VARARGS, "get_devices" },
+    { "stats", mc_py_2_stats, METH_NOARGS, "Backend counters" },
+    { "wait_all", (PyCFunction) mc_py_2_wait_all, METH_VARARGS | METH_KEYWORDS,
+      "Block until all runs complete, or timeout seconds pass. Returns True if all completed" },
+    { "wait_any", (PyCFunction) mc_py_2_wait_any, METH_VARARGS | METH_KEYWORDS,
+      "Block until any run completes, or timeout seconds pass. Returns a completed run, or None" },
+    { "completion_fd", mc_py_2_completion_fd, METH_NOARGS,
+      "New non-blocking fd which becomes readable when runs complete. Read to clear, close when done" },
+    { "copy_threads", (PyCFunction) mc_py_2_copy_threads, METH_VARARGS | METH_KEYWORDS,
+      "Threads sharing large copies into and out of buffers: copy_threads(threads). 0 for the default, 1 for none. Returns the setting" },
+    { "kernel_cache", (PyCFunction) mc_py_2_kernel_cache, METH_VARARGS | METH_KEYWORDS,
+      "Configure the compiled kernel cache: dir, memory_limit, disk_limit, clear" },
+    { "autotune_results", (PyCFunction) mc_py_2_autotune_results, METH_VARARGS | METH_KEYWORDS,
+      "Saved autotuning results, as {(function key, grid bucket): threadgroup}. clear=True removes them" },
+    { "f32", mc_py_2_f32, METH_O, "Float passed to a kernel inline, as a 32 bit float" },
+    { "i32", mc_py_2_i32, METH_O, "Int passed to a kernel inline, as a 32 bit signed int" },
+    { "u32", mc_py_2_u32, METH_O, "Int passed to a kernel inline, as a 32 bit unsigned int" },
+    { "bytes_arg", mc_py_2_bytes_arg, METH_O,
+      "Copy of the bytes of an object (e.g. from struct.pack), passed to a kernel inline. At most 4096 bytes" },
 
     // End
     {NULL, NULL, 0, NULL}        /* Sentinel */
 };
 
-static struct PyModuleDef metalcomputemodule = {
-    PyModuleDef_HEAD_INIT,
-    "metalcompute",   /* name of module */
-    "Run metal compute kernels", /* module documentation, may be NULL */
-    -1,       /* size of per-interpreter state of the module,
-                 or -1 if the module keeps state in global variables. */
-    MetalComputeMethods
-};
-
-void define_device_info_type() {
+static PyTypeObject* define_device_info_type(void) {
     PyStructSequence_Field fields[5] = {
         { .name="deviceName", .doc="" },
         { .name="recommendedWorkingSetSize", .doc="" },
@@ -810,57 +5063,158 @@ void define_device_info_type() {
         .doc = "",
         .fields = fields,
         .n_in_sequence = 4 };
-    DeviceInfo = PyStructSequence_NewType(&dev_item_desc);
+    return PyStructSequence_NewType(&dev_item_desc);
 }
 
-PyMODINIT_FUNC
-PyInit_metalcompute(void)
+static int
+metalcompute_exec(PyObject *m)
 {
     //printf("(creating stdout)\n"); // Uncomment if debugging swift code with print statements
 
-    if (PyType_Ready(&DeviceType) < 0)
-        return NULL;
-
-    if (PyType_Ready(&KernelType) < 0)
-        return NULL;
+    mc_state* state = PyModule_GetState(m);
 
-    if (PyType_Ready(&FunctionType) < 0)
-        return NULL;
+    state->error = PyErr_NewException("metalcompute.error", NULL, NULL);
+    if (state->error == NULL)
+        return -1;
+    Py_INCREF(state->error);
+    if (PyModule_AddObject(m, "error", state->error) < 0) {
+        Py_DECREF(state->error);
+        return -1;
+    }
 
-    if (PyType_Ready(&BufferType) < 0)
-        return NULL;
+    state->DeviceInfo = define_device_info_type();
+    if (state->DeviceInfo == NULL)
+        return -1;
 
-    if (PyType_Ready(&RunType) < 0)
-        return NULL;
+    // Each type is bound to this module, so its methods can find the state
+    if ((state->DeviceType = (PyTypeObject*)PyType_FromModuleAndSpec(m, &Device_spec, NULL)) == NULL
+        || (state->KernelType = (PyTypeObject*)PyType_FromModuleAndSpec(m, &Kernel_spec, NULL)) == NULL
+        || (state->KernelFutureType = (PyTypeObject*)PyType_FromModuleAndSpec(m, &KernelFuture_spec, NULL)) == NULL
+        || (state->FunctionType = (PyTypeObject*)PyType_FromModuleAndSpec(m, &Function_spec, NULL)) == NULL
+        || (state->BoundFunctionType = (PyTypeObject*)PyType_FromModuleAndSpec(m, &BoundFunction_spec, NULL)) == NULL
+        || (state->BufferType = (PyTypeObject*)PyType_FromModuleAndSpec(m, &Buffer_spec, NULL)) == NULL
+        || (state->ConstantType = (PyTypeObject*)PyType_FromModuleAndSpec(m, &Constant_spec, NULL)) == NULL
+        || (state->RunType = (PyTypeObject*)PyType_FromModuleAndSpec(m, &Run_spec, NULL)) == NULL
+        || (state->CommandListType = (PyTypeObject*)PyType_FromModuleAndSpec(m, &CommandList_spec, NULL)) == NULL
+        || (state->EventType = (PyTypeObject*)PyType_FromModuleAndSpec(m, &Event_spec, NULL)) == NULL
+        || (state->CommandStreamType = (PyTypeObject*)PyType_FromModuleAndSpec(m, &CommandStream_spec, NULL)) == NULL
+        || (state->StreamType = (PyTypeObject*)PyType_FromModuleAndSpec(m, &Stream_spec, NULL)) == NULL
+        || (state->DeviceGroupType = (PyTypeObject*)PyType_FromModuleAndSpec(m, &DeviceGroup_spec, NULL)) == NULL
+        || (state->GroupKernelType = (PyTypeObject*)PyType_FromModuleAndSpec(m, &GroupKernel_spec, NULL)) == NULL
+        || (state->GroupFunctionType = (PyTypeObject*)PyType_FromModuleAndSpec(m, &GroupFunction_spec, NULL)) == NULL)
+        return -1;
+    // Made only by methods of other objects, so cannot be created from python
+    state->ConstantType->tp_new = NULL;
+    state->KernelFutureType->tp_new = NULL;
+    state->BoundFunctionType->tp_new = NULL;
+
+    state->async_loops = PyDict_New();
+    state->async_ready_fn = PyCFunction_New(&async_ready_def, m);
+    state->tune_timer_fn = PyCFunction_New(&tune_timer_def, m);
+    if (state->async_loops == NULL || state->async_ready_fn == NULL || state->tune_timer_fn == NULL)
+        return -1;
+    Py_INCREF(state->tune_timer_fn);
+    if (PyModule_AddObject(m, "autotune_timer", state->tune_timer_fn) < 0) {
+        Py_DECREF(state->tune_timer_fn);
+        return -1;
+    }
 
-    PyObject *m;
+    if (PyModule_AddType(m, state->DeviceType) < 0)
+        return -1;
 
-    m = PyModule_Create(&metalcomputemodule);
-    if (m == NULL)
-        return NULL;
+    if (PyModule_AddType(m, state->DeviceGroupType) < 0)
+        return -1;
 
-    MetalComputeError = PyErr_NewException("metalcompute.error", NULL, NULL);
-    Py_XINCREF(MetalComputeError);
-    if (PyModule_AddObject(m, "error", MetalComputeError) < 0) {
-        Py_XDECREF(MetalComputeError);
-        Py_CLEAR(MetalComputeError);
-        Py_DECREF(m);
-        return NULL;
-    }
+    return 0;
+}
 
-    define_device_info_type();
-    
-    Py_INCREF(&DeviceType);
-    if (PyModule_AddObject(m, "Device", (PyObject *) &DeviceType) < 0) {
-        Py_XDECREF(MetalComputeError);
-        Py_DECREF(&DeviceType);
-        Py_DECREF(m);
-        return NULL;
-    }
+static int
+metalcompute_traverse(PyObject *m, visitproc visit, void *arg)
+{
+    mc_state* state = PyModule_GetState(m);
+    Py_VISIT(state->error);
+    Py_VISIT(state->DeviceInfo);
+    Py_VISIT(state->DeviceType);
+    Py_VISIT(state->KernelType);
+    Py_VISIT(state->FunctionType);
+    Py_VISIT(state->BoundFunctionType);
+    Py_VISIT(state->KernelFutureType);
+    Py_VISIT(state->BufferType);
+    Py_VISIT(state->ConstantType);
+    Py_VISIT(state->RunType);
+    Py_VISIT(state->CommandListType);
+    Py_VISIT(state->EventType);
+    Py_VISIT(state->CommandStreamType);
+    Py_VISIT(state->StreamType);
+    Py_VISIT(state->DeviceGroupType);
+    Py_VISIT(state->GroupKernelType);
+    Py_VISIT(state->GroupFunctionType);
+    Py_VISIT(state->tune_timer_fn);
+    Py_VISIT(state->async_loops);
+    Py_VISIT(state->async_ready_fn);
+    Py_VISIT(state->async_get_running_loop);
+    return 0;
+}
 
-    return m;
+static int
+metalcompute_clear(PyObject *m)
+{
+    mc_state* state = PyModule_GetState(m);
+    Py_CLEAR(state->error);
+    Py_CLEAR(state->DeviceInfo);
+    Py_CLEAR(state->DeviceType);
+    Py_CLEAR(state->KernelType);
+    Py_CLEAR(state->FunctionType);
+    Py_CLEAR(state->BoundFunctionType);
+    Py_CLEAR(state->KernelFutureType);
+    Py_CLEAR(state->BufferType);
+    Py_CLEAR(state->ConstantType);
+    Py_CLEAR(state->RunType);
+    Py_CLEAR(state->CommandListType);
+    Py_CLEAR(state->EventType);
+    Py_CLEAR(state->CommandStreamType);
+    Py_CLEAR(state->StreamType);
+    Py_CLEAR(state->DeviceGroupType);
+    Py_CLEAR(state->GroupKernelType);
+    Py_CLEAR(state->GroupFunctionType);
+    Py_CLEAR(state->tune_timer_fn);
+    Py_CLEAR(state->async_loops);
+    Py_CLEAR(state->async_ready_fn);
+    Py_CLEAR(state->async_get_running_loop);
+    return 0;
 }
 
+static void
+metalcompute_free(void *m)
+{
+    metalcompute_clear((PyObject *)m);
+}
 
+static PyModuleDef_Slot metalcompute_slots[] = {
+    {Py_mod_exec, metalcompute_exec},
+#ifdef Py_mod_multiple_interpreters
+    {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+#ifdef Py_mod_gil
+    {Py_mod_gil, Py_MOD_GIL_NOT_USED}, // Shared state is locked, objects use critical sections
+#endif
+    {0, NULL}
+};
 
+static struct PyModuleDef metalcomputemodule = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "metalcompute",
+    .m_doc = "Run metal compute kernels",
+    .m_size = sizeof(mc_state), // Per module, so each interpreter has its own
+    .m_methods = MetalComputeMethods,
+    .m_slots = metalcompute_slots,
+    .m_traverse = metalcompute_traverse,
+    .m_clear = metalcompute_clear,
+    .m_free = metalcompute_free,
+};
 
+PyMODINIT_FUNC
+PyInit_metalcompute(void)
+{
+    return PyModuleDef_Init(&metalcomputemodule);
+}
@@ -13,7 +13,7 @@ RetCode mc_sw_init(uint64_t device_index);
 RetCode mc_sw_release();
 RetCode mc_sw_compile(const char* program, const char* functionName);
 RetCode mc_sw_alloc(int icount, float* input, int iformat, int ocount, int oformat); // Allocate I/O buffers and fill input buffer
-RetCode mc_sw_run();
+RetCode mc_sw_run(int64_t kcount);
 RetCode mc_sw_retrieve(int ocount, float* output); // Copy results to output buffer
 char* mc_sw_get_compile_error(); // Must free after calling
 
@@ -40,33 +40,143 @@ typedef struct {
 
 typedef struct {
     int64_t id;
+    char* error; // Compiler message set by mc_sw_kern_open with FailedToCompile, freed by the caller
 } mc_kern_handle;
 
 typedef struct {
     int64_t id;
+    // Dispatch geometry of the function's pipeline, set by mc_sw_fn_open
+    int64_t thread_execution_width;
+    int64_t max_total_threads_per_threadgroup;
+    int64_t threadgroup_size; // Used for 1-D dispatch
+    uint64_t written_mask;    // Bit n set if [[ buffer(n) ]] may be written. Buffers past 63 may all be
 } mc_fn_handle;
 
 typedef struct {
     int64_t id;
-    char* buf;
+    char* buf;      // Start of this buffer's data, including offset
     int64_t length;
+    int64_t offset; // Bytes into the allocation with this id. Non-zero for views
 } mc_buf_handle;
 
+// A run's buf with id 0 is not a buffer, but length bytes at buf passed inline as a
+// constant argument, without allocating (setBytes). They are copied when the run opens.
+#define MC_INLINE_MAX 4096 // Largest inline argument, Metal's limit for setBytes
+
 typedef struct {
     int64_t id;
     int64_t kcount;
     int64_t buf_count;
     mc_buf_handle** bufs;
+    // Dispatch shape. A zero grid is a 1-D grid of kcount threads, and a zero
+    // threadgroup the function's default for the grid. Threads are dispatched
+    // exactly, so groups at the edges of the grid may be partial.
+    int64_t grid[3];
+    int64_t threadgroup[3];
+    int64_t threadgroup_mem_count;
+    int64_t* threadgroup_mem; // Bytes for each [[ threadgroup(index) ]] argument
+    // Runs which must complete before this one starts. Runs may otherwise execute
+    // concurrently with those submitted earlier. Closed runs count as complete.
+    int64_t dep_count;
+    const int64_t* deps;
+    int64_t stream; // Queue to submit to: a stream id, or 0 for the device's own queue
+    int64_t args;   // Arguments from mc_sw_args_open to use in place of bufs, or 0
 } mc_run_handle;
 
+typedef struct {
+    int64_t id;
+} mc_args_handle;
+
+typedef struct {
+    int64_t id;
+    int64_t priority; // Set before mc_sw_stream_open. Higher is run first, where the device can choose
+} mc_stream_handle;
+
+typedef struct {
+    int64_t id;
+} mc_event_handle;
+
 RetCode mc_sw_dev_open(uint64_t device_index, mc_dev_handle* dev_handle);
 RetCode mc_sw_dev_close(mc_dev_handle* dev_handle);
 RetCode mc_sw_kern_open(const mc_dev_handle* dev_handle, const char* program, mc_kern_handle* kern_handle);
 RetCode mc_sw_kern_close(const mc_dev_handle* dev_handle, mc_kern_handle* kern_handle);
+RetCode mc_sw_kern_cache_trim(int64_t max_bytes); // Evict compiled kernels from the in-process cache tier
 RetCode mc_sw_fn_open(const mc_dev_handle* dev_handle, const mc_kern_handle* kern_handle, const char* func_name, mc_fn_handle* fn_handle);
 RetCode mc_sw_fn_close(const mc_dev_handle* dev_handle, const mc_kern_handle* kern_handle, mc_fn_handle* fn_handle);
 RetCode mc_sw_buf_open(const mc_dev_handle* dev_handle, uint64_t length, char* src, mc_buf_handle* buf_handle);
+// Buffer of count items in format, converted from the items at src in src_format as
+// they are copied in, with flags from mc_convert.h. Gives UnsupportedInputFormat if
+// the formats do not convert.
+RetCode mc_sw_buf_convert(const mc_dev_handle* dev_handle, uint64_t count, const char* src, int64_t src_format,
+                          int64_t format, int64_t flags, mc_buf_handle* buf_handle);
+// Buffer using length bytes at data in place, without copying. The memory must stay valid
+// until the buffer is closed. Gives CannotWrapMemory unless data is page aligned and
+// length a whole number of pages, as Metal requires.
+RetCode mc_sw_buf_wrap(const mc_dev_handle* dev_handle, char* data, uint64_t length, mc_buf_handle* buf_handle);
 RetCode mc_sw_buf_close(const mc_dev_handle* dev_handle, mc_buf_handle* buf_handle);
+// Arguments resolved once for many runs: the buffers of count handles, which are
+// kept alive until mc_sw_args_close, and copies of the bytes of inline ones
+RetCode mc_sw_args_open(const mc_dev_handle* dev_handle, int64_t count, mc_buf_handle* const* bufs,
+                        mc_args_handle* args_handle);
+RetCode mc_sw_args_close(const mc_dev_handle* dev_handle, mc_args_handle* args_handle);
+// Buffer memory freed by mc_sw_buf_close is kept per device by size class,
+// and reused by later buffers of the same class
+typedef struct {
+    int64_t limit;          // High-water mark of cached bytes
+    int64_t cached_bytes;
+    int64_t cached_buffers;
+    int64_t hits;           // Buffers opened with recycled memory
+    int64_t misses;         // Buffers which needed a new allocation
+    int64_t evictions;      // Cached buffers freed by trimming
+} mc_pool_stats;
+
+// Set the limit (unless negative), trim cached memory down to trim_to bytes
+// (unless negative), then return the pool's stats
+RetCode mc_sw_buf_pool(const mc_dev_handle* dev_handle, int64_t limit, int64_t trim_to, mc_pool_stats* stats);
+// Working set size recommended for the device, and bytes it has allocated now,
+// including buffers wrapping host memory and cached pool memory
+RetCode mc_sw_dev_memory(const mc_dev_handle* dev_handle, int64_t* recommended, int64_t* allocated);
 RetCode mc_sw_run_open(const mc_dev_handle* dev_handle, const mc_kern_handle* kern_handle,
                      const mc_fn_handle* fn_handle, mc_run_handle* run_handle);
-RetCode mc_sw_run_close(const mc_run_handle* run_handle);
+// One dispatch of a batch. kcount and bufs are given in run_handle, as for mc_sw_run_open
+typedef struct {
+    const mc_kern_handle* kern_handle;
+    const mc_fn_handle* fn_handle;
+    const mc_run_handle* run_handle;
+} mc_dispatch;
+
+// Submit dispatches in order as one command buffer, with a memory barrier between each.
+// Gives a single run, which is waited on and closed like one from mc_sw_run_open.
+RetCode mc_sw_batch_open(const mc_dev_handle* dev_handle, int64_t count, const mc_dispatch* dispatches,
+                         mc_run_handle* run_handle);
+RetCode mc_sw_run_close(const mc_run_handle* run_handle); // Waits for the run to complete
+// Wait until all (or any) of the runs are complete, or timeout seconds have passed.
+// A negative timeout waits without limit, 0 only polls. Sets complete[i] for each run.
+RetCode mc_sw_run_wait(int64_t count, const mc_run_handle* const* run_handles, bool all,
+                       double timeout, bool* complete);
+
+// Streams are further command queues of a device. Work on different streams is
+// independent, except through events and the deps of runs.
+RetCode mc_sw_stream_open(const mc_dev_handle* dev_handle, mc_stream_handle* stream_handle);
+RetCode mc_sw_stream_close(const mc_stream_handle* stream_handle);
+// Events hold a value, raised by streams or the host, which streams can wait for
+RetCode mc_sw_event_open(const mc_dev_handle* dev_handle, mc_event_handle* event_handle);
+RetCode mc_sw_event_close(const mc_event_handle* event_handle);
+// Set the event to value once the work submitted to the stream so far has completed
+RetCode mc_sw_stream_signal(const mc_stream_handle* stream_handle, const mc_event_handle* event_handle,
+                            uint64_t value);
+// Work submitted to the stream from now on starts only once the event reaches value
+RetCode mc_sw_stream_wait(const mc_stream_handle* stream_handle, const mc_event_handle* event_handle,
+                          uint64_t value);
+RetCode mc_sw_event_signal(const mc_event_handle* event_handle, uint64_t value); // From the host
+// Wait until the event reaches value, or timeout seconds have passed (as for mc_sw_run_wait).
+// Sets the event's value at return.
+RetCode mc_sw_event_wait(const mc_event_handle* event_handle, uint64_t value, double timeout, uint64_t* current);
+
+// Backend counters, for tests and benchmarks
+
+typedef struct {
+    int64_t pipelines_created;
+} mc_stats;
+
+RetCode mc_sw_get_stats(mc_stats* stats);
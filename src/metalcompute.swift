@@ -19,14 +19,14 @@ let FailedToFindFunction:RetCode = -5
 let NotReadyToCompute:RetCode = -6
 let FailedToMakeInputBuffer:RetCode = -7
 let FailedToMakeOutputBuffer:RetCode = -8
-let NotReadyToRun:RetCode = -8
-let CannotCreateCommandBuffer:RetCode = -9
-let CannotCreateCommandEncoder:RetCode = -10
-let CannotCreatePipelineState:RetCode = -11
-let IncorrectOutputCount:RetCode = -12
-let NotReadyToRetrieve:RetCode = -13
-let UnsupportedInputFormat:RetCode = -14
-let UnsupportedOutputFormat:RetCode = -15
+let NotReadyToRun:RetCode = -9
+let CannotCreateCommandBuffer:RetCode = -10
+let CannotCreateCommandEncoder:RetCode = -11
+let CannotCreatePipelineState:RetCode = -12
+let IncorrectOutputCount:RetCode = -13
+let NotReadyToRetrieve:RetCode = -14
+let UnsupportedInputFormat:RetCode = -15
+let UnsupportedOutputFormat:RetCode = -16
 
 // v2 errors
 let DeviceNotFound:RetCode = -1000
@@ -36,6 +36,10 @@ let CouldNotMakeBuffer:RetCode = -1003
 let BufferNotFound:RetCode = -1004
 let RunNotFound:RetCode = -1005
 let DeviceBuffersAllocated:RetCode = -1006
+let InvalidDispatch:RetCode = -1007
+let CannotWrapMemory:RetCode = -1008
+let StreamNotFound:RetCode = -1009
+let EventNotFound:RetCode = -1010
 
 // Buffer formats
 let FormatUnknown = -1
@@ -63,6 +67,7 @@ var device:MTLDevice?
 var commandQueue:MTLCommandQueue?
 var library:MTLLibrary?
 var function:MTLFunction?
+var pipelineState:MTLComputePipelineState?
 var inputBuffer:MTLBuffer?
 var inputCount:Int = 0;
 var inputStride:Int = 0
@@ -74,6 +79,50 @@ var readyToCompute = false
 var readyToRun = false
 var readyToRetrieve = false
 var compileError:String = ""
+var pipelinesCreated:Int64 = 0 // Reported by mc_sw_get_stats
+let mc_globals_lock = NSLock() // For compileError and pipelinesCreated, set from any thread
+
+// Threadgroup size used for 1-D dispatch: the largest multiple
+// of the SIMD width which fits in one threadgroup
+func default_threadgroup_size(_ pipeline:MTLComputePipelineState) -> Int {
+    let w = pipeline.threadExecutionWidth
+    let h = pipeline.maxTotalThreadsPerThreadgroup / w
+    return w * h
+}
+
+// Pipelines of a kernel with a new archive are added to it and saved.
+// If written is given, it is set to the mask of buffer indices the function may write.
+func make_pipeline(_ dev:MTLDevice, _ fn:MTLFunction, _ kern:mc_sw_kern? = nil,
+                   _ written:UnsafeMutablePointer<UInt64>? = nil) -> MTLComputePipelineState? {
+    let descriptor = MTLComputePipelineDescriptor()
+    descriptor.computeFunction = fn
+    if let archive = kern?.archive {
+        descriptor.binaryArchives = [archive]
+    }
+    var reflection:MTLAutoreleasedComputePipelineReflection? = nil
+    let options:MTLPipelineOption = written != nil ? [.bindingInfo] : []
+    guard let pipeline = try? dev.makeComputePipelineState(descriptor: descriptor, options: options, reflection: &reflection) else { return nil }
+    mc_globals_lock.lock()
+    pipelinesCreated += 1
+    mc_globals_lock.unlock()
+    if let written = written {
+        var mask:UInt64 = reflection == nil ? ~0 : 0
+        for binding in reflection?.bindings ?? [] where binding.type == .buffer && binding.access != .readOnly {
+            mask |= binding.index < 64 ? UInt64(1) << UInt64(binding.index) : 0
+        }
+        written.pointee = mask
+    }
+    if let archive = kern?.archive, let path = kern?.archive_path {
+        var tmp_buf = [CChar](repeating: 0, count: 4200)
+        mc_cache_tmp_path(path, &tmp_buf, tmp_buf.count)
+        let tmp_path = String(cString: tmp_buf)
+        if (try? archive.addComputePipelineFunctions(descriptor: descriptor)) != nil,
+           (try? archive.serialize(to: URL(fileURLWithPath: tmp_path))) != nil {
+            mc_cache_commit(tmp_path, path)
+        }
+    }
+    return pipeline
+}
 
 @_cdecl("mc_sw_init") public func mc_sw_init(device_index_i64:Int64) -> RetCode {
     let device_index = Int(device_index_i64)
@@ -104,6 +153,7 @@ var compileError:String = ""
     inputBuffer = nil
     outputBuffer = nil
     function = nil
+    pipelineState = nil
     library = nil
     device = nil
     readyToCompile = false
@@ -135,6 +185,12 @@ var compileError:String = ""
         return FailedToCompile
     }
 
+    // Pipeline is reused by every mc_sw_run until the next compile
+    guard let lFunction = function, let newPipelineState = make_pipeline(lDevice, lFunction) else {
+        return CannotCreatePipelineState
+    }
+    pipelineState = newPipelineState
+
     readyToCompute = true
     readyToRun = false
 
@@ -142,12 +198,19 @@ var compileError:String = ""
 }
 
 func get_stride(_ format: Int) -> Int {
-    if (format == FormatF32) {
-        return MemoryLayout<Float>.stride;
-    } else if (format == FormatU8) {
-        return MemoryLayout<UInt8>.stride;
-    } else {
-        return 0;
+    switch format {
+    case FormatI8: return MemoryLayout<Int8>.stride
+    case FormatU8: return MemoryLayout<UInt8>.stride
+    case FormatI16: return MemoryLayout<Int16>.stride
+    case FormatU16: return MemoryLayout<UInt16>.stride
+    case FormatI32: return MemoryLayout<Int32>.stride
+    case FormatU32: return MemoryLayout<UInt32>.stride
+    case FormatI64: return MemoryLayout<Int64>.stride
+    case FormatU64: return MemoryLayout<UInt64>.stride
+    case FormatF16: return MemoryLayout<UInt16>.stride // Float16 is not available on x86_64 macOS
+    case FormatF32: return MemoryLayout<Float>.stride
+    case FormatF64: return MemoryLayout<Double>.stride
+    default: return 0
     }
 }
 
@@ -163,7 +226,8 @@ func get_stride(_ format: Int) -> Int {
     outputStride = get_stride(oformat);
     guard outputStride != 0 else { return UnsupportedOutputFormat }
 
-    guard let newInputBuffer = lDevice.makeBuffer(bytes: input, length: inputStride * icount, options: .storageModeShared) else { return FailedToMakeInputBuffer }
+    guard let newInputBuffer = lDevice.makeBuffer(length: inputStride * icount, options: .storageModeShared) else { return FailedToMakeInputBuffer }
+    mc_copy(newInputBuffer.contents(), input, inputStride * icount)
     guard let newOutputBuffer = lDevice.makeBuffer(length: outputStride * ocount, options: .storageModeShared) else { return FailedToMakeOutputBuffer }
 
     inputBuffer = newInputBuffer
@@ -179,32 +243,23 @@ func get_stride(_ format: Int) -> Int {
 @_cdecl("mc_sw_run") public func mc_sw_run(kcount:Int) -> RetCode {
     // Execute the configured compute task, waiting for completion
     guard readyToRun else { return NotReadyToRun }
-    guard let lDevice = device else { return NotReadyToRun }
-    guard let lFunction = function else { return NotReadyToRun }
+    guard let lPipelineState = pipelineState else { return NotReadyToRun }
     guard let lCommandQueue = commandQueue else { return NotReadyToRun }
     guard let lInputBuffer = inputBuffer else { return NotReadyToRun }
     guard let lOutputBuffer = outputBuffer else { return NotReadyToRun }
     guard let commandBuffer = lCommandQueue.makeCommandBuffer() else { return CannotCreateCommandBuffer }
     guard let encoder = commandBuffer.makeComputeCommandEncoder() else { return CannotCreateCommandEncoder }
 
-    do {
-        let pipelineState = try lDevice.makeComputePipelineState(function:lFunction)
-        encoder.setComputePipelineState(pipelineState);
-        encoder.setBuffer(lInputBuffer, offset: 0, index: 0)
-        encoder.setBuffer(lOutputBuffer, offset: 0, index: 1)
-        let w = pipelineState.threadExecutionWidth
-        let h = pipelineState.maxTotalThreadsPerThreadgroup / w
-        let numThreadgroups = MTLSize(width: (kcount+(w*h-1))/(w*h), height: 1, depth: 1)
-        let threadsPerThreadgroup = MTLSize(width: w*h, height: 1, depth: 1)
-        //print(numThreadgroups, threadsPerThreadgroup)
-        encoder.dispatchThreadgroups(numThreadgroups, threadsPerThreadgroup: threadsPerThreadgroup)
-        encoder.endEncoding()
-        commandBuffer.commit()
-        commandBuffer.waitUntilCompleted()
-
-    } catch {
-        return CannotCreatePipelineState
-    }
+    encoder.setComputePipelineState(lPipelineState);
+    encoder.setBuffer(lInputBuffer, offset: 0, index: 0)
+    encoder.setBuffer(lOutputBuffer, offset: 0, index: 1)
+    let group = default_threadgroup_size(lPipelineState)
+    let numThreadgroups = MTLSize(width: (kcount+(group-1))/group, height: 1, depth: 1)
+    let threadsPerThreadgroup = MTLSize(width: group, height: 1, depth: 1)
+    encoder.dispatchThreadgroups(numThreadgroups, threadsPerThreadgroup: threadsPerThreadgroup)
+    encoder.endEncoding()
+    commandBuffer.commit()
+    commandBuffer.waitUntilCompleted()
 
     readyToRetrieve = true
 
@@ -217,12 +272,14 @@ func get_stride(_ format: Int) -> Int {
     guard ocount == outputCount else { return IncorrectOutputCount }
     guard let lOutputBuffer = outputBuffer else { return NotReadyToRetrieve }
 
-    output.copyMemory(from: lOutputBuffer.contents(), byteCount: outputCount * outputStride)
+    mc_copy(output, lOutputBuffer.contents(), outputCount * outputStride)
 
     return Success
 }
 
 @_cdecl("mc_sw_get_compile_error") public func mc_sw_get_compile_error() -> UnsafeMutablePointer<CChar> {
+    mc_globals_lock.lock()
+    defer { mc_globals_lock.unlock() }
     return strdup(compileError)
 }
 
@@ -237,55 +294,328 @@ func get_stride(_ format: Int) -> Int {
 
 class mc_sw_buf {
     let buf:MTLBuffer
-    init(_ buf:MTLBuffer) {
+    let pool:mc_sw_pool? // Nil for wrapped memory, which belongs to the caller
+    init(_ buf:MTLBuffer, _ pool:mc_sw_pool?) {
         self.buf = buf
+        self.pool = pool
     }
     deinit {
-        self.buf.setPurgeableState(MTLPurgeableState.empty)
+        pool?.put(buf) // Closed only once no run uses it, so safe to reuse
     }
 }
 
+// Buffer pool. Freed buffers are kept by size class and reused by later
+// buffers of the same class, up to a high-water mark of cached bytes.
+// Classes are a page, then four steps per power of two.
+
+let mc_sw_pool_limit:Int64 = 64 << 20
+
+func pool_class_size(_ length:Int) -> Int {
+    if length <= 4096 { return 4096 }
+    let n = length - 1
+    let step = 1 << (Int.bitWidth - 1 - n.leadingZeroBitCount - 2)
+    return (n / step + 1) * step
+}
+
+final class mc_sw_pool {
+    private let lock = NSLock()
+    private var free:[Int:[MTLBuffer]] = [:]
+    private var stats = mc_pool_stats(limit: mc_sw_pool_limit, cached_bytes: 0, cached_buffers: 0,
+                                      hits: 0, misses: 0, evictions: 0)
+
+    func get(_ size:Int) -> MTLBuffer? {
+        lock.lock()
+        defer { lock.unlock() }
+        guard let buf = free[size]?.popLast() else {
+            stats.misses += 1
+            return nil
+        }
+        stats.hits += 1
+        stats.cached_bytes -= Int64(size)
+        stats.cached_buffers -= 1
+        return buf
+    }
+
+    func put(_ buf:MTLBuffer) {
+        lock.lock()
+        defer { lock.unlock() }
+        guard stats.cached_bytes + Int64(buf.length) <= stats.limit else {
+            buf.setPurgeableState(MTLPurgeableState.empty)
+            return
+        }
+        free[buf.length, default: []].append(buf)
+        stats.cached_bytes += Int64(buf.length)
+        stats.cached_buffers += 1
+    }
+
+    // Free cached buffers, largest first, until at most max_bytes remain
+    private func trim_locked(_ max_bytes:Int64) {
+        for size in free.keys.sorted(by: >) where stats.cached_bytes > max_bytes {
+            while stats.cached_bytes > max_bytes, let buf = free[size]?.popLast() {
+                buf.setPurgeableState(MTLPurgeableState.empty)
+                stats.cached_bytes -= Int64(size)
+                stats.cached_buffers -= 1
+                stats.evictions += 1
+            }
+        }
+        free = free.filter { !$0.value.isEmpty }
+    }
+
+    func trim(_ max_bytes:Int64) {
+        lock.lock()
+        trim_locked(max_bytes)
+        lock.unlock()
+    }
+
+    func configure(_ limit:Int64, _ trim_to:Int64) -> mc_pool_stats {
+        lock.lock()
+        defer { lock.unlock() }
+        if limit >= 0 {
+            stats.limit = limit
+            trim_locked(limit)
+        }
+        if trim_to >= 0 {
+            trim_locked(trim_to)
+        }
+        return stats
+    }
+}
+
+// Function with its pipeline state, created once when the function is
+// opened rather than on every run
 class mc_sw_fn {
     let fn:MTLFunction
-    init(_ fn:MTLFunction) {
+    let pipeline:MTLComputePipelineState
+    let threadgroup_size:Int
+    init(_ fn:MTLFunction, _ pipeline:MTLComputePipelineState) {
         self.fn = fn
+        self.pipeline = pipeline
+        self.threadgroup_size = default_threadgroup_size(pipeline)
+    }
+}
+
+// Slab of objects addressed by generation checked ids
+//
+// id = generation << 32 | (slot index + 1)
+// Lookup is O(1). Closing a slot bumps its generation, so a stale id
+// can never reach an object which later reuses the same slot.
+// Each table has its own lock, held only for the lookup or update, so callers
+// on different threads contend only when they use the same table. Devices
+// have their own kernel and buffer tables, which shards those by device.
+final class mc_sw_table<T: AnyObject> {
+    private let lock = NSLock()
+    private var slots:[T?] = []
+    private var generations:[UInt32] = []
+    private var free_slots:[Int] = []
+
+    var count:Int {
+        lock.lock()
+        defer { lock.unlock() }
+        return slots.count - free_slots.count
+    }
+
+    func insert(_ obj:T) -> Int64 {
+        lock.lock()
+        defer { lock.unlock() }
+        var index:Int
+        if let reused = free_slots.popLast() {
+            index = reused
+            slots[index] = obj
+        } else {
+            index = slots.count
+            slots.append(obj)
+            generations.append(1)
+        }
+        return (Int64(generations[index]) << 32) | Int64(index + 1)
+    }
+
+    private func slot(_ id:Int64) -> Int? {
+        let index = Int(id & 0xffff_ffff) - 1
+        guard index >= 0 && index < slots.count else { return nil }
+        guard generations[index] == UInt32(truncatingIfNeeded: id >> 32) else { return nil }
+        return index
+    }
+
+    subscript(id:Int64) -> T? {
+        lock.lock()
+        defer { lock.unlock() }
+        guard let index = slot(id) else { return nil }
+        return slots[index]
+    }
+
+    @discardableResult func remove(_ id:Int64) -> T? {
+        lock.lock()
+        defer { lock.unlock() }
+        guard let index = slot(id), let obj = slots[index] else { return nil }
+        slots[index] = nil
+        generations[index] = (generations[index] &+ 1) & 0x7fff_ffff
+        free_slots.append(index)
+        return obj
     }
 }
 
 class mc_sw_kern {
     let lib:MTLLibrary
-    var fns:[Int64:mc_sw_fn] = [:]
-    init(_ lib:MTLLibrary) {
+    let archive:MTLBinaryArchive?
+    let archive_path:String? // Set when the archive is new and should be saved
+    let fns = mc_sw_table<mc_sw_fn>()
+    init(_ lib:MTLLibrary, _ archive:MTLBinaryArchive?, _ archive_path:String?) {
         self.lib = lib
+        self.archive = archive
+        self.archive_path = archive_path
+    }
+}
+
+// Kernel cache
+//
+// In-process tier: libraries by source key, least recently used evicted
+// first once over the memory limit. Source length stands in for size.
+// On-disk tier (mc_cache): a binary archive of the pipelines built from
+// each source, so warm processes skip compiling them for the GPU.
+
+let mc_sw_cache_backend = "metal-archive-1"
+let mc_sw_cache_options = "fastMath=1;languageVersion=2.3" // Must match kern_open
+
+final class mc_sw_lib_cache {
+    private let lock = NSLock() // Not held while compiling
+    private var entries:[String:(lib:MTLLibrary, bytes:Int, used:UInt64)] = [:]
+    private var tick:UInt64 = 0
+    private var bytes = 0
+
+    func lookup(_ key:String) -> MTLLibrary? {
+        lock.lock()
+        defer { lock.unlock() }
+        guard let entry = entries[key] else { return nil }
+        tick += 1
+        entries[key] = (entry.lib, entry.bytes, tick)
+        return entry.lib
+    }
+
+    func insert(_ key:String, _ lib:MTLLibrary, _ size:Int) {
+        lock.lock()
+        defer { lock.unlock() }
+        if let old = entries[key] {
+            bytes -= old.bytes
+        }
+        tick += 1
+        entries[key] = (lib, size, tick)
+        bytes += size
+        trim_locked(Int(mc_cache_memory_limit()))
+    }
+
+    func trim(_ limit:Int) {
+        lock.lock()
+        trim_locked(limit)
+        lock.unlock()
+    }
+
+    private func trim_locked(_ limit:Int) {
+        while bytes > limit, let oldest = entries.min(by: { $0.value.used < $1.value.used }) {
+            entries.removeValue(forKey: oldest.key)
+            bytes -= oldest.value.bytes
+            mc_cache_count(MC_CACHE_EVICTION)
+        }
+        mc_cache_set_memory_usage(Int64(entries.count), Int64(bytes))
+    }
+}
+
+let mc_lib_cache = mc_sw_lib_cache()
+
+func cache_key(_ dev:MTLDevice, _ program:String) -> String {
+    var key = [CChar](repeating: 0, count: Int(MC_CACHE_KEY_SIZE))
+    mc_cache_key(mc_sw_cache_backend, "\(dev.name) \(dev.registryID)", mc_sw_cache_options, program, &key)
+    return String(cString: key)
+}
+
+func cache_path(_ key:String, _ ext:String) -> String? {
+    var path = [CChar](repeating: 0, count: 4096)
+    guard mc_cache_path(key, ext, &path, path.count) != 0 else { return nil }
+    return String(cString: path)
+}
+
+// Command queue: the device's own, or a stream. Each command buffer committed
+// raises the queue's timeline event to its sequence number as it completes, so
+// runs on other queues can wait for it. Command buffers of a queue execute in
+// the order they are committed, so the timeline only rises. Threads committing
+// to the same queue take turns, so that order matches the sequence numbers.
+final class mc_sw_queue {
+    let queue:MTLCommandQueue
+    let timeline:MTLSharedEvent
+    let priority:Int64 // Metal has no queue priorities, so this is only kept
+    let submit = NSLock() // Held from taking a sequence number until commit
+    var committed:UInt64 = 0 // Locked by submit and mc_cbs_lock
+    init(_ queue:MTLCommandQueue, _ timeline:MTLSharedEvent, _ priority:Int64) {
+        self.queue = queue
+        self.timeline = timeline
+        self.priority = priority
+    }
+}
+
+final class mc_sw_event {
+    let event:MTLSharedEvent
+    init(_ event:MTLSharedEvent) {
+        self.event = event
     }
 }
 
 class mc_sw_dev {
     let dev:MTLDevice
-    let queue:MTLCommandQueue
-    var kerns:[Int64:mc_sw_kern] = [:]
-    var bufs:[Int64:mc_sw_buf] = [:]
-    init(_ dev:MTLDevice, _ queue:MTLCommandQueue) {
+    let queue:mc_sw_queue
+    let nonuniform:Bool // Can dispatch grids which are not a multiple of the threadgroup size
+    let kerns = mc_sw_table<mc_sw_kern>()
+    let bufs = mc_sw_table<mc_sw_buf>()
+    let args = mc_sw_table<mc_sw_args>()
+    let pool = mc_sw_pool()
+    let pressure:DispatchSourceMemoryPressure
+    init(_ dev:MTLDevice, _ queue:mc_sw_queue) {
         self.dev = dev
         self.queue = queue
+        self.nonuniform = dev.supportsFamily(.apple4) || dev.supportsFamily(.mac2)
+        // Give back cached buffers when the system is short of memory
+        self.pressure = DispatchSource.makeMemoryPressureSource(eventMask: [.warning, .critical], queue: .global())
+        self.pressure.setEventHandler { [pool] in pool.trim(0) }
+        self.pressure.resume()
+    }
+    deinit {
+        pressure.cancel()
     }
 }
 
+// Run record. Retired when both the GPU (completion handler)
+// and python (mc_sw_run_close) are done with it, whichever is last.
 class mc_sw_cb {
     let dev_id:Int64
     let cb:MTLCommandBuffer
+    let queue:mc_sw_queue
+    let value:UInt64 // Of the queue's timeline once complete
     var running = true
     var released = false
-    init(_ dev_id:Int64, _ cb:MTLCommandBuffer) {
+    init(_ dev_id:Int64, _ cb:MTLCommandBuffer, _ queue:mc_sw_queue, _ value:UInt64) {
         self.dev_id = dev_id
         self.cb = cb
+        self.queue = queue
+        self.value = value
     }
 }
 
-// Index of next object
-var mc_next_index:Int64 = 4242 
-var mc_devs:[Int64:mc_sw_dev] = [:]
-var mc_cbs:[Int64:mc_sw_cb] = [:]
+let mc_devs = mc_sw_table<mc_sw_dev>()
+let mc_cbs = mc_sw_table<mc_sw_cb>()
+let mc_streams = mc_sw_table<mc_sw_queue>()
+let mc_events = mc_sw_table<mc_sw_event>()
+let mc_event_listener = MTLSharedEventListener()
+let mc_cbs_lock = NSCondition() // Completion handlers run on a Metal thread, and wake waiters
+
+func mc_sw_run_completed(_ run_id:Int64) {
+    mc_cbs_lock.lock()
+    defer { mc_cbs_lock.unlock() }
+    guard let sw_cb = mc_cbs[run_id] else { return }
+    sw_cb.running = false
+    mc_cbs_lock.broadcast()
+    mc_notify_signal() // Wakes event loops waiting on completions
+    if sw_cb.released {
+        mc_cbs.remove(run_id)
+    }
+}
 
 @_cdecl("mc_sw_count_devs") public func mc_sw_get_devices(devices: UnsafeMutablePointer<mc_devices>) -> RetCode {
     let metal_devices = MTLCopyAllDevices()
@@ -319,15 +649,13 @@ var mc_cbs:[Int64:mc_sw_cb] = [:]
         return CannotCreateDevice
     }
     let newDevice = device_index < 0 ? defaultDevice : devices[device_index] 
-    guard let newCommandQueue = newDevice.makeCommandQueue() else {
+    guard let newCommandQueue = newDevice.makeCommandQueue(), let timeline = newDevice.makeSharedEvent() else {
         return CannotCreateCommandQueue 
     } 
 
     // Return device object
-    let dev_obj = mc_sw_dev(newDevice, newCommandQueue)
-    let id = mc_next_index
-    mc_next_index += 1
-    mc_devs[id] = dev_obj // Store the dev
+    let dev_obj = mc_sw_dev(newDevice, mc_sw_queue(newCommandQueue, timeline, 0))
+    let id = mc_devs.insert(dev_obj) // Store the dev
     dev_handle[0].id = id // Return id of dev
     dev_handle[0].name = strdup(newDevice.name) // Python must free this later
 
@@ -337,7 +665,7 @@ var mc_cbs:[Int64:mc_sw_cb] = [:]
 @_cdecl("mc_sw_dev_close") public func mc_sw_dev_close(handle: UnsafeMutablePointer<mc_dev_handle>) -> RetCode {
     guard let sw_dev = mc_devs[handle[0].id] else { return DeviceNotFound }
     guard sw_dev.bufs.count == 0 else { return DeviceBuffersAllocated }
-    mc_devs.removeValue(forKey: handle[0].id)
+    mc_devs.remove(handle[0].id)
     return Success
 }
 
@@ -345,26 +673,57 @@ var mc_cbs:[Int64:mc_sw_cb] = [:]
         dev_handle: UnsafePointer<mc_dev_handle>, 
         program_raw: UnsafePointer<CChar>, 
         kern_handle: UnsafeMutablePointer<mc_kern_handle>) -> RetCode {
+    kern_handle[0].error = nil
     guard let sw_dev = mc_devs[dev_handle[0].id] else { return DeviceNotFound }
 
     // Convert c strings to Swift String
     let program = String(cString:program_raw)
-
-    let options = MTLCompileOptions();
-    options.fastMathEnabled = true
-    options.languageVersion = .version2_3
-
-    do {
-        let newLibrary = try sw_dev.dev.makeLibrary(source: program, options:options) 
-        let kern = mc_sw_kern(newLibrary)
-        let id = mc_next_index
-        mc_next_index += 1
-        sw_dev.kerns[id] = kern
-        kern_handle[0].id = id 
-    } catch {
-        compileError = error.localizedDescription
-        return FailedToCompile
+    let key = cache_key(sw_dev.dev, program)
+
+    var library = mc_lib_cache.lookup(key)
+    let memory_hit = library != nil
+    if !memory_hit {
+        let options = MTLCompileOptions();
+        options.fastMathEnabled = true
+        options.languageVersion = .version2_3
+
+        do {
+            let newLibrary = try sw_dev.dev.makeLibrary(source: program, options:options) 
+            mc_lib_cache.insert(key, newLibrary, program.utf8.count)
+            library = newLibrary
+        } catch {
+            // Given to this caller alone, as compiles run concurrently
+            kern_handle[0].error = strdup(error.localizedDescription)
+            return FailedToCompile
+        }
+    }
+    guard let newLibrary = library else { return FailedToCompile }
+
+    // Pipelines built from this source by earlier processes
+    var archive:MTLBinaryArchive? = nil
+    var archive_path:String? = nil
+    var disk_hit = false
+    if let path = cache_path(key, "metalarchive") {
+        let descriptor = MTLBinaryArchiveDescriptor()
+        if FileManager.default.fileExists(atPath: path) {
+            descriptor.url = URL(fileURLWithPath: path)
+            archive = try? sw_dev.dev.makeBinaryArchive(descriptor: descriptor)
+            disk_hit = archive != nil
+            if disk_hit {
+                // Recently used, for trimming
+                try? FileManager.default.setAttributes([.modificationDate: Date()], ofItemAtPath: path)
+            }
+        }
+        if archive == nil {
+            descriptor.url = nil
+            archive = try? sw_dev.dev.makeBinaryArchive(descriptor: descriptor)
+            archive_path = path
+        }
     }
+    mc_cache_count(memory_hit ? MC_CACHE_MEMORY_HIT : (disk_hit ? MC_CACHE_DISK_HIT : MC_CACHE_MISS))
+
+    let kern = mc_sw_kern(newLibrary, archive, archive_path)
+    kern_handle[0].id = sw_dev.kerns.insert(kern)
 
     return Success; 
 }
@@ -373,12 +732,17 @@ var mc_cbs:[Int64:mc_sw_cb] = [:]
         dev_handle: UnsafePointer<mc_dev_handle>,
         kern_handle: UnsafeMutablePointer<mc_kern_handle>) -> RetCode {
     guard let sw_dev = mc_devs[dev_handle[0].id] else { return DeviceNotFound }
-    guard sw_dev.kerns.removeValue(forKey: kern_handle[0].id) != nil else {
+    guard sw_dev.kerns.remove(kern_handle[0].id) != nil else {
         return KernelNotFound
     }
     return Success
 }
 
+@_cdecl("mc_sw_kern_cache_trim") public func mc_sw_kern_cache_trim(max_bytes:Int64) -> RetCode {
+    mc_lib_cache.trim(Int(max_bytes))
+    return Success
+}
+
 @_cdecl("mc_sw_fn_open") public func mc_sw_fn_open(
         dev_handle: UnsafePointer<mc_dev_handle>, 
         kern_handle: UnsafePointer<mc_kern_handle>,
@@ -392,12 +756,15 @@ var mc_cbs:[Int64:mc_sw_cb] = [:]
     let func_name = String(cString:func_name_raw)
 
     guard let newFunction = sw_kern.lib.makeFunction(name: func_name) else { return FunctionNotFound }
+    var written:UInt64 = ~0
+    guard let pipeline = make_pipeline(sw_dev.dev, newFunction, sw_kern, &written) else { return CannotCreatePipelineState }
 
-    let fn = mc_sw_fn(newFunction)
-    let id = mc_next_index
-    mc_next_index += 1
-    sw_kern.fns[id] = fn
-    fn_handle[0].id = id 
+    let fn = mc_sw_fn(newFunction, pipeline)
+    fn_handle[0].id = sw_kern.fns.insert(fn)
+    fn_handle[0].thread_execution_width = Int64(pipeline.threadExecutionWidth)
+    fn_handle[0].max_total_threads_per_threadgroup = Int64(pipeline.maxTotalThreadsPerThreadgroup)
+    fn_handle[0].threadgroup_size = Int64(fn.threadgroup_size)
+    fn_handle[0].written_mask = written
 
     return Success; 
 }
@@ -408,121 +775,550 @@ var mc_cbs:[Int64:mc_sw_cb] = [:]
         fn_handle: UnsafeMutablePointer<mc_fn_handle>) -> RetCode {
     guard let sw_dev = mc_devs[dev_handle[0].id] else { return DeviceNotFound }
     guard let sw_kern = sw_dev.kerns[kern_handle[0].id] else { return KernelNotFound }
-    guard sw_kern.fns.removeValue(forKey: fn_handle[0].id) != nil else {
+    guard sw_kern.fns.remove(fn_handle[0].id) != nil else {
         return FunctionNotFound
     }
     return Success
 }
 
+// Buffer of at least length bytes, recycled from the pool if possible.
+// Zeroed like a new buffer unless the caller fills it
+func make_buffer(_ sw_dev: mc_sw_dev, _ length: Int, zeroed: Bool) -> MTLBuffer? {
+    let size = pool_class_size(length)
+    if let recycled = sw_dev.pool.get(size) {
+        if zeroed {
+            memset(recycled.contents(), 0, length)
+        }
+        return recycled
+    }
+    if sw_dev.dev.currentAllocatedSize + size > Int(sw_dev.dev.recommendedMaxWorkingSetSize) {
+        sw_dev.pool.trim(0) // Near the working set limit, so stop holding on to spare buffers
+    }
+    return sw_dev.dev.makeBuffer(length: size, options: .storageModeShared)
+}
+
+func register_buffer(_ sw_dev: mc_sw_dev, _ newBuffer: MTLBuffer, _ length: Int64,
+                     _ buf_handle: UnsafeMutablePointer<mc_buf_handle>) {
+    let buf = mc_sw_buf(newBuffer, sw_dev.pool)
+    buf_handle[0].id = sw_dev.bufs.insert(buf)
+    buf_handle[0].buf = newBuffer.contents().bindMemory(to: CChar.self, capacity: Int(length))
+    buf_handle[0].length = length
+}
+
 @_cdecl("mc_sw_buf_open") public func mc_sw_buf_open(
         dev_handle: UnsafePointer<mc_dev_handle>, 
         length:Int64,
         src_opt: UnsafeRawPointer?,
         buf_handle: UnsafeMutablePointer<mc_buf_handle>) -> RetCode {
     guard let sw_dev = mc_devs[dev_handle[0].id] else { return DeviceNotFound }
-    var newBuffer:MTLBuffer
+    guard length >= 0 else { return CouldNotMakeBuffer }
+    guard let newBuffer = make_buffer(sw_dev, Int(length), zeroed: src_opt == nil) else {
+        return CouldNotMakeBuffer
+    }
     if let src = src_opt {
-        guard let copyBuffer = sw_dev.dev.makeBuffer(bytes: src, length: Int(length), options: .storageModeShared) else {
-            return CouldNotMakeBuffer
-        }
-        newBuffer = copyBuffer 
-    } else {
-        guard let zeroBuffer = sw_dev.dev.makeBuffer(length: Int(length), options: .storageModeShared) else {
-            return CouldNotMakeBuffer
-        }
-        newBuffer = zeroBuffer 
+        mc_copy(newBuffer.contents(), src, Int(length))
     }
+    register_buffer(sw_dev, newBuffer, length, buf_handle)
 
-    let buf = mc_sw_buf(newBuffer)
-    let id = mc_next_index
-    mc_next_index += 1
-    sw_dev.bufs[id] = buf
-    buf_handle[0].id = id
+    return Success; 
+}
+
+@_cdecl("mc_sw_buf_convert") public func mc_sw_buf_convert(
+        dev_handle: UnsafePointer<mc_dev_handle>,
+        count: Int64,
+        src: UnsafeRawPointer,
+        src_format: Int64,
+        format: Int64,
+        flags: Int64,
+        buf_handle: UnsafeMutablePointer<mc_buf_handle>) -> RetCode {
+    guard let sw_dev = mc_devs[dev_handle[0].id] else { return DeviceNotFound }
+    let length = Int(count) * get_stride(Int(format))
+    guard let newBuffer = make_buffer(sw_dev, length, zeroed: false) else {
+        return CouldNotMakeBuffer
+    }
+    guard mc_convert(newBuffer.contents(), Int(format), src, Int(src_format), Int(count), Int32(flags)) == 0 else {
+        sw_dev.pool.put(newBuffer) // Unused, so straight back to the pool
+        return UnsupportedInputFormat
+    }
+    register_buffer(sw_dev, newBuffer, Int64(length), buf_handle)
+
+    return Success
+}
+
+@_cdecl("mc_sw_buf_wrap") public func mc_sw_buf_wrap(
+        dev_handle: UnsafePointer<mc_dev_handle>,
+        data: UnsafeMutableRawPointer,
+        length:Int64,
+        buf_handle: UnsafeMutablePointer<mc_buf_handle>) -> RetCode {
+    guard let sw_dev = mc_devs[dev_handle[0].id] else { return DeviceNotFound }
+    let page = Int(getpagesize())
+    guard length > 0 && Int(bitPattern: data) % page == 0 && Int(length) % page == 0 else {
+        return CannotWrapMemory
+    }
+    // No deallocator: the caller keeps the memory valid until the buffer is closed
+    guard let newBuffer = sw_dev.dev.makeBuffer(bytesNoCopy: data, length: Int(length),
+                                                options: .storageModeShared, deallocator: nil) else {
+        return CannotWrapMemory
+    }
+
+    let buf = mc_sw_buf(newBuffer, nil)
+    buf_handle[0].id = sw_dev.bufs.insert(buf)
     buf_handle[0].buf = newBuffer.contents().bindMemory(to: CChar.self, capacity: Int(length))
     buf_handle[0].length = length
 
-    return Success; 
+    return Success
 }
 
 @_cdecl("mc_sw_buf_close") public func mc_sw_buf_close(
         dev_handle: UnsafePointer<mc_dev_handle>,
         buf_handle: UnsafeMutablePointer<mc_buf_handle>) -> RetCode {
     guard let sw_dev = mc_devs[dev_handle[0].id] else { return DeviceNotFound }
-    guard sw_dev.bufs.removeValue(forKey: buf_handle[0].id) != nil else {
+    guard sw_dev.bufs.remove(buf_handle[0].id) != nil else {
         return BufferNotFound
     }
     
     return Success
 }
 
+@_cdecl("mc_sw_args_open") public func mc_sw_args_open(
+        dev_handle: UnsafePointer<mc_dev_handle>,
+        count: Int64,
+        bufs: UnsafePointer<UnsafeMutablePointer<mc_buf_handle>?>,
+        args_handle: UnsafeMutablePointer<mc_args_handle>) -> RetCode {
+    guard let sw_dev = mc_devs[dev_handle[0].id] else { return DeviceNotFound }
+    let (args, ret) = resolve_args(sw_dev, Int(count), bufs)
+    guard let args = args else { return ret }
+    args_handle[0].id = sw_dev.args.insert(args)
+    return Success
+}
+
+@_cdecl("mc_sw_args_close") public func mc_sw_args_close(
+        dev_handle: UnsafePointer<mc_dev_handle>,
+        args_handle: UnsafeMutablePointer<mc_args_handle>) -> RetCode {
+    guard let sw_dev = mc_devs[dev_handle[0].id] else { return DeviceNotFound }
+    guard sw_dev.args.remove(args_handle[0].id) != nil else { return BufferNotFound }
+    return Success
+}
+
+// Everything needed to encode one dispatch, resolved before anything is encoded
+struct mc_sw_dispatch {
+    let fn:mc_sw_fn
+    let bufs:[MTLBuffer?] // nil for arguments passed inline
+    let offsets:[Int] // Of each buffer, non-zero for views
+    let constants:[Data?] // Bytes of inline arguments
+    let grid:MTLSize
+    let group:MTLSize
+    let threadgroup_mem:[Int]
+}
+
+// Arguments of a dispatch: buffers with offsets, or bytes passed inline
+final class mc_sw_args {
+    let bufs:[MTLBuffer?] // nil for arguments passed inline
+    let offsets:[Int] // Of each buffer, non-zero for views
+    let constants:[Data?] // Bytes of inline arguments
+    init(_ bufs:[MTLBuffer?], _ offsets:[Int], _ constants:[Data?]) {
+        self.bufs = bufs
+        self.offsets = offsets
+        self.constants = constants
+    }
+}
+
+func resolve_args(
+        _ sw_dev:mc_sw_dev,
+        _ count:Int,
+        _ handles: UnsafePointer<UnsafeMutablePointer<mc_buf_handle>?>) -> (mc_sw_args?, RetCode) {
+    var bufs:[MTLBuffer?] = []
+    var offsets:[Int] = []
+    var constants:[Data?] = []
+    for index in 0..<count {
+        guard let buf_index = handles[index] else { return (nil, BufferNotFound) }
+        if buf_index[0].id == 0 {
+            let length = Int(buf_index[0].length)
+            guard let bytes = buf_index[0].buf, length > 0 && length <= Int(MC_INLINE_MAX) else { return (nil, BufferNotFound) }
+            bufs.append(nil)
+            offsets.append(0)
+            constants.append(Data(bytes: bytes, count: length))
+            continue
+        }
+        guard let sw_buf = sw_dev.bufs[buf_index[0].id] else { return (nil, BufferNotFound) }
+        let offset = Int(buf_index[0].offset)
+        guard offset >= 0 && offset + Int(buf_index[0].length) <= sw_buf.buf.length else { return (nil, BufferNotFound) }
+        bufs.append(sw_buf.buf)
+        offsets.append(offset)
+        constants.append(nil)
+    }
+    return (mc_sw_args(bufs, offsets, constants), Success)
+}
+
+func resolve_dispatch(
+        _ sw_dev:mc_sw_dev,
+        _ kern_handle: UnsafePointer<mc_kern_handle>,
+        _ fn_handle: UnsafePointer<mc_fn_handle>,
+        _ run_handle: UnsafePointer<mc_run_handle>) -> (mc_sw_dispatch?, RetCode) {
+    guard let sw_kern = sw_dev.kerns[kern_handle[0].id] else { return (nil, KernelNotFound) }
+    guard let sw_fn = sw_kern.fns[fn_handle[0].id] else { return (nil, FunctionNotFound) }
+    let handle = run_handle[0]
+    let args:mc_sw_args
+    if handle.args != 0 {
+        // Resolved once by mc_sw_args_open
+        guard let bound = sw_dev.args[handle.args] else { return (nil, BufferNotFound) }
+        args = bound
+    } else {
+        guard let bufs = handle.bufs else { return (nil, BufferNotFound) }
+        let (resolved, ret) = resolve_args(sw_dev, Int(handle.buf_count), bufs)
+        guard let resolved = resolved else { return (nil, ret) }
+        args = resolved
+    }
+
+    // 1-D grid of kcount threads unless a grid is given
+    var grid = MTLSize(width: Int(handle.kcount), height: 1, depth: 1)
+    if handle.grid.0 != 0 || handle.grid.1 != 0 || handle.grid.2 != 0 {
+        grid = MTLSize(width: Int(handle.grid.0), height: Int(handle.grid.1), depth: Int(handle.grid.2))
+    }
+    let pipeline = sw_fn.pipeline
+    var group = MTLSize(width: sw_fn.threadgroup_size, height: 1, depth: 1)
+    if handle.threadgroup.0 != 0 || handle.threadgroup.1 != 0 || handle.threadgroup.2 != 0 {
+        group = MTLSize(width: Int(handle.threadgroup.0), height: Int(handle.threadgroup.1), depth: Int(handle.threadgroup.2))
+    } else if grid.height != 1 || grid.depth != 1 {
+        // Recommended shape for 2-D work: one SIMD group wide, as tall as the pipeline allows
+        let width = pipeline.threadExecutionWidth
+        group = MTLSize(width: width, height: max(1, pipeline.maxTotalThreadsPerThreadgroup / width), depth: 1)
+    }
+    if grid.width < 0 || grid.height < 0 || grid.depth < 0 ||
+        group.width < 1 || group.height < 1 || group.depth < 1 ||
+        group.width * group.height * group.depth > pipeline.maxTotalThreadsPerThreadgroup {
+        return (nil, InvalidDispatch)
+    }
+
+    var threadgroup_mem:[Int] = []
+    var total_mem = 0
+    for index in 0..<Int(handle.threadgroup_mem_count) {
+        let length = Int(handle.threadgroup_mem[index])
+        if length < 0 { return (nil, InvalidDispatch) }
+        let rounded = (length + 15) & ~15 // Must be a multiple of 16
+        threadgroup_mem.append(rounded)
+        total_mem += rounded
+    }
+    if total_mem > sw_dev.dev.maxThreadgroupMemoryLength { return (nil, InvalidDispatch) }
+
+    return (mc_sw_dispatch(fn: sw_fn, bufs: args.bufs, offsets: args.offsets, constants: args.constants, grid: grid, group: group, threadgroup_mem: threadgroup_mem), Success)
+}
+
+func encode_dispatch(_ sw_dev:mc_sw_dev, _ encoder:MTLComputeCommandEncoder, _ dispatch:mc_sw_dispatch) {
+    encoder.setComputePipelineState(dispatch.fn.pipeline);
+
+    for (index, buf) in dispatch.bufs.enumerated() {
+        if let data = dispatch.constants[index] {
+            data.withUnsafeBytes { bytes in
+                encoder.setBytes(bytes.baseAddress!, length: data.count, index: index)
+            }
+        } else {
+            encoder.setBuffer(buf, offset: dispatch.offsets[index], index: index)
+        }
+    }
+    for (index, length) in dispatch.threadgroup_mem.enumerated() where length > 0 {
+        encoder.setThreadgroupMemoryLength(length, index: index)
+    }
+
+    let grid = dispatch.grid
+    let group = dispatch.group
+    if grid.width == 0 || grid.height == 0 || grid.depth == 0 {
+        return
+    }
+    if sw_dev.nonuniform {
+        // Exactly the threads of the grid, with partial threadgroups at the edges
+        encoder.dispatchThreads(grid, threadsPerThreadgroup: group)
+    } else {
+        let numThreadgroups = MTLSize(width: (grid.width + group.width - 1) / group.width,
+                                      height: (grid.height + group.height - 1) / group.height,
+                                      depth: (grid.depth + group.depth - 1) / group.depth)
+        encoder.dispatchThreadgroups(numThreadgroups, threadsPerThreadgroup: group)
+    }
+}
+
+// Queue of a run: its stream, or the device's own
+func run_queue(_ sw_dev:mc_sw_dev, _ run_handle:UnsafePointer<mc_run_handle>) -> mc_sw_queue? {
+    let stream = run_handle[0].stream
+    return stream == 0 ? sw_dev.queue : mc_streams[stream]
+}
+
+// Command buffer for a run, which first waits for the runs it depends on that
+// are still running on other queues. On the same queue, Metal's hazard tracking
+// already keeps runs sharing buffers in order while letting others overlap.
+func begin_run(_ sw_queue:mc_sw_queue, _ run_handle:UnsafePointer<mc_run_handle>) -> MTLCommandBuffer? {
+    guard let commandBuffer = sw_queue.queue.makeCommandBuffer() else { return nil }
+    let handle = run_handle[0]
+    mc_cbs_lock.lock()
+    for index in 0..<Int(handle.dep_count) {
+        guard let dep = mc_cbs[handle.deps[index]], dep.running, dep.queue !== sw_queue else { continue }
+        commandBuffer.encodeWaitForEvent(dep.queue.timeline, value: dep.value)
+    }
+    mc_cbs_lock.unlock()
+    return commandBuffer
+}
+
+// Track and commit an encoded command buffer as a run
+func commit_run(_ dev_handle: UnsafePointer<mc_dev_handle>, _ sw_queue:mc_sw_queue, _ commandBuffer:MTLCommandBuffer,
+                _ run_handle: UnsafeMutablePointer<mc_run_handle>) {
+    sw_queue.submit.lock()
+    defer { sw_queue.submit.unlock() }
+    mc_cbs_lock.lock()
+    sw_queue.committed += 1
+    let run = mc_sw_cb(dev_handle[0].id, commandBuffer, sw_queue, sw_queue.committed)
+    let id = mc_cbs.insert(run)
+    mc_cbs_lock.unlock()
+    run_handle[0].id = id
+    commandBuffer.encodeSignalEvent(sw_queue.timeline, value: run.value)
+
+    // Completion handler - will run later. Captures only the id, not the
+    // record, so no reference cycle through the command buffer.
+    commandBuffer.addCompletedHandler { _ in
+        mc_sw_run_completed(id)
+    }
+
+    commandBuffer.commit()
+}
+
 @_cdecl("mc_sw_run_open") public func mc_sw_run_open(
         dev_handle: UnsafePointer<mc_dev_handle>, 
         kern_handle: UnsafePointer<mc_kern_handle>, 
         fn_handle: UnsafePointer<mc_fn_handle>, 
         run_handle: UnsafeMutablePointer<mc_run_handle>) -> RetCode {
     guard let sw_dev = mc_devs[dev_handle[0].id] else { return DeviceNotFound }
-    guard let sw_kern = sw_dev.kerns[kern_handle[0].id] else { return KernelNotFound }
-    guard let sw_fn = sw_kern.fns[fn_handle[0].id] else { return FunctionNotFound }
-    guard let commandBuffer = sw_dev.queue.makeCommandBuffer() else { return CannotCreateCommandBuffer }
+    let (dispatch_opt, ret) = resolve_dispatch(sw_dev, kern_handle, fn_handle, run_handle)
+    guard let dispatch = dispatch_opt else { return ret }
+    guard let sw_queue = run_queue(sw_dev, run_handle) else { return StreamNotFound }
+    guard let commandBuffer = begin_run(sw_queue, run_handle) else { return CannotCreateCommandBuffer }
     guard let encoder = commandBuffer.makeComputeCommandEncoder() else { return CannotCreateCommandEncoder }
 
-    do {
-        let pipelineState = try sw_dev.dev.makeComputePipelineState(function:sw_fn.fn)
-        encoder.setComputePipelineState(pipelineState);
-
-        for index in 0..<Int(run_handle[0].buf_count) {
-            guard let buf_index = run_handle[0].bufs[index] else { return BufferNotFound }
-            guard let sw_buf = sw_dev.bufs[buf_index[0].id] else { return BufferNotFound }
-            encoder.setBuffer(sw_buf.buf, offset: 0, index: index)
-        }
+    encode_dispatch(sw_dev, encoder, dispatch)
+    encoder.endEncoding()
 
-        let w = pipelineState.threadExecutionWidth
-        let h = pipelineState.maxTotalThreadsPerThreadgroup / w
-        let kcount = run_handle[0].kcount
-        let numThreadgroups = MTLSize(width: (Int(kcount)+(w*h-1))/(w*h), height: 1, depth: 1)
-        let threadsPerThreadgroup = MTLSize(width: w*h, height: 1, depth: 1)
-        encoder.dispatchThreadgroups(numThreadgroups, threadsPerThreadgroup: threadsPerThreadgroup)
-        encoder.endEncoding()
-
-        let run = mc_sw_cb(dev_handle[0].id, commandBuffer)
-        let id = mc_next_index
-        mc_next_index += 1
-        mc_cbs[id] = run
-        run_handle[0].id = id
-
-        // Completion handler - will run later
-        commandBuffer.addCompletedHandler { cb in
-            for (cb_id, sw_cb) in mc_cbs {
-                if sw_cb.cb === cb {
-                    sw_cb.running = false
-                    // Could call back to python here...
-                    if sw_cb.released {
-                        mc_cbs.removeValue(forKey:cb_id)
-                    }
-                    return
-                }
-            }
-        }
+    commit_run(dev_handle, sw_queue, commandBuffer, run_handle)
+    return Success
+}
 
-        commandBuffer.commit()
+@_cdecl("mc_sw_batch_open") public func mc_sw_batch_open(
+        dev_handle: UnsafePointer<mc_dev_handle>,
+        count: Int64,
+        dispatches: UnsafePointer<mc_dispatch>,
+        run_handle: UnsafeMutablePointer<mc_run_handle>) -> RetCode {
+    guard let sw_dev = mc_devs[dev_handle[0].id] else { return DeviceNotFound }
+    var resolved:[mc_sw_dispatch] = []
+    for index in 0..<Int(count) {
+        let (dispatch_opt, ret) = resolve_dispatch(sw_dev, dispatches[index].kern_handle,
+                                                   dispatches[index].fn_handle, dispatches[index].run_handle)
+        guard let dispatch = dispatch_opt else { return ret }
+        resolved.append(dispatch)
+    }
+    guard let sw_queue = run_queue(sw_dev, run_handle) else { return StreamNotFound }
+    guard let commandBuffer = begin_run(sw_queue, run_handle) else { return CannotCreateCommandBuffer }
+    // Concurrent so that the only ordering is the explicit barriers
+    guard let encoder = commandBuffer.makeComputeCommandEncoder(dispatchType: .concurrent) else {
+        return CannotCreateCommandEncoder
+    }
 
-    } catch {
-        return CannotCreatePipelineState
+    for (index, dispatch) in resolved.enumerated() {
+        if index > 0 {
+            encoder.memoryBarrier(scope: .buffers)
+        }
+        encode_dispatch(sw_dev, encoder, dispatch)
     }
+    encoder.endEncoding()
 
+    commit_run(dev_handle, sw_queue, commandBuffer, run_handle)
     return Success
 }
 
 @_cdecl("mc_sw_run_close") public func mc_sw_run_close(
         run_handle: UnsafePointer<mc_run_handle>) -> RetCode {
-    guard let sw_run = mc_cbs[run_handle[0].id] else {
+    let id = run_handle[0].id
+    mc_cbs_lock.lock()
+    let sw_run_opt = mc_cbs[id]
+    mc_cbs_lock.unlock()
+    guard let sw_run = sw_run_opt else {
         return RunNotFound
     }
-    if sw_run.running {
-        // Block until completion
-        sw_run.cb.waitUntilCompleted()
+    // Block until completion
+    sw_run.cb.waitUntilCompleted()
+
+    mc_cbs_lock.lock()
+    sw_run.released = true
+    if !sw_run.running {
+        mc_cbs.remove(id)
+    }
+    mc_cbs_lock.unlock()
+    return Success
+}
+
+
+
+@_cdecl("mc_sw_buf_pool") public func mc_sw_buf_pool(
+        dev_handle: UnsafePointer<mc_dev_handle>,
+        limit:Int64,
+        trim_to:Int64,
+        stats: UnsafeMutablePointer<mc_pool_stats>) -> RetCode {
+    guard let sw_dev = mc_devs[dev_handle[0].id] else { return DeviceNotFound }
+    stats[0] = sw_dev.pool.configure(limit, trim_to)
+    return Success
+}
+
+@_cdecl("mc_sw_dev_memory") public func mc_sw_dev_memory(
+        dev_handle: UnsafePointer<mc_dev_handle>,
+        recommended: UnsafeMutablePointer<Int64>,
+        allocated: UnsafeMutablePointer<Int64>) -> RetCode {
+    guard let sw_dev = mc_devs[dev_handle[0].id] else { return DeviceNotFound }
+    recommended[0] = Int64(sw_dev.dev.recommendedMaxWorkingSetSize)
+    allocated[0] = Int64(sw_dev.dev.currentAllocatedSize)
+    return Success
+}
+
+@_cdecl("mc_sw_get_stats") public func mc_sw_get_stats(
+        stats: UnsafeMutablePointer<mc_stats>) -> RetCode {
+    mc_globals_lock.lock()
+    stats[0].pipelines_created = pipelinesCreated
+    mc_globals_lock.unlock()
+    return Success
+}
+
+@_cdecl("mc_sw_run_wait") public func mc_sw_run_wait(
+        count:Int64,
+        run_handles: UnsafePointer<UnsafePointer<mc_run_handle>?>,
+        all:Bool,
+        timeout:Double,
+        complete: UnsafeMutablePointer<Bool>) -> RetCode {
+    let deadline = Date(timeIntervalSinceNow: max(timeout, 0))
+    mc_cbs_lock.lock()
+    defer { mc_cbs_lock.unlock() }
+    var runs:[mc_sw_cb] = []
+    for index in 0..<Int(count) {
+        guard let handle = run_handles[index], let sw_run = mc_cbs[handle[0].id] else { return RunNotFound }
+        runs.append(sw_run)
+    }
+    var timed_out = timeout == 0
+    while true {
+        var ready = 0
+        for (index, sw_run) in runs.enumerated() {
+            complete[index] = !sw_run.running
+            if !sw_run.running { ready += 1 }
+        }
+        if runs.isEmpty || (all ? ready == runs.count : ready > 0) || timed_out { break }
+        if timeout < 0 {
+            mc_cbs_lock.wait()
+        } else if !mc_cbs_lock.wait(until: deadline) {
+            timed_out = true // Check once more then give up
+        }
+    }
+    return Success
+}
+
+@_cdecl("mc_sw_stream_open") public func mc_sw_stream_open(
+        dev_handle: UnsafePointer<mc_dev_handle>,
+        stream_handle: UnsafeMutablePointer<mc_stream_handle>) -> RetCode {
+    guard let sw_dev = mc_devs[dev_handle[0].id] else { return DeviceNotFound }
+    guard let queue = sw_dev.dev.makeCommandQueue(), let timeline = sw_dev.dev.makeSharedEvent() else {
+        return CannotCreateCommandQueue
     }
+    stream_handle[0].id = mc_streams.insert(mc_sw_queue(queue, timeline, stream_handle[0].priority))
+    return Success
+}
+
+@_cdecl("mc_sw_stream_close") public func mc_sw_stream_close(
+        stream_handle: UnsafePointer<mc_stream_handle>) -> RetCode {
+    // Command buffers already committed keep the queue alive until they complete
+    guard mc_streams.remove(stream_handle[0].id) != nil else { return StreamNotFound }
+    return Success
+}
+
+@_cdecl("mc_sw_event_open") public func mc_sw_event_open(
+        dev_handle: UnsafePointer<mc_dev_handle>,
+        event_handle: UnsafeMutablePointer<mc_event_handle>) -> RetCode {
+    guard let sw_dev = mc_devs[dev_handle[0].id] else { return DeviceNotFound }
+    guard let event = sw_dev.dev.makeSharedEvent() else { return CannotCreateCommandQueue }
+    event_handle[0].id = mc_events.insert(mc_sw_event(event))
+    return Success
+}
+
+@_cdecl("mc_sw_event_close") public func mc_sw_event_close(
+        event_handle: UnsafePointer<mc_event_handle>) -> RetCode {
+    guard mc_events.remove(event_handle[0].id) != nil else { return EventNotFound }
+    return Success
+}
+
+// A command buffer holding only an event operation, ordered after the work
+// committed to the stream before it, and before the work committed after it
+func commit_event(_ stream_handle: UnsafePointer<mc_stream_handle>, _ event_handle: UnsafePointer<mc_event_handle>,
+                  _ encode: (MTLCommandBuffer, MTLSharedEvent) -> Void) -> RetCode {
+    guard let sw_queue = mc_streams[stream_handle[0].id] else { return StreamNotFound }
+    guard let sw_event = mc_events[event_handle[0].id] else { return EventNotFound }
+    guard let commandBuffer = sw_queue.queue.makeCommandBuffer() else { return CannotCreateCommandBuffer }
+    encode(commandBuffer, sw_event.event)
+    sw_queue.submit.lock()
+    defer { sw_queue.submit.unlock() }
+    mc_cbs_lock.lock()
+    sw_queue.committed += 1
+    commandBuffer.encodeSignalEvent(sw_queue.timeline, value: sw_queue.committed)
+    mc_cbs_lock.unlock()
+    commandBuffer.commit()
     return Success
 }
 
+@_cdecl("mc_sw_stream_signal") public func mc_sw_stream_signal(
+        stream_handle: UnsafePointer<mc_stream_handle>,
+        event_handle: UnsafePointer<mc_event_handle>,
+        value:UInt64) -> RetCode {
+    return commit_event(stream_handle, event_handle) { commandBuffer, event in
+        commandBuffer.encodeSignalEvent(event, value: value)
+    }
+}
+
+@_cdecl("mc_sw_stream_wait") public func mc_sw_stream_wait(
+        stream_handle: UnsafePointer<mc_stream_handle>,
+        event_handle: UnsafePointer<mc_event_handle>,
+        value:UInt64) -> RetCode {
+    return commit_event(stream_handle, event_handle) { commandBuffer, event in
+        commandBuffer.encodeWaitForEvent(event, value: value)
+    }
+}
+
+@_cdecl("mc_sw_event_signal") public func mc_sw_event_signal(
+        event_handle: UnsafePointer<mc_event_handle>,
+        value:UInt64) -> RetCode {
+    guard let sw_event = mc_events[event_handle[0].id] else { return EventNotFound }
+    if value > sw_event.event.signaledValue { // Values only rise
+        sw_event.event.signaledValue = value
+    }
+    return Success
+}
 
+@_cdecl("mc_sw_event_wait") public func mc_sw_event_wait(
+        event_handle: UnsafePointer<mc_event_handle>,
+        value:UInt64,
+        timeout:Double,
+        current: UnsafeMutablePointer<UInt64>) -> RetCode {
+    guard let sw_event = mc_events[event_handle[0].id] else { return EventNotFound }
+    let event = sw_event.event
+    if timeout != 0 && event.signaledValue < value {
+        // Woken by a listener once the value is reached
+        let reached = NSCondition()
+        var done = false
+        event.notify(mc_event_listener, atValue: value) { _, _ in
+            reached.lock()
+            done = true
+            reached.broadcast()
+            reached.unlock()
+        }
+        let deadline = Date(timeIntervalSinceNow: timeout)
+        reached.lock()
+        while !done {
+            if timeout < 0 {
+                reached.wait()
+            } else if !reached.wait(until: deadline) {
+                break
+            }
+        }
+        reached.unlock()
+    }
+    current[0] = event.signaledValue
+    return Success
+}
@@ -0,0 +1,1650 @@
+/*
+metalcompute_cpu.c
+
+CPU backend for Python extension, for hosts without Metal.
+Implements the same C interface as metalcompute.swift, running
+kernels on a pool of worker threads.
+
+(c) Andrew Baldwin 2021
+*/
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metalcompute.h"
+#include "mc_cache.h"
+#include "mc_convert.h"
+#include "mc_copy.h"
+#include "mc_notify.h"
+#include "mc_cpu/mc_msl.h"
+
+// Value symbols are defined in metalcompute.c
+
+extern const RetCode Success;
+extern const RetCode CannotCreateDevice;
+extern const RetCode CannotCreateCommandQueue;
+extern const RetCode NotReadyToCompile;
+extern const RetCode FailedToCompile;
+extern const RetCode FailedToFindFunction;
+extern const RetCode NotReadyToCompute;
+extern const RetCode FailedToMakeInputBuffer;
+extern const RetCode FailedToMakeOutputBuffer;
+extern const RetCode NotReadyToRun;
+extern const RetCode CannotCreatePipelineState;
+extern const RetCode IncorrectOutputCount;
+extern const RetCode NotReadyToRetrieve;
+extern const RetCode UnsupportedInputFormat;
+extern const RetCode UnsupportedOutputFormat;
+extern const RetCode DeviceNotFound;
+extern const RetCode KernelNotFound;
+extern const RetCode FunctionNotFound;
+extern const RetCode CouldNotMakeBuffer;
+extern const RetCode BufferNotFound;
+extern const RetCode RunNotFound;
+extern const RetCode DeviceBuffersAllocated;
+extern const RetCode InvalidDispatch;
+extern const RetCode CannotWrapMemory;
+extern const RetCode StreamNotFound;
+extern const RetCode EventNotFound;
+
+
+// Threads per threadgroup, i.e. lanes executed together by one worker
+#define MC_CPU_GROUP_SIZE 256
+// Threadgroup memory indices which can be given a length
+#define MC_CPU_MAX_THREADGROUP_MEM 31
+// Buffer pool: size classes, and default high-water mark of cached bytes
+#define MC_CPU_POOL_CLASSES 256
+#define MC_CPU_POOL_LIMIT ((int64_t)64 << 20)
+
+static atomic_llong pipelines_created = 0; // Reported by mc_sw_get_stats
+
+static char* compile_error = NULL;
+static pthread_mutex_t compile_error_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void set_compile_error(char* error) {
+    pthread_mutex_lock(&compile_error_lock);
+    free(compile_error);
+    compile_error = error;
+    pthread_mutex_unlock(&compile_error_lock);
+}
+
+char* mc_sw_get_compile_error() {
+    pthread_mutex_lock(&compile_error_lock);
+    char* error = strdup(compile_error ? compile_error : "");
+    pthread_mutex_unlock(&compile_error_lock);
+    return error;
+}
+
+// -------------------------------------------------
+// Backend objects. Reference counted so that queued runs
+// keep everything they use alive.
+
+// Freed buffer memory of a device, kept by size class for reuse.
+// Each free block holds the link to the next one of its class.
+typedef struct {
+    atomic_int refs; // The device, and each buffer allocated from the pool
+    pthread_mutex_t lock;
+    void* free[MC_CPU_POOL_CLASSES];
+    mc_pool_stats stats;
+} mc_cpu_bufpool;
+
+typedef struct {
+    atomic_int refs;
+    char* data;
+    uint64_t length;
+    uint64_t capacity;     // Allocated size, that of the size class when pooled
+    mc_cpu_bufpool* pool;  // Memory returns here when released. NULL if not pooled
+    int wrapped;           // Memory belongs to the caller, so is never freed
+} mc_cpu_buf;
+
+typedef struct {
+    atomic_int refs;
+    mc_msl_lib* lib;
+} mc_cpu_kern;
+
+// Function with its execution state worked out once when opened
+typedef struct {
+    atomic_int refs;
+    mc_cpu_kern* kern;
+    const mc_msl_fn* fn;
+    uint32_t group;      // Threadgroup size used for dispatch
+    size_t scratch_size; // Per worker, for batches of group lanes
+} mc_cpu_fn;
+
+typedef struct {
+    atomic_llong kerns;
+    atomic_llong bufs;
+    atomic_llong buf_bytes; // Memory of open buffers
+    mc_cpu_bufpool* pool;
+} mc_cpu_dev;
+
+// Command queue. Runs on a stream are ordered by its events: a signal waits for
+// the stream's earlier runs, and a wait holds back its later ones.
+typedef struct {
+    atomic_int refs;
+    int64_t priority;
+    int waits; // Wait markers queued. Locked by the pool
+} mc_cpu_stream;
+
+typedef struct {
+    atomic_int refs;
+    uint64_t value; // Locked by the pool
+} mc_cpu_event;
+
+// Arguments resolved once for many runs, holding their buffers
+typedef struct {
+    int count;
+    mc_cpu_buf** bufs;       // NULL for inline arguments
+    mc_msl_buffer* bindings;
+    char* constants;         // Copies of inline arguments
+} mc_cpu_args;
+
+// Kinds of marker run, which have no groups and stand for an event operation
+#define MC_CPU_SIGNAL 1
+#define MC_CPU_WAIT 2
+
+typedef struct {
+    _Atomic uint64_t range; // First group in high 32 bits, end group in low 32 bits
+    char pad[56];           // Keep each worker's range in its own cache line
+} mc_cpu_range;
+
+typedef struct mc_cpu_run {
+    atomic_int refs;
+    mc_cpu_fn* fn;
+    int buf_count;
+    mc_cpu_buf** bufs;
+    mc_msl_buffer* bindings;
+    char* constants; // Copies of inline arguments, where bufs is NULL
+    mc_msl_dispatch dispatch;
+    uint32_t groups;
+    size_t scratch_size; // Per worker: lane slots, then threadgroup memory
+    int tg_count;
+    uint64_t tg_lengths[MC_CPU_MAX_THREADGROUP_MEM];
+    uint32_t unfinished; // Groups not yet executed
+    int done;
+    int dep_count;
+    struct mc_cpu_run** deps; // Runs which must complete before this one starts
+    mc_cpu_range* ranges;
+    mc_cpu_stream* stream; // NULL for the device's own queue
+    int marker;            // MC_CPU_SIGNAL or MC_CPU_WAIT of event to value. 0 for dispatches
+    mc_cpu_event* event;
+    uint64_t value;
+    struct mc_cpu_run* next;
+    struct mc_cpu_run* then; // Next stage of a batch, run in place of this one once it finishes
+} mc_cpu_run;
+
+// -------------------------------------------------
+// Buffer pool. Classes are a page, then four steps per power of two,
+// so at most a quarter of a pooled allocation is unused.
+
+// Class of length, or -1 if its size would not fit in 64 bits
+static int bufpool_class(uint64_t length, uint64_t* size) {
+    if (length <= 4096) {
+        *size = 4096;
+        return 0;
+    }
+    uint64_t n = length - 1;
+    int p = 63 - __builtin_clzll(n); // 2^p <= n < 2^(p+1), p >= 12
+    if (p == 63) return -1;
+    uint64_t step = (uint64_t)1 << (p - 2);
+    uint64_t sub = n / step - 4;
+    *size = (sub + 5) * step;
+    return 1 + (p - 12) * 4 + (int)sub;
+}
+
+static mc_cpu_bufpool* bufpool_new(void) {
+    mc_cpu_bufpool* pool = calloc(1, sizeof(mc_cpu_bufpool));
+    if (pool == NULL) return NULL;
+    atomic_init(&pool->refs, 1);
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->stats.limit = MC_CPU_POOL_LIMIT;
+    return pool;
+}
+
+// Free cached memory, largest classes first, until at most max_bytes remain. Locked.
+static void bufpool_trim_locked(mc_cpu_bufpool* pool, int64_t max_bytes) {
+    for (int c = MC_CPU_POOL_CLASSES - 1; c >= 0 && pool->stats.cached_bytes > max_bytes; c--) {
+        uint64_t size = c == 0 ? 4096 : (uint64_t)((c - 1) % 4 + 5) << ((c - 1) / 4 + 10);
+        while (pool->free[c] != NULL && pool->stats.cached_bytes > max_bytes) {
+            void* block = pool->free[c];
+            pool->free[c] = *(void**)block;
+            free(block);
+            pool->stats.cached_bytes -= (int64_t)size;
+            pool->stats.cached_buffers--;
+            pool->stats.evictions++;
+        }
+    }
+}
+
+static void bufpool_release(mc_cpu_bufpool* pool) {
+    if (atomic_fetch_sub(&pool->refs, 1) == 1) {
+        bufpool_trim_locked(pool, 0);
+        pthread_mutex_destroy(&pool->lock);
+        free(pool);
+    }
+}
+
+// Recycled memory of the class, or a new allocation
+static void* bufpool_get(mc_cpu_bufpool* pool, int c, uint64_t size) {
+    pthread_mutex_lock(&pool->lock);
+    void* block = pool->free[c];
+    if (block != NULL) {
+        pool->free[c] = *(void**)block;
+        pool->stats.cached_bytes -= (int64_t)size;
+        pool->stats.cached_buffers--;
+        pool->stats.hits++;
+    } else {
+        pool->stats.misses++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (block != NULL) return block;
+    if (posix_memalign(&block, 4096, size) == 0) return block;
+    // Memory pressure: give back everything cached, then try once more
+    pthread_mutex_lock(&pool->lock);
+    bufpool_trim_locked(pool, 0);
+    pthread_mutex_unlock(&pool->lock);
+    return posix_memalign(&block, 4096, size) == 0 ? block : NULL;
+}
+
+static void bufpool_put(mc_cpu_bufpool* pool, void* block, int c, uint64_t size) {
+    pthread_mutex_lock(&pool->lock);
+    if (pool->stats.cached_bytes + (int64_t)size <= pool->stats.limit) {
+        *(void**)block = pool->free[c];
+        pool->free[c] = block;
+        pool->stats.cached_bytes += (int64_t)size;
+        pool->stats.cached_buffers++;
+        block = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    free(block); // Over the high-water mark
+}
+
+// New buffer, with its memory from the pool if given, for the caller to fill
+static mc_cpu_buf* buf_alloc(mc_cpu_bufpool* pool, uint64_t length) {
+    mc_cpu_buf* buf = calloc(1, sizeof(mc_cpu_buf));
+    if (buf == NULL) return NULL;
+    int c = pool != NULL ? bufpool_class(length, &buf->capacity) : -1;
+    if (c >= 0) {
+        buf->data = bufpool_get(pool, c, buf->capacity);
+        if (buf->data != NULL) {
+            atomic_fetch_add(&pool->refs, 1);
+            buf->pool = pool;
+        }
+    } else {
+        buf->capacity = length ? length : 1;
+        if (posix_memalign((void**)&buf->data, 4096, buf->capacity)) buf->data = NULL;
+    }
+    if (buf->data == NULL) {
+        free(buf);
+        return NULL;
+    }
+    buf->length = length;
+    atomic_init(&buf->refs, 1);
+    return buf;
+}
+
+// New buffer, zeroed like a new MTLBuffer unless src is given to copy from
+static mc_cpu_buf* buf_new(mc_cpu_bufpool* pool, uint64_t length, const char* src) {
+    mc_cpu_buf* buf = buf_alloc(pool, length);
+    if (buf == NULL) return NULL;
+    if (src != NULL) mc_copy(buf->data, src, length);
+    else memset(buf->data, 0, length);
+    return buf;
+}
+
+static void buf_release(mc_cpu_buf* buf) {
+    if (atomic_fetch_sub(&buf->refs, 1) == 1) {
+        if (buf->pool != NULL) {
+            uint64_t size;
+            bufpool_put(buf->pool, buf->data, bufpool_class(buf->length, &size), buf->capacity);
+            bufpool_release(buf->pool);
+        } else if (!buf->wrapped) {
+            free(buf->data);
+        }
+        free(buf);
+    }
+}
+
+static void kern_release(mc_cpu_kern* kern) {
+    if (atomic_fetch_sub(&kern->refs, 1) == 1) {
+        mc_msl_lib_free(kern->lib);
+        free(kern);
+    }
+}
+
+static mc_cpu_fn* fn_new(mc_cpu_kern* kern, const mc_msl_fn* found) {
+    mc_cpu_fn* fn = calloc(1, sizeof(mc_cpu_fn));
+    if (fn == NULL) return NULL;
+    atomic_init(&fn->refs, 1);
+    atomic_fetch_add(&kern->refs, 1);
+    fn->kern = kern;
+    fn->fn = found;
+    fn->group = MC_CPU_GROUP_SIZE;
+    fn->scratch_size = mc_msl_fn_scratch_size(found, MC_CPU_GROUP_SIZE);
+    atomic_fetch_add(&pipelines_created, 1);
+    return fn;
+}
+
+static void fn_release(mc_cpu_fn* fn) {
+    if (atomic_fetch_sub(&fn->refs, 1) == 1) {
+        kern_release(fn->kern);
+        free(fn);
+    }
+}
+
+// -------------------------------------------------
+// Kernel cache. The in-process tier keeps compiled libraries by source
+// key and evicts the least recently used once over the memory limit.
+// The on-disk tier (mc_cache) holds library images so that other
+// processes skip parsing.
+
+#define MC_CPU_CACHE_BACKEND "cpu-msl-2" // Change when the image format changes
+
+typedef struct mc_cpu_cached {
+    char key[MC_CACHE_KEY_SIZE];
+    mc_cpu_kern* kern;
+    int64_t bytes;
+    uint64_t used;
+    struct mc_cpu_cached* next;
+} mc_cpu_cached;
+
+static mc_cpu_cached* kern_cache = NULL;
+static uint64_t kern_cache_tick = 0;
+static pthread_mutex_t kern_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Locked
+static void kern_cache_trim_locked(int64_t max_bytes) {
+    for (;;) {
+        int64_t entries = 0, bytes = 0;
+        mc_cpu_cached** oldest = NULL;
+        for (mc_cpu_cached** e = &kern_cache; *e; e = &(*e)->next) {
+            entries++;
+            bytes += (*e)->bytes;
+            if (oldest == NULL || (*e)->used < (*oldest)->used) oldest = e;
+        }
+        if (bytes <= max_bytes) {
+            mc_cache_set_memory_usage(entries, bytes);
+            return;
+        }
+        mc_cpu_cached* victim = *oldest;
+        *oldest = victim->next;
+        kern_release(victim->kern); // Kernels still open keep their library
+        free(victim);
+        mc_cache_count(MC_CACHE_EVICTION);
+    }
+}
+
+// Compiled kernel for a program, from the cache when possible. Caller owns a reference.
+// With FailedToCompile, *error is the message, which the caller frees.
+static RetCode kern_compile(const char* program, mc_cpu_kern** kern_out, char** error) {
+    char key[MC_CACHE_KEY_SIZE];
+    mc_cache_key(MC_CPU_CACHE_BACKEND, "CPU", "", program, key);
+    pthread_mutex_lock(&kern_cache_lock);
+    for (mc_cpu_cached* e = kern_cache; e; e = e->next) {
+        if (strcmp(e->key, key) == 0) {
+            e->used = ++kern_cache_tick;
+            atomic_fetch_add(&e->kern->refs, 1);
+            pthread_mutex_unlock(&kern_cache_lock);
+            mc_cache_count(MC_CACHE_MEMORY_HIT);
+            *kern_out = e->kern;
+            return Success;
+        }
+    }
+    pthread_mutex_unlock(&kern_cache_lock); // Not held while compiling
+
+    mc_msl_lib* lib = NULL;
+    void* image;
+    size_t length;
+    if (mc_cache_read(key, "msl", &image, &length)) {
+        lib = mc_msl_lib_load(image, length);
+        free(image);
+    }
+    if (lib != NULL) {
+        mc_cache_count(MC_CACHE_DISK_HIT);
+    } else {
+        lib = mc_msl_compile(program, error);
+        if (lib == NULL) return FailedToCompile;
+        mc_cache_count(MC_CACHE_MISS);
+        image = mc_msl_lib_save(lib, &length);
+        if (image != NULL) {
+            mc_cache_write(key, "msl", image, length);
+            free(image);
+        }
+    }
+
+    mc_cpu_kern* kern = calloc(1, sizeof(mc_cpu_kern));
+    if (kern == NULL) {
+        mc_msl_lib_free(lib);
+        *error = strdup("out of memory");
+        return FailedToCompile;
+    }
+    kern->lib = lib;
+    atomic_init(&kern->refs, 1);
+
+    mc_cpu_cached* entry = calloc(1, sizeof(mc_cpu_cached));
+    if (entry != NULL) {
+        memcpy(entry->key, key, sizeof(key));
+        atomic_fetch_add(&kern->refs, 1); // Cache reference
+        entry->kern = kern;
+        entry->bytes = (int64_t)mc_msl_lib_size(lib);
+        pthread_mutex_lock(&kern_cache_lock);
+        entry->used = ++kern_cache_tick;
+        entry->next = kern_cache;
+        kern_cache = entry;
+        kern_cache_trim_locked(mc_cache_memory_limit());
+        pthread_mutex_unlock(&kern_cache_lock);
+    }
+    *kern_out = kern;
+    return Success;
+}
+
+RetCode mc_sw_kern_cache_trim(int64_t max_bytes) {
+    pthread_mutex_lock(&kern_cache_lock);
+    kern_cache_trim_locked(max_bytes);
+    pthread_mutex_unlock(&kern_cache_lock);
+    return Success;
+}
+
+static void stream_release(mc_cpu_stream* stream) {
+    if (atomic_fetch_sub(&stream->refs, 1) == 1) free(stream);
+}
+
+static void event_release(mc_cpu_event* event) {
+    if (atomic_fetch_sub(&event->refs, 1) == 1) free(event);
+}
+
+static void run_release(mc_cpu_run* run) {
+    if (atomic_fetch_sub(&run->refs, 1) == 1) {
+        for (int i = 0; i < run->buf_count; i++) {
+            if (run->bufs[i]) buf_release(run->bufs[i]);
+        }
+        if (run->fn) fn_release(run->fn);
+        if (run->stream) stream_release(run->stream);
+        if (run->event) event_release(run->event);
+        if (run->then) run_release(run->then);
+        for (int i = 0; i < run->dep_count; i++)
+            run_release(run->deps[i]);
+        free(run->deps);
+        free(run->bufs);
+        free(run->bindings);
+        free(run->constants);
+        free(run->ranges);
+        free(run);
+    }
+}
+
+// -------------------------------------------------
+// Handle table. Slab of objects addressed by generation checked ids:
+// id = generation << 32 | (slot index + 1). Closed slots go on a free
+// list and have their generation bumped so stale ids are rejected.
+// Waits look up handles without the GIL, so the table has its own lock.
+
+enum { HandleFree, HandleDev, HandleKern, HandleFn, HandleBuf, HandleRun, HandleStream, HandleEvent, HandleArgs };
+
+typedef struct {
+    int type;
+    uint32_t generation;
+    void* obj;
+    int64_t next_free;
+} mc_cpu_handle;
+
+static mc_cpu_handle* handles = NULL;
+static int64_t handle_count = 0;
+static int64_t handle_cap = 0;
+static int64_t handle_free = -1;
+static pthread_mutex_t handle_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int64_t handle_open(int type, void* obj) {
+    int64_t index;
+    pthread_mutex_lock(&handle_lock);
+    if (handle_free >= 0) {
+        index = handle_free;
+        handle_free = handles[index].next_free;
+    } else {
+        if (handle_count == handle_cap) {
+            int64_t cap = handle_cap ? handle_cap * 2 : 64;
+            mc_cpu_handle* grown = realloc(handles, cap * sizeof(mc_cpu_handle));
+            if (grown == NULL) {
+                pthread_mutex_unlock(&handle_lock);
+                return 0;
+            }
+            handles = grown;
+            handle_cap = cap;
+        }
+        index = handle_count++;
+        handles[index].generation = 1;
+    }
+    handles[index].type = type;
+    handles[index].obj = obj;
+    int64_t id = ((int64_t)handles[index].generation << 32) | (index + 1); // 0 is never a valid id
+    pthread_mutex_unlock(&handle_lock);
+    return id;
+}
+
+static mc_cpu_handle* handle_slot(int64_t id, int type) {
+    int64_t index = (id & 0xffffffff) - 1;
+    if (index < 0 || index >= handle_count) return NULL;
+    mc_cpu_handle* h = &handles[index];
+    if (h->type != type || h->generation != (uint32_t)(id >> 32)) return NULL;
+    return h;
+}
+
+static void* handle_get(int64_t id, int type) {
+    pthread_mutex_lock(&handle_lock);
+    mc_cpu_handle* h = handle_slot(id, type);
+    void* obj = h ? h->obj : NULL;
+    pthread_mutex_unlock(&handle_lock);
+    return obj;
+}
+
+static void handle_close(int64_t id) {
+    int64_t index = (id & 0xffffffff) - 1;
+    pthread_mutex_lock(&handle_lock);
+    handles[index].type = HandleFree;
+    handles[index].obj = NULL;
+    handles[index].generation = (handles[index].generation + 1) & 0x7fffffff;
+    handles[index].next_free = handle_free;
+    handle_free = index;
+    pthread_mutex_unlock(&handle_lock);
+}
+
+// -------------------------------------------------
+// Worker pool
+//
+// Runs are queued in submission order, and start once the runs they depend
+// on have completed. Workers cooperate on the earliest run of the highest
+// priority stream which is ready and has threadgroups left, so independent
+// runs overlap: workers which run out of groups in one run move on to the
+// next. Each worker starts a run with an equal share of the threadgroups and
+// steals half of the largest remaining share from another worker when its
+// own is exhausted.
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    int nthreads;
+    mc_cpu_run* head; // Queued runs, oldest first
+    mc_cpu_run* tail;
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, NULL, NULL };
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static inline uint64_t range_pack(uint32_t lo, uint32_t hi) {
+    return ((uint64_t)lo << 32) | hi;
+}
+
+static int range_take(mc_cpu_range* r, uint32_t* group) {
+    uint64_t cur = atomic_load(&r->range);
+    for (;;) {
+        uint32_t lo = (uint32_t)(cur >> 32), hi = (uint32_t)cur;
+        if (lo >= hi) return 0;
+        if (atomic_compare_exchange_weak(&r->range, &cur, range_pack(lo + 1, hi))) {
+            *group = lo;
+            return 1;
+        }
+    }
+}
+
+static int range_steal(mc_cpu_run* run, int self) {
+    for (;;) {
+        int victim = -1;
+        uint32_t best = 0;
+        uint64_t cur = 0;
+        for (int w = 0; w < pool.nthreads; w++) {
+            if (w == self) continue;
+            uint64_t r = atomic_load(&run->ranges[w].range);
+            uint32_t lo = (uint32_t)(r >> 32), hi = (uint32_t)r;
+            if (lo < hi && hi - lo > best) {
+                best = hi - lo;
+                victim = w;
+                cur = r;
+            }
+        }
+        if (victim < 0) return 0;
+        uint32_t lo = (uint32_t)(cur >> 32), hi = (uint32_t)cur;
+        uint32_t mid = hi - (hi - lo + 1) / 2;
+        if (atomic_compare_exchange_strong(&run->ranges[victim].range, &cur, range_pack(lo, mid))) {
+            atomic_store(&run->ranges[self].range, range_pack(mid, hi));
+            return 1;
+        }
+    }
+}
+
+// Execute groups of the run until none are left to take or steal.
+// Returns the number executed, or -1 if out of memory.
+static int64_t run_execute(mc_cpu_run* run, int self, void** scratch, size_t* scratch_size) {
+    const mc_msl_fn* fn = run->fn->fn;
+    size_t need = run->scratch_size;
+    if (need > *scratch_size) {
+        free(*scratch);
+        if (posix_memalign(scratch, 64, need)) {
+            *scratch = NULL;
+            *scratch_size = 0;
+            return -1; // Leave the groups to other workers
+        }
+        *scratch_size = need;
+    }
+    // Threadgroup memory follows the lane slots, reused by each group this worker runs
+    mc_msl_buffer tg[MC_CPU_MAX_THREADGROUP_MEM];
+    char* tg_data = (char*)*scratch + mc_msl_fn_scratch_size(fn, (int)(run->dispatch.group[0] * run->dispatch.group[1] * run->dispatch.group[2]));
+    for (int i = 0; i < run->tg_count; i++) {
+        tg_data = (char*)(((uintptr_t)tg_data + 15) & ~(uintptr_t)15);
+        tg[i].data = run->tg_lengths[i] ? tg_data : NULL;
+        tg[i].length = run->tg_lengths[i];
+        tg_data += run->tg_lengths[i];
+    }
+    int64_t executed = 0;
+    for (;;) {
+        uint32_t group;
+        if (range_take(&run->ranges[self], &group)) {
+            mc_msl_exec(fn, run->bindings, run->buf_count, tg, run->tg_count, &run->dispatch, group, *scratch);
+            executed++;
+        } else if (!range_steal(run, self)) {
+            return executed;
+        }
+    }
+}
+
+static void run_prepare(mc_cpu_run* run);
+
+static int run_ready(const mc_cpu_run* run) {
+    for (int i = 0; i < run->dep_count; i++) {
+        if (!run->deps[i]->done) return 0;
+    }
+    if (run->marker == MC_CPU_WAIT && run->event->value < run->value) return 0;
+    if (run->stream && (run->marker == MC_CPU_SIGNAL || run->stream->waits > 0)) {
+        // Queued runs are those not yet done
+        for (const mc_cpu_run* q = pool.head; q != run; q = q->next) {
+            if (q->stream == run->stream && (run->marker == MC_CPU_SIGNAL || q->marker == MC_CPU_WAIT))
+                return 0;
+        }
+    }
+    return 1;
+}
+
+static int64_t run_priority(const mc_cpu_run* run) {
+    return run->stream ? run->stream->priority : 0;
+}
+
+static int run_has_groups(mc_cpu_run* run) {
+    for (int w = 0; w < pool.nthreads; w++) {
+        uint64_t r = atomic_load(&run->ranges[w].range);
+        if ((uint32_t)(r >> 32) < (uint32_t)r) return 1;
+    }
+    return 0;
+}
+
+// Once all of a run's groups are executed. A batch continues with its next
+// stage in the same place in the queue, and the stage boundary is the barrier
+// between dispatches. Locked.
+static void run_retire(mc_cpu_run* run) {
+    mc_cpu_run* then = run->then;
+    run->then = NULL; // The batch's reference becomes the queue reference
+    run->done = 1;
+    if (run->marker == MC_CPU_SIGNAL && run->value > run->event->value) // Streams may retire out of order
+        run->event->value = run->value;
+    if (run->marker == MC_CPU_WAIT) run->stream->waits--;
+    mc_cpu_run** link = &pool.head;
+    mc_cpu_run* prev = NULL;
+    while (*link != run) {
+        prev = *link;
+        link = &(*link)->next;
+    }
+    if (then) {
+        run_prepare(then);
+        then->next = run->next;
+        *link = then;
+        if (pool.tail == run) pool.tail = then;
+    } else {
+        *link = run->next;
+        if (pool.tail == run) pool.tail = prev;
+        pthread_cond_broadcast(&pool.done);
+        mc_notify_signal();
+    }
+    pthread_cond_broadcast(&pool.work); // Runs depending on this one may be ready
+    run_release(run); // Queue reference
+}
+
+// Earliest run of the highest priority which is ready and has groups to take,
+// or NULL. Ready runs without any groups (empty grids, empty batch stages,
+// event markers) are retired on the way. Locked.
+static mc_cpu_run* pool_next(void) {
+    mc_cpu_run* best = NULL;
+    mc_cpu_run* run = pool.head;
+    while (run != NULL) {
+        if (!run_ready(run)) {
+            run = run->next;
+        } else if (run->groups == 0) {
+            run_retire(run);
+            run = pool.head; // Its next stage may have groups, and later runs may be ready
+            best = NULL;
+        } else {
+            if (run_has_groups(run) && (best == NULL || run_priority(run) > run_priority(best)))
+                best = run;
+            run = run->next;
+        }
+    }
+    return best;
+}
+
+static void* pool_worker(void* arg) {
+    int self = (int)(intptr_t)arg;
+    void* scratch = NULL;
+    size_t scratch_size = 0;
+
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        mc_cpu_run* run = pool_next();
+        if (run == NULL) {
+            pthread_cond_wait(&pool.work, &pool.lock);
+            continue;
+        }
+        atomic_fetch_add(&run->refs, 1); // Held while working on it
+        pthread_mutex_unlock(&pool.lock);
+
+        int64_t executed = run_execute(run, self, &scratch, &scratch_size);
+
+        pthread_mutex_lock(&pool.lock);
+        if (executed > 0) {
+            run->unfinished -= (uint32_t)executed;
+            if (run->unfinished == 0) {
+                // Last group done, so move on. The working reference goes first, so that
+                // the run is freed by whoever drops the last one after it completes.
+                atomic_fetch_sub(&run->refs, 1); // The queue still holds one
+                run_retire(run);
+                continue;
+            }
+        } else if (executed < 0) {
+            pthread_cond_wait(&pool.work, &pool.lock); // Out of memory, try again later
+        }
+        pthread_mutex_unlock(&pool.lock);
+        run_release(run);
+        pthread_mutex_lock(&pool.lock);
+    }
+    return NULL;
+}
+
+static void pool_start(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    const char* env = getenv("METALCOMPUTE_CPU_THREADS");
+    if (env != NULL && atol(env) > 0) n = atol(env);
+    if (n < 1) n = 1;
+    pool.nthreads = 0;
+    for (long i = 0; i < n; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, pool_worker, (void*)(intptr_t)i) != 0) break;
+        pthread_detach(thread);
+        pool.nthreads++;
+    }
+}
+
+static int pool_ready(void) {
+    pthread_once(&pool_once, pool_start);
+    return pool.nthreads > 0;
+}
+
+// Share out the threadgroups before workers can see the run
+static void run_prepare(mc_cpu_run* run) {
+    uint32_t n = (uint32_t)pool.nthreads;
+    for (uint32_t w = 0; w < n; w++) {
+        uint32_t lo = (uint32_t)((uint64_t)run->groups * w / n);
+        uint32_t hi = (uint32_t)((uint64_t)run->groups * (w + 1) / n);
+        atomic_init(&run->ranges[w].range, range_pack(lo, hi));
+    }
+    run->unfinished = run->groups;
+}
+
+static void pool_submit(mc_cpu_run* run) {
+    run_prepare(run);
+    atomic_fetch_add(&run->refs, 1); // Queue reference
+
+    pthread_mutex_lock(&pool.lock);
+    if (run->marker == MC_CPU_WAIT) run->stream->waits++;
+    if (pool.tail) pool.tail->next = run; else pool.head = run;
+    pool.tail = run;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+static void pool_wait(mc_cpu_run* run) {
+    pthread_mutex_lock(&pool.lock);
+    while (!run->done)
+        pthread_cond_wait(&pool.done, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+// Create a run of fn over kcount threads. bufs may be NULL when the caller owns the memory.
+static RetCode run_new(mc_cpu_fn* fn, int64_t kcount, int buf_count, mc_cpu_buf** bufs,
+                       const mc_msl_buffer* bindings, mc_cpu_run** run_out) {
+    if (mc_msl_fn_buffer_count(fn->fn) > buf_count) return BufferNotFound;
+    if (kcount < 0 || kcount > UINT32_MAX) return NotReadyToRun;
+    mc_cpu_run* run = calloc(1, sizeof(mc_cpu_run));
+    if (run == NULL) return NotReadyToRun;
+    run->bufs = calloc(buf_count ? buf_count : 1, sizeof(mc_cpu_buf*));
+    run->bindings = calloc(buf_count ? buf_count : 1, sizeof(mc_msl_buffer));
+    run->ranges = aligned_alloc(64, pool.nthreads * sizeof(mc_cpu_range));
+    if (!run->bufs || !run->bindings || !run->ranges) {
+        free(run->bufs);
+        free(run->bindings);
+        free(run->ranges);
+        free(run);
+        return NotReadyToRun;
+    }
+    atomic_init(&run->refs, 1);
+    atomic_fetch_add(&fn->refs, 1);
+    run->fn = fn;
+    run->buf_count = buf_count;
+    for (int i = 0; i < buf_count; i++) {
+        run->bindings[i] = bindings[i];
+        if (bufs && bufs[i]) {
+            atomic_fetch_add(&bufs[i]->refs, 1);
+            run->bufs[i] = bufs[i];
+        }
+    }
+    // 1-D until run_shape says otherwise
+    run->dispatch = (mc_msl_dispatch){ { (uint32_t)kcount, 1, 1 }, { fn->group, 1, 1 } };
+    run->groups = (uint32_t)((kcount + fn->group - 1) / fn->group);
+    run->scratch_size = fn->scratch_size;
+    *run_out = run;
+    return Success;
+}
+
+// Apply the grid, threadgroup shape and threadgroup memory of a run handle
+static RetCode run_shape(mc_cpu_run* run, const mc_run_handle* run_handle) {
+    const int64_t* grid = run_handle->grid;
+    const int64_t* shape = run_handle->threadgroup;
+    mc_msl_dispatch* d = &run->dispatch;
+    if (grid[0] != 0 || grid[1] != 0 || grid[2] != 0) {
+        for (int k = 0; k < 3; k++) {
+            if (grid[k] < 0 || grid[k] > UINT32_MAX) return InvalidDispatch;
+            d->grid[k] = (uint32_t)grid[k];
+        }
+    }
+    if (shape[0] != 0 || shape[1] != 0 || shape[2] != 0) {
+        for (int k = 0; k < 3; k++) {
+            if (shape[k] < 1 || shape[k] > MC_MSL_MAX_LANES) return InvalidDispatch;
+            d->group[k] = (uint32_t)shape[k];
+        }
+    } else if (d->grid[1] != 1 || d->grid[2] != 1) {
+        // Fill the default group size, x fastest, without exceeding the grid
+        uint32_t left = run->fn->group;
+        for (int k = 0; k < 3; k++) {
+            d->group[k] = d->grid[k] == 0 ? 1 : (d->grid[k] < left ? d->grid[k] : left);
+            left /= d->group[k];
+        }
+    }
+    uint64_t lanes = (uint64_t)d->group[0] * d->group[1] * d->group[2];
+    if (lanes > MC_MSL_MAX_LANES) return InvalidDispatch;
+    uint64_t groups = 1;
+    for (int k = 0; k < 3; k++) groups *= (d->grid[k] + (uint64_t)d->group[k] - 1) / d->group[k];
+    if (groups > UINT32_MAX) return InvalidDispatch;
+    run->groups = (uint32_t)groups;
+
+    int64_t tg_count = run_handle->threadgroup_mem_count;
+    if (tg_count < 0 || tg_count > MC_CPU_MAX_THREADGROUP_MEM) return InvalidDispatch;
+    size_t need = (mc_msl_fn_scratch_size(run->fn->fn, (int)lanes) + 63) & ~(size_t)63;
+    for (int i = 0; i < tg_count; i++) {
+        int64_t length = run_handle->threadgroup_mem[i];
+        if (length < 0 || length > (1 << 30)) return InvalidDispatch;
+        run->tg_lengths[i] = (uint64_t)length;
+        need += ((size_t)length + 15) & ~(size_t)15;
+    }
+    run->tg_count = (int)tg_count;
+    run->scratch_size = need;
+    return Success;
+}
+
+static void run_start(mc_cpu_run* run) {
+    if (run->groups == 0 && run->dep_count == 0 && run->stream == NULL) {
+        run->done = 1;
+        return;
+    }
+    pool_submit(run);
+}
+
+// Find a run by id and take a reference to it, in one step so that another
+// thread closing it meanwhile cannot free it first. NULL if closed.
+static mc_cpu_run* run_hold(int64_t id) {
+    pthread_mutex_lock(&handle_lock);
+    mc_cpu_handle* h = handle_slot(id, HandleRun);
+    mc_cpu_run* run = h ? h->obj : NULL;
+    if (run) atomic_fetch_add(&run->refs, 1);
+    pthread_mutex_unlock(&handle_lock);
+    return run;
+}
+
+// Hold the runs which must complete before run starts. Those already closed are complete.
+static RetCode run_depend(mc_cpu_run* run, const mc_run_handle* run_handle) {
+    if (run_handle->dep_count <= 0) return Success;
+    run->deps = calloc(run_handle->dep_count, sizeof(mc_cpu_run*));
+    if (run->deps == NULL) return NotReadyToRun;
+    for (int64_t i = 0; i < run_handle->dep_count; i++) {
+        mc_cpu_run* dep = run_hold(run_handle->deps[i]);
+        if (dep == NULL) continue;
+        run->deps[run->dep_count++] = dep;
+    }
+    return Success;
+}
+
+// Submit the run to the stream of run_handle, if it has one
+static RetCode run_stream(mc_cpu_run* run, const mc_run_handle* run_handle) {
+    if (run_handle->stream == 0) return Success;
+    mc_cpu_stream* stream = handle_get(run_handle->stream, HandleStream);
+    if (stream == NULL) return StreamNotFound;
+    atomic_fetch_add(&stream->refs, 1);
+    run->stream = stream;
+    return Success;
+}
+
+// Queue a marker run for an event operation on a stream
+static RetCode marker_submit(const mc_stream_handle* stream_handle, const mc_event_handle* event_handle,
+                             uint64_t value, int marker) {
+    mc_cpu_stream* stream = handle_get(stream_handle->id, HandleStream);
+    if (stream == NULL) return StreamNotFound;
+    mc_cpu_event* event = handle_get(event_handle->id, HandleEvent);
+    if (event == NULL) return EventNotFound;
+    mc_cpu_run* run = calloc(1, sizeof(mc_cpu_run));
+    if (run == NULL) return NotReadyToRun;
+    run->ranges = aligned_alloc(64, pool.nthreads * sizeof(mc_cpu_range));
+    if (run->ranges == NULL) {
+        free(run);
+        return NotReadyToRun;
+    }
+    atomic_init(&run->refs, 1);
+    atomic_fetch_add(&stream->refs, 1);
+    run->stream = stream;
+    atomic_fetch_add(&event->refs, 1);
+    run->event = event;
+    run->marker = marker;
+    run->value = value;
+    pool_submit(run);
+    run_release(run); // Now held by the queue
+    return Success;
+}
+
+// -------------------------------------------------
+// v0.1 of API - simple functions and retained state
+
+static int ready_to_compile = 0;
+static int ready_to_compute = 0;
+static int ready_to_run = 0;
+static int ready_to_retrieve = 0;
+static mc_cpu_fn* function = NULL;
+static mc_cpu_buf* input_buffer = NULL;
+static mc_cpu_buf* output_buffer = NULL;
+static int output_count = 0;
+static int output_stride = 0;
+
+static void release_v1_buffers(void) {
+    if (input_buffer) buf_release(input_buffer);
+    if (output_buffer) buf_release(output_buffer);
+    input_buffer = output_buffer = NULL;
+}
+
+RetCode mc_sw_init(uint64_t device_index) {
+    if ((int64_t)device_index >= 1 || !pool_ready()) return CannotCreateDevice;
+    ready_to_compile = 1;
+    ready_to_compute = 0;
+    return Success;
+}
+
+RetCode mc_sw_release() {
+    release_v1_buffers();
+    if (function) fn_release(function);
+    function = NULL;
+    ready_to_compile = 0;
+    ready_to_compute = 0;
+    ready_to_run = 0;
+    ready_to_retrieve = 0;
+    return Success;
+}
+
+RetCode mc_sw_compile(const char* program, const char* functionName) {
+    if (!ready_to_compile) return NotReadyToCompile;
+
+    mc_cpu_kern* kern;
+    char* error;
+    RetCode ret = kern_compile(program, &kern, &error);
+    if (ret == FailedToCompile) set_compile_error(error);
+    if (ret != Success) return ret;
+    const mc_msl_fn* found = mc_msl_lib_find(kern->lib, functionName);
+    if (found == NULL) {
+        kern_release(kern);
+        return FailedToFindFunction;
+    }
+    // Function is reused by every mc_sw_run until the next compile
+    mc_cpu_fn* fn = fn_new(kern, found);
+    kern_release(kern); // Now owned by fn
+    if (fn == NULL) return CannotCreatePipelineState;
+
+    if (function) fn_release(function);
+    function = fn;
+    ready_to_compute = 1;
+    ready_to_run = 0;
+    return Success;
+}
+
+RetCode mc_sw_alloc(int icount, float* input, int iformat, int ocount, int oformat) {
+    if (!ready_to_compute) return NotReadyToCompute;
+
+    int input_stride = mc_format_stride(iformat);
+    if (input_stride == 0) return UnsupportedInputFormat;
+    int new_output_stride = mc_format_stride(oformat);
+    if (new_output_stride == 0) return UnsupportedOutputFormat;
+
+    mc_cpu_buf* new_input = buf_new(NULL, (uint64_t)input_stride * icount, (const char*)input);
+    if (new_input == NULL) return FailedToMakeInputBuffer;
+    mc_cpu_buf* new_output = buf_new(NULL, (uint64_t)new_output_stride * ocount, NULL);
+    if (new_output == NULL) {
+        buf_release(new_input);
+        return FailedToMakeOutputBuffer;
+    }
+
+    release_v1_buffers();
+    input_buffer = new_input;
+    output_buffer = new_output;
+    output_count = ocount;
+    output_stride = new_output_stride;
+    ready_to_run = 1;
+    ready_to_retrieve = 0;
+    return Success;
+}
+
+RetCode mc_sw_run(int64_t kcount) {
+    // Execute the configured compute task, waiting for completion
+    if (!ready_to_run || !function) return NotReadyToRun;
+
+    mc_cpu_buf* bufs[2] = { input_buffer, output_buffer };
+    mc_msl_buffer bindings[2] = {
+        { input_buffer->data, input_buffer->length },
+        { output_buffer->data, output_buffer->length }
+    };
+    mc_cpu_run* run = NULL;
+    RetCode ret = run_new(function, kcount, 2, bufs, bindings, &run);
+    if (ret != Success) return ret;
+    run_start(run);
+    pool_wait(run);
+    run_release(run);
+
+    ready_to_retrieve = 1;
+    return Success;
+}
+
+RetCode mc_sw_retrieve(int ocount, float* output) {
+    // Return result of compute task
+    if (!ready_to_retrieve) return NotReadyToRetrieve;
+    if (ocount != output_count) return IncorrectOutputCount;
+    mc_copy(output, output_buffer->data, (size_t)output_count * output_stride);
+    return Success;
+}
+
+// ------------------------------
+// v0.2 of the API - object based
+
+// Number of devices to present. METALCOMPUTE_CPU_DEVICES gives stand-in devices
+// sharing the one worker pool, so multi-device code can be tested without a GPU
+static int dev_count(void) {
+    const char* env = getenv("METALCOMPUTE_CPU_DEVICES");
+    int n = env != NULL ? atoi(env) : 1;
+    return n < 1 ? 1 : n;
+}
+
+static void dev_name(int64_t index, char* name, size_t size) {
+    if (dev_count() == 1)
+        snprintf(name, size, "CPU (%d threads)", pool.nthreads);
+    else
+        snprintf(name, size, "CPU %" PRId64 " (%d threads)", index, pool.nthreads);
+}
+
+RetCode mc_sw_count_devs(mc_devices* devices) {
+    if (!pool_ready()) return CannotCreateDevice;
+    int count = dev_count();
+    devices->dev_count = count;
+    devices->devs = malloc(count * sizeof(mc_dev)); // Must be freed by python
+    if (devices->devs == NULL) return CannotCreateDevice;
+    for (int i = 0; i < count; i++) {
+        char name[64];
+        dev_name(i, name, sizeof(name));
+        devices->devs[i].name = strdup(name); // Must be freed by python
+        devices->devs[i].recommendedMaxWorkingSetSize = (int64_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+        devices->devs[i].hasUnifiedMemory = true;
+        devices->devs[i].maxTransferRate = 0;
+    }
+    return Success;
+}
+
+RetCode mc_sw_dev_open(uint64_t device_index, mc_dev_handle* dev_handle) {
+    int64_t index = (int64_t)device_index < 0 ? 0 : (int64_t)device_index; // -1 for the default device
+    if (index >= dev_count() || !pool_ready()) return CannotCreateDevice;
+    mc_cpu_dev* dev = calloc(1, sizeof(mc_cpu_dev));
+    if (dev == NULL) return CannotCreateDevice;
+    dev->pool = bufpool_new();
+    int64_t id = dev->pool ? handle_open(HandleDev, dev) : 0;
+    if (id == 0) {
+        if (dev->pool) bufpool_release(dev->pool);
+        free(dev);
+        return CannotCreateDevice;
+    }
+    char name[64];
+    dev_name(index, name, sizeof(name));
+    dev_handle->id = id;
+    dev_handle->name = strdup(name); // Python must free this later
+    return Success;
+}
+
+RetCode mc_sw_dev_close(mc_dev_handle* dev_handle) {
+    mc_cpu_dev* dev = handle_get(dev_handle->id, HandleDev);
+    if (dev == NULL) return DeviceNotFound;
+    if (dev->bufs != 0) return DeviceBuffersAllocated;
+    handle_close(dev_handle->id);
+    bufpool_release(dev->pool); // Freed once buffers still in use by runs are released
+    free(dev);
+    return Success;
+}
+
+RetCode mc_sw_kern_open(const mc_dev_handle* dev_handle, const char* program, mc_kern_handle* kern_handle) {
+    mc_cpu_dev* dev = handle_get(dev_handle->id, HandleDev);
+    if (dev == NULL) return DeviceNotFound;
+
+    mc_cpu_kern* kern;
+    kern_handle->error = NULL;
+    RetCode ret = kern_compile(program, &kern, &kern_handle->error);
+    if (ret != Success) return ret;
+    int64_t id = handle_open(HandleKern, kern);
+    if (id == 0) {
+        kern_release(kern);
+        kern_handle->error = strdup("out of memory");
+        return FailedToCompile;
+    }
+    dev->kerns++;
+    kern_handle->id = id;
+    return Success;
+}
+
+RetCode mc_sw_kern_close(const mc_dev_handle* dev_handle, mc_kern_handle* kern_handle) {
+    mc_cpu_dev* dev = handle_get(dev_handle->id, HandleDev);
+    if (dev == NULL) return DeviceNotFound;
+    mc_cpu_kern* kern = handle_get(kern_handle->id, HandleKern);
+    if (kern == NULL) return KernelNotFound;
+    handle_close(kern_handle->id);
+    dev->kerns--;
+    kern_release(kern);
+    return Success;
+}
+
+RetCode mc_sw_fn_open(const mc_dev_handle* dev_handle, const mc_kern_handle* kern_handle,
+                      const char* func_name, mc_fn_handle* fn_handle) {
+    if (handle_get(dev_handle->id, HandleDev) == NULL) return DeviceNotFound;
+    mc_cpu_kern* kern = handle_get(kern_handle->id, HandleKern);
+    if (kern == NULL) return KernelNotFound;
+    const mc_msl_fn* found = mc_msl_lib_find(kern->lib, func_name);
+    if (found == NULL) return FunctionNotFound;
+
+    mc_cpu_fn* fn = fn_new(kern, found);
+    if (fn == NULL) return CannotCreatePipelineState;
+    int64_t id = handle_open(HandleFn, fn);
+    if (id == 0) {
+        fn_release(fn);
+        return FunctionNotFound;
+    }
+    fn_handle->id = id;
+    // Nominal geometry: whole threadgroups run in lockstep on one worker
+    fn_handle->thread_execution_width = fn->group;
+    fn_handle->max_total_threads_per_threadgroup = MC_MSL_MAX_LANES;
+    fn_handle->threadgroup_size = fn->group;
+    fn_handle->written_mask = mc_msl_fn_written_mask(found);
+    return Success;
+}
+
+RetCode mc_sw_fn_close(const mc_dev_handle* dev_handle, const mc_kern_handle* kern_handle, mc_fn_handle* fn_handle) {
+    if (handle_get(dev_handle->id, HandleDev) == NULL) return DeviceNotFound;
+    if (handle_get(kern_handle->id, HandleKern) == NULL) return KernelNotFound;
+    mc_cpu_fn* fn = handle_get(fn_handle->id, HandleFn);
+    if (fn == NULL) return FunctionNotFound;
+    handle_close(fn_handle->id);
+    fn_release(fn);
+    return Success;
+}
+
+// Give a new buffer its handle, which takes over its reference
+static RetCode buf_register(mc_cpu_dev* dev, mc_cpu_buf* buf, uint64_t length, mc_buf_handle* buf_handle) {
+    int64_t id = handle_open(HandleBuf, buf);
+    if (id == 0) {
+        buf_release(buf);
+        return CouldNotMakeBuffer;
+    }
+    dev->bufs++;
+    dev->buf_bytes += (int64_t)buf->capacity;
+    buf_handle->id = id;
+    buf_handle->buf = buf->data;
+    buf_handle->length = (int64_t)length;
+    return Success;
+}
+
+RetCode mc_sw_buf_open(const mc_dev_handle* dev_handle, uint64_t length, char* src, mc_buf_handle* buf_handle) {
+    mc_cpu_dev* dev = handle_get(dev_handle->id, HandleDev);
+    if (dev == NULL) return DeviceNotFound;
+    mc_cpu_buf* buf = buf_new(dev->pool, length, src);
+    if (buf == NULL) return CouldNotMakeBuffer;
+    return buf_register(dev, buf, length, buf_handle);
+}
+
+RetCode mc_sw_buf_convert(const mc_dev_handle* dev_handle, uint64_t count, const char* src, int64_t src_format,
+                          int64_t format, int64_t flags, mc_buf_handle* buf_handle) {
+    mc_cpu_dev* dev = handle_get(dev_handle->id, HandleDev);
+    if (dev == NULL) return DeviceNotFound;
+    uint64_t length = count * mc_format_stride(format);
+    mc_cpu_buf* buf = buf_alloc(dev->pool, length);
+    if (buf == NULL) return CouldNotMakeBuffer;
+    if (mc_convert(buf->data, format, src, src_format, count, (int)flags)) {
+        buf_release(buf);
+        return UnsupportedInputFormat;
+    }
+    return buf_register(dev, buf, length, buf_handle);
+}
+
+RetCode mc_sw_buf_wrap(const mc_dev_handle* dev_handle, char* data, uint64_t length, mc_buf_handle* buf_handle) {
+    mc_cpu_dev* dev = handle_get(dev_handle->id, HandleDev);
+    if (dev == NULL) return DeviceNotFound;
+    // Any memory would do here, but keep to the same rules as Metal
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    if (length == 0 || (uintptr_t)data % page != 0 || length % page != 0) return CannotWrapMemory;
+    mc_cpu_buf* buf = calloc(1, sizeof(mc_cpu_buf));
+    if (buf == NULL) return CouldNotMakeBuffer;
+    buf->data = data;
+    buf->length = buf->capacity = length;
+    buf->wrapped = 1;
+    atomic_init(&buf->refs, 1);
+    return buf_register(dev, buf, length, buf_handle);
+}
+
+RetCode mc_sw_buf_close(const mc_dev_handle* dev_handle, mc_buf_handle* buf_handle) {
+    mc_cpu_dev* dev = handle_get(dev_handle->id, HandleDev);
+    if (dev == NULL) return DeviceNotFound;
+    mc_cpu_buf* buf = handle_get(buf_handle->id, HandleBuf);
+    if (buf == NULL) return BufferNotFound;
+    handle_close(buf_handle->id);
+    dev->bufs--;
+    dev->buf_bytes -= (int64_t)buf->capacity;
+    buf_release(buf); // Memory stays alive until queued runs using it complete
+    return Success;
+}
+
+// Copy the run's inline arguments, which like setBytes are taken when the run opens
+static RetCode run_constants(mc_cpu_run* run) {
+    size_t total = 0;
+    for (int i = 0; i < run->buf_count; i++)
+        if (run->bufs[i] == NULL) total += run->bindings[i].length;
+    if (total == 0) return Success;
+    run->constants = malloc(total);
+    if (run->constants == NULL) return NotReadyToRun;
+    char* next = run->constants;
+    for (int i = 0; i < run->buf_count; i++) {
+        if (run->bufs[i] != NULL) continue;
+        memcpy(next, run->bindings[i].data, run->bindings[i].length);
+        run->bindings[i].data = next;
+        next += run->bindings[i].length;
+    }
+    return Success;
+}
+
+// Look up the buffers of count handles, or bind the bytes of inline ones, without taking references
+static RetCode args_resolve(int count, mc_buf_handle* const* handles, mc_cpu_buf** bufs, mc_msl_buffer* bindings) {
+    for (int i = 0; i < count; i++) {
+        const mc_buf_handle* buf_handle = handles[i];
+        if (buf_handle && buf_handle->id == 0 && buf_handle->buf != NULL
+            && buf_handle->length > 0 && buf_handle->length <= MC_INLINE_MAX) {
+            bindings[i].data = buf_handle->buf;
+            bindings[i].length = (uint64_t)buf_handle->length;
+            continue;
+        }
+        mc_cpu_buf* buf = buf_handle ? handle_get(buf_handle->id, HandleBuf) : NULL;
+        if (buf == NULL || buf_handle->offset < 0 || buf_handle->length < 0
+            || (uint64_t)(buf_handle->offset + buf_handle->length) > buf->length)
+            return BufferNotFound;
+        bufs[i] = buf;
+        bindings[i].data = buf->data + buf_handle->offset;
+        bindings[i].length = (uint64_t)buf_handle->length;
+    }
+    return Success;
+}
+
+// Create the run for one dispatch, without starting it
+static RetCode run_open(const mc_kern_handle* kern_handle, const mc_fn_handle* fn_handle,
+                        const mc_run_handle* run_handle, mc_cpu_run** run_out) {
+    if (handle_get(kern_handle->id, HandleKern) == NULL) return KernelNotFound;
+    mc_cpu_fn* fn = handle_get(fn_handle->id, HandleFn);
+    if (fn == NULL) return FunctionNotFound;
+
+    RetCode ret;
+    if (run_handle->args != 0) {
+        // Resolved by mc_sw_args_open. Its inline bytes are copied like any others
+        mc_cpu_args* args = handle_get(run_handle->args, HandleArgs);
+        if (args == NULL) return BufferNotFound;
+        ret = run_new(fn, run_handle->kcount, args->count, args->bufs, args->bindings, run_out);
+    } else {
+        int buf_count = (int)run_handle->buf_count;
+        mc_cpu_buf** bufs = calloc(buf_count ? buf_count : 1, sizeof(mc_cpu_buf*));
+        mc_msl_buffer* bindings = calloc(buf_count ? buf_count : 1, sizeof(mc_msl_buffer));
+        if (!bufs || !bindings) {
+            free(bufs);
+            free(bindings);
+            return NotReadyToRun;
+        }
+        ret = args_resolve(buf_count, run_handle->bufs, bufs, bindings);
+        if (ret == Success) ret = run_new(fn, run_handle->kcount, buf_count, bufs, bindings, run_out);
+        free(bufs);
+        free(bindings);
+    }
+    if (ret == Success && ((ret = run_shape(*run_out, run_handle)) != Success || (ret = run_constants(*run_out)) != Success)) {
+        run_release(*run_out);
+        *run_out = NULL;
+    }
+    return ret;
+}
+
+static void args_free(mc_cpu_args* args) {
+    for (int i = 0; i < args->count; i++)
+        if (args->bufs[i]) buf_release(args->bufs[i]);
+    free(args->bufs);
+    free(args->bindings);
+    free(args->constants);
+    free(args);
+}
+
+RetCode mc_sw_args_open(const mc_dev_handle* dev_handle, int64_t count, mc_buf_handle* const* bufs,
+                        mc_args_handle* args_handle) {
+    if (handle_get(dev_handle->id, HandleDev) == NULL) return DeviceNotFound;
+    if (count < 0 || count > INT_MAX) return BufferNotFound;
+    mc_cpu_args* args = calloc(1, sizeof(mc_cpu_args));
+    if (args == NULL) return NotReadyToRun;
+    args->bufs = calloc(count ? count : 1, sizeof(mc_cpu_buf*));
+    args->bindings = calloc(count ? count : 1, sizeof(mc_msl_buffer));
+    if (!args->bufs || !args->bindings) {
+        args_free(args);
+        return NotReadyToRun;
+    }
+    RetCode ret = args_resolve((int)count, bufs, args->bufs, args->bindings);
+    if (ret != Success) {
+        args_free(args); // No references taken yet, as count is 0
+        return ret;
+    }
+    args->count = (int)count;
+    size_t total = 0;
+    for (int i = 0; i < args->count; i++) {
+        if (args->bufs[i]) atomic_fetch_add(&args->bufs[i]->refs, 1);
+        else total += args->bindings[i].length;
+    }
+    // Inline bytes are copied now, as a run would copy them when it opens
+    if (total > 0 && (args->constants = malloc(total)) == NULL) {
+        args_free(args);
+        return NotReadyToRun;
+    }
+    char* next = args->constants;
+    for (int i = 0; i < args->count; i++) {
+        if (args->bufs[i]) continue;
+        memcpy(next, args->bindings[i].data, args->bindings[i].length);
+        args->bindings[i].data = next;
+        next += args->bindings[i].length;
+    }
+    int64_t id = handle_open(HandleArgs, args);
+    if (id == 0) {
+        args_free(args);
+        return NotReadyToRun;
+    }
+    args_handle->id = id;
+    return Success;
+}
+
+RetCode mc_sw_args_close(const mc_dev_handle* dev_handle, mc_args_handle* args_handle) {
+    if (handle_get(dev_handle->id, HandleDev) == NULL) return DeviceNotFound;
+    mc_cpu_args* args = handle_get(args_handle->id, HandleArgs);
+    if (args == NULL) return BufferNotFound;
+    handle_close(args_handle->id);
+    args_free(args); // Open runs hold their own references to its buffers
+    args_handle->id = 0;
+    return Success;
+}
+
+RetCode mc_sw_run_open(const mc_dev_handle* dev_handle, const mc_kern_handle* kern_handle,
+                       const mc_fn_handle* fn_handle, mc_run_handle* run_handle) {
+    if (handle_get(dev_handle->id, HandleDev) == NULL) return DeviceNotFound;
+    mc_cpu_run* run = NULL;
+    RetCode ret = run_open(kern_handle, fn_handle, run_handle, &run);
+    if (ret == Success && ((ret = run_depend(run, run_handle)) != Success || (ret = run_stream(run, run_handle)) != Success))
+        run_release(run);
+    if (ret != Success) return ret;
+
+    int64_t id = handle_open(HandleRun, run);
+    if (id == 0) {
+        run_release(run);
+        return NotReadyToRun;
+    }
+    run_handle->id = id;
+    run_start(run);
+    return Success;
+}
+
+// A batch is a chain of stage runs submitted as one. The handle refers to the
+// last stage, which completes only after all the earlier ones.
+RetCode mc_sw_batch_open(const mc_dev_handle* dev_handle, int64_t count, const mc_dispatch* dispatches,
+                         mc_run_handle* run_handle) {
+    if (handle_get(dev_handle->id, HandleDev) == NULL) return DeviceNotFound;
+    if (count <= 0) return NotReadyToRun;
+    mc_cpu_run* first = NULL;
+    mc_cpu_run* last = NULL;
+    for (int64_t i = 0; i < count; i++) {
+        mc_cpu_run* run = NULL;
+        RetCode ret = run_open(dispatches[i].kern_handle, dispatches[i].fn_handle, dispatches[i].run_handle, &run);
+        if (ret == Success && (ret = run_stream(run, run_handle)) != Success)
+            run_release(run);
+        if (ret != Success) {
+            if (first) run_release(first); // Releases the chain
+            return ret;
+        }
+        if (last) last->then = run; else first = run; // Owns the new run's reference
+        last = run;
+    }
+    RetCode ret = run_depend(first, run_handle); // Later stages follow the first
+    if (ret != Success) {
+        run_release(first);
+        return ret;
+    }
+
+    atomic_fetch_add(&last->refs, 1); // Handle reference
+    int64_t id = handle_open(HandleRun, last);
+    if (id == 0) {
+        run_release(last);
+        run_release(first);
+        return NotReadyToRun;
+    }
+    run_handle->id = id;
+    pool_submit(first);
+    run_release(first); // Now held by the queue
+    return Success;
+}
+
+RetCode mc_sw_run_close(const mc_run_handle* run_handle) {
+    mc_cpu_run* run = handle_get(run_handle->id, HandleRun);
+    if (run == NULL) return RunNotFound;
+    // Block until completion
+    pool_wait(run);
+    handle_close(run_handle->id);
+    run_release(run);
+    return Success;
+}
+
+static void timeout_deadline(double timeout, struct timespec* deadline) {
+    clock_gettime(CLOCK_REALTIME, deadline);
+    double whole = floor(timeout);
+    deadline->tv_sec += (time_t)whole;
+    deadline->tv_nsec += (long)((timeout - whole) * 1e9);
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+RetCode mc_sw_run_wait(int64_t count, const mc_run_handle* const* run_handles, bool all,
+                       double timeout, bool* complete) {
+    mc_cpu_run** runs = calloc(count ? count : 1, sizeof(mc_cpu_run*));
+    if (runs == NULL) return NotReadyToRun;
+    for (int64_t i = 0; i < count; i++) {
+        runs[i] = run_hold(run_handles[i]->id); // Other threads may close it while waiting
+        if (runs[i] == NULL) {
+            while (i > 0) run_release(runs[--i]);
+            free(runs);
+            return RunNotFound;
+        }
+    }
+    struct timespec deadline;
+    if (timeout > 0) timeout_deadline(timeout, &deadline);
+
+    int timed_out = timeout == 0;
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        int64_t ready = 0;
+        for (int64_t i = 0; i < count; i++) {
+            complete[i] = runs[i]->done;
+            ready += complete[i];
+        }
+        if (count == 0 || (all ? ready == count : ready > 0) || timed_out) break;
+        if (timeout < 0) {
+            pthread_cond_wait(&pool.done, &pool.lock);
+        } else if (pthread_cond_timedwait(&pool.done, &pool.lock, &deadline) == ETIMEDOUT) {
+            timed_out = 1; // Check once more then give up
+        }
+    }
+    pthread_mutex_unlock(&pool.lock);
+    for (int64_t i = 0; i < count; i++) run_release(runs[i]);
+    free(runs);
+    return Success;
+}
+
+RetCode mc_sw_stream_open(const mc_dev_handle* dev_handle, mc_stream_handle* stream_handle) {
+    if (handle_get(dev_handle->id, HandleDev) == NULL) return DeviceNotFound;
+    mc_cpu_stream* stream = calloc(1, sizeof(mc_cpu_stream));
+    if (stream == NULL) return CannotCreateCommandQueue;
+    atomic_init(&stream->refs, 1);
+    stream->priority = stream_handle->priority;
+    int64_t id = handle_open(HandleStream, stream);
+    if (id == 0) {
+        free(stream);
+        return CannotCreateCommandQueue;
+    }
+    stream_handle->id = id;
+    return Success;
+}
+
+RetCode mc_sw_stream_close(const mc_stream_handle* stream_handle) {
+    mc_cpu_stream* stream = handle_get(stream_handle->id, HandleStream);
+    if (stream == NULL) return StreamNotFound;
+    handle_close(stream_handle->id);
+    stream_release(stream); // Freed once its queued runs are done with it
+    return Success;
+}
+
+RetCode mc_sw_event_open(const mc_dev_handle* dev_handle, mc_event_handle* event_handle) {
+    if (handle_get(dev_handle->id, HandleDev) == NULL) return DeviceNotFound;
+    mc_cpu_event* event = calloc(1, sizeof(mc_cpu_event));
+    if (event == NULL) return NotReadyToRun;
+    atomic_init(&event->refs, 1);
+    int64_t id = handle_open(HandleEvent, event);
+    if (id == 0) {
+        free(event);
+        return NotReadyToRun;
+    }
+    event_handle->id = id;
+    return Success;
+}
+
+RetCode mc_sw_event_close(const mc_event_handle* event_handle) {
+    mc_cpu_event* event = handle_get(event_handle->id, HandleEvent);
+    if (event == NULL) return EventNotFound;
+    handle_close(event_handle->id);
+    event_release(event);
+    return Success;
+}
+
+RetCode mc_sw_stream_signal(const mc_stream_handle* stream_handle, const mc_event_handle* event_handle,
+                            uint64_t value) {
+    return marker_submit(stream_handle, event_handle, value, MC_CPU_SIGNAL);
+}
+
+RetCode mc_sw_stream_wait(const mc_stream_handle* stream_handle, const mc_event_handle* event_handle,
+                          uint64_t value) {
+    return marker_submit(stream_handle, event_handle, value, MC_CPU_WAIT);
+}
+
+RetCode mc_sw_event_signal(const mc_event_handle* event_handle, uint64_t value) {
+    mc_cpu_event* event = handle_get(event_handle->id, HandleEvent);
+    if (event == NULL) return EventNotFound;
+    pthread_mutex_lock(&pool.lock);
+    if (value > event->value) event->value = value; // Values only rise
+    pthread_cond_broadcast(&pool.work); // Waiting streams may go on
+    pthread_cond_broadcast(&pool.done);
+    pthread_mutex_unlock(&pool.lock);
+    return Success;
+}
+
+RetCode mc_sw_event_wait(const mc_event_handle* event_handle, uint64_t value, double timeout, uint64_t* current) {
+    mc_cpu_event* event = handle_get(event_handle->id, HandleEvent);
+    if (event == NULL) return EventNotFound;
+    atomic_fetch_add(&event->refs, 1); // In case it is closed meanwhile
+    struct timespec deadline;
+    if (timeout > 0) timeout_deadline(timeout, &deadline);
+    pthread_mutex_lock(&pool.lock);
+    int timed_out = timeout == 0;
+    while (event->value < value && !timed_out) {
+        if (timeout < 0) {
+            pthread_cond_wait(&pool.done, &pool.lock);
+        } else if (pthread_cond_timedwait(&pool.done, &pool.lock, &deadline) == ETIMEDOUT) {
+            timed_out = 1;
+        }
+    }
+    *current = event->value;
+    pthread_mutex_unlock(&pool.lock);
+    event_release(event);
+    return Success;
+}
+
+RetCode mc_sw_buf_pool(const mc_dev_handle* dev_handle, int64_t limit, int64_t trim_to, mc_pool_stats* stats) {
+    mc_cpu_dev* dev = handle_get(dev_handle->id, HandleDev);
+    if (dev == NULL) return DeviceNotFound;
+    mc_cpu_bufpool* pool = dev->pool;
+    pthread_mutex_lock(&pool->lock);
+    if (limit >= 0) {
+        pool->stats.limit = limit;
+        bufpool_trim_locked(pool, limit);
+    }
+    if (trim_to >= 0) bufpool_trim_locked(pool, trim_to);
+    *stats = pool->stats;
+    pthread_mutex_unlock(&pool->lock);
+    return Success;
+}
+
+RetCode mc_sw_dev_memory(const mc_dev_handle* dev_handle, int64_t* recommended, int64_t* allocated) {
+    mc_cpu_dev* dev = handle_get(dev_handle->id, HandleDev);
+    if (dev == NULL) return DeviceNotFound;
+    // Device memory is host memory, so everything physical is available
+    *recommended = (int64_t)sysconf(_SC_PHYS_PAGES) * (int64_t)sysconf(_SC_PAGESIZE);
+    pthread_mutex_lock(&dev->pool->lock);
+    *allocated = dev->buf_bytes + dev->pool->stats.cached_bytes;
+    pthread_mutex_unlock(&dev->pool->lock);
+    return Success;
+}
+
+RetCode mc_sw_get_stats(mc_stats* stats) {
+    stats->pipelines_created = atomic_load(&pipelines_created);
+    return Success;
+}
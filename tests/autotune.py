@@ -0,0 +1,108 @@
+import os
+import sys
+import shutil
+import subprocess
+import tempfile
+from array import array
+
+import metalcompute as mc
+
+# Check threadgroup autotuning: candidates are timed once per grid size bucket,
+# the fastest is kept and saved, and a fresh process starts with the saved choice.
+# A stand-in timer makes the selection deterministic.
+
+kernel = """
+#include <metal_stdlib>
+using namespace metal;
+
+kernel void inc(device float *data [[ buffer(0) ]],
+                uint id [[ thread_position_in_grid ]]) {
+    data[id] = data[id] + 1.0f;
+}
+
+kernel void fill2d(device uint *out [[ buffer(0) ]],
+                   uint2 gid [[ thread_position_in_grid ]],
+                   uint2 size [[ threads_per_grid ]]) {
+    out[gid.y * size.x + gid.x] = gid.x + gid.y;
+}
+"""
+
+cache_dir = tempfile.mkdtemp()
+mc.kernel_cache(dir=cache_dir)
+assert mc.autotune_results() == {}
+
+dev = mc.Device()
+kern = dev.kernel(kernel)
+inc = kern.function("inc")
+
+timed = []
+def fake_timer(launch, threadgroup):
+    # Candidates really run, but the costs are made up: 128 wide is fastest
+    launch()
+    timed.append(threadgroup)
+    return abs(threadgroup[0] - 128) + 1.0
+
+inc.autotune(timer=fake_timer)
+data = dev.buffer(array('f', [0] * 1000))
+inc(1000, data)
+assert timed, "first run should tune"
+assert (128, 1, 1) in timed and all(t[0] <= 1024 for t in timed)
+assert all(x == 1.0 for x in memoryview(data).cast('f')), "candidates should not touch the run's buffers"
+assert inc.tuned == {(1024, 1, 1): (128, 1, 1)}
+
+# Same bucket reuses the choice, a new bucket tunes again
+timed.clear()
+inc(900, data)
+assert timed == []
+inc(3000, dev.buffer(3000 * 4))
+assert timed and inc.tuned[(4096, 1, 1)] == (128, 1, 1)
+
+# An explicit threadgroup skips tuning
+timed.clear()
+inc(100000, dev.buffer(100000 * 4), threadgroup=64)
+assert timed == []
+
+# Multi-dimensional grids tune x and y together
+fill2d = kern.function("fill2d")
+fill2d.autotune(timer=lambda launch, threadgroup: 1.0 / threadgroup[0])
+out = dev.buffer(100 * 50 * 4)
+fill2d((100, 50), out)
+(group,) = fill2d.tuned.values()
+assert list(fill2d.tuned) == [(128, 64, 1)]
+assert group[0] <= 128 and group[1] <= 64 and group[0] * group[1] <= fill2d.max_total_threads_per_threadgroup
+assert list(memoryview(out).cast('I'))[:3] == [0, 1, 2]
+
+# Results are saved, so a new process starts tuned and never calls its timer
+assert len(mc.autotune_results()) == 3
+child = subprocess.run([sys.executable, "-c", f"""
+import metalcompute as mc
+mc.kernel_cache(dir={cache_dir!r})
+dev = mc.Device()
+fn = dev.kernel({kernel!r}).function("inc")
+def timer(launch, threadgroup):
+    raise AssertionError("should not tune")
+fn.autotune(timer=timer)
+fn(1000, dev.buffer(4000))
+print(fn.tuned[(1024, 1, 1)])
+"""], capture_output=True, text=True, env=dict(os.environ))
+assert child.returncode == 0, child.stderr
+assert child.stdout.strip() == "(128, 1, 1)", child.stdout
+
+# The default timer measures real launches
+mc.autotune_results(clear=True)
+assert inc.tuned == {}
+inc.autotune()
+data = dev.buffer(array('f', [0] * 5000))
+inc(5000, data)
+assert all(x == 1.0 for x in memoryview(data).cast('f'))
+(group,) = inc.tuned.values()
+assert group[0] >= 1 and group[0] <= inc.max_total_threads_per_threadgroup
+assert mc.autotune_timer(lambda: None, (32, 1, 1)) >= 0
+
+# Disabled again, runs use the default threadgroup
+inc.autotune(False)
+inc(50000, dev.buffer(50000 * 4))
+assert (65536, 1, 1) not in inc.tuned
+
+shutil.rmtree(cache_dir)
+print("OK")
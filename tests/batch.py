@@ -0,0 +1,96 @@
+from array import array
+from time import time as now
+
+import metalcompute as mc
+
+# Check command lists: runs recorded with dev.batch() are submitted together,
+# execute in order with each seeing the previous one's results, and complete as one
+
+kernel = """
+#include <metal_stdlib>
+using namespace metal;
+
+kernel void add_one(device float *data [[ buffer(0) ]],
+                    uint id [[ thread_position_in_grid ]]) {
+    data[id] = data[id] + 1.0f;
+}
+
+kernel void shift(const device float *in [[ buffer(0) ]],
+                  device float *out [[ buffer(1) ]],
+                  uint id [[ thread_position_in_grid ]]) {
+    out[id] = in[(id + 1) % 1000];
+}
+"""
+
+dev = mc.Device()
+kern = dev.kernel(kernel)
+add_one = kern.function("add_one")
+shift = kern.function("shift")
+count = 1000
+
+# Each stage reads what the previous stage wrote, including other threads' results
+a = dev.buffer(array('f', range(count)))
+b = dev.buffer(count * 4)
+batch = dev.batch()
+stages = 50
+for i in range(stages):
+    batch.add(add_one, count, a)
+    batch.add(shift, count, a, b)
+    a, b = b, a
+run = batch.commit()
+assert run.wait(timeout=10)
+result = memoryview(a).cast('f')
+assert all(result[i] == (i + stages) % count + stages for i in range(count)), "stages ran out of order"
+del run
+
+# The same list can be committed again
+run = batch.commit()
+run.wait()
+del run
+
+# Context manager submits on exit and waits
+out = dev.buffer(array('f', [0] * count))
+with dev.batch() as batch:
+    for i in range(10):
+        batch.add(add_one, count, out)
+assert memoryview(out).cast('f')[count - 1] == 10
+
+# Nothing is submitted if the block raises
+out = dev.buffer(array('f', [0] * count))
+try:
+    with dev.batch() as batch:
+        batch.add(add_one, count, out)
+        raise KeyError()
+except KeyError:
+    pass
+assert memoryview(out).cast('f')[0] == 0
+
+# Errors
+def expect_error(fn, *args):
+    try:
+        fn(*args)
+    except mc.error:
+        return
+    assert False, "expected metalcompute.error"
+
+expect_error(dev.batch().commit)
+expect_error(dev.batch().add, kern, count, out)
+expect_error(dev.batch().add, add_one, "x", out)
+expect_error(dev.batch().add, add_one, count)
+expect_error(mc.Device().batch().add, add_one, count, out)
+
+# One submission is cheaper than many
+n = 1000
+out = dev.buffer(count * 4)
+start = now()
+for i in range(n):
+    add_one(1, out)
+separate = now() - start
+start = now()
+with dev.batch() as batch:
+    for i in range(n):
+        batch.add(add_one, 1, out)
+batched = now() - start
+print(f"{n} runs: separate {separate*1e3:.1f} ms, batched {batched*1e3:.1f} ms")
+assert memoryview(out).cast('f')[0] == 2 * n
+print("OK")
@@ -0,0 +1,85 @@
+import sys
+from time import time as now
+
+import metalcompute as mc
+
+# Measure the fixed cost of launching a tiny kernel, and check the
+# pipeline state is created once per Function rather than once per call.
+# Then the cost of the call alone, using runs of zero threads: the backend
+# completes those when submitted, so stands in as a no-op. A python function
+# doing nothing with the same arguments is shown for comparison.
+# Usage: python3 tests/bench_call_overhead.py [call count, default 100k]
+
+kernel = """
+#include <metal_stdlib>
+using namespace metal;
+
+kernel void noop(device uint *out [[ buffer(0) ]],
+                 uint id [[ thread_position_in_grid ]]) {
+}
+
+kernel void noop4(device uint *a [[ buffer(0) ]],
+                  device uint *b [[ buffer(1) ]],
+                  device uint *c [[ buffer(2) ]],
+                  device uint *d [[ buffer(3) ]],
+                  uint id [[ thread_position_in_grid ]]) {
+}
+"""
+
+calls = int(sys.argv[1]) if len(sys.argv) > 1 else 100_000
+
+dev = mc.Device()
+buf = dev.buffer(4)
+
+before = mc.stats()["pipelines_created"]
+fn = dev.kernel(kernel).function("noop")
+opened = mc.stats()["pipelines_created"]
+
+print(f"thread_execution_width: {fn.thread_execution_width}")
+print(f"max_total_threads_per_threadgroup: {fn.max_total_threads_per_threadgroup}")
+print(f"threadgroup_size: {fn.threadgroup_size}")
+
+fn(1, buf) # Warm up
+start = now()
+for i in range(calls):
+    fn(1, buf)
+per_call = (now() - start) / calls
+called = mc.stats()["pipelines_created"]
+
+print(f"{calls} calls: {per_call*1e6:.2f} us/call")
+print(f"Pipelines created: {opened - before} at open, {called - opened} during calls")
+assert opened - before == 1, "function open should create one pipeline"
+assert called == opened, "calls should reuse the function's pipeline"
+
+def stand_in(*args, **kwargs):
+    pass
+
+def loop_1(f):
+    for i in range(calls):
+        f(0, buf)
+
+def loop_4(f):
+    a, b, c, d = bufs
+    for i in range(calls):
+        f(0, a, b, c, d)
+
+def loop_keywords(f):
+    a, b, c, d = bufs
+    for i in range(calls):
+        f(0, a, b, c, d, threadgroup=None, reads=None)
+
+def loop_bound(f):
+    for i in range(calls):
+        f(0)
+
+def time_call(loop, f):
+    start = now()
+    loop(f)
+    return (now() - start) / calls
+
+fn4 = dev.kernel(kernel).function("noop4")
+bufs = [dev.buffer(4) for i in range(4)]
+for name, loop, f in [("1 buffer", loop_1, fn), ("4 buffers", loop_4, fn4), ("4 buffers, keywords", loop_keywords, fn4),
+                      ("4 buffers, bound", loop_bound, fn4.bind(*bufs))]:
+    print(f"{name}: {time_call(loop, f)*1e9:.0f} ns/call (python no-op: {time_call(loop, stand_in)*1e9:.0f} ns/call)")
+print("OK")
@@ -0,0 +1,43 @@
+import sys
+from array import array
+from time import time as now
+
+import metalcompute as mc
+
+# Measure copy bandwidth into and out of buffers: assignment through memoryview
+# (one thread, holding the GIL) against write_from and read_into, on the calling
+# thread alone and shared between the default number of threads, and write_from
+# converting from float64 (in GB/s of float32 written).
+# Usage: python3 tests/bench_copy.py [largest size in MB, default 256]
+
+largest = (int(sys.argv[1]) if len(sys.argv) > 1 else 256) << 20
+dev = mc.Device()
+default_threads = mc.copy_threads(0)
+
+def bandwidth(copy, length):
+    copy() # Touch pages first
+    repeats = max(3, (1 << 30) // length)
+    start = now()
+    for i in range(repeats):
+        copy()
+    return repeats * length / (now() - start) / 1e9
+
+size = 1 << 20
+while size <= largest:
+    host = bytearray(b"\x5a" * size)
+    buf = dev.buffer(size)
+    results = []
+    for name, copy in [("memoryview in", lambda: memoryview(buf).__setitem__(slice(None), host)),
+                       ("memoryview out", lambda: memoryview(host).__setitem__(slice(None), memoryview(buf)))]:
+        results.append(f"{name} {bandwidth(copy, size):.1f}")
+    for threads in sorted({1, default_threads}):
+        mc.copy_threads(threads)
+        results.append(f"write_from x{threads} {bandwidth(lambda: buf.write_from(host), size):.1f}")
+        results.append(f"read_into x{threads} {bandwidth(lambda: buf.read_into(host), size):.1f}")
+    mc.copy_threads(0)
+    doubles = array('d', bytes(2 * size)) # As many items as the buffer holds floats
+    results.append(f"write_from f64 as f32 {bandwidth(lambda: buf.write_from(doubles, format='f'), size):.1f}")
+    print(f"{size >> 20} MB (GB/s): " + ", ".join(results))
+    del host, buf, doubles
+    size *= 8
+print("OK")
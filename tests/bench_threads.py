@@ -0,0 +1,57 @@
+import sys
+import threading
+from array import array
+from time import time as now
+
+import metalcompute as mc
+
+# Measure run throughput with several Python threads submitting at once, and
+# check each thread's results. Submission and waiting release the GIL, so
+# throughput should rise with the thread count until the device is busy.
+# Usage: python3 tests/bench_threads.py [runs per thread, default 2000]
+
+kernel = """
+#include <metal_stdlib>
+using namespace metal;
+
+kernel void scale(const device float *in [[ buffer(0) ]],
+                  device float *out [[ buffer(1) ]],
+                  uint id [[ thread_position_in_grid ]]) {
+    out[id] = in[id] * 2.0f + 1.0f;
+}
+"""
+
+runs = int(sys.argv[1]) if len(sys.argv) > 1 else 2000
+count = 4096
+
+dev = mc.Device()
+fn = dev.kernel(kernel).function("scale")
+
+def submit(index, failures):
+    data = dev.buffer(array('f', [index] * count))
+    outs = [dev.buffer(count * 4) for i in range(4)]
+    in_flight = []
+    for i in range(runs):
+        in_flight.append(fn(count, data, outs[i % len(outs)]))
+        if len(in_flight) == len(outs):
+            in_flight.pop(0).wait()
+    del in_flight
+    for out in outs:
+        if memoryview(out).cast('f')[count - 1] != index * 2 + 1:
+            failures.append(index)
+
+fn(count, dev.buffer(count * 4), dev.buffer(count * 4)) # Warm up
+base = None
+for threads in [1, 2, 4, 8]:
+    failures = []
+    workers = [threading.Thread(target=submit, args=(i, failures)) for i in range(threads)]
+    start = now()
+    for w in workers:
+        w.start()
+    for w in workers:
+        w.join()
+    rate = threads * runs / (now() - start)
+    base = base or rate
+    print(f"{threads} threads: {rate:.0f} runs/s ({rate / base:.2f}x)")
+    assert failures == [], f"wrong results from threads {failures}"
+print("OK")
@@ -0,0 +1,68 @@
+from array import array
+
+import metalcompute as mc
+
+# Check functions with bound arguments: repeated runs over the same buffers,
+# with new contents or counts, and the usual dependency tracking between them
+
+kernel = """
+#include <metal_stdlib>
+using namespace metal;
+
+kernel void axpy(const device float *x [[ buffer(0) ]],
+                 constant float &a [[ buffer(1) ]],
+                 device float *y [[ buffer(2) ]],
+                 uint id [[ thread_position_in_grid ]]) {
+    y[id] = y[id] + a * x[id];
+}
+"""
+
+dev = mc.Device()
+axpy = dev.kernel(kernel).function("axpy")
+count = 1000
+x = dev.buffer(array('f', range(count)))
+y = dev.buffer(array('f', [0] * count))
+
+def values(buf):
+    return memoryview(buf).cast('f') # Waits for runs writing the buffer
+
+bound = axpy.bind(x, 2.0, y)
+assert bound.function is axpy and len(bound.arguments) == 3
+assert str(bound) == "metalcompute.BoundFunction(arguments=3)"
+
+# Runs in flight over the same buffers are kept in order
+runs = [bound(count) for i in range(10)]
+assert values(y)[count - 1] == 20 * (count - 1)
+del runs
+
+# New contents and counts are seen by later runs
+values(x)[:] = array('f', [1] * count)
+bound(count // 2).wait()
+assert values(y)[0] == 2.0 and values(y)[count - 1] == 20 * (count - 1)
+
+# launch takes grids, and threadgroup settings given to bind or to each run
+values(y)[:] = array('f', [0] * count)
+bound.launch((count,)).wait()
+bound.launch(count, threadgroup=10).wait()
+axpy.bind(x, mc.f32(-4.0), y, threadgroup=(10,))(count).wait()
+assert all(v == 0.0 for v in values(y))
+
+# reads and writes are fixed at bind
+y2 = dev.buffer(count * 4)
+slow = axpy(count, x, 1.0, y2)
+reader = axpy.bind(y2, 1.0, y, reads=[y2])
+reader(count).wait()
+del slow
+
+# Invalid arguments
+for bad, error in [(lambda: axpy.bind(), mc.error), (lambda: bound(), mc.error),
+                   (lambda: bound(1, 2), mc.error), (lambda: bound(1, group=2), TypeError),
+                   (lambda: axpy.bind(x, 2.0, y, threadgroup="64"), mc.error),
+                   (lambda: axpy.bind(x, 2.0, y, writes=[7]), IndexError)]:
+    try:
+        bad()
+        assert False
+    except error:
+        pass
+
+print("OK")
@@ -0,0 +1,83 @@
+from array import array
+
+import metalcompute as mc
+
+# Check copies into and out of buffers with write_from and read_into: offsets,
+# views, ordering against runs, and large copies shared between threads
+
+kernel = """
+#include <metal_stdlib>
+using namespace metal;
+
+kernel void double_it(const device float *in [[ buffer(0) ]],
+                      device float *out [[ buffer(1) ]],
+                      uint id [[ thread_position_in_grid ]]) {
+    out[id] = in[id] * 2.0f;
+}
+"""
+
+dev = mc.Device()
+fn = dev.kernel(kernel).function("double_it")
+count = 1024
+
+buf = dev.buffer(count * 4)
+assert buf.write_from(array('f', range(count))) == count * 4
+assert buf.write_from(array('f', [-1, -2]), offset=8) == 8
+out = array('f', [0] * 4)
+assert buf.read_into(out) == 16
+assert list(out) == [0, 1, -1, -2]
+data = bytearray(8)
+buf.read_into(data, offset=(count - 2) * 4)
+assert array('f', bytes(data)).tolist() == [count - 2, count - 1]
+
+# Views copy within their own range
+view = buf[64:128]
+view.write_from(bytes(64))
+assert memoryview(buf).cast('f')[15] == 15 and memoryview(buf).cast('f')[16] == 0
+
+# Reads wait for runs writing the buffer, and writes for runs reading it too
+src = dev.buffer(array('f', [1] * count))
+dst = dev.buffer(count * 4)
+for i in range(10):
+    fn(count, src, dst)
+    src.write_from(array('f', [i + 2] * count))
+result = array('f', [0] * count)
+dst.read_into(result)
+assert result[0] == 2 * 10 and result[count - 1] == 2 * 10
+
+# Large copies are split between threads, and give the same bytes. Lowering the
+# setting after a copy with more threads takes effect, though the workers remain
+big = bytes(range(256)) * ((40 << 20) // 256 + 3)
+for threads in [1, 8, 2, 0]:
+    setting = mc.copy_threads(threads)
+    large = dev.buffer(len(big) + 16)
+    large.write_from(big, offset=16)
+    assert 1 <= mc.stats()["copy_threads_last"] <= setting, f"copy used more than {setting} threads"
+    back = bytearray(len(big))
+    large.read_into(back, offset=16)
+    assert back == big, f"copy differs with {threads} threads"
+    assert bytes(dev.buffer(big)) == big
+    assert mc.stats()["copy_threads_last"] <= setting
+assert mc.copy_threads() >= 1
+mc.copy_threads(3)
+assert mc.copy_threads(-1) == 3 and mc.copy_threads() == 3
+try:
+    mc.copy_threads(-2)
+    assert False
+except ValueError:
+    pass
+assert mc.copy_threads(0) >= 1
+
+# Copies which do not fit, and objects which cannot be written
+for bad, error in [(lambda: buf.write_from(bytes(count * 4 + 1)), ValueError),
+                   (lambda: buf.write_from(b"1234", offset=count * 4 - 2), ValueError),
+                   (lambda: buf.read_into(bytearray(4), offset=-4), ValueError),
+                   (lambda: buf.read_into(b"read only"), BufferError),
+                   (lambda: buf.write_from(1234), TypeError)]:
+    try:
+        bad()
+        assert False
+    except error:
+        pass
+
+print("OK")
@@ -0,0 +1,86 @@
+import os
+import tempfile
+from array import array
+
+import metalcompute as mc
+
+# Check file backed buffers: kernels read mapped files, private mappings keep
+# writes out of the file, writable mappings flush results back, and windows
+# at an offset line up with the file's contents
+
+kernel = """
+#include <metal_stdlib>
+using namespace metal;
+
+kernel void double_it(device float *data [[ buffer(0) ]],
+                      device float *out [[ buffer(1) ]],
+                      uint id [[ thread_position_in_grid ]]) {
+    out[id] = data[id] * 2.0f;
+    data[id] = -1.0f;
+}
+"""
+
+dev = mc.Device()
+fn = dev.kernel(kernel).function("double_it")
+
+count = 100000
+fd, path = tempfile.mkstemp()
+with os.fdopen(fd, "wb") as f:
+    array('f', range(count)).tofile(f)
+
+# Read only: kernel writes go to a private copy
+buf = dev.buffer_from_file(path)
+assert len(buf) == count * 4 and buf.offset == 0
+out = dev.buffer(count * 4)
+fn(count, buf, out)
+assert memoryview(out).cast('f')[count - 1] == (count - 1) * 2
+assert memoryview(buf).cast('f')[0] == -1.0
+buf.flush() # Nothing to write back
+del buf
+with open(path, "rb") as f:
+    assert array('f', f.read(8)).tolist() == [0.0, 1.0]
+
+# A window at an offset which is not page aligned, and views of it
+window = dev.buffer_from_file(path, offset=1024 * 4, length=1000 * 4)
+assert len(window) == 4000 and memoryview(window).cast('f')[0] == 1024.0
+out = dev.buffer(500 * 4)
+fn(500, window[2000:], out)
+assert memoryview(out).cast('f')[0] == 1524.0 * 2
+window.advise("willneed")
+window[16:32].advise("random")
+window.advise("dontneed", 2048)
+for bad in [lambda: window.advise("soon"), lambda: dev.buffer(64).advise("normal")]:
+    try:
+        bad()
+        assert False
+    except ValueError:
+        pass
+del window
+
+# Writable: results reach the file
+buf = dev.buffer_from_file(path, writable=True, sequential=False)
+fn(count, buf, dev.buffer(count * 4))
+buf.flush()
+with open(path, "rb") as f:
+    assert array('f', f.read(8)).tolist() == [-1.0, -1.0]
+del buf
+
+# Bad ranges and files
+for args, error in [((path, 3), mc.error), ((path, 0, 0), ValueError),
+                    ((path, count * 4), ValueError), ((path + ".missing",), OSError)]:
+    try:
+        dev.buffer_from_file(*args)
+        assert False, args
+    except error:
+        pass
+
+# Headroom for mapped windows
+info = dev.working_set()
+assert info["recommended"] > 0 and info["allocated"] >= 0
+assert info["headroom"] == max(info["recommended"] - info["allocated"], 0)
+big = dev.buffer(1 << 20)
+assert dev.working_set()["allocated"] >= info["allocated"] + (1 << 20)
+del big
+
+os.unlink(path)
+print("OK")
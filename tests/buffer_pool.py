@@ -0,0 +1,85 @@
+from array import array
+
+import metalcompute as mc
+
+# Check the per-device buffer pool: freed buffers are reused by size class,
+# reused memory looks new, the high-water mark holds, and trimming frees it all
+
+kernel = """
+#include <metal_stdlib>
+using namespace metal;
+
+kernel void double_it(const device float *in [[ buffer(0) ]],
+                      device float *out [[ buffer(1) ]],
+                      uint id [[ thread_position_in_grid ]]) {
+    out[id] = in[id] * 2.0f;
+}
+"""
+
+dev = mc.Device()
+fn = dev.kernel(kernel).function("double_it")
+count = 10000
+data = array('f', range(count))
+
+def pool():
+    return dev.buffer_pool()
+
+# Steady state: fresh output buffers and temporary input copies on every call
+# stop allocating once the pool has warmed up
+for i in range(3):
+    out = dev.buffer(count * 4)
+    fn(count, data, out)
+    del out
+before = pool()
+for i in range(100):
+    out = dev.buffer(count * 4)
+    fn(count, data, out)
+    assert memoryview(out).cast('f')[count - 1] == (count - 1) * 2
+    del out
+after = pool()
+assert after["misses"] == before["misses"], "steady state should not allocate"
+assert after["hits"] - before["hits"] == 200
+assert after["cached_bytes"] > 0 and after["cached_buffers"] == 2
+
+# Reused memory is zeroed, and sizes in the same class share it
+buf = dev.buffer(array('B', [255] * 5000))
+del buf
+before = pool()
+buf = dev.buffer(4900)
+assert pool()["hits"] == before["hits"] + 1
+assert bytes(buf) == bytes(4900)
+del buf
+
+# High-water mark: nothing beyond the limit is kept
+info = dev.buffer_pool(limit=16 * 1024)
+assert info["limit"] == 16 * 1024 and info["cached_bytes"] <= 16 * 1024
+big = dev.buffer(64 * 1024)
+del big
+assert pool()["cached_bytes"] <= 16 * 1024
+
+# Trimming frees everything cached
+small = dev.buffer(1000)
+del small
+assert pool()["cached_buffers"] > 0
+info = dev.buffer_pool(trim=True)
+assert info["cached_bytes"] == 0 and info["cached_buffers"] == 0
+assert info["evictions"] > 0
+
+# Pooling can be turned off
+dev.buffer_pool(limit=0)
+b = dev.buffer(1000)
+del b
+assert pool()["cached_buffers"] == 0
+dev.buffer_pool(limit=64 << 20)
+
+# Lengths which no size class can hold
+for length, error in [(-1, ValueError), (-4096, ValueError), ((1 << 62) + 1, ValueError),
+                      ((1 << 63) - 1, ValueError), (1 << 64, OverflowError)]:
+    try:
+        dev.buffer(length)
+        assert False, length
+    except error:
+        pass
+assert len(dev.buffer(0)) == 0
+
+print("OK")
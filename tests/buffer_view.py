@@ -0,0 +1,79 @@
+from array import array
+
+import metalcompute as mc
+
+# Check buffer views: slices share the parent's memory, kernels bound to
+# a view see only its part, views keep the parent alive, and offsets are checked
+
+kernel = """
+#include <metal_stdlib>
+using namespace metal;
+
+kernel void add_index(device float *data [[ buffer(0) ]],
+                      uint id [[ thread_position_in_grid ]]) {
+    data[id] = data[id] + float(id);
+}
+
+kernel void copy(const device float *in [[ buffer(0) ]],
+                 device float *out [[ buffer(1) ]],
+                 uint id [[ thread_position_in_grid ]]) {
+    out[id] = in[id];
+}
+"""
+
+dev = mc.Device()
+kern = dev.kernel(kernel)
+add_index = kern.function("add_index")
+copy = kern.function("copy")
+
+# One arena carved into per-batch slices, with no copies
+count = 1024
+batch = 256
+arena = dev.buffer(count * 4)
+for start in range(0, count, batch):
+    add_index(batch, arena[start * 4:(start + batch) * 4])
+values = memoryview(arena).cast('f')
+assert all(values[i] == i % batch for i in range(count))
+
+# Views share memory both ways, and views of views add their offsets
+view = arena.view(64, 128)
+assert len(view) == 128 and view.offset == 64 and view.parent is arena
+sub = view[32:]
+assert sub.offset == 96 and len(sub) == 96 and sub.parent is arena
+memoryview(sub).cast('f')[0] = 123.0
+assert values[24] == 123.0
+
+# A view can be read by one run and written by another, like any buffer
+out = dev.buffer(batch * 4)
+copy(batch, arena[batch * 4:], out)
+assert list(memoryview(out).cast('f'))[:4] == [0.0, 1.0, 2.0, 3.0]
+copy(4, array('f', [7, 8, 9, 10]), arena[16:32])
+assert list(values[4:8]) == [7.0, 8.0, 9.0, 10.0]
+assert values[3] == 3.0 and values[8] == 8.0
+
+# Views in a command list
+with dev.batch() as b:
+    b.add(add_index, 4, arena[:16])
+    b.add(copy, 4, arena[:16], arena[4096 - 16:])
+assert list(values[-4:]) == [0.0, 2.0, 4.0, 6.0]
+
+# The parent stays alive while views of it exist
+tail = dev.buffer(array('f', range(16)))[32:]
+assert list(memoryview(tail).cast('f')) == [8.0, 9.0, 10.0, 11.0, 12.0, 13.0, 14.0, 15.0]
+
+# Out of range, misaligned and strided views are rejected
+for bad in [lambda: arena.view(4, 16), lambda: arena.view(0, count * 4 + 16),
+            lambda: arena.view(-16), lambda: view.view(8)]:
+    try:
+        bad()
+        assert False
+    except mc.error:
+        pass
+try:
+    arena[::2]
+    assert False
+except ValueError:
+    pass
+assert len(arena[count * 4:]) == 0
+
+print("OK")
@@ -0,0 +1,124 @@
+import os
+from array import array
+
+os.environ.setdefault("METALCOMPUTE_CPU_THREADS", "4")
+
+import metalcompute as mc
+
+# Check dependency tracking between runs in flight: runs sharing buffers see
+# each other's results in submission order without waiting, memoryviews wait
+# for pending writers and readers, and independent runs are free to overlap
+
+kernel = """
+#include <metal_stdlib>
+using namespace metal;
+
+kernel void add_one(const device float *in [[ buffer(0) ]],
+                    device float *out [[ buffer(1) ]],
+                    uint id [[ thread_position_in_grid ]]) {
+    out[id] = in[id] + 1.0f;
+}
+
+kernel void inc(device float *data [[ buffer(0) ]],
+                uint id [[ thread_position_in_grid ]]) {
+    data[id] = data[id] + 1.0f;
+}
+
+kernel void spin(const device uint *n [[ buffer(0) ]],
+                 device float *out [[ buffer(1) ]],
+                 uint id [[ thread_position_in_grid ]]) {
+    float acc = 0.0f;
+    for (uint i = 0; i < n[0]; i++) {
+        acc = acc * 0.5f + 1.0f;
+    }
+    out[id] = acc;
+}
+"""
+
+dev = mc.Device()
+kern = dev.kernel(kernel)
+add_one = kern.function("add_one")
+inc = kern.function("inc")
+spin = kern.function("spin")
+count = 100000
+
+# A chain of runs kept in flight: each reads what the one before wrote
+a = dev.buffer(array('f', [0] * count))
+b = dev.buffer(count * 4)
+runs = []
+for i in range(10):
+    runs.append(add_one(count, a, b))
+    runs.append(add_one(count, b, a))
+assert memoryview(a).cast('f')[count - 1] == 20.0, "memoryview should wait for writers"
+assert all(x == 20.0 for x in memoryview(a).cast('f'))
+del runs
+
+# Read-modify-write of the same buffer, and views of it
+data = dev.buffer(array('f', [0] * count))
+half = count // 2 * 4
+runs = [inc(count, data) for i in range(5)]
+runs += [inc(count // 2, data.view(0, half)) for i in range(3)]
+runs += [inc(count // 2, data.view(half, half)) for i in range(2)]
+v = memoryview(data).cast('f')
+assert v[0] == 8.0 and v[count - 1] == 7.0, (v[0], v[count - 1])
+del runs, v
+
+# Annotations: the function declares data writable, but this run only
+# reads it, so nothing needs to wait for it
+src = dev.buffer(array('f', [1] * count))
+out = dev.buffer(count * 4)
+run = inc(count, src, reads=[src])
+run.wait()
+run = add_one(count, src, out, writes=[1])
+assert memoryview(out).cast('f')[0] == 3.0
+run = add_one(count, src, out, reads=[0], writes=[out])
+run.wait()
+for bad in [dict(writes=[5]), dict(reads=[dev.buffer(4)]), dict(writes=3)]:
+    try:
+        add_one(count, src, out, **bad)
+        assert False, bad
+    except (IndexError, ValueError, TypeError):
+        pass
+
+# Batches wait for runs in flight, and later runs wait for batches
+x = dev.buffer(array('f', [0] * count))
+y = dev.buffer(count * 4)
+first = inc(count, x)
+batch = dev.batch()
+batch.add(add_one, count, x, y)
+batch.add(inc, count, y)
+batch_run = batch.commit()
+after = add_one(count, y, x)
+assert memoryview(x).cast('f')[count - 1] == 4.0
+del first, batch_run, after
+
+# Host writes wait for runs still to read the buffer
+if str(dev).startswith("metalcompute.Device(CPU"):
+    n = dev.buffer(array('I', [1 << 22]))
+    gate = dev.buffer(4)
+    slow = spin(1, n, gate)
+    src = dev.buffer(array('f', [1] * 16))
+    out = dev.buffer(16 * 4)
+    held = add_one(16, gate, out) # Waits for the spin, and holds back the next run writing out
+    reader = add_one(16, src, out)
+    memoryview(src).cast('f')[0] = 5.0
+    assert memoryview(out).cast('f')[0] == 2.0, "run should read the buffer before the host writes it"
+    del slow, held, reader
+
+# Independent runs overlap: a short run completes while a long one which
+# shares no memory with it is still going (workers are free on the CPU backend)
+if str(dev).startswith("metalcompute.Device(CPU"):
+    n = dev.buffer(array('I', [1 << 24]))
+    slow_out = dev.buffer(4)
+    slow = spin(1, n, slow_out)
+    quick_out = dev.buffer(count * 4)
+    quick = add_one(count, src, quick_out)
+    assert quick.wait(timeout=10)
+    assert not slow.done(), "independent run should not wait for the long one"
+    # A run reading the long one's output does wait for it
+    follow = add_one(1, slow_out, dev.buffer(4))
+    assert not follow.done()
+    slow.wait()
+    assert follow.wait(timeout=10)
+
+print("OK")
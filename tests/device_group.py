@@ -0,0 +1,125 @@
+import os
+from array import array
+
+# Stand-in devices for the CPU backend. Ignored by Metal, which uses the real ones
+os.environ.setdefault("METALCOMPUTE_CPU_DEVICES", "3")
+
+import metalcompute as mc
+
+# Check runs split across a device group: rows are partitioned by share,
+# split input slices are scattered, outputs gathered, and shares follow throughput
+
+kernel = """
+#include <metal_stdlib>
+using namespace metal;
+
+kernel void scale(const device float *in [[ buffer(0) ]],
+                  const device float *factor [[ buffer(1) ]],
+                  device float *out [[ buffer(2) ]],
+                  uint id [[ thread_position_in_grid ]]) {
+    out[id] = in[id] * factor[0];
+}
+
+kernel void rows(device uint *out [[ buffer(0) ]],
+                 uint2 gid [[ thread_position_in_grid ]],
+                 uint2 size [[ threads_per_grid ]]) {
+    out[gid.y * size.x + gid.x] = gid.x;
+}
+
+kernel void reverse(const device float *lut [[ buffer(0) ]],
+                    device float *out [[ buffer(1) ]],
+                    constant uint &first [[ buffer(2) ]],
+                    constant uint &last [[ buffer(3) ]],
+                    uint id [[ thread_position_in_grid ]]) {
+    out[id] = lut[last - (first + id)];
+}
+"""
+
+group = mc.DeviceGroup()
+n = len(group.devices)
+assert n == len(mc.get_devices())
+kern = group.kernel(kernel)
+scale = kern.function("scale")
+assert len(scale.functions) == n
+assert abs(sum(scale.shares) - 1.0) < 1e-9
+
+# Python buffers: the input is scattered, the factor shared, the output gathered
+count = 100003
+data = array('f', range(count))
+out = array('f', [0]) * count
+scale.adaptive = False
+scale(count, data, array('f', [3.0]), out, split=[0, 2])
+assert all(out[i] == i * 3.0 for i in range(0, count, 997)) and out[count - 1] == (count - 1) * 3.0
+partition = scale.partition
+assert partition[0][0] == 0 and partition[-1][1] == count
+assert all(partition[i][1] == partition[i + 1][0] for i in range(n - 1))
+assert all(start * 4 % 16 == 0 for start, end in partition), "slices should stay aligned"
+
+# Device buffers, including one held by another member
+out = group.devices[0].buffer(count * 4)
+source = group.devices[-1].buffer(data)
+scale(count, source, array('f', [0.5]), out, split=[0, 2])
+assert memoryview(out).cast('f')[count - 1] == (count - 1) * 0.5
+
+# Uneven shares, set directly and learned from timings
+scale.shares = [3] + [1] * (n - 1)
+assert abs(scale.shares[0] - 3 / (n + 2)) < 1e-9
+out = array('f', [0]) * count
+scale(count, data, array('f', [1.0]), out, split=[0, 2], outputs=[2])
+assert out == data
+if n > 1:
+    rows_0 = scale.partition[0][1] - scale.partition[0][0]
+    assert rows_0 > count // n
+    scale.shares = [1] * n
+    scale(count, data, array('f', [1.0]), out, split=[0, 2])
+    scale.rebalance([1.0] + [4.0] * (n - 1)) # Device 0 four times faster
+    assert scale.shares[0] > scale.shares[1]
+    # Rebalancing is smoothed, and no device is starved
+    assert scale.shares[0] < 0.9 and min(scale.shares) > 0
+
+# Measured automatically after each call
+scale.adaptive = True
+for i in range(3):
+    scale(count, data, array('f', [1.0]), out, split=[0, 2])
+assert abs(sum(scale.shares) - 1.0) < 1e-9 and min(scale.shares) > 0
+
+# 2-D grids split by rows, with thread positions local to each slice
+rows = kern.function("rows")
+width, height = 33, 40
+grid_out = array('I', [0]) * (width * height)
+rows((width, height), grid_out, split=[0])
+assert list(grid_out) == list(range(width)) * height
+
+# Kernels using positions in the whole grid are given their slice's first row
+reverse = kern.function("reverse")
+lut = array('f', range(count))
+out = array('f', [0]) * count
+reverse(count, lut, out, 0, count - 1, split=[1], origin=2)
+assert out == array('f', reversed(lut))
+assert len([p for p in reverse.partition if p[1] > p[0]]) == n
+
+# Buffers which cannot be split, and calls which would not know their rows
+for bad in [lambda: scale(count, data, array('f', [1.0]), out, split=[1]),
+            lambda: scale(count, data, array('f', [1.0]), out),
+            lambda: reverse(count, lut, out, 0, count - 1, origin=0),
+            lambda: reverse(count, lut, out, 0, count - 1, origin=4)]:
+    try:
+        bad()
+        assert False
+    except ValueError:
+        pass
+
+# Indexes are opened into a new tuple, leaving the caller's as given
+given = (0,)
+assert isinstance(mc.DeviceGroup(given).devices[0], mc.Device) and given == (0,)
+given = (0, 99)
+try:
+    mc.DeviceGroup(given)
+    assert False
+except mc.error:
+    pass
+assert given == (0, 99)
+
+if n > 1:
+    assert str(group.devices[0]) != str(group.devices[1])
+print("OK")
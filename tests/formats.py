@@ -0,0 +1,93 @@
+import math
+import struct
+from array import array
+
+import metalcompute as mc
+
+# Check item formats: every one accepted by mc.run, and converted while copying
+# into and out of buffers, including half floats and normalized integers
+
+dev = mc.Device()
+
+# The legacy interface takes any item format of the right size
+mc.init()
+mc.compile("""
+#include <metal_stdlib>
+using namespace metal;
+
+kernel void widen(const device short *in [[ buffer(0) ]],
+                  device int *out [[ buffer(1) ]],
+                  uint id [[ thread_position_in_grid ]]) {
+    out[id] = int(in[id]) * 100000;
+}
+""", "widen")
+out = array('i', [0] * 4)
+mc.run(array('h', [1, -2, 3, 3000]), out, 4)
+assert list(out) == [100000, -200000, 300000, 300000000]
+mc.release()
+
+# Conversion on the way in, at sizes covering the vectorized part and the rest
+for count in [1, 15, 16, 17, 1000]:
+    doubles = array('d', [(i - count / 2) * 0.37 for i in range(count)])
+    buf = dev.buffer(doubles, format='f')
+    assert len(buf) == count * 4
+    assert list(memoryview(buf).cast('f')) == list(array('f', doubles))
+
+    halves = dev.buffer(array('f', doubles), format='e')
+    assert len(halves) == count * 2
+    assert list(struct.unpack(f"{count}e", bytes(halves))) == list(struct.unpack(f"{count}e", struct.pack(f"{count}e", *doubles)))
+
+    back = array('d', [0] * count)
+    assert halves.read_into(back, format='e') == count * 2
+    assert list(back) == list(struct.unpack(f"{count}e", bytes(halves)))
+
+    pixels = array('B', [i % 256 for i in range(count)])
+    floats = dev.buffer(pixels, format='f', normalize=True)
+    assert list(memoryview(floats).cast('f')) == list(array('f', [p / 255 for p in pixels]))
+    again = array('B', [0] * count)
+    floats.read_into(again, format='f', normalize=True)
+    assert again == pixels
+
+# Every format to every other, through write_from
+for src in "bBhHiIqQfd": # array has no half floats
+    for dst in "bBhHiIqQefd":
+        values = [0, 1, 7, 100, 3] if src in "BHIQ" else [-3, 0, 1, 7, 100]
+        size = len(values) * struct.calcsize(dst)
+        buf = dev.buffer(len(values) * 8)
+        assert buf.write_from(array(src, values), format=dst) == size
+        if dst in "BHIQ" and src in "bhiq":
+            values = [v % (1 << (8 * struct.calcsize(dst))) for v in values] # Wraps as casts do
+        elif dst in "BHIQ":
+            values = [max(v, 0) for v in values] # Saturates
+        result = struct.unpack(f"{len(values)}{dst}", bytes(buf)[:size])
+        assert list(result) == values, f"{src} to {dst}: {result}"
+
+# Floats to integers round toward zero and saturate, or round when normalized, with NaN as 0
+buf = dev.buffer(array('f', [2.7, -2.7, 300, -300, math.nan, 0.5, 1.5, 1e20] * 3))
+out = array('B', [0] * 24)
+buf.read_into(out, format='f')
+assert list(out[:8]) == [2, 0, 255, 0, 0, 0, 1, 255]
+buf.read_into(out, format='f', normalize=True)
+assert list(out[:8]) == [255, 0, 255, 0, 0, 128, 255, 255]
+signed = array('h', [0] * 8)
+buf.read_into(signed, format='f')
+assert list(signed) == [2, -2, 300, -300, 0, 0, 1, 32767]
+snorm = dev.buffer(array('b', [-128, -127, 0, 127]), format='f', normalize=True)
+assert list(memoryview(snorm).cast('f')) == [-1, -1, 0, 1]
+
+# Formats which cannot be used, or conversions which do not apply
+for bad, error in [(lambda: dev.buffer(array('f', [1]), format='x'), ValueError),
+                   (lambda: dev.buffer(16, format='f'), mc.error),
+                   (lambda: dev.buffer(array('f', [1]), normalize=True), ValueError),
+                   (lambda: dev.buffer(array('i', [1]), format='f', normalize=True), mc.error),
+                   (lambda: dev.buffer(array('f', [1]), format='d', normalize=True), mc.error),
+                   (lambda: dev.buffer(array('f', [1]), format='>f'), ValueError),
+                   (lambda: dev.buffer(8).read_into(array('u', 'ab'), format='f'), mc.error),
+                   (lambda: dev.buffer(8).write_from(array('d', [1, 2]), format='f', offset=4), ValueError)]:
+    try:
+        bad()
+        assert False
+    except error:
+        pass
+
+print("OK")
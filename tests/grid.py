@@ -0,0 +1,100 @@
+from array import array
+
+import metalcompute as mc
+
+# Check multi-dimensional grids, explicit threadgroup sizes and threadgroup memory
+
+kernel = """
+#include <metal_stdlib>
+using namespace metal;
+
+kernel void index2d(device uint *out [[ buffer(0) ]],
+                    device uint *hits [[ buffer(1) ]],
+                    uint2 gid [[ thread_position_in_grid ]],
+                    uint2 size [[ threads_per_grid ]]) {
+    uint i = gid.y * size.x + gid.x;
+    out[i] = gid.x * 1000 + gid.y;
+    hits[i] += 1;
+}
+
+kernel void group_sum(const device float *in [[ buffer(0) ]],
+                      device float *out [[ buffer(1) ]],
+                      threadgroup float *partial [[ threadgroup(0) ]],
+                      uint gid [[ thread_position_in_grid ]],
+                      uint lid [[ thread_position_in_threadgroup ]],
+                      uint group [[ threadgroup_position_in_grid ]],
+                      uint width [[ threads_per_threadgroup ]]) {
+    partial[lid] = in[gid];
+    threadgroup_barrier(mem_flags::mem_threadgroup);
+    if (lid == 0) {
+        float total = 0.0f;
+        for (uint i = 0; i < width; i++) {
+            total += partial[i];
+        }
+        out[group] = total;
+    }
+}
+"""
+
+dev = mc.Device()
+kern = dev.kernel(kernel)
+index2d = kern.function("index2d")
+group_sum = kern.function("group_sum")
+
+# Ragged 2-D grid: every thread runs exactly once, with its own position
+width, height = 100, 37
+out = dev.buffer(width * height * 4)
+hits = dev.buffer(width * height * 4)
+index2d((width, height), out, hits)
+out_v = memoryview(out).cast('I')
+hits_v = memoryview(hits).cast('I')
+for y in range(height):
+    for x in range(width):
+        assert out_v[y * width + x] == x * 1000 + y
+assert all(h == 1 for h in hits_v)
+
+# Same again with an explicit threadgroup shape which does not divide the grid
+hits = dev.buffer(width * height * 4)
+index2d([width, height], out, hits, threadgroup=(16, 4))
+assert all(h == 1 for h in memoryview(hits).cast('I'))
+
+# Threadgroup memory reduction, one partial sum per threadgroup
+group = 64
+groups = 20
+data = array('f', range(group * groups))
+sums = dev.buffer(groups * 4)
+group_sum(group * groups, data, sums, threadgroup=group, threadgroup_memory=group * 4)
+sums_v = memoryview(sums).cast('f')
+for g in range(groups):
+    assert sums_v[g] == sum(data[g * group:(g + 1) * group]), (g, sums_v[g])
+
+# Invalid shapes are rejected
+for bad in [dict(threadgroup=(0, 1)), dict(threadgroup=(1 << 20,)), dict(threadgroup_memory=-4)]:
+    try:
+        group_sum(group, data, sums, **bad)
+        assert False, bad
+    except mc.error:
+        pass
+try:
+    index2d((1, 2, 3, 4), out, hits)
+    assert False
+except mc.error:
+    pass
+for bad, error in [(lambda: group_sum(group, data, sums, thread_group=group), TypeError),
+                   (lambda: group_sum(), mc.error), (lambda: group_sum(group), mc.error)]:
+    try:
+        bad()
+        assert False
+    except error:
+        pass
+
+# Grids and threadgroup settings also apply to runs in a command list
+hits = dev.buffer(width * height * 4)
+sums = dev.buffer(groups * 4)
+with dev.batch() as batch:
+    batch.add(index2d, (width, height), out, hits, threadgroup=(8, 8))
+    batch.add(group_sum, group * groups, data, sums, threadgroup=group, threadgroup_memory=[group * 4])
+assert all(h == 1 for h in memoryview(hits).cast('I'))
+assert memoryview(sums).cast('f')[groups - 1] == sum(data[(groups - 1) * group:])
+
+print("OK")
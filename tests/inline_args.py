@@ -0,0 +1,91 @@
+import struct
+from array import array
+
+import metalcompute as mc
+
+# Check scalar and small arguments passed inline, without a buffer: plain ints
+# and floats, typed constants, and small objects at positions a kernel only reads
+
+kernel = """
+#include <metal_stdlib>
+using namespace metal;
+
+kernel void axpb(const device float *x [[ buffer(0) ]],
+                 constant float &a [[ buffer(1) ]],
+                 constant uint &b [[ buffer(2) ]],
+                 device float *out [[ buffer(3) ]],
+                 uint id [[ thread_position_in_grid ]]) {
+    out[id] = x[id] * a + float(b);
+}
+
+kernel void offset(constant int &k [[ buffer(0) ]],
+                   constant float *params [[ buffer(1) ]],
+                   device float *out [[ buffer(2) ]],
+                   uint id [[ thread_position_in_grid ]]) {
+    out[id] = float(k) * params[0] + params[1];
+}
+"""
+
+dev = mc.Device()
+kern = dev.kernel(kernel)
+axpb = kern.function("axpb")
+offset = kern.function("offset")
+count = 1000
+x = dev.buffer(array('f', range(count)))
+out = dev.buffer(count * 4)
+v = memoryview(out).cast('f')
+
+def copied():
+    return mc.stats()["buffer_bytes_copied"]
+
+# Plain floats are 32 bit floats, and ints 32 bit ints, with nothing copied into buffers
+before = copied()
+axpb(count, x, 2.0, 3, out).wait()
+assert v[10] == 23.0 and v[count - 1] == (count - 1) * 2 + 3
+assert copied() == before
+
+# Typed constants
+axpb(count, x, mc.f32(0.5), mc.u32(0xFFFFFFFF), out).wait()
+assert v[2] == 1.0 + 4294967295.0
+offset(count, mc.i32(-3), array('f', [2, 1]), out).wait()
+assert v[0] == -5.0
+assert copied() == before, "small read only arguments are inline"
+
+# Bytes, e.g. packed with struct, and repeated use of the same constant
+params = mc.bytes_arg(struct.pack('ff', 0.25, 10))
+for k in range(3):
+    offset(count, k, params, out).wait()
+    assert v[count - 1] == k * 0.25 + 10
+offset(count, -8, struct.pack('ff', 1, 0), out).wait()
+assert v[0] == -8.0
+
+# Constants read like the bytes they hold
+c = mc.f32(1.5)
+assert len(c) == 4 and bytes(c) == struct.pack('f', 1.5)
+assert memoryview(c).readonly
+assert str(mc.bytes_arg(bytes(12))) == "metalcompute.Constant(length=12)"
+
+# Batches and streams take them too
+batch = dev.batch()
+batch.add(axpb, count, x, 1.0, 1, out)
+batch.add(axpb, count, out, 3.0, 0, out)
+batch.commit().wait()
+assert v[1] == 6.0
+results = [bytes(r) for r in axpb.stream([array('f', [1] * 8), array('f', [2] * 8)], 10.0, 5, out_size=32)]
+assert [struct.unpack('f', r[:4])[0] for r in results] == [15.0, 25.0]
+
+# Values which do not fit
+for bad, error in [(lambda: mc.f32("1"), TypeError), (lambda: mc.u32(-1), OverflowError),
+                   (lambda: mc.i32(1 << 31), OverflowError), (lambda: mc.bytes_arg(bytes(5000)), ValueError),
+                   (lambda: mc.bytes_arg(b""), ValueError), (lambda: axpb(count, x, 1 << 40, 1, out), OverflowError),
+                   # Positions the kernel writes take buffers only, as writes to inline bytes would be lost
+                   (lambda: axpb(count, x, 1.0, 1, 2.0), TypeError), (lambda: axpb(count, x, 1.0, 1, 7), TypeError),
+                   (lambda: axpb(count, x, 1.0, 1, mc.f32(2)), TypeError),
+                   (lambda: dev.batch().add(axpb, count, x, 1.0, 1, 2.0), TypeError)]:
+    try:
+        bad()
+        assert False
+    except error:
+        pass
+
+print("OK")
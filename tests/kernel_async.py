@@ -0,0 +1,93 @@
+import asyncio
+import threading
+from array import array
+from time import time as now
+
+import metalcompute as mc
+
+# Check kernels compiled in the background: many at once, each with its own
+# compile error, awaited from asyncio or waited for from any thread
+
+def program(n):
+    return f"""
+#include <metal_stdlib>
+using namespace metal;
+
+kernel void add(device float *out [[ buffer(0) ]],
+                uint id [[ thread_position_in_grid ]]) {{
+    out[id] = out[id] + {n}.0f;
+}}
+"""
+
+def bad(n):
+    return program(n).replace(f"{n}.0f", f"missing{n}")
+
+dev = mc.Device()
+
+def check(kernel, n):
+    out = dev.buffer(array('f', [1] * 16))
+    kernel.function("add")(16, out).wait()
+    assert memoryview(out).cast('f')[15] == 1 + n
+
+# Many compiles in flight, each giving its own kernel or error
+count = 24
+start = now()
+futures = [dev.kernel_async(program(i) if i % 3 else bad(i)) for i in range(count)]
+for i, future in enumerate(futures):
+    if i % 3:
+        kernel = future.result()
+        assert future.done() and future.result() is kernel
+        check(kernel, i)
+    else:
+        for attempt in range(2): # The same error each time
+            try:
+                future.result()
+                assert False
+            except mc.error as e:
+                assert f"missing{i}" in str(e), str(e)
+print(f"{count} kernels compiled in {now() - start:.3f} s")
+
+# wait and result with timeouts, and dropping a future before its compile completes
+future = dev.kernel_async(program(100))
+assert future.wait(timeout=10) and future.result(timeout=0)
+assert str(future) == "metalcompute.KernelFuture(done=True)"
+del future
+dev.kernel_async(program(101))
+
+# Threads compile and wait for kernels at once
+failures = []
+def compile_in_thread(n):
+    try:
+        check(dev.kernel_async(program(n)).result(), n)
+        check(dev.kernel(program(n + 1)), n + 1)
+        dev.kernel(bad(n))
+        failures.append(n)
+    except mc.error as e:
+        if f"missing{n}" not in str(e):
+            failures.append(n)
+workers = [threading.Thread(target=compile_in_thread, args=(200 + 10 * i,)) for i in range(4)]
+for w in workers:
+    w.start()
+for w in workers:
+    w.join()
+assert failures == [], f"wrong results from {failures}"
+
+# Awaited from an event loop, alongside runs, without a thread per future
+async def main():
+    threads = threading.active_count()
+    kernels = await asyncio.gather(*(dev.kernel_async(program(300 + i)) for i in range(8)))
+    for i, kernel in enumerate(kernels):
+        check(kernel, 300 + i)
+    out = dev.buffer(array('f', [1] * 16))
+    fn = (await dev.kernel_async(program(5))).function("add")
+    await fn(16, out)
+    assert memoryview(out).cast('f')[0] == 6.0
+    try:
+        await dev.kernel_async(bad(400))
+        assert False
+    except mc.error as e:
+        assert "missing400" in str(e)
+    assert threading.active_count() == threads, "awaiting started python threads"
+asyncio.run(main())
+
+print("OK")
@@ -0,0 +1,100 @@
+import os
+import sys
+import subprocess
+import tempfile
+from array import array
+
+import metalcompute as mc
+
+# Check the compiled kernel cache: in-process hits, on-disk hits from
+# a fresh process, eviction by size, and results from cached kernels
+
+kernel = """
+#include <metal_stdlib>
+using namespace metal;
+
+kernel void scale(const device float *in [[ buffer(0) ]],
+                  device float *out [[ buffer(1) ]],
+                  uint id [[ thread_position_in_grid ]]) {
+    float x = in[id];
+    for (int i = 0; i < 3; i++) {
+        x = x * 2.0f + 1.0f;
+    }
+    out[id] = x;
+}
+"""
+
+def counts():
+    s = mc.stats()
+    return (s["kernel_cache_hits"], s["kernel_cache_disk_hits"], s["kernel_cache_misses"])
+
+def delta(before):
+    return tuple(b - a for a, b in zip(before, counts()))
+
+def check_run(dev, source):
+    out = dev.buffer(4 * 4)
+    dev.kernel(source).function("scale")(4, array('f', [0, 1, 2, 3]), out)
+    assert list(memoryview(out).cast('f')) == [7.0, 15.0, 23.0, 31.0]
+
+cache_dir = tempfile.mkdtemp()
+info = mc.kernel_cache(dir=cache_dir)
+assert info["dir"] == cache_dir and info["disk_bytes"] == 0
+
+dev = mc.Device()
+before = counts()
+check_run(dev, kernel)
+assert delta(before) == (0, 0, 1), "first compile should miss"
+
+before = counts()
+check_run(dev, kernel)
+assert delta(before) == (1, 0, 0), "same source should hit in memory"
+assert mc.kernel_cache()["disk_bytes"] > 0, "artifact should be on disk"
+
+# Different source is a different entry
+before = counts()
+check_run(dev, kernel + "\n// changed\n")
+assert delta(before) == (0, 0, 1)
+
+# A new process finds the artifact on disk
+child = subprocess.run([sys.executable, "-c", f"""
+import metalcompute as mc
+mc.kernel_cache(dir={cache_dir!r})
+dev = mc.Device()
+dev.kernel({kernel!r}).function("scale")
+s = mc.stats()
+print(s["kernel_cache_disk_hits"], s["kernel_cache_misses"])
+"""], capture_output=True, text=True, env=dict(os.environ))
+assert child.returncode == 0, child.stderr
+assert child.stdout.split() == ["1", "0"], child.stdout
+
+# Dropping the in-process tier falls back to disk
+info = mc.kernel_cache(memory_limit=0)
+assert info["memory_entries"] == 0
+before = counts()
+check_run(dev, kernel)
+assert delta(before) == (0, 1, 0), "should load from disk"
+
+# Disk tier is trimmed to its limit
+evictions = mc.stats()["kernel_cache_evictions"]
+info = mc.kernel_cache(disk_limit=0)
+assert info["disk_bytes"] == 0
+assert mc.stats()["kernel_cache_evictions"] > evictions
+
+# Compile errors are not cached
+mc.kernel_cache(memory_limit=64 << 20, disk_limit=256 << 20, clear=True)
+for i in range(2):
+    try:
+        dev.kernel("kernel void bad(")
+        assert False, "should not compile"
+    except mc.error:
+        pass
+
+# Disabled disk tier
+mc.kernel_cache(dir=None, clear=True)
+before = counts()
+check_run(dev, kernel)
+assert delta(before) == (0, 0, 1)
+assert mc.kernel_cache()["dir"] is None
+
+os.rmdir(cache_dir)
+print("OK")
@@ -0,0 +1,76 @@
+import importlib.util
+import os
+from array import array
+
+import metalcompute as mc
+
+# Check that each import of the module has its own types and error, so it
+# can be loaded again alongside itself and in subinterpreters
+
+kernel = """
+#include <metal_stdlib>
+using namespace metal;
+
+kernel void add_one(const device float *in [[ buffer(0) ]],
+                    device float *out [[ buffer(1) ]],
+                    uint id [[ thread_position_in_grid ]]) {
+    out[id] = in[id] + 1.0f;
+}
+"""
+
+def check(module):
+    dev = module.Device()
+    fn = dev.kernel(kernel).function("add_one")
+    out = dev.buffer(4 * 4)
+    fn(4, array('f', [1, 2, 3, 4]), out).wait()
+    assert list(memoryview(out).cast('f')) == [2, 3, 4, 5]
+    try:
+        dev.kernel("not a kernel")
+        assert False
+    except module.error:
+        pass
+    return dev
+
+dev = check(mc)
+
+# A second instance in the same interpreter
+spec = importlib.util.find_spec("metalcompute")
+other = importlib.util.module_from_spec(spec)
+spec.loader.exec_module(other)
+assert other.Device is not mc.Device and other.error is not mc.error
+other_dev = check(other)
+assert type(other_dev) is other.Device and not isinstance(other_dev, mc.Device)
+try:
+    other_dev.kernel("not a kernel")
+except mc.error:
+    assert False, "error should be the instance's own"
+except other.error:
+    pass
+del other_dev, other
+
+# Subinterpreters import their own copy, and report back through a pipe
+try:
+    import _xxsubinterpreters as interpreters
+except ImportError:
+    interpreters = None
+if interpreters is not None:
+    read_fd, write_fd = os.pipe()
+    interp = interpreters.create()
+    interpreters.run_string(interp, f"""
+import os
+from array import array
+import metalcompute as mc
+dev = mc.Device()
+fn = dev.kernel({kernel!r}).function("add_one")
+out = dev.buffer(4 * 4)
+fn(4, array('f', [1, 2, 3, 4]), out).wait()
+os.write({write_fd}, repr((list(memoryview(out).cast('f')), id(mc.Device))).encode())
+""")
+    interpreters.destroy(interp)
+    result, device_type = eval(os.read(read_fd, 1000))
+    os.close(read_fd)
+    os.close(write_fd)
+    assert result == [2, 3, 4, 5]
+    assert device_type != id(mc.Device)
+
+print("OK")
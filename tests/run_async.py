@@ -0,0 +1,85 @@
+import asyncio
+import os
+import select
+import threading
+from array import array
+from time import time as now
+
+import metalcompute as mc
+
+# Check awaiting runs from asyncio: many in flight on one event loop,
+# resolved from the completion fd without a thread per run
+
+kernel = """
+#include <metal_stdlib>
+using namespace metal;
+
+kernel void scale(const device float *in [[ buffer(0) ]],
+                  const device float *factor [[ buffer(1) ]],
+                  device float *out [[ buffer(2) ]],
+                  uint id [[ thread_position_in_grid ]]) {
+    out[id] = in[id] * factor[0];
+}
+"""
+
+dev = mc.Device()
+fn = dev.kernel(kernel).function("scale")
+count = 1024
+data = dev.buffer(array('f', range(count)))
+
+async def scaled(factor):
+    out = dev.buffer(count * 4)
+    run = await fn(count, data, array('f', [factor]), out)
+    assert run.done()
+    return memoryview(out).cast('f')[count - 1]
+
+async def main(total):
+    threads = threading.active_count()
+    start = now()
+    results = await asyncio.gather(*(scaled(i) for i in range(total)))
+    took = now() - start
+    assert results == [float(count - 1) * i for i in range(total)]
+    assert threading.active_count() == threads, "awaiting started threads"
+    print(f"{total} awaited runs in {took:.3f} s")
+
+    # Awaiting an already completed run returns immediately
+    run = fn(count, data, array('f', [1]), dev.buffer(count * 4))
+    run.wait()
+    assert await run is run
+
+    # A run can still be waited on synchronously after a cancelled await
+    task = asyncio.ensure_future(scaled(2))
+    task.cancel()
+    try:
+        await task
+    except asyncio.CancelledError:
+        pass
+
+    # Another loop task keeps running while runs are outstanding
+    ticks = 0
+    async def ticker():
+        nonlocal ticks
+        while True:
+            ticks += 1
+            await asyncio.sleep(0)
+    tick_task = asyncio.ensure_future(ticker())
+    await asyncio.gather(*(scaled(i) for i in range(100)))
+    tick_task.cancel()
+    assert ticks > 0
+
+asyncio.run(main(2000))
+
+# The loop unsubscribes from notifications once nothing is outstanding
+asyncio.run(main(10))
+
+# Raw completion fd for other event loops
+fd = mc.completion_fd()
+run = fn(count, data, array('f', [3]), dev.buffer(count * 4))
+readable, _, _ = select.select([fd], [], [], 5.0)
+assert readable == [fd]
+assert len(os.read(fd, 4096)) >= 1
+assert run.wait(timeout=5.0)
+os.close(fd)
+del run
+fn(count, data, array('f', [3]), dev.buffer(count * 4)) # Signal after close is harmless
+print("OK")
@@ -0,0 +1,93 @@
+import threading
+from time import time as now
+
+import metalcompute as mc
+
+# Check non-blocking completion of runs: done, wait with timeout, wait_all/wait_any
+# and that other python threads keep running while waiting
+
+kernel = """
+#include <metal_stdlib>
+using namespace metal;
+
+kernel void spin(const device uint *loops [[ buffer(0) ]],
+                 device float *out [[ buffer(1) ]],
+                 uint id [[ thread_position_in_grid ]]) {
+    float x = id;
+    for (uint i = 0; i < loops[0]; i++) {
+        x = x * 0.999f + 1.0f;
+    }
+    out[id] = x;
+}
+"""
+
+dev = mc.Device()
+fn = dev.kernel(kernel).function("spin")
+count = 4096
+
+def loops_for(seconds):
+    # Find a loop count which takes roughly the requested time
+    loops = 1000
+    while True:
+        buf = dev.buffer(count * 4)
+        start = now()
+        fn(count, mc_loops(loops), buf)
+        took = now() - start
+        if took > 0.05:
+            return int(loops * seconds / took) + 1
+        loops *= 4
+
+def mc_loops(loops):
+    lbuf = dev.buffer(4)
+    memoryview(lbuf).cast('I')[0] = loops
+    return lbuf
+
+slow = mc_loops(loops_for(0.5))
+fast = mc_loops(1)
+
+out = dev.buffer(count * 4)
+run = fn(count, slow, out)
+assert not run.done()
+assert run.wait(timeout=0) is False
+assert run.wait(timeout=0.01) is False
+assert run.wait() is True
+assert run.done()
+assert run.wait(timeout=0) is True
+del run
+
+# wait_any returns the run which completed first, or None on timeout
+slow_run = fn(count, slow, dev.buffer(count * 4))
+assert mc.wait_any([slow_run], timeout=0.01) is None
+fast_run = fn(count, fast, dev.buffer(count * 4))
+assert mc.wait_all([slow_run, fast_run], timeout=0.01) is False
+first = mc.wait_any([slow_run, fast_run])
+assert first is fast_run or first is slow_run
+assert mc.wait_all([slow_run, fast_run]) is True
+assert mc.wait_all([]) is True
+assert mc.wait_any([]) is None
+del slow_run, fast_run, first
+
+try:
+    mc.wait_all([1])
+    assert False, "expected TypeError"
+except TypeError:
+    pass
+
+# Another thread keeps running while this one waits
+ticks = 0
+stop = False
+def ticker():
+    global ticks
+    while not stop:
+        ticks += 1
+
+run = fn(count, slow, out)
+thread = threading.Thread(target=ticker)
+thread.start()
+run.wait()
+del run # Dealloc also waits without holding the GIL
+stop = True
+thread.join()
+print(f"Ticks while waiting: {ticks}")
+assert ticks > 1000, "GIL held while waiting"
+print("OK")
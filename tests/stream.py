@@ -0,0 +1,81 @@
+from array import array
+
+import metalcompute as mc
+
+# Check streaming a function over chunks: results come back in order, only
+# depth chunks are taken ahead of the consumer, and stage times are reported
+
+kernel = """
+#include <metal_stdlib>
+using namespace metal;
+
+kernel void scale(const device float *in [[ buffer(0) ]],
+                  const device float *factor [[ buffer(1) ]],
+                  device float *out [[ buffer(2) ]],
+                  uint id [[ thread_position_in_grid ]]) {
+    out[id] = in[id] * factor[0];
+}
+
+kernel void sum_pairs(const device uint *in [[ buffer(0) ]],
+                      device uint *out [[ buffer(1) ]],
+                      uint id [[ thread_position_in_grid ]]) {
+    out[id] = in[id * 2] + in[id * 2 + 1];
+}
+"""
+
+dev = mc.Device()
+kern = dev.kernel(kernel)
+scale = kern.function("scale")
+sum_pairs = kern.function("sum_pairs")
+
+# Chunks of varying size, each result in the order given
+taken = []
+def chunks(n):
+    for i in range(n):
+        taken.append(i)
+        yield array('f', [i] * (1000 + i * 37))
+
+stream = scale.stream(chunks(20), array('f', [2.0]), depth=3)
+assert stream.depth == 3 and taken == []
+results = []
+for i, result in enumerate(stream):
+    # Backpressure: never more than depth chunks taken ahead of what was returned
+    assert len(taken) <= i + stream.depth
+    values = array('f', result)
+    assert len(values) == 1000 + i * 37 and values[0] == i * 2.0 and values[-1] == i * 2.0
+    results.append(values)
+assert len(results) == 20 and stream.in_flight == 0
+
+timing = stream.timing
+assert timing["chunks"] == 20
+assert all(timing[stage] >= 0 for stage in ("fill", "dispatch", "compute", "drain"))
+assert timing["bound"] in ("fill", "dispatch", "compute", "drain")
+
+# Counts and result sizes worked out from each chunk, and empty chunks
+pairs = [array('I', range(n * 2)) for n in (4, 0, 100, 7)]
+out = list(sum_pairs.stream(pairs, count=lambda c: len(c) // 2, out_size=lambda c: len(c) * 2, depth=2))
+assert out[1] == b""
+for chunk, result in zip(pairs, out):
+    assert array('I', result).tolist() == [chunk[i * 2] + chunk[i * 2 + 1] for i in range(len(chunk) // 2)]
+
+# Plain bytes chunks, as read from a file, with a threadgroup setting passed to each run
+data = [bytes(array('f', [1.5] * 256)) for _ in range(5)]
+for result in scale.stream(iter(data), array('f', [4.0]), depth=1, threadgroup=64):
+    assert array('f', result)[255] == 6.0
+
+# Errors from the chunks reach the consumer
+def failing():
+    yield array('f', [1.0] * 16)
+    raise RuntimeError("read failed")
+try:
+    list(scale.stream(failing(), array('f', [1.0])))
+    assert False
+except RuntimeError:
+    pass
+try:
+    scale.stream([], array('f', [1.0]), depth=0)
+    assert False
+except ValueError:
+    pass
+
+print("OK")
@@ -0,0 +1,127 @@
+import os
+from array import array
+
+# One worker, so the order runs are served in is visible
+os.environ.setdefault("METALCOMPUTE_CPU_THREADS", "1")
+
+import metalcompute as mc
+
+# Check command streams: runs on a stream, events ordering work between
+# streams and the host, and higher priority streams served first
+
+kernel = """
+#include <metal_stdlib>
+using namespace metal;
+
+kernel void add_one(const device float *in [[ buffer(0) ]],
+                    device float *out [[ buffer(1) ]],
+                    uint id [[ thread_position_in_grid ]]) {
+    out[id] = in[id] + 1.0f;
+}
+
+kernel void spin(const device uint *n [[ buffer(0) ]],
+                 device float *out [[ buffer(1) ]],
+                 uint id [[ thread_position_in_grid ]]) {
+    float acc = 0.0f;
+    for (uint i = 0; i < n[0]; i++) {
+        acc = acc * 0.5f + 1.0f;
+    }
+    out[id] = acc;
+}
+"""
+
+dev = mc.Device()
+kern = dev.kernel(kernel)
+add_one = kern.function("add_one")
+spin = kern.function("spin")
+count = 1000
+
+# Runs on a stream behave like any other
+stream = dev.stream()
+assert stream.priority == 0
+data = dev.buffer(array('f', range(count)))
+out = dev.buffer(count * 4)
+run = stream.run(add_one, count, data, out)
+assert run.wait(timeout=10)
+assert memoryview(out).cast('f')[count - 1] == count
+assert stream.synchronize()
+
+# Events: values only rise, and default to one more than the last signalled
+event = dev.event()
+assert event.value == 0
+assert event.signal() == 1 and event.value == 1
+assert event.wait(1) and event.wait()
+assert not event.wait(5, timeout=0.01)
+assert event.signal(5) == 5 and event.signal(5) == 5
+for lower in [lambda: event.signal(2), lambda: stream.signal(event, 2)]:
+    try:
+        lower()
+        assert False
+    except ValueError:
+        pass
+assert event.value == 5 and event.wait(3, timeout=0.1)
+assert stream.signal(event) == 6 and stream.synchronize() and event.value == 6
+
+# A stream waiting on an event holds back its later work until the host signals
+gate = dev.event()
+held = dev.stream()
+held.wait(gate, 1)
+out = dev.buffer(count * 4)
+run = held.run(add_one, count, data, out)
+assert not run.wait(timeout=0.2), "run should wait for the event"
+gate.signal(1)
+assert run.wait(timeout=10)
+assert memoryview(out).cast('f')[0] == 1.0
+
+# Cross-stream order: the consumer waits for the producer's signal, even for
+# work which shares no buffers with the producer's
+producer = dev.stream()
+consumer = dev.stream()
+ready = dev.event()
+consumer.wait(ready, 1)
+long_run = producer.run(spin, 1, array('I', [1 << 22]), dev.buffer(4))
+assert producer.signal(ready) == 1
+after = consumer.run(add_one, count, data, dev.buffer(count * 4))
+assert after.wait(timeout=30)
+assert long_run.done(), "consumer ran before the producer signalled"
+assert ready.value == 1
+
+# Runs on different streams sharing buffers are still kept in order
+mid = dev.buffer(count * 4)
+final = dev.buffer(count * 4)
+first = producer.run(add_one, count, data, mid)
+second = consumer.run(add_one, count, mid, final)
+assert memoryview(final).cast('f')[count - 1] == count + 1
+del first, second
+
+# Priority: with both streams held until the same moment, the high priority
+# stream's short run goes ahead of the low priority stream's long one
+low = dev.stream(priority=-1)
+high = dev.stream(priority=10)
+assert high.priority == 10 and "priority=10" in str(high)
+start = dev.event()
+low.wait(start, 1)
+high.wait(start, 1)
+slow = low.run(spin, 1, array('I', [1 << 24]), dev.buffer(4))
+quick = high.run(add_one, count, data, dev.buffer(count * 4))
+start.signal(1)
+assert quick.wait(timeout=10)
+if str(dev).startswith("metalcompute.Device(CPU"):
+    assert not slow.done(), "high priority run should be served first"
+assert slow.wait(timeout=30)
+assert low.synchronize() and high.synchronize()
+
+# Invalid arguments
+Run = type(run) # Made by functions and streams, but reachable, so checks its arguments
+for bad in [lambda: stream.wait("event"), lambda: stream.signal(None),
+            lambda: stream.run(out, count, data, out),
+            lambda: Run(add_one, (count, data, out), None, 12345),
+            lambda: Run(add_one, (count, data, out), None, mc.Device(0)),
+            lambda: Run("add_one", (count, data, out), None, stream)]:
+    try:
+        bad()
+        assert False
+    except (TypeError, mc.error):
+        pass
+
+print("OK")
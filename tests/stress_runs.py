@@ -0,0 +1,55 @@
+import sys
+import resource
+from time import time as now
+from array import array
+
+import metalcompute as mc
+
+# Submit many runs and check that per-run cost and memory stay flat
+# Usage: python3 tests/stress_runs.py [run count, default 10M]
+
+kernel = """
+#include <metal_stdlib>
+using namespace metal;
+
+kernel void inc(device uint *counter [[ buffer(0) ]],
+                uint id [[ thread_position_in_grid ]]) {
+    counter[0] += 1;
+}
+"""
+
+def rss_bytes():
+    try:
+        with open("/proc/self/statm") as statm:
+            return int(statm.read().split()[1]) * resource.getpagesize()
+    except OSError:
+        # macOS: peak rather than current, still flat if nothing leaks
+        return resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+
+total = int(sys.argv[1]) if len(sys.argv) > 1 else 10_000_000
+blocks = 10
+per_block = max(1, total // blocks)
+
+dev = mc.Device()
+fn = dev.kernel(kernel).function("inc")
+counter = dev.buffer(4)
+
+print(f"Submitting {per_block * blocks} runs in {blocks} blocks")
+times = []
+rss = []
+for block in range(blocks):
+    start = now()
+    for i in range(per_block):
+        fn(1, counter) # Run is released immediately
+    times.append((now() - start) / per_block)
+    rss.append(rss_bytes())
+    print(f"Block {block}: {times[-1]*1e6:.2f} us/run, rss {rss[-1]/1e6:.1f} MB")
+
+assert memoryview(counter).cast('I')[0] == per_block * blocks
+
+# Skip the first block which includes warm up
+growth = rss[-1] - rss[1 if blocks > 1 else 0]
+print(f"Per-run cost ratio last/second block: {times[-1]/times[min(1, blocks-1)]:.2f}")
+print(f"Memory growth after warm up: {growth/1e6:.1f} MB")
+assert growth < 16e6, "run records are leaking"
+print("OK")
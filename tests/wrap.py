@@ -0,0 +1,84 @@
+import mmap
+from array import array
+
+import metalcompute as mc
+
+# Check zero-copy wrapping: page aligned, whole page python buffers are used
+# in place (both by dev.wrap and as run arguments), others are copied,
+# and the exporter stays locked while the device may use its memory
+
+kernel = """
+#include <metal_stdlib>
+using namespace metal;
+
+kernel void square(device float *data [[ buffer(0) ]],
+                   uint id [[ thread_position_in_grid ]]) {
+    data[id] = data[id] * data[id];
+}
+"""
+
+dev = mc.Device()
+fn = dev.kernel(kernel).function("square")
+
+def counters():
+    s = mc.stats()
+    return s["buffer_bytes_copied"], s["buffer_bytes_wrapped"]
+
+def delta(before):
+    return tuple(b - a for a, b in zip(before, counters()))
+
+size = mmap.PAGESIZE * 4
+count = size // 4
+
+# Anonymous mmaps are page aligned, so are used in place
+region = mmap.mmap(-1, size)
+memoryview(region).cast('f')[:] = array('f', [3.0] * count)
+before = counters()
+buf = dev.wrap(region, copy=False)
+assert delta(before) == (0, size)
+fn(count, buf)
+assert memoryview(region).cast('f')[count - 1] == 9.0, "kernel should write in place"
+
+# The exporter cannot be resized or closed while wrapped
+try:
+    region.close()
+    assert False, "should still be exported"
+except BufferError:
+    pass
+del buf
+region.close()
+
+# Run arguments are wrapped automatically when possible
+region = mmap.mmap(-1, size)
+memoryview(region).cast('f')[:] = array('f', [4.0] * count)
+before = counters()
+fn(count, region)
+assert delta(before) == (0, size)
+assert memoryview(region).cast('f')[0] == 16.0
+region.close()
+
+# Other memory takes the copy path, unless copying is refused
+small = array('f', [2.0] * 100)
+before = counters()
+fn(100, small)
+assert delta(before) == (400, 0)
+assert small[0] == 2.0, "copied argument is unchanged"
+copied = dev.wrap(small)
+assert delta(before) == (800, 0)
+assert bytes(copied) == bytes(small)
+for unsuitable in [small, bytes(size), memoryview(mmap.mmap(-1, size))[4:]]:
+    try:
+        dev.wrap(unsuitable, copy=False)
+        assert False, "should not wrap"
+    except mc.error:
+        pass
+
+# dev.buffer always copies
+region = mmap.mmap(-1, size)
+before = counters()
+copy = dev.buffer(region)
+assert delta(before) == (size, 0)
+fn(count, copy)
+region.close()
+
+print("OK")